@@ -15,6 +15,7 @@
 #include "ppp_auth.h"
 #include "ppp_lcp.h"
 #include "pwdb.h"
+#include "random.h"
 
 #include "memdebug.h"
 
@@ -77,6 +78,13 @@ struct chap_auth_data_t
 	struct triton_timer_t interval;
 	int failure;
 	int started:1;
+
+	/* response waiting for the password database */
+	char *name;
+	int resp_id;
+	int pending:1;
+	int cancelled:1;
+	int dead:1;
 };
 
 static void chap_send_challenge(struct chap_auth_data_t *ad, int new);
@@ -118,6 +126,12 @@ static void auth_data_free(struct ppp_t *ppp, struct auth_data_t *auth)
 	if (d->interval.tpd)
 		triton_timer_del(&d->interval);
 
+	/* freed by chap_check_cb */
+	if (d->pending) {
+		d->dead = 1;
+		return;
+	}
+
 	_free(d);
 }
 
@@ -149,6 +163,9 @@ static int chap_finish(struct ppp_t *ppp, struct auth_data_t *auth)
 	if (d->interval.tpd)
 		triton_timer_del(&d->interval);
 
+	if (d->pending)
+		d->cancelled = 1;
+
 	ppp_unregister_handler(ppp, &d->h);
 
 	return 0;
@@ -235,7 +252,7 @@ static void chap_send_challenge(struct chap_auth_data_t *ad, int new)
 	};
 
 	if (new)
-		read(urandom_fd, ad->val, VALUE_SIZE);
+		u_randbuf(ad->val, VALUE_SIZE);
 
 	memcpy(msg.val, ad->val, VALUE_SIZE);
 
@@ -251,6 +268,58 @@ static void chap_send_challenge(struct chap_auth_data_t *ad, int new)
 		triton_timer_add(ad->ppp->ctrl->ctx, &ad->timeout, 0);
 }
 
+static void chap_result(struct chap_auth_data_t *ad, char *name, int r)
+{
+	if (r == PWDB_DENIED) {
+		chap_send_failure(ad);
+		if (ad->started)
+			ppp_terminate(ad->ppp, TERM_USER_ERROR, 0);
+		else
+			ppp_auth_failed(ad->ppp, name);
+		_free(name);
+	} else {
+		if (!ad->started) {
+			if (ppp_auth_succeeded(ad->ppp, name)) {
+				chap_send_failure(ad);
+				ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
+				_free(name);
+			} else {
+				chap_send_success(ad);
+				ad->started = 1;
+				if (conf_interval)
+					triton_timer_add(ad->ppp->ctrl->ctx, &ad->interval, 0);
+			}
+		} else {
+			chap_send_success(ad);
+			_free(name);
+		}
+	}
+}
+
+static void chap_check_cb(void *arg, int r)
+{
+	struct chap_auth_data_t *ad = arg;
+	char *name = ad->name;
+
+	ad->pending = 0;
+	ad->name = NULL;
+
+	if (ad->dead) {
+		_free(name);
+		_free(ad);
+		return;
+	}
+
+	/* the layer was finished or a new challenge was sent meanwhile */
+	if (ad->cancelled || ad->resp_id != ad->id) {
+		ad->cancelled = 0;
+		_free(name);
+		return;
+	}
+
+	chap_result(ad, name, r);
+}
+
 static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *hdr)
 {
 	MD5_CTX md5_ctx;
@@ -260,6 +329,10 @@ static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *h
 	int r;
 	struct chap_challenge_t *msg = (struct chap_challenge_t*)hdr;
 
+	/* retransmission of the response being checked */
+	if (ad->pending)
+		return;
+
 	if (ad->timeout.tpd)
 		triton_timer_del(&ad->timeout);
 
@@ -301,7 +374,14 @@ static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *h
 		return;
 	}
 
-	r = pwdb_check(ad->ppp, name, PPP_CHAP, CHAP_MD5, ad->id, ad->val, VALUE_SIZE, msg->val);
+	r = pwdb_check_async(ad->ppp, chap_check_cb, ad, name, PPP_CHAP, CHAP_MD5, ad->id, ad->val, VALUE_SIZE, msg->val);
+
+	if (r == PWDB_WAIT) {
+		ad->pending = 1;
+		ad->name = name;
+		ad->resp_id = ad->id;
+		return;
+	}
 
 	if (r == PWDB_NO_IMPL) {
 		passwd = pwdb_get_passwd(ad->ppp,name);
@@ -346,30 +426,8 @@ static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *h
 				_free(name);
 		}
 		_free(passwd);
-	} else if (r == PWDB_DENIED) {
-		chap_send_failure(ad);
-		if (ad->started)
-			ppp_terminate(ad->ppp, TERM_USER_ERROR, 0);
-		else
-			ppp_auth_failed(ad->ppp, name);
-		_free(name);
-	} else {
-		if (!ad->started) {
-			if (ppp_auth_succeeded(ad->ppp, name)) {
-				chap_send_failure(ad);
-				ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
-				_free(name);
-			} else {
-				chap_send_success(ad);
-				ad->started = 1;
-				if (conf_interval)
-					triton_timer_add(ad->ppp->ctrl->ctx, &ad->interval, 0);
-			}
-		} else {
-			chap_send_success(ad);
-			_free(name);
-		}
-	}
+	} else
+		chap_result(ad, name, r);
 }
 
 static int chap_check(uint8_t *ptr)
@@ -16,6 +16,7 @@
 #include "ppp_auth.h"
 #include "ppp_lcp.h"
 #include "pwdb.h"
+#include "random.h"
 
 #include "memdebug.h"
 
@@ -76,6 +77,14 @@ struct chap_auth_data_t
 	struct triton_timer_t interval;
 	int failure;
 	int started:1;
+
+	/* response waiting for the password database */
+	char *name;
+	int resp_id;
+	char *mschap_error;
+	int pending:1;
+	int cancelled:1;
+	int dead:1;
 };
 
 static void chap_send_challenge(struct chap_auth_data_t *ad, int new);
@@ -119,6 +128,12 @@ static void auth_data_free(struct ppp_t *ppp, struct auth_data_t *auth)
 	if (d->interval.tpd)
 		triton_timer_del(&d->interval);
 
+	/* freed by chap_check_cb */
+	if (d->pending) {
+		d->dead = 1;
+		return;
+	}
+
 	_free(d);
 }
 
@@ -150,6 +165,9 @@ static int chap_finish(struct ppp_t *ppp, struct auth_data_t *auth)
 	if (d->interval.tpd)
 		triton_timer_del(&d->interval);
 
+	if (d->pending)
+		d->cancelled = 1;
+
 	ppp_unregister_handler(ppp, &d->h);
 
 	return 0;
@@ -238,7 +256,7 @@ static void chap_send_challenge(struct chap_auth_data_t *ad, int new)
 	};
 
 	if (new)
-		read(urandom_fd, ad->val, VALUE_SIZE);
+		u_randbuf(ad->val, VALUE_SIZE);
 
 	memcpy(msg.val, ad->val, VALUE_SIZE);
 
@@ -254,13 +272,68 @@ static void chap_send_challenge(struct chap_auth_data_t *ad, int new)
 		triton_timer_add(ad->ppp->ctrl->ctx, &ad->timeout, 0);
 }
 
+static void chap_result(struct chap_auth_data_t *ad, char *name, int r)
+{
+	if (r == PWDB_DENIED) {
+		chap_send_failure(ad, ad->mschap_error);
+		if (ad->started)
+			ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
+		else
+			ppp_auth_failed(ad->ppp, name);
+		_free(name);
+	} else {
+		if (!ad->started) {
+			if (ppp_auth_succeeded(ad->ppp, name)) {
+				chap_send_failure(ad, ad->mschap_error);
+				ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
+				_free(name);
+			} else {
+				chap_send_success(ad);
+				ad->started = 1;
+				if (conf_interval)
+					triton_timer_add(ad->ppp->ctrl->ctx, &ad->interval, 0);
+			}
+		} else {
+			chap_send_success(ad);
+			_free(name);
+		}
+	}
+}
+
+static void chap_check_cb(void *arg, int r)
+{
+	struct chap_auth_data_t *ad = arg;
+	char *name = ad->name;
+
+	ad->pending = 0;
+	ad->name = NULL;
+
+	if (ad->dead) {
+		_free(name);
+		_free(ad);
+		return;
+	}
+
+	/* the layer was finished or a new challenge was sent meanwhile */
+	if (ad->cancelled || ad->resp_id != ad->id) {
+		ad->cancelled = 0;
+		_free(name);
+		return;
+	}
+
+	chap_result(ad, name, r);
+}
+
 static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *hdr)
 {
 	struct chap_response_t *msg = (struct chap_response_t*)hdr;
 	char *name;
-	char *mschap_error = conf_msg_failure;
 	int r;
 
+	/* retransmission of the response being checked */
+	if (ad->pending)
+		return;
+
 	if (ad->timeout.tpd)
 		triton_timer_del(&ad->timeout);
 
@@ -301,7 +374,7 @@ static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *h
 
 	if (conf_any_login) {
 		if (ppp_auth_succeeded(ad->ppp, name)) {
-			chap_send_failure(ad, mschap_error);
+			chap_send_failure(ad, conf_msg_failure);
 			ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
 			_free(name);
 			return;
@@ -311,35 +384,22 @@ static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *h
 		return;
 	}
 
-	r = pwdb_check(ad->ppp, name, PPP_CHAP, MSCHAP_V1, ad->id, ad->val, VALUE_SIZE, msg->lm_hash, msg->nt_hash, msg->flags, &mschap_error);
+	ad->mschap_error = conf_msg_failure;
+
+	r = pwdb_check_async(ad->ppp, chap_check_cb, ad, name, PPP_CHAP, MSCHAP_V1, ad->id, ad->val, VALUE_SIZE, msg->lm_hash, msg->nt_hash, msg->flags, &ad->mschap_error);
+
+	if (r == PWDB_WAIT) {
+		ad->pending = 1;
+		ad->name = name;
+		ad->resp_id = ad->id;
+		return;
+	}
+
 	if (r == PWDB_NO_IMPL)
 		if (chap_check_response(ad, msg, name))
 			r = PWDB_DENIED;
-	
-	if (r == PWDB_DENIED) {
-		chap_send_failure(ad, mschap_error);
-		if (ad->started)
-			ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
-		else
-			ppp_auth_failed(ad->ppp, name);
-		_free(name);
-	} else {
-		if (!ad->started) {
-			if (ppp_auth_succeeded(ad->ppp, name)) {
-				chap_send_failure(ad, mschap_error);
-				ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
-				_free(name);
-			} else {
-				chap_send_success(ad);
-				ad->started = 1;
-				if (conf_interval)
-					triton_timer_add(ad->ppp->ctrl->ctx, &ad->interval, 0);
-			}
-		} else {
-			chap_send_success(ad);
-			_free(name);
-		}
-	}
+
+	chap_result(ad, name, r);
 }
 
 static void des_encrypt(const uint8_t *input, const uint8_t *key, uint8_t *output)
@@ -16,6 +16,7 @@
 #include "ppp_auth.h"
 #include "ppp_lcp.h"
 #include "pwdb.h"
+#include "random.h"
 
 #include "memdebug.h"
 
@@ -76,6 +77,16 @@ struct chap_auth_data_t
 	struct triton_timer_t interval;
 	int failure;
 	int started:1;
+
+	/* response waiting for the password database */
+	char *name;
+	int resp_id;
+	char *mschap_error;
+	char *reply_msg;
+	char authenticator[41];
+	int pending:1;
+	int cancelled:1;
+	int dead:1;
 };
 
 static void chap_send_challenge(struct chap_auth_data_t *ad, int new);
@@ -120,6 +131,12 @@ static void auth_data_free(struct ppp_t *ppp, struct auth_data_t *auth)
 	if (d->interval.tpd)
 		triton_timer_del(&d->interval);
 
+	/* freed by chap_check_cb */
+	if (d->pending) {
+		d->dead = 1;
+		return;
+	}
+
 	_free(d);
 }
 
@@ -151,6 +168,9 @@ static int chap_finish(struct ppp_t *ppp, struct auth_data_t *auth)
 	if (d->interval.tpd)
 		triton_timer_del(&d->interval);
 
+	if (d->pending)
+		d->cancelled = 1;
+
 	ppp_unregister_handler(ppp,&d->h);
 
 	return 0;
@@ -311,7 +331,7 @@ static void chap_send_challenge(struct chap_auth_data_t *ad, int new)
 	};
 
 	if (new)
-		read(urandom_fd, ad->val, VALUE_SIZE);
+		u_randbuf(ad->val, VALUE_SIZE);
 
 	memcpy(msg.val, ad->val, VALUE_SIZE);
 
@@ -327,16 +347,67 @@ static void chap_send_challenge(struct chap_auth_data_t *ad, int new)
 		triton_timer_add(ad->ppp->ctrl->ctx, &ad->timeout, 0);
 }
 
+static void chap_result(struct chap_auth_data_t *ad, char *name, int r)
+{
+	if (r == PWDB_DENIED) {
+		chap_send_failure(ad, ad->mschap_error, ad->reply_msg);
+		if (ad->started)
+			ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
+		else
+			ppp_auth_failed(ad->ppp, name);
+		_free(name);
+	} else {
+		if (!ad->started) {
+			if (ppp_auth_succeeded(ad->ppp, name)) {
+				chap_send_failure(ad, ad->mschap_error, ad->reply_msg);
+				ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
+				_free(name);
+			} else {
+				chap_send_success(ad, NULL, ad->authenticator);
+				ad->started = 1;
+				if (conf_interval)
+					triton_timer_add(ad->ppp->ctrl->ctx, &ad->interval, 0);
+			}
+		} else {
+			chap_send_success(ad, NULL, ad->authenticator);
+			_free(name);
+		}
+	}
+}
+
+static void chap_check_cb(void *arg, int r)
+{
+	struct chap_auth_data_t *ad = arg;
+	char *name = ad->name;
+
+	ad->pending = 0;
+	ad->name = NULL;
+
+	if (ad->dead) {
+		_free(name);
+		_free(ad);
+		return;
+	}
+
+	/* the layer was finished or a new challenge was sent meanwhile */
+	if (ad->cancelled || ad->resp_id != ad->id) {
+		ad->cancelled = 0;
+		_free(name);
+		return;
+	}
+
+	chap_result(ad, name, r);
+}
+
 static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *hdr)
 {
 	struct chap_response_t *msg = (struct chap_response_t*)hdr;
 	char *name;
-	char authenticator[41];
 	int r;
-	char *mschap_error = conf_msg_failure;
-	char *reply_msg = conf_msg_failure2;
 
-	authenticator[40] = 0;
+	/* retransmission of the response being checked */
+	if (ad->pending)
+		return;
 
 	if (ad->timeout.tpd)
 		triton_timer_del(&ad->timeout);
@@ -359,7 +430,7 @@ static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *h
 
 	if (msg->val_size != RESPONSE_VALUE_SIZE) {
 		log_ppp_error("mschap-v2: incorrect value-size (%i)\n", msg->val_size);
-		chap_send_failure(ad, mschap_error, reply_msg);
+		chap_send_failure(ad, conf_msg_failure, conf_msg_failure2);
 		if (ad->started)
 			ppp_terminate(ad->ppp, TERM_USER_ERROR, 0);
 		else
@@ -377,40 +448,28 @@ static void chap_recv_response(struct chap_auth_data_t *ad, struct chap_hdr_t *h
 		return;
 	}
 	
-	r = pwdb_check(ad->ppp, name, PPP_CHAP, MSCHAP_V2, ad->id, ad->val, msg->peer_challenge, msg->reserved, msg->nt_hash, msg->flags, authenticator, &mschap_error, &reply_msg);
+	ad->mschap_error = conf_msg_failure;
+	ad->reply_msg = conf_msg_failure2;
+	ad->authenticator[40] = 0;
+
+	r = pwdb_check_async(ad->ppp, chap_check_cb, ad, name, PPP_CHAP, MSCHAP_V2, ad->id, ad->val, msg->peer_challenge, msg->reserved, msg->nt_hash, msg->flags, ad->authenticator, &ad->mschap_error, &ad->reply_msg);
+
+	if (r == PWDB_WAIT) {
+		ad->pending = 1;
+		ad->name = name;
+		ad->resp_id = ad->id;
+		return;
+	}
 
 	if (r == PWDB_NO_IMPL) {
 		r = chap_check_response(ad, msg, name);
 		if (r)
 			r = PWDB_DENIED;
-		else if (generate_response(ad, msg, name, authenticator))
+		else if (generate_response(ad, msg, name, ad->authenticator))
 			r = PWDB_DENIED;
 	}
 
-	if (r == PWDB_DENIED) {
-		chap_send_failure(ad, mschap_error, reply_msg);
-		if (ad->started)
-			ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
-		else
-			ppp_auth_failed(ad->ppp, name);
-		_free(name);
-	} else {
-		if (!ad->started) {
-			if (ppp_auth_succeeded(ad->ppp, name)) {
-				chap_send_failure(ad, mschap_error, reply_msg);
-				ppp_terminate(ad->ppp, TERM_AUTH_ERROR, 0);
-				_free(name);
-			} else {
-				chap_send_success(ad, msg, authenticator);
-				ad->started = 1;
-				if (conf_interval)
-					triton_timer_add(ad->ppp->ctrl->ctx, &ad->interval, 0);
-			}
-		} else {
-			chap_send_success(ad, msg, authenticator);
-			_free(name);
-		}
-	}
+	chap_result(ad, name, r);
 }
 
 static void des_encrypt(const uint8_t *input, const uint8_t *key, uint8_t *output)
@@ -40,6 +40,13 @@ struct pap_auth_data_t
 	struct ppp_t *ppp;
 	int started:1;
 	struct triton_timer_t timeout;
+
+	/* request waiting for the password database */
+	char *peer_id;
+	int req_id;
+	int pending:1;
+	int cancelled:1;
+	int dead:1;
 };
 
 struct pap_hdr_t
@@ -83,6 +90,12 @@ static void auth_data_free(struct ppp_t *ppp, struct auth_data_t *auth)
 {
 	struct pap_auth_data_t *d = container_of(auth, typeof(*d), auth);
 
+	/* freed by pap_check_cb */
+	if (d->pending) {
+		d->dead = 1;
+		return;
+	}
+
 	_free(d);
 }
 
@@ -108,6 +121,9 @@ static int pap_finish(struct ppp_t *ppp, struct auth_data_t *auth)
 	if (d->timeout.tpd)
 		triton_timer_del(&d->timeout);
 
+	if (d->pending)
+		d->cancelled = 1;
+
 	ppp_unregister_handler(ppp, &d->h);
 
 	return 0;
@@ -167,9 +183,57 @@ static void pap_send_nak(struct pap_auth_data_t *p, int id)
 	ppp_chan_send(p->ppp, msg, ntohs(msg->hdr.len) + 2);
 }
 
+static int pap_result(struct pap_auth_data_t *p, char *peer_id, int id, int r)
+{
+	if (r == PWDB_DENIED) {
+		pap_send_nak(p, id);
+		if (p->started)
+			ppp_terminate(p->ppp, TERM_AUTH_ERROR, 0);
+		else
+			ppp_auth_failed(p->ppp, peer_id);
+		_free(peer_id);
+		return -1;
+	}
+
+	if (ppp_auth_succeeded(p->ppp, peer_id)) {
+		pap_send_nak(p, id);
+		ppp_terminate(p->ppp, TERM_AUTH_ERROR, 0);
+		_free(peer_id);
+		return -1;
+	}
+
+	pap_send_ack(p, id);
+	p->started = 1;
+
+	return 0;
+}
+
+static void pap_check_cb(void *arg, int r)
+{
+	struct pap_auth_data_t *p = arg;
+	char *peer_id = p->peer_id;
+
+	p->pending = 0;
+	p->peer_id = NULL;
+
+	if (p->dead) {
+		_free(peer_id);
+		_free(p);
+		return;
+	}
+
+	if (p->cancelled) {
+		p->cancelled = 0;
+		_free(peer_id);
+		return;
+	}
+
+	pap_result(p, peer_id, p->req_id, r);
+}
+
 static int pap_recv_req(struct pap_auth_data_t *p, struct pap_hdr_t *hdr)
 {
-	int ret, r;
+	int r;
 	char *peer_id;
 	char *passwd;
 	char *passwd2;
@@ -177,6 +241,10 @@ static int pap_recv_req(struct pap_auth_data_t *p, struct pap_hdr_t *hdr)
 	int passwd_len;
 	uint8_t *ptr = (uint8_t*)(hdr + 1);
 
+	/* retransmission of the request being checked */
+	if (p->pending)
+		return 0;
+
 	if (p->timeout.tpd)
 		triton_timer_del(&p->timeout);
 
@@ -212,53 +280,34 @@ static int pap_recv_req(struct pap_auth_data_t *p, struct pap_hdr_t *hdr)
 
 	passwd = _strndup((const char*)ptr, passwd_len);
 
-	r = pwdb_check(p->ppp, peer_id, PPP_PAP, passwd);
+	r = pwdb_check_async(p->ppp, pap_check_cb, p, peer_id, PPP_PAP, passwd);
+	if (r == PWDB_WAIT) {
+		p->pending = 1;
+		p->peer_id = peer_id;
+		p->req_id = hdr->id;
+		_free(passwd);
+		return 0;
+	}
+
 	if (r == PWDB_NO_IMPL) {
 		passwd2 = pwdb_get_passwd(p->ppp, peer_id);
 		if (!passwd2) {
 			if (conf_ppp_verbose)
 				log_ppp_warn("pap: user not found\n");
-			goto failed;
-		}
-
-		if (strcmp(passwd2, passwd))
 			r = PWDB_DENIED;
-		else
-			r = PWDB_SUCCESS;
-
-		_free(passwd2);
-	}
-
-	if (r == PWDB_DENIED) {
-		goto failed;
-	} else {
-		if (ppp_auth_succeeded(p->ppp, peer_id)) {
-			pap_send_nak(p, hdr->id);
-			ppp_terminate(p->ppp, TERM_AUTH_ERROR, 0);
-			_free(peer_id);
-			ret = -1;
 		} else {
-			pap_send_ack(p, hdr->id);
-			p->started = 1;
-			ret = 0;
+			if (strcmp(passwd2, passwd))
+				r = PWDB_DENIED;
+			else
+				r = PWDB_SUCCESS;
+
+			_free(passwd2);
 		}
 	}
 
 	_free(passwd);
 
-	return 0;
-		
-failed:
-	pap_send_nak(p, hdr->id);
-	if (p->started)
-		ppp_terminate(p->ppp, TERM_AUTH_ERROR, 0);
-	else
-		ppp_auth_failed(p->ppp, peer_id);
-	
-	_free(passwd);
-	_free(peer_id);
-	
-	return -1;
+	return pap_result(p, peer_id, hdr->id, r);
 }
 
 static void pap_recv(struct ppp_handler_t *h)
@@ -15,9 +15,11 @@
 #include <sys/types.h>
 
 #include "triton.h"
+#include "events.h"
 #include "log.h"
 #include "ppp.h"
 #include "list.h"
+#include "upgrade.h"
 #include "memdebug.h"
 
 #include "cli_p.h"
@@ -624,11 +626,33 @@ static void serv_close(struct triton_context_t *ctx)
 		disconnect(cln);
 	}
 
-	triton_md_unregister_handler(&serv_hnd);
-	close(serv_hnd.fd);
+	if (serv_hnd.tpd) {
+		triton_md_unregister_handler(&serv_hnd);
+		close(serv_hnd.fd);
+	}
 	triton_context_unregister(ctx);
 }
 
+/* runs in serv_ctx, connected clients stay */
+static void serv_release(void *arg)
+{
+	if (serv_hnd.tpd) {
+		triton_md_unregister_handler(&serv_hnd);
+		close(serv_hnd.fd);
+	}
+
+	upgrade_release();
+}
+
+static void ev_upgrade(void)
+{
+	/* release the port for the new process */
+	if (serv_ctx.tpd) {
+		upgrade_hold();
+		triton_context_call(&serv_ctx, serv_release, NULL);
+	}
+}
+
 static struct triton_context_t serv_ctx = {
 	.close = serv_close,
 	.before_switch = log_switch,
@@ -756,6 +780,8 @@ static void init(void)
 
 	start_server(host, port);
 	free(host);
+
+	triton_event_register_handler(EV_UPGRADE, (triton_event_func)ev_upgrade);
 	
 	atexit(save_history_file);
 	
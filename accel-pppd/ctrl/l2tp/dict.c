@@ -19,6 +19,10 @@ struct l2tp_dict_t
 
 static struct l2tp_dict_t *dict;
 
+/* attributes indexed by id, built once the dictionary is loaded */
+static struct l2tp_dict_attr_t **dict_by_id;
+static int dict_max_id = -1;
+
 #define BUF_SIZE 1024
 static char *path, *fname1, *buf;
 
@@ -36,14 +40,10 @@ struct l2tp_dict_attr_t *l2tp_dict_find_attr_by_name(const char *name)
 
 struct l2tp_dict_attr_t *l2tp_dict_find_attr_by_id(int id)
 {
-	struct l2tp_dict_attr_t *attr;
-
-	list_for_each_entry(attr, &dict->items, entry) {
-		if (attr->id == id)
-			return attr;
-	}
+	if (id < 0 || id > dict_max_id)
+		return NULL;
 
-	return NULL;
+	return dict_by_id[id];
 }
 
 struct l2tp_dict_value_t *l2tp_dict_find_value(struct l2tp_dict_attr_t *attr, l2tp_value_t val)
@@ -234,6 +234,34 @@ out_err:
 	return -1;
 }
 
+static int dict_build_index(void)
+{
+	struct l2tp_dict_attr_t *attr;
+	int max_id = -1;
+
+	list_for_each_entry(attr, &dict->items, entry) {
+		if (attr->id < 0 || attr->id > 0xffff) {
+			log_emerg("l2tp: attribute %s: invalid id %i\n", attr->name, attr->id);
+			return -1;
+		}
+		if (attr->id > max_id)
+			max_id = attr->id;
+	}
+
+	dict_by_id = _malloc((max_id + 1) * sizeof(*dict_by_id));
+	memset(dict_by_id, 0, (max_id + 1) * sizeof(*dict_by_id));
+
+	/* first definition wins, as with the list lookup */
+	list_for_each_entry(attr, &dict->items, entry) {
+		if (!dict_by_id[attr->id])
+			dict_by_id[attr->id] = attr;
+	}
+
+	dict_max_id = max_id;
+
+	return 0;
+}
+
 static int l2tp_dict_load(const char *fname)
 {
 	int r;
@@ -254,6 +282,9 @@ static int l2tp_dict_load(const char *fname)
 	_free(fname1);
 	_free(path);
 
+	if (!r)
+		r = dict_build_index();
+
 	return r;
 }
 
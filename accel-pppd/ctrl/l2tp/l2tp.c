@@ -17,12 +17,14 @@
 
 #include "triton.h"
 #include "mempool.h"
+#include "spinlock.h"
 #include "log.h"
 #include "ppp.h"
 #include "events.h"
 #include "utils.h"
 #include "iprange.h"
 #include "cli.h"
+#include "upgrade.h"
 #include "crypto.h"
 
 #include "connlimit.h"
@@ -46,28 +48,52 @@
 #define STATE_FIN        8
 #define STATE_CLOSE      0
 
+#define L2TP_SESS_HASH_SIZE 256
+#define L2TP_MAX_SID 65535
+
+#define L2TP_RX_BATCH 16
+
 int conf_verbose = 0;
 int conf_avp_permissive = 0;
 static int conf_timeout = 60;
 static int conf_rtimeout = 5;
 static int conf_retransmit = 5;
+static int conf_recv_window = 16;
+static int conf_ack_delay = 100;
 static int conf_hello_interval = 60;
 static int conf_dir300_quirk = 0;
 static const char *conf_host_name = "accel-ppp";
-static const char *conf_secret = NULL;
+const char *conf_secret = NULL;
 static int conf_mppe = MPPE_UNSET;
 static char *conf_ip_pool;
+static int conf_shared_socket;
 
 static unsigned int stat_active;
 static unsigned int stat_starting;
+static unsigned int stat_tunnels;
+
+struct l2tp_rx_slot_t
+{
+	struct sockaddr_in addr;
+	struct iovec iov;
+	char msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	uint8_t *buf;
+};
 
 struct l2tp_serv_t
 {
 	struct triton_context_t ctx;
 	struct triton_md_handler_t hnd;
 	struct sockaddr_in addr;
+	struct mmsghdr rx_msg[L2TP_RX_BATCH];
+	struct l2tp_rx_slot_t *rx_slot;
 };
 
+/*
+ * Tunnel (control connection). Owns the UDP socket, the control channel
+ * state and the kernel tunnel, runs in its own context. Sessions are kept
+ * in sess_hash from ICRQ until the session context has been torn down.
+ */
 struct l2tp_conn_t
 {
 	struct triton_context_t ctx;
@@ -75,25 +101,66 @@ struct l2tp_conn_t
 	struct triton_timer_t timeout_timer;
 	struct triton_timer_t rtimeout_timer;
 	struct triton_timer_t hello_timer;
+	struct triton_timer_t ack_timer;
 
 	int tunnel_fd;
 
+	/* listener the control traffic goes through until the tunnel gets
+	 * its own socket (shared-socket mode only) */
+	struct l2tp_serv_t *serv;
+	spinlock_t rx_lock;
+	struct list_head rx_queue;
+
 	struct sockaddr_in addr;
+	struct sockaddr_in host_addr;
 	uint16_t tid;
-	uint16_t sid;
 	uint16_t peer_tid;
-	uint16_t peer_sid;
+	uint16_t next_sid;
 	uint32_t framing_cap;
 	uint16_t challenge_len;
 	l2tp_value_t challenge;
 
+	/* Ns is the next sequence number to send, Nr the next one expected.
+	 * send_queue holds unacknowledged messages, the first in_flight of
+	 * them have been transmitted, send_next is the first one waiting
+	 * for room in the peer's receive window. recv_queue holds messages
+	 * received ahead of Nr, ordered by Ns. */
 	int retransmit;
 	uint16_t Ns, Nr;
+	int peer_rws;
+	int in_flight;
 	struct list_head send_queue;
+	struct list_head *send_next;
+	struct list_head recv_queue;
 
 	int state;
-	int state1;
 	int state2;
+	int closed;
+
+	int sess_cnt;
+	struct list_head sess_hash[L2TP_SESS_HASH_SIZE];
+};
+
+/*
+ * Session (call). Fields above ctx belong to the tunnel context, ppp state
+ * belongs to the session context; the two talk through triton_context_call
+ * only. Once closing is set the tunnel does not touch the session again
+ * until it comes back through l2tp_sess_release.
+ */
+struct l2tp_sess_t
+{
+	struct list_head entry;
+	struct l2tp_conn_t *conn;
+	struct triton_timer_t timeout_timer;
+	uint16_t sid;
+	uint16_t peer_sid;
+	int state1;
+	int closing;
+	int cdn_res;
+
+	struct triton_context_t ctx;
+	struct sockaddr_pppol2tp pppox_addr;
+	int state;
 
 	struct ppp_ctrl_t ctrl;
 	struct ppp_t ppp;
@@ -104,20 +171,126 @@ static struct l2tp_conn_t **l2tp_conn;
 static uint16_t l2tp_tid;
 
 static mempool_t l2tp_conn_pool;
+static mempool_t l2tp_sess_pool;
+
+static struct l2tp_serv_t *udp_serv;
+static int udp_serv_cnt;
 
 static void l2tp_timeout(struct triton_timer_t *t);
 static void l2tp_rtimeout(struct triton_timer_t *t);
+static void l2tp_ack_timeout(struct triton_timer_t *t);
 static void l2tp_send_HELLO(struct triton_timer_t *t);
 static void l2tp_send_SCCRP(struct l2tp_conn_t *conn);
 static int l2tp_send(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack, int log_debug);
 static int l2tp_conn_read(struct triton_md_handler_t *);
+static void l2tp_sess_free(struct l2tp_sess_t *sess);
+
+static struct l2tp_sess_t *l2tp_sess_find(struct l2tp_conn_t *conn, uint16_t sid)
+{
+	struct l2tp_sess_t *sess;
+
+	list_for_each_entry(sess, &conn->sess_hash[sid % L2TP_SESS_HASH_SIZE], entry) {
+		if (sess->sid == sid)
+			return sess;
+	}
+
+	return NULL;
+}
+
+/* Sessions being torn down keep their sid until released, so a new call
+ * never collides with a kernel session that is still being closed. */
+static uint16_t l2tp_sess_alloc_sid(struct l2tp_conn_t *conn)
+{
+	uint16_t sid;
+	int i;
+
+	if (conn->sess_cnt >= L2TP_MAX_SID)
+		return 0;
+
+	for (i = 0; i < L2TP_MAX_SID; i++) {
+		sid = ++conn->next_sid;
+		if (!sid)
+			sid = conn->next_sid = 1;
+		if (!l2tp_sess_find(conn, sid))
+			return sid;
+	}
+
+	return 0;
+}
+
+/* The tid is kept busy until the kernel tunnel is gone */
+static void l2tp_tunnel_free(struct l2tp_conn_t *conn)
+{
+	struct l2tp_packet_t *pack;
+
+	if (conn->tunnel_fd != -1)
+		close(conn->tunnel_fd);
+
+	pthread_mutex_lock(&l2tp_lock);
+	l2tp_conn[conn->tid] = NULL;
+	pthread_mutex_unlock(&l2tp_lock);
+
+	while (!list_empty(&conn->rx_queue)) {
+		pack = list_entry(conn->rx_queue.next, typeof(*pack), entry);
+		list_del(&pack->entry);
+		l2tp_packet_free(pack);
+	}
+
+	if (conn->challenge_len)
+	    _free(conn->challenge.octets);
+
+	triton_context_unregister(&conn->ctx);
+
+	mempool_free(conn);
+}
+
+static void l2tp_sess_release(struct l2tp_sess_t *sess)
+{
+	struct l2tp_conn_t *conn = sess->conn;
+
+	list_del(&sess->entry);
+	mempool_free(sess);
+
+	if (--conn->sess_cnt == 0 && conn->closed)
+		l2tp_tunnel_free(conn);
+}
+
+static void l2tp_sess_drop(struct l2tp_sess_t *sess)
+{
+	sess->closing = 1;
+
+	if (sess->timeout_timer.tpd)
+		triton_timer_del(&sess->timeout_timer);
+
+	triton_context_call(&sess->ctx, (triton_event_func)l2tp_sess_free, sess);
+}
+
+static void l2tp_drop_sessions(struct l2tp_conn_t *conn)
+{
+	struct l2tp_sess_t *sess;
+	int i;
+
+	for (i = 0; i < L2TP_SESS_HASH_SIZE; i++) {
+		list_for_each_entry(sess, &conn->sess_hash[i], entry) {
+			if (!sess->closing)
+				l2tp_sess_drop(sess);
+		}
+	}
+}
 
 static void l2tp_disconnect(struct l2tp_conn_t *conn)
 {
 	struct l2tp_packet_t *pack;
 
-	triton_md_unregister_handler(&conn->hnd);
-	close(conn->hnd.fd);
+	if (conn->closed)
+		return;
+
+	conn->closed = 1;
+
+	if (conn->hnd.fd != -1) {
+		triton_md_unregister_handler(&conn->hnd);
+		close(conn->hnd.fd);
+	}
 
 	if (conn->timeout_timer.tpd)
 		triton_timer_del(&conn->timeout_timer);
@@ -128,28 +301,14 @@ static void l2tp_disconnect(struct l2tp_conn_t *conn)
 	if (conn->hello_timer.tpd)
 		triton_timer_del(&conn->hello_timer);
 
-	if (conn->state == STATE_PPP) {
-		__sync_sub_and_fetch(&stat_active, 1);
-		conn->state = STATE_FIN;
-		ppp_terminate(&conn->ppp, TERM_USER_REQUEST, 1);
-	} else if (conn->state != STATE_FIN)
-		__sync_sub_and_fetch(&stat_starting, 1);
-
-	pthread_mutex_lock(&l2tp_lock);
-	l2tp_conn[conn->tid] = NULL;
-	pthread_mutex_unlock(&l2tp_lock);
+	if (conn->ack_timer.tpd)
+		triton_timer_del(&conn->ack_timer);
 
-	if (conn->ppp.fd != -1)
-		close(conn->ppp.fd);
-	
-	if (conn->tunnel_fd != -1)
-		close(conn->tunnel_fd);
+	l2tp_drop_sessions(conn);
 
-	triton_event_fire(EV_CTRL_FINISHED, &conn->ppp);
-	
-	log_ppp_info1("disconnected\n");
+	__sync_sub_and_fetch(&stat_tunnels, 1);
 
-	triton_context_unregister(&conn->ctx);
+	log_ppp_info1("l2tp: tunnel %i disconnected\n", conn->tid);
 
 	while (!list_empty(&conn->send_queue)) {
 		pack = list_entry(conn->send_queue.next, typeof(*pack), entry);
@@ -157,14 +316,14 @@ static void l2tp_disconnect(struct l2tp_conn_t *conn)
 		l2tp_packet_free(pack);
 	}
 
-	if (conn->ppp.chan_name)
-		_free(conn->ppp.chan_name);
-	if (conn->challenge_len)
-	    _free(conn->challenge.octets);
-	_free(conn->ctrl.calling_station_id);
-	_free(conn->ctrl.called_station_id);
+	while (!list_empty(&conn->recv_queue)) {
+		pack = list_entry(conn->recv_queue.next, typeof(*pack), entry);
+		list_del(&pack->entry);
+		l2tp_packet_free(pack);
+	}
 
-	mempool_free(conn);
+	if (!conn->sess_cnt)
+		l2tp_tunnel_free(conn);
 }
 
 static int l2tp_terminate(struct l2tp_conn_t *conn, int res, int err)
@@ -177,10 +336,13 @@ static int l2tp_terminate(struct l2tp_conn_t *conn, int res, int err)
 	if (conn->hello_timer.tpd)
 		triton_timer_del(&conn->hello_timer);
 
+	/* StopCCN clears all calls of the tunnel, no CDN is needed */
+	l2tp_drop_sessions(conn);
+
 	pack = l2tp_packet_alloc(2, Message_Type_Stop_Ctrl_Conn_Notify, &conn->addr);
 	if (!pack)
 		return -1;
-	
+
 	if (l2tp_packet_add_int16(pack, Assigned_Tunnel_ID, conn->tid, 1))
 		goto out_err;
 	if (l2tp_packet_add_octets(pack, Result_Code, (uint8_t *)&rc, sizeof(rc), 0))
@@ -197,115 +359,202 @@ out_err:
 	return -1;
 }
 
+static int l2tp_send_CDN(struct l2tp_conn_t *conn, uint16_t sid, uint16_t peer_sid, int res, int err)
+{
+	struct l2tp_packet_t *pack;
+	struct l2tp_avp_result_code rc = {res, err};
+
+	pack = l2tp_packet_alloc(2, Message_Type_Call_Disconnect_Notify, &conn->addr);
+	if (!pack)
+		return -1;
+
+	pack->hdr.sid = htons(peer_sid);
+
+	if (l2tp_packet_add_octets(pack, Result_Code, (uint8_t *)&rc, sizeof(rc), 1))
+		goto out_err;
+	if (l2tp_packet_add_int16(pack, Assigned_Session_ID, sid, 1))
+		goto out_err;
+
+	return l2tp_send(conn, pack, 0);
+
+out_err:
+	l2tp_packet_free(pack);
+	return -1;
+}
+
+/* Called in the tunnel context when a session wants to go away */
+static void l2tp_sess_finished(struct l2tp_sess_t *sess)
+{
+	struct l2tp_conn_t *conn = sess->conn;
+
+	if (sess->closing)
+		return;
+
+	if (conn->state == STATE_ESTB && l2tp_send_CDN(conn, sess->sid, sess->peer_sid, sess->cdn_res, 0)) {
+		l2tp_disconnect(conn);
+		return;
+	}
+
+	l2tp_sess_drop(sess);
+}
+
+static void l2tp_sess_free(struct l2tp_sess_t *sess)
+{
+	struct l2tp_conn_t *conn = sess->conn;
+
+	if (sess->state == STATE_PPP) {
+		__sync_sub_and_fetch(&stat_active, 1);
+		sess->state = STATE_FIN;
+		ppp_terminate(&sess->ppp, TERM_USER_REQUEST, 1);
+	} else if (sess->state != STATE_FIN)
+		__sync_sub_and_fetch(&stat_starting, 1);
+
+	if (sess->ppp.fd != -1)
+		close(sess->ppp.fd);
+
+	triton_event_fire(EV_CTRL_FINISHED, &sess->ppp);
+
+	log_ppp_info1("disconnected\n");
+
+	triton_context_unregister(&sess->ctx);
+
+	if (sess->ppp.chan_name)
+		_free(sess->ppp.chan_name);
+	_free(sess->ctrl.calling_station_id);
+	_free(sess->ctrl.called_station_id);
+
+	triton_context_call(&conn->ctx, (triton_event_func)l2tp_sess_release, sess);
+}
+
 static void l2tp_ppp_started(struct ppp_t *ppp)
 {
-	struct l2tp_conn_t *conn = container_of(ppp, typeof(*conn), ppp);
-	
 	log_ppp_debug("l2tp: ppp started\n");
-	
-	if (conf_hello_interval)
-		triton_timer_add(&conn->ctx, &conn->hello_timer, 0);
 }
 
 static void l2tp_ppp_finished(struct ppp_t *ppp)
 {
-	struct l2tp_conn_t *conn = container_of(ppp, typeof(*conn), ppp);
+	struct l2tp_sess_t *sess = container_of(ppp, typeof(*sess), ppp);
 
 	log_ppp_debug("l2tp: ppp finished\n");
 
-	if (conn->state != STATE_FIN) {
+	if (sess->state != STATE_FIN) {
 		__sync_sub_and_fetch(&stat_active, 1);
-		if (l2tp_terminate(conn, 0, 0))
-			triton_context_call(&conn->ctx, (triton_event_func)l2tp_disconnect, conn);
+		sess->state = STATE_FIN;
+		triton_context_call(&sess->conn->ctx, (triton_event_func)l2tp_sess_finished, sess);
 	}
 }
 
-static void l2tp_conn_close(struct triton_context_t *ctx)
+static void l2tp_sess_close(struct triton_context_t *ctx)
 {
-	struct l2tp_conn_t *conn = container_of(ctx, typeof(*conn), ctx);
-	
-	if (conn->state == STATE_PPP) {
+	struct l2tp_sess_t *sess = container_of(ctx, typeof(*sess), ctx);
+
+	if (sess->state == STATE_PPP) {
 		__sync_sub_and_fetch(&stat_active, 1);
-		conn->state = STATE_FIN;
-		ppp_terminate(&conn->ppp, TERM_ADMIN_RESET, 1);
+		sess->state = STATE_FIN;
+		ppp_terminate(&sess->ppp, TERM_ADMIN_RESET, 1);
+	} else if (sess->state != STATE_FIN) {
+		__sync_sub_and_fetch(&stat_starting, 1);
+		sess->state = STATE_FIN;
 	}
-	
+
+	triton_context_call(&sess->conn->ctx, (triton_event_func)l2tp_sess_finished, sess);
+}
+
+static void l2tp_conn_close(struct triton_context_t *ctx)
+{
+	struct l2tp_conn_t *conn = container_of(ctx, typeof(*conn), ctx);
+
+	if (conn->closed)
+		return;
+
 	if (l2tp_terminate(conn, 0, 0))
 		l2tp_disconnect(conn);
 }
 
-static int l2tp_tunnel_alloc(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack, struct in_pktinfo *pkt_info, struct l2tp_attr_t *assigned_tid, 
-    struct l2tp_attr_t *framing_cap, struct l2tp_attr_t *challenge)
+/* Opens a socket connected to the peer, the kernel tunnel is built on it */
+static int l2tp_conn_socket(struct l2tp_conn_t *conn)
 {
-	struct l2tp_conn_t *conn;
-	struct sockaddr_in addr;
-	uint16_t tid;
-	//char *opt;
 	int flag = 1;
 
-	conn = mempool_alloc(l2tp_conn_pool);
-	if (!conn) {
-		log_emerg("l2tp: out of memory\n");
-		return -1;
-	}
-
-	memset(conn, 0, sizeof(*conn));
-	INIT_LIST_HEAD(&conn->send_queue);
-
 	conn->hnd.fd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (conn->hnd.fd < 0) {
 		log_error("l2tp: socket: %s\n", strerror(errno));
-		mempool_free(conn);
 		return -1;
 	}
-	
-	fcntl(conn->hnd.fd, F_SETFD, fcntl(conn->hnd.fd, F_GETFD) | FD_CLOEXEC);
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr = pkt_info->ipi_addr;
-	addr.sin_port = htons(L2TP_PORT);
+	fcntl(conn->hnd.fd, F_SETFD, fcntl(conn->hnd.fd, F_GETFD) | FD_CLOEXEC);
 
   setsockopt(conn->hnd.fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-	if (bind(conn->hnd.fd, &addr, sizeof(addr))) {
+
+	if (bind(conn->hnd.fd, &conn->host_addr, sizeof(conn->host_addr))) {
 		log_error("l2tp: bind: %s\n", strerror(errno));
 		goto out_err;
 	}
-	
-	if (connect(conn->hnd.fd, (struct sockaddr *)&pack->addr, sizeof(addr))) {
+
+	if (connect(conn->hnd.fd, (struct sockaddr *)&conn->addr, sizeof(conn->addr))) {
 		log_error("l2tp: connect: %s\n", strerror(errno));
 		goto out_err;
 	}
- 
+
 	if (fcntl(conn->hnd.fd, F_SETFL, O_NONBLOCK)) {
     log_emerg("l2tp: failed to set nonblocking mode: %s\n", strerror(errno));
 		goto out_err;
 	}
 
-	pthread_mutex_lock(&l2tp_lock);
-	for (tid = l2tp_tid + 1; tid != l2tp_tid; tid++) {
-		if (tid == L2TP_MAX_TID)
-			tid = 1;
-		if (!l2tp_conn[tid]) {
-			l2tp_conn[tid] = conn;
-			conn->tid = tid;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&l2tp_lock);
+	conn->hnd.read = l2tp_conn_read;
 
-	if (!conn->tid) {
-		if (conf_verbose)
-			log_warn("l2tp: no free tid available\n");
-		mempool_free(conn);
+	return 0;
+
+out_err:
+	close(conn->hnd.fd);
+	conn->hnd.fd = -1;
+	return -1;
+}
+
+static int l2tp_tunnel_alloc(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack, struct in_pktinfo *pkt_info, struct l2tp_attr_t *assigned_tid,
+    struct l2tp_attr_t *framing_cap, struct l2tp_attr_t *challenge, struct l2tp_attr_t *recv_window)
+{
+	struct l2tp_conn_t *conn;
+	uint16_t tid;
+	int i;
+
+	conn = mempool_alloc(l2tp_conn_pool);
+	if (!conn) {
+		log_emerg("l2tp: out of memory\n");
 		return -1;
 	}
 
-	conn->sid = 1;
+	memset(conn, 0, sizeof(*conn));
+	INIT_LIST_HEAD(&conn->send_queue);
+	INIT_LIST_HEAD(&conn->recv_queue);
+	INIT_LIST_HEAD(&conn->rx_queue);
+	conn->send_next = &conn->send_queue;
+	spinlock_init(&conn->rx_lock);
+	for (i = 0; i < L2TP_SESS_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&conn->sess_hash[i]);
+
+	conn->serv = serv;
+	conn->hnd.fd = -1;
+	conn->tunnel_fd = -1;
 
 	memcpy(&conn->addr, &pack->addr, sizeof(pack->addr));
+	conn->host_addr.sin_family = AF_INET;
+	conn->host_addr.sin_addr = pkt_info->ipi_addr;
+	conn->host_addr.sin_port = htons(L2TP_PORT);
+
+	if (!conf_shared_socket && l2tp_conn_socket(conn)) {
+		mempool_free(conn);
+		return -1;
+	}
+
 	conn->peer_tid = assigned_tid->val.uint16;
 	conn->framing_cap = framing_cap->val.uint32;
+	conn->Nr = ntohs(pack->hdr.Ns) + 1;
+
+	/* RFC 2661 5.8: the window defaults to 4 if the peer does not tell */
+	conn->peer_rws = recv_window ? recv_window->val.uint16 : 4;
+	if (!conn->peer_rws)
+		conn->peer_rws = 1;
 
 	/* If challenge set in SCCRQ, we need to calculate response for SCCRP */
 	if (challenge && challenge->length <= 16) {
@@ -326,60 +575,144 @@ static int l2tp_tunnel_alloc(struct l2tp_serv_t *serv, struct l2tp_packet_t *pac
 
 	conn->ctx.before_switch = log_switch;
 	conn->ctx.close = l2tp_conn_close;
-	conn->hnd.read = l2tp_conn_read;
 	conn->timeout_timer.expire = l2tp_timeout;
 	conn->timeout_timer.period = conf_timeout * 1000;
 	conn->rtimeout_timer.expire = l2tp_rtimeout;
 	conn->rtimeout_timer.period = conf_rtimeout * 1000;
 	conn->hello_timer.expire = l2tp_send_HELLO;
 	conn->hello_timer.period = conf_hello_interval * 1000;
-	conn->ctrl.ctx = &conn->ctx;
-	conn->ctrl.type = CTRL_TYPE_L2TP;
-	conn->ctrl.name = "l2tp";
-	conn->ctrl.started = l2tp_ppp_started;
-	conn->ctrl.finished = l2tp_ppp_finished;
-	conn->ctrl.max_mtu = 1420;
-	conn->ctrl.mppe = conf_mppe;
-	conn->ctrl.def_pool = conf_ip_pool;
-
-	conn->ctrl.calling_station_id = _malloc(17);
-	conn->ctrl.called_station_id = _malloc(17);
-	u_inet_ntoa(conn->addr.sin_addr.s_addr, conn->ctrl.calling_station_id);
-	u_inet_ntoa(addr.sin_addr.s_addr, conn->ctrl.called_station_id);
-
-	ppp_init(&conn->ppp);
-	conn->ppp.ctrl = &conn->ctrl;
-	conn->ppp.fd = -1;
-	conn->tunnel_fd = -1;
+	conn->ack_timer.expire = l2tp_ack_timeout;
+	conn->ack_timer.period = conf_ack_delay;
+
+	/* The context is registered before the tid is published, listeners
+	 * may queue packets to the tunnel as soon as it is in l2tp_conn[] */
+	triton_context_register(&conn->ctx, NULL);
+
+	pthread_mutex_lock(&l2tp_lock);
+	for (tid = l2tp_tid + 1; tid != l2tp_tid; tid++) {
+		if (tid == L2TP_MAX_TID)
+			tid = 1;
+		if (!l2tp_conn[tid]) {
+			l2tp_conn[tid] = conn;
+			conn->tid = tid;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&l2tp_lock);
+
+	if (!conn->tid) {
+		if (conf_verbose)
+			log_warn("l2tp: no free tid available\n");
+		triton_context_unregister(&conn->ctx);
+		if (conn->hnd.fd != -1)
+			close(conn->hnd.fd);
+		if (conn->challenge_len)
+			_free(conn->challenge.octets);
+		mempool_free(conn);
+		return -1;
+	}
 
-	triton_context_register(&conn->ctx, &conn->ppp);
-	triton_md_register_handler(&conn->ctx, &conn->hnd);
-	triton_md_enable_handler(&conn->hnd, MD_MODE_READ);
+	if (conn->hnd.fd != -1) {
+		triton_md_register_handler(&conn->ctx, &conn->hnd);
+		triton_md_enable_handler(&conn->hnd, MD_MODE_READ);
+	}
 	triton_context_wakeup(&conn->ctx);
 
 	if (conf_verbose) {
-		log_switch(&conn->ctx, &conn->ppp);
-		log_ppp_info2("recv ");
-		l2tp_packet_print(pack, log_ppp_info2);
+		log_info2("recv ");
+		l2tp_packet_print(pack, log_info2);
 	}
 
 	triton_context_call(&conn->ctx, (triton_event_func)l2tp_send_SCCRP, conn);
 
-	__sync_add_and_fetch(&stat_starting, 1);
+	__sync_add_and_fetch(&stat_tunnels, 1);
 
 	return 0;
-
-out_err:
-	close(conn->hnd.fd);
-	mempool_free(conn);
-	return -1;
 }
 
-static int l2tp_connect(struct l2tp_conn_t *conn)
-{
-	struct sockaddr_pppol2tp pppox_addr;
-	int arg = 1;
-	int flg;
+static void l2tp_sess_timeout(struct triton_timer_t *t);
+
+static struct l2tp_sess_t *l2tp_sess_alloc(struct l2tp_conn_t *conn, uint16_t peer_sid)
+{
+	struct l2tp_sess_t *sess;
+	uint16_t sid;
+
+	sid = l2tp_sess_alloc_sid(conn);
+	if (!sid) {
+		if (conf_verbose)
+			log_warn("l2tp: tunnel %i: no free sid available\n", conn->tid);
+		return NULL;
+	}
+
+	sess = mempool_alloc(l2tp_sess_pool);
+	if (!sess) {
+		log_emerg("l2tp: out of memory\n");
+		return NULL;
+	}
+
+	memset(sess, 0, sizeof(*sess));
+
+	sess->conn = conn;
+	sess->sid = sid;
+	sess->peer_sid = peer_sid;
+	sess->state1 = STATE_WAIT_ICCN;
+	sess->state = STATE_WAIT_ICCN;
+	sess->cdn_res = 3;
+
+	sess->timeout_timer.expire = l2tp_sess_timeout;
+	sess->timeout_timer.period = conf_timeout * 1000;
+
+	sess->ctx.before_switch = log_switch;
+	sess->ctx.close = l2tp_sess_close;
+	sess->ctrl.ctx = &sess->ctx;
+	sess->ctrl.type = CTRL_TYPE_L2TP;
+	sess->ctrl.name = "l2tp";
+	sess->ctrl.started = l2tp_ppp_started;
+	sess->ctrl.finished = l2tp_ppp_finished;
+	sess->ctrl.max_mtu = 1420;
+	sess->ctrl.mppe = conf_mppe;
+	sess->ctrl.def_pool = conf_ip_pool;
+
+	sess->ctrl.calling_station_id = _malloc(17);
+	sess->ctrl.called_station_id = _malloc(17);
+	u_inet_ntoa(conn->addr.sin_addr.s_addr, sess->ctrl.calling_station_id);
+	u_inet_ntoa(conn->host_addr.sin_addr.s_addr, sess->ctrl.called_station_id);
+
+	ppp_init(&sess->ppp);
+	sess->ppp.ctrl = &sess->ctrl;
+	sess->ppp.fd = -1;
+
+	triton_context_register(&sess->ctx, &sess->ppp);
+	triton_context_wakeup(&sess->ctx);
+
+	list_add_tail(&sess->entry, &conn->sess_hash[sid % L2TP_SESS_HASH_SIZE]);
+	conn->sess_cnt++;
+
+	__sync_add_and_fetch(&stat_starting, 1);
+
+	return sess;
+}
+
+/*
+ * Creates the kernel tunnel once, on the first ICCN of the tunnel. The
+ * kernel binds a tunnel to a UDP socket of its own, so in shared-socket
+ * mode the tunnel moves off the listener here; from now on the peer's
+ * datagrams are delivered to the connected socket.
+ */
+static int l2tp_tunnel_connect(struct l2tp_conn_t *conn)
+{
+	struct sockaddr_pppol2tp pppox_addr;
+	int flg;
+
+	if (conn->tunnel_fd != -1)
+		return 0;
+
+	if (conn->hnd.fd == -1) {
+		if (l2tp_conn_socket(conn))
+			return -1;
+		triton_md_register_handler(&conn->ctx, &conn->hnd);
+		triton_md_enable_handler(&conn->hnd, MD_MODE_READ);
+	}
 
 	memset(&pppox_addr, 0, sizeof(pppox_addr));
 	pppox_addr.sa_family = AF_PPPOX;
@@ -406,90 +739,179 @@ static int l2tp_connect(struct l2tp_conn_t *conn)
 		goto out_err;
 	}
 
-	conn->ppp.fd = socket(AF_PPPOX, SOCK_DGRAM, PX_PROTO_OL2TP);
-	if (conn->ppp.fd < 0) {
+	if (connect(conn->tunnel_fd, (struct sockaddr *)&pppox_addr, sizeof(pppox_addr)) < 0) {
+		log_ppp_error("l2tp: connect(tunnel): %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	return 0;
+
+out_err:
+	if (conn->tunnel_fd >= 0) {
+		close(conn->tunnel_fd);
+		conn->tunnel_fd = -1;
+	}
+	return -1;
+}
+
+/* Runs in the session context, attaches the call to the kernel tunnel */
+static void l2tp_sess_connect(struct l2tp_sess_t *sess)
+{
+	int arg = 1;
+	int flg;
+
+	if (sess->state == STATE_FIN)
+		return;
+
+	sess->ppp.fd = socket(AF_PPPOX, SOCK_DGRAM, PX_PROTO_OL2TP);
+	if (sess->ppp.fd < 0) {
 		log_ppp_error("l2tp: socket(AF_PPPOX): %s\n", strerror(errno));
 		goto out_err;
 	}
 
-	flg = fcntl(conn->ppp.fd, F_GETFD);
+	flg = fcntl(sess->ppp.fd, F_GETFD);
 	if (flg < 0) {
 		log_ppp_error("l2tp: fcntl(F_GETFD): %s\n", strerror(errno));
 		goto out_err;
 	}
-	flg = fcntl(conn->ppp.fd, F_SETFD, flg | FD_CLOEXEC);
+	flg = fcntl(sess->ppp.fd, F_SETFD, flg | FD_CLOEXEC);
 	if (flg < 0) {
 		log_ppp_error("l2tp: fcntl(F_SETFD): %s\n", strerror(errno));
 		goto out_err;
 	}
 
-	if (connect(conn->tunnel_fd, (struct sockaddr *)&pppox_addr, sizeof(pppox_addr)) < 0) {
-		log_ppp_error("l2tp: connect(tunnel): %s\n", strerror(errno));
-		goto out_err;
-	}
-
-	pppox_addr.pppol2tp.s_session = conn->sid;
-	pppox_addr.pppol2tp.d_session = conn->peer_sid;
-
-	if (connect(conn->ppp.fd, (struct sockaddr *)&pppox_addr, sizeof(pppox_addr)) < 0) {
+	if (connect(sess->ppp.fd, (struct sockaddr *)&sess->pppox_addr, sizeof(sess->pppox_addr)) < 0) {
 		log_ppp_error("l2tp: connect(session): %s\n", strerror(errno));
 		goto out_err;
 	}
 
-	if (setsockopt(conn->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_LNSMODE, &arg, sizeof(arg))) {
+	if (setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_LNSMODE, &arg, sizeof(arg))) {
 		log_ppp_error("l2tp: setsockopt: %s\n", strerror(errno));
 		goto out_err;
 	}
 
-	conn->ppp.chan_name = _strdup(inet_ntoa(conn->addr.sin_addr));
+	sess->ppp.chan_name = _strdup(inet_ntoa(sess->pppox_addr.pppol2tp.addr.sin_addr));
 
-	triton_event_fire(EV_CTRL_STARTED, &conn->ppp);
+	triton_event_fire(EV_CTRL_STARTED, &sess->ppp);
 
-	if (establish_ppp(&conn->ppp))
+	if (establish_ppp(&sess->ppp))
 		goto out_err;
 
 	__sync_sub_and_fetch(&stat_starting, 1);
 	__sync_add_and_fetch(&stat_active, 1);
 
-	conn->state = STATE_PPP;
+	sess->state = STATE_PPP;
 
-	return 0;
+	return;
 
 out_err:
-	if (conn->tunnel_fd >= 0) {
-		close(conn->tunnel_fd);
-		conn->tunnel_fd = -1;
+	if (sess->ppp.fd >= 0) {
+		close(sess->ppp.fd);
+		sess->ppp.fd = -1;
 	}
-	if (conn->ppp.fd >= 0) {
-		close(conn->ppp.fd);
-		conn->ppp.fd = -1;
+	sess->cdn_res = 2;
+	triton_context_call(&sess->conn->ctx, (triton_event_func)l2tp_sess_finished, sess);
+}
+
+static int l2tp_xmit(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
+{
+	if (conn->hnd.fd != -1)
+		return l2tp_packet_send(conn->hnd.fd, pack);
+
+	return l2tp_packet_sendto(conn->serv->hnd.fd, pack, &conn->host_addr.sin_addr);
+}
+
+static inline int l2tp_seq_cmp(uint16_t a, uint16_t b)
+{
+	return (int16_t)(a - b);
+}
+
+/* Every transmitted message carries the current Nr, so it acknowledges
+ * whatever the delayed-ack timer is waiting for */
+static int l2tp_transmit(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
+{
+	pack->hdr.Nr = htons(conn->Nr);
+
+	if (conn->ack_timer.tpd)
+		triton_timer_del(&conn->ack_timer);
+
+	return l2tp_xmit(conn, pack);
+}
+
+/* Transmits queued messages as far as the peer's receive window allows */
+static int l2tp_push(struct l2tp_conn_t *conn)
+{
+	struct l2tp_packet_t *pack;
+
+	while (conn->send_next != &conn->send_queue && conn->in_flight < conn->peer_rws) {
+		pack = list_entry(conn->send_next, typeof(*pack), entry);
+		conn->send_next = conn->send_next->next;
+		conn->in_flight++;
+		if (l2tp_transmit(conn, pack))
+			return -1;
 	}
-	return -1;
+
+	if (conn->in_flight && !conn->rtimeout_timer.tpd)
+		triton_timer_add(&conn->ctx, &conn->rtimeout_timer, 0);
+
+	return 0;
 }
 
-static void l2tp_retransmit(struct l2tp_conn_t *conn)
+/* Releases messages acknowledged by the peer's Nr */
+static int l2tp_ack(struct l2tp_conn_t *conn, uint16_t Nr)
 {
 	struct l2tp_packet_t *pack;
+	int acked = 0;
 
-	pack = list_entry(conn->send_queue.next, typeof(*pack), entry);
-	pack->hdr.Nr = htons(conn->Nr + 1);
-	if (conf_verbose) {
-		log_ppp_debug("send ");
-		l2tp_packet_print(pack, log_ppp_debug);
+	while (conn->in_flight) {
+		pack = list_entry(conn->send_queue.next, typeof(*pack), entry);
+		if (l2tp_seq_cmp(ntohs(pack->hdr.Ns), Nr) >= 0)
+			break;
+		list_del(&pack->entry);
+		l2tp_packet_free(pack);
+		conn->in_flight--;
+		acked = 1;
 	}
-	l2tp_packet_send(conn->hnd.fd, pack);
+
+	if (!acked)
+		return 0;
+
+	conn->retransmit = 0;
+
+	if (conn->in_flight)
+		triton_timer_mod(&conn->rtimeout_timer, 0);
+	else if (conn->rtimeout_timer.tpd)
+		triton_timer_del(&conn->rtimeout_timer);
+
+	return l2tp_push(conn);
 }
 
+/* Resends every unacknowledged message, the peer may have lost any of them */
 static void l2tp_rtimeout(struct triton_timer_t *t)
 {
 	struct l2tp_conn_t *conn = container_of(t, typeof(*conn), rtimeout_timer);
+	struct l2tp_packet_t *pack;
+	int i = 0;
 
-	if (!list_empty(&conn->send_queue)) {
-		log_ppp_debug("l2tp: retransmit (%i)\n", conn->retransmit);
-		if (++conn->retransmit <= conf_retransmit) {
-			l2tp_retransmit(conn);
-		} else
-			l2tp_disconnect(conn);
+	if (!conn->in_flight)
+		return;
+
+	log_ppp_debug("l2tp: retransmit (%i)\n", conn->retransmit);
+
+	if (++conn->retransmit > conf_retransmit) {
+		l2tp_disconnect(conn);
+		return;
+	}
+
+	list_for_each_entry(pack, &conn->send_queue, entry) {
+		if (i++ == conn->in_flight)
+			break;
+		if (conf_verbose) {
+			log_ppp_debug("send ");
+			l2tp_packet_print(pack, log_ppp_debug);
+		}
+		if (l2tp_transmit(conn, pack))
+			break;
 	}
 }
 
@@ -500,18 +922,31 @@ static void l2tp_timeout(struct triton_timer_t *t)
 	l2tp_disconnect(conn);
 }
 
+static void l2tp_sess_timeout(struct triton_timer_t *t)
+{
+	struct l2tp_sess_t *sess = container_of(t, typeof(*sess), timeout_timer);
+
+	log_ppp_debug("l2tp: tunnel %i: session %i timeout\n", sess->conn->tid, sess->sid);
+
+	triton_timer_del(t);
+
+	sess->cdn_res = 2;
+	l2tp_sess_finished(sess);
+}
+
+/*
+ * Queues a message for reliable delivery, it goes out at once if the
+ * peer's window has room. A ZLB is sent immediately and not queued.
+ */
 static int l2tp_send(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack, int log_debug)
 {
-	conn->retransmit = 0;
+	int r;
 
 	pack->hdr.tid = htons(conn->peer_tid);
 	//pack->hdr.sid = htons(conn->peer_sid);
-	pack->hdr.Nr = htons(conn->Nr + 1);
+	pack->hdr.Nr = htons(conn->Nr);
 	pack->hdr.Ns = htons(conn->Ns);
 
-	if (!list_empty(&pack->attrs))
-		conn->Ns++;
-
 	if (conf_verbose) {
 		if (log_debug) {
 			log_ppp_debug("send ");
@@ -522,21 +957,19 @@ static int l2tp_send(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack, int l
 		}
 	}
 
-	if (l2tp_packet_send(conn->hnd.fd, pack))
-		goto out_err;
-
-	if (!list_empty(&pack->attrs)) {
-		list_add_tail(&pack->entry, &conn->send_queue);
-		if (!conn->rtimeout_timer.tpd)
-			triton_timer_add(&conn->ctx, &conn->rtimeout_timer, 0);
-	} else
+	if (list_empty(&pack->attrs)) {
+		r = l2tp_transmit(conn, pack);
 		l2tp_packet_free(pack);
-	
-	return 0;
+		return r;
+	}
 
-out_err:
-	l2tp_packet_free(pack);
-	return -1;
+	conn->Ns++;
+
+	list_add_tail(&pack->entry, &conn->send_queue);
+	if (conn->send_next == &conn->send_queue)
+		conn->send_next = &pack->entry;
+
+	return l2tp_push(conn);
 }
 
 static int l2tp_send_ZLB(struct l2tp_conn_t *conn)
@@ -553,6 +986,14 @@ static int l2tp_send_ZLB(struct l2tp_conn_t *conn)
 	return 0;
 }
 
+static void l2tp_ack_timeout(struct triton_timer_t *t)
+{
+	struct l2tp_conn_t *conn = container_of(t, typeof(*conn), ack_timer);
+
+	if (l2tp_send_ZLB(conn))
+		l2tp_disconnect(conn);
+}
+
 static void l2tp_send_HELLO(struct triton_timer_t *t)
 {
 	struct l2tp_conn_t *conn = container_of(t, typeof(*conn), hello_timer);
@@ -575,7 +1016,7 @@ static void l2tp_send_SCCRP(struct l2tp_conn_t *conn)
 	pack = l2tp_packet_alloc(2, Message_Type_Start_Ctrl_Conn_Reply, &conn->addr);
 	if (!pack)
 		goto out;
-	
+
 	if (l2tp_packet_add_int16(pack, Protocol_Version, L2TP_V2_PROTOCOL_VERSION, 1))
 		goto out_err;
 	if (l2tp_packet_add_string(pack, Host_Name, conf_host_name, 1))
@@ -584,6 +1025,8 @@ static void l2tp_send_SCCRP(struct l2tp_conn_t *conn)
 		goto out_err;
 	if (l2tp_packet_add_int16(pack, Assigned_Tunnel_ID, conn->tid, 1))
 		goto out_err;
+	if (l2tp_packet_add_int16(pack, Recv_Window_Size, conf_recv_window, 1))
+		goto out_err;
 	if (l2tp_packet_add_string(pack, Vendor_Name, "accel-ppp", 0))
 		goto out_err;
 	/* If challenge response available */
@@ -610,28 +1053,25 @@ out:
 	l2tp_disconnect(conn);
 }
 
-static int l2tp_send_ICRP(struct l2tp_conn_t *conn)
+static int l2tp_send_ICRP(struct l2tp_sess_t *sess)
 {
+	struct l2tp_conn_t *conn = sess->conn;
 	struct l2tp_packet_t *pack;
 
 	pack = l2tp_packet_alloc(2, Message_Type_Incoming_Call_Reply, &conn->addr);
 	if (!pack)
 		return -1;
 
-	pack->hdr.sid = htons(conn->peer_sid);
-	
-	if (l2tp_packet_add_int16(pack, Assigned_Session_ID, conn->sid, 1))
+	pack->hdr.sid = htons(sess->peer_sid);
+
+	if (l2tp_packet_add_int16(pack, Assigned_Session_ID, sess->sid, 1))
 		goto out_err;
 
-	l2tp_send(conn, pack, 0);
+	if (l2tp_send(conn, pack, 0))
+		return -1;
+
+	triton_timer_add(&conn->ctx, &sess->timeout_timer, 0);
 
-	if (!conn->timeout_timer.tpd)
-		triton_timer_add(&conn->ctx, &conn->timeout_timer, 0);
-	else
-		triton_timer_mod(&conn->timeout_timer, 0);
-	
-	conn->state1 = STATE_WAIT_ICCN;
-	
 	return 0;
 
 out_err:
@@ -646,7 +1086,7 @@ out_err:
 	pack = l2tp_packet_alloc(2, Message_Type_Outgoing_Call_Request, &conn->addr);
 	if (!pack)
 		return -1;
-	
+
 	pack->hdr.sid = htons(conn->peer_sid);
 
 	if (l2tp_packet_add_int16(pack, Assigned_Session_ID, conn->sid, 1))
@@ -671,9 +1111,9 @@ out_err:
 		triton_timer_add(&conn->ctx, &conn->timeout_timer, 0);
 	else
 		triton_timer_mod(&conn->timeout_timer, 0);
-	
+
 	conn->state2 = STATE_WAIT_OCRP;
-	
+
 	return 0;
 
 out_err:
@@ -681,7 +1121,6 @@ out_err:
 	return -1;
 }*/
 
-
 static int l2tp_recv_SCCRQ(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack, struct in_pktinfo *pkt_info)
 {
 	struct l2tp_attr_t *attr;
@@ -691,6 +1130,7 @@ static int l2tp_recv_SCCRQ(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack,
 	struct l2tp_attr_t *framing_cap = NULL;
 	struct l2tp_attr_t *router_id = NULL;
 	struct l2tp_attr_t *challenge = NULL;
+	struct l2tp_attr_t *recv_window = NULL;
 	
 	if (ppp_shutdown)
 		return 0;
@@ -698,6 +1138,12 @@ static int l2tp_recv_SCCRQ(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack,
 	if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_ipv4(pack->addr.sin_addr.s_addr)))
 		return 0;
 
+	if (ppp_admission_check()) {
+		if (conf_verbose)
+			log_warn("l2tp: discard SCCRQ (admission limit reached)\n");
+		return 0;
+	}
+
 	list_for_each_entry(attr, &pack->attrs, entry) {
 		switch (attr->attr->id) {
 			case Protocol_Version:
@@ -718,6 +1164,9 @@ static int l2tp_recv_SCCRQ(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack,
 			case Router_ID:
 				router_id = attr;
 				break;
+			case Recv_Window_Size:
+				recv_window = attr;
+				break;
 			case Message_Digest:
 				if (conf_verbose)
 					log_warn("l2tp: Message-Digest is not supported\n");
@@ -742,7 +1191,7 @@ static int l2tp_recv_SCCRQ(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack,
 			return -1;
 		}
 		
-		if (l2tp_tunnel_alloc(serv, pack, pkt_info, assigned_tid, framing_cap, challenge))
+		if (l2tp_tunnel_alloc(serv, pack, pkt_info, assigned_tid, framing_cap, challenge, recv_window))
 			return -1;
 
 	} else if (assigned_cid) {
@@ -766,9 +1215,10 @@ static int l2tp_recv_SCCRQ(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack,
 static int l2tp_recv_SCCCN(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 {
 	if (conn->state == STATE_WAIT_SCCCN) {
-		triton_timer_mod(&conn->timeout_timer, 0);
+		triton_timer_del(&conn->timeout_timer);
 		conn->state = STATE_ESTB;
-		conn->state1 = STATE_WAIT_ICRQ;
+		if (conf_hello_interval)
+			triton_timer_add(&conn->ctx, &conn->hello_timer, 0);
 	}
 	else
 		log_ppp_warn("l2tp: unexpected SCCCN\n");
@@ -784,9 +1234,6 @@ static int l2tp_recv_StopCCN(struct l2tp_conn_t *conn, struct l2tp_packet_t *pac
 
 static int l2tp_recv_HELLO(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 {
-	if (l2tp_send_ZLB(conn))
-		return -1;
-	
 	return 0;
 }
 
@@ -794,8 +1241,9 @@ static int l2tp_recv_ICRQ(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 {
 	struct l2tp_attr_t *attr;
 	struct l2tp_attr_t *assigned_sid = NULL;
+	struct l2tp_sess_t *sess;
 
-	if (conn->state1 != STATE_WAIT_ICRQ) {
+	if (conn->state != STATE_ESTB) {
 		log_ppp_warn("l2tp: unexpected ICRQ\n");
 		return 0;
 	}
@@ -830,13 +1278,27 @@ static int l2tp_recv_ICRQ(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 			log_ppp_warn("l2tp: ICRQ: no Assigned-Session-ID attribute present in message\n");
 		if (l2tp_terminate(conn, 2, 0))
 			return -1;
+		return 0;
 	}
 
-	conn->peer_sid = assigned_sid->val.uint16;
+	if (ppp_shutdown || ppp_admission_acquire()) {
+		if (conf_verbose)
+			log_ppp_warn("l2tp: discard ICRQ (admission limit reached)\n");
+		if (l2tp_send_CDN(conn, 0, assigned_sid->val.uint16, 4, 0))
+			return -1;
+		return 0;
+	}
 
-	if (l2tp_send_ICRP(conn))
+	sess = l2tp_sess_alloc(conn, assigned_sid->val.uint16);
+	if (!sess) {
+		if (l2tp_send_CDN(conn, 0, assigned_sid->val.uint16, 4, 0))
+			return -1;
+		return 0;
+	}
+
+	if (l2tp_send_ICRP(sess))
 		return -1;
-		
+
 	/*if (l2tp_send_OCRQ(conn))
 		return -1;*/
 	
@@ -845,23 +1307,33 @@ static int l2tp_recv_ICRQ(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 
 static int l2tp_recv_ICCN(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 {
-	if (conn->state1 != STATE_WAIT_ICCN) {
+	struct l2tp_sess_t *sess = l2tp_sess_find(conn, ntohs(pack->hdr.sid));
+
+	if (!sess || sess->closing || sess->state1 != STATE_WAIT_ICCN) {
 		log_ppp_warn("l2tp: unexpected ICCN\n");
 		return 0;
 	}
 
-	conn->state1 = STATE_ESTB;
+	sess->state1 = STATE_ESTB;
+	triton_timer_del(&sess->timeout_timer);
 
-	if (l2tp_connect(conn)) {
+	if (l2tp_tunnel_connect(conn)) {
 		if (l2tp_terminate(conn, 2, 0))
 			return -1;
 		return 0;
 	}
 
-	if (l2tp_send_ZLB(conn))
-		return -1;
-	
-	triton_timer_del(&conn->timeout_timer);
+	memset(&sess->pppox_addr, 0, sizeof(sess->pppox_addr));
+	sess->pppox_addr.sa_family = AF_PPPOX;
+	sess->pppox_addr.sa_protocol = PX_PROTO_OL2TP;
+	sess->pppox_addr.pppol2tp.fd = conn->hnd.fd;
+	memcpy(&sess->pppox_addr.pppol2tp.addr, &conn->addr, sizeof(conn->addr));
+	sess->pppox_addr.pppol2tp.s_tunnel = conn->tid;
+	sess->pppox_addr.pppol2tp.d_tunnel = conn->peer_tid;
+	sess->pppox_addr.pppol2tp.s_session = sess->sid;
+	sess->pppox_addr.pppol2tp.d_session = sess->peer_sid;
+
+	triton_context_call(&sess->ctx, (triton_event_func)l2tp_sess_connect, sess);
 
 	return 0;
 }
@@ -892,21 +1364,16 @@ static int l2tp_recv_OCCN(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 
 static int l2tp_recv_CDN(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 {
-	if (ntohs(pack->hdr.sid) != conn->sid) {
+	struct l2tp_sess_t *sess = l2tp_sess_find(conn, ntohs(pack->hdr.sid));
+
+	if (!sess || sess->closing) {
 		if (conf_verbose)
 			log_warn("l2tp: sid %i is incorrect\n", ntohs(pack->hdr.sid));
 		return 0;
 	}
 
-	if (conn->state == STATE_PPP) {
-		__sync_sub_and_fetch(&stat_active, 1);
-		conn->state = STATE_FIN;
-		ppp_terminate(&conn->ppp, TERM_USER_REQUEST, 1);
-	}
-	
-	if (l2tp_terminate(conn, 0, 0))
-		return -1;
-	
+	l2tp_sess_drop(sess);
+
 	return 0;
 }
 
@@ -915,11 +1382,195 @@ static int l2tp_recv_SLI(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
 	return 0;
 }
 
+static void l2tp_recv_queue_add(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
+{
+	struct l2tp_packet_t *p;
+	int d;
+
+	list_for_each_entry(p, &conn->recv_queue, entry) {
+		d = l2tp_seq_cmp(ntohs(p->hdr.Ns), ntohs(pack->hdr.Ns));
+		if (d == 0) {
+			l2tp_packet_free(pack);
+			return;
+		}
+		if (d > 0)
+			break;
+	}
+
+	/* the receive arena is sized for the largest datagram */
+	pack = l2tp_packet_compact(pack);
+
+	list_add_tail(&pack->entry, &p->entry);
+}
+
+static int l2tp_conn_msg(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack);
+
+/* Handles one control message of the tunnel, returns -1 if the tunnel
+ * has been disconnected (conn may be already freed) */
+static int l2tp_conn_recv(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
+{
+	int d;
+
+	if (ntohs(pack->hdr.tid) != conn->tid && (pack->hdr.tid || !conf_dir300_quirk)) {
+		if (conf_verbose)
+			log_warn("l2tp: incorrect tid %i in tunnel %i\n", ntohs(pack->hdr.tid), conn->tid);
+		l2tp_packet_free(pack);
+		return 0;
+	}
+
+	if (l2tp_ack(conn, ntohs(pack->hdr.Nr)))
+		goto drop;
+
+	if (conn->state == STATE_FIN && list_empty(&conn->send_queue))
+		goto drop;
+
+	if (list_empty(&pack->attrs)) {
+		l2tp_packet_free(pack);
+		return 0;
+	}
+
+	d = l2tp_seq_cmp(ntohs(pack->hdr.Ns), conn->Nr);
+
+	if (d < 0) {
+		/* our ack was lost, repeat it */
+		log_ppp_debug("duplicate packet\n");
+		l2tp_packet_free(pack);
+		if (l2tp_send_ZLB(conn)) {
+			l2tp_disconnect(conn);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (d > 0) {
+		if (d < conf_recv_window) {
+			log_ppp_debug("reordered packet\n");
+			l2tp_recv_queue_add(conn, pack);
+		} else {
+			log_ppp_debug("packet out of receive window\n");
+			l2tp_packet_free(pack);
+		}
+		return 0;
+	}
+
+	while (1) {
+		conn->Nr++;
+
+		/* a reply sent while handling the message carries the ack */
+		if (!conn->ack_timer.tpd)
+			triton_timer_add(&conn->ctx, &conn->ack_timer, 0);
+
+		if (l2tp_conn_msg(conn, pack))
+			return -1;
+
+		if (conn->closed || list_empty(&conn->recv_queue))
+			break;
+
+		pack = list_entry(conn->recv_queue.next, typeof(*pack), entry);
+		if (ntohs(pack->hdr.Ns) != conn->Nr)
+			break;
+
+		list_del(&pack->entry);
+	}
+
+	return 0;
+
+drop:
+	l2tp_packet_free(pack);
+	l2tp_disconnect(conn);
+	return -1;
+}
+
+static int l2tp_conn_msg(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack)
+{
+	struct l2tp_attr_t *msg_type;
+
+	msg_type = list_entry(pack->attrs.next, typeof(*msg_type), entry);
+
+	if (msg_type->attr->id != Message_Type) {
+		if (conf_verbose)
+			log_ppp_error("l2tp: first attribute is not Message-Type, dropping connection...\n");
+		goto drop;
+	}
+
+	if (conf_verbose) {
+		if (msg_type->val.uint16 == Message_Type_Hello) {
+			log_ppp_debug("recv ");
+			l2tp_packet_print(pack, log_ppp_debug);
+		} else {
+			log_ppp_info2("recv ");
+			l2tp_packet_print(pack, log_ppp_info2);
+		}
+	}
+
+	switch (msg_type->val.uint16) {
+		case Message_Type_Start_Ctrl_Conn_Connected:
+			if (l2tp_recv_SCCCN(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Stop_Ctrl_Conn_Notify:
+			if (l2tp_recv_StopCCN(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Hello:
+			if (l2tp_recv_HELLO(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Incoming_Call_Request:
+			if (l2tp_recv_ICRQ(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Incoming_Call_Connected:
+			if (l2tp_recv_ICCN(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Outgoing_Call_Reply:
+			if (l2tp_recv_OCRP(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Outgoing_Call_Connected:
+			if (l2tp_recv_OCCN(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Call_Disconnect_Notify:
+			if (l2tp_recv_CDN(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Set_Link_Info:
+			if (l2tp_recv_SLI(conn, pack))
+				goto drop;
+			break;
+		case Message_Type_Start_Ctrl_Conn_Request:
+		case Message_Type_Start_Ctrl_Conn_Reply:
+		case Message_Type_Outgoing_Call_Request:
+		case Message_Type_Incoming_Call_Reply:
+		case Message_Type_WAN_Error_Notify:
+			if (conf_verbose)
+				log_warn("l2tp: unexpected Message-Type %i\n", msg_type->val.uint16);
+			break;
+		default:
+			if (conf_verbose)
+				log_warn("l2tp: unknown Message-Type %i\n", msg_type->val.uint16);
+			if (msg_type->M) {
+				if (l2tp_terminate(conn, 2, 8))
+					goto drop;
+			}
+	}
+
+	l2tp_packet_free(pack);
+
+	return 0;
+
+drop:
+	l2tp_packet_free(pack);
+	l2tp_disconnect(conn);
+	return -1;
+}
+
 static int l2tp_conn_read(struct triton_md_handler_t *h)
 {
 	struct l2tp_conn_t *conn = container_of(h, typeof(*conn), hnd);
-	struct l2tp_packet_t *pack, *p;
-	struct l2tp_attr_t *msg_type;
+	struct l2tp_packet_t *pack;
 	int res;
 
 	while (1) {
@@ -934,174 +1585,162 @@ static int l2tp_conn_read(struct triton_md_handler_t *h)
 		if (!pack)
 			continue;
 
-		if (ntohs(pack->hdr.tid) != conn->tid && (pack->hdr.tid || !conf_dir300_quirk)) {
-			if (conf_verbose)
-				log_warn("l2tp: incorrect tid %i in tunnel %i\n", ntohs(pack->hdr.tid), conn->tid);
-			l2tp_packet_free(pack);
-			continue;
-		}
+		if (l2tp_conn_recv(conn, pack))
+			return -1;
+	}
+}
 
-		if (ntohs(pack->hdr.Ns) == conn->Nr + 1) {
-			if (!list_empty(&pack->attrs))
-				conn->Nr++;
-			if (!list_empty(&conn->send_queue)) {
-				p = list_entry(conn->send_queue.next, typeof(*pack), entry);
-				list_del(&p->entry);
-				l2tp_packet_free(p);
-				conn->retransmit = 0;
-			}
-			if (!list_empty(&conn->send_queue))
-				triton_timer_mod(&conn->rtimeout_timer, 0);
-			else {
-				if (conn->rtimeout_timer.tpd)
-					triton_timer_del(&conn->rtimeout_timer);
-				if (conn->state == STATE_FIN)
-					goto drop;
-			}
-		} else {
-			if (ntohs(pack->hdr.Ns) < conn->Nr + 1 || (ntohs(pack->hdr.Ns > 32767 && conn->Nr + 1 < 32767))) {
-				log_ppp_debug("duplicate packet\n");
-				if (!list_empty(&conn->send_queue))
-					l2tp_retransmit(conn);
-				else if (l2tp_send_ZLB(conn))
-					goto drop;
-			} else
-				log_ppp_debug("reordered packet\n");
-			l2tp_packet_free(pack);
-			continue;
-		}
+/* Drains the messages queued by the shared listeners */
+static void l2tp_conn_rx(struct l2tp_conn_t *conn)
+{
+	struct l2tp_packet_t *pack;
 
-		if (list_empty(&pack->attrs)) {
-			l2tp_packet_free(pack);
-			continue;
+	while (1) {
+		spin_lock(&conn->rx_lock);
+		if (list_empty(&conn->rx_queue)) {
+			spin_unlock(&conn->rx_lock);
+			break;
 		}
+		pack = list_entry(conn->rx_queue.next, typeof(*pack), entry);
+		list_del(&pack->entry);
+		spin_unlock(&conn->rx_lock);
 
-		msg_type = list_entry(pack->attrs.next, typeof(*msg_type), entry);
-
-		if (msg_type->attr->id != Message_Type) {
-			if (conf_verbose)
-				log_ppp_error("l2tp: first attribute is not Message-Type, dropping connection...\n");
-			goto drop;
-		}
+		if (conn->closed)
+			l2tp_packet_free(pack);
+		else if (l2tp_conn_recv(conn, pack))
+			break;
+	}
+}
 
-		if (conf_verbose) {
-			if (msg_type->val.uint16 == Message_Type_Hello) {
-				log_ppp_debug("recv ");
-				l2tp_packet_print(pack, log_ppp_debug);
-			} else {
-				log_ppp_info2("recv ");
-				l2tp_packet_print(pack, log_ppp_info2);
-			}
-		}
+/* Hands a message received on a shared listener to the owning tunnel */
+static void l2tp_dispatch(struct l2tp_packet_t *pack)
+{
+	struct l2tp_conn_t *conn;
+	uint16_t tid = ntohs(pack->hdr.tid);
+	int queued;
 
-		switch (msg_type->val.uint16) {
-			case Message_Type_Start_Ctrl_Conn_Connected:
-				if (l2tp_recv_SCCCN(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Stop_Ctrl_Conn_Notify:
-				if (l2tp_recv_StopCCN(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Hello:
-				if (l2tp_recv_HELLO(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Incoming_Call_Request:
-				if (l2tp_recv_ICRQ(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Incoming_Call_Connected:
-				if (l2tp_recv_ICCN(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Outgoing_Call_Reply:
-				if (l2tp_recv_OCRP(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Outgoing_Call_Connected:
-				if (l2tp_recv_OCCN(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Call_Disconnect_Notify:
-				if (l2tp_recv_CDN(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Set_Link_Info:
-				if (l2tp_recv_SLI(conn, pack))
-					goto drop;
-				break;
-			case Message_Type_Start_Ctrl_Conn_Request:
-			case Message_Type_Start_Ctrl_Conn_Reply:
-			case Message_Type_Outgoing_Call_Request:
-			case Message_Type_Incoming_Call_Reply:
-			case Message_Type_WAN_Error_Notify:
-				if (conf_verbose)
-					log_warn("l2tp: unexpected Message-Type %i\n", msg_type->val.uint16);
-				break;
-			default:
-				if (conf_verbose)
-					log_warn("l2tp: unknown Message-Type %i\n", msg_type->val.uint16);
-				if (msg_type->M) {
-					if (l2tp_terminate(conn, 2, 8))
-						goto drop;
-				}
-		}
+	pthread_mutex_lock(&l2tp_lock);
+	conn = tid < L2TP_MAX_TID ? l2tp_conn[tid] : NULL;
+	if (conn && conn->addr.sin_addr.s_addr == pack->addr.sin_addr.s_addr && conn->addr.sin_port == pack->addr.sin_port) {
+		spin_lock(&conn->rx_lock);
+		queued = !list_empty(&conn->rx_queue);
+		list_add_tail(&pack->entry, &conn->rx_queue);
+		spin_unlock(&conn->rx_lock);
+		if (!queued)
+			triton_context_call(&conn->ctx, (triton_event_func)l2tp_conn_rx, conn);
+		pack = NULL;
+	}
+	pthread_mutex_unlock(&l2tp_lock);
 
+	if (pack) {
+		if (conf_verbose)
+			log_warn("l2tp: unknown tid %i\n", tid);
 		l2tp_packet_free(pack);
 	}
-
-drop:
-	l2tp_packet_free(pack);
-	l2tp_disconnect(conn);
-	return -1;
 }
 
-static int l2tp_udp_read(struct triton_md_handler_t *h)
+static void l2tp_udp_recv(struct l2tp_serv_t *serv, struct mmsghdr *mmsg, struct l2tp_rx_slot_t *slot)
 {
-	struct l2tp_serv_t *serv = container_of(h, typeof(*serv), hnd);
 	struct l2tp_packet_t *pack;
 	struct l2tp_attr_t *msg_type;
 	struct in_pktinfo pkt_info;
+	struct cmsghdr *cmsg;
+	uint8_t *buf;
 
-	while (1) {
-		if (l2tp_recv(h->fd, &pack, &pkt_info))
+	if (mmsg->msg_hdr.msg_flags & MSG_TRUNC) {
+		if (conf_verbose)
+			log_warn("l2tp: too long message received (%u)\n", mmsg->msg_len);
+		return;
+	}
+
+	memset(&pkt_info, 0, sizeof(pkt_info));
+	for (cmsg = CMSG_FIRSTHDR(&mmsg->msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&mmsg->msg_hdr, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+			memcpy(&pkt_info, CMSG_DATA(cmsg), sizeof(pkt_info));
 			break;
+		}
+	}
 
-		if (!pack)
-			continue;
+	/* the parsed packet keeps the buffer, the slot gets a fresh one */
+	buf = l2tp_rx_buf_alloc();
+	if (!buf) {
+		log_emerg("l2tp: out of memory\n");
+		return;
+	}
+
+	l2tp_packet_parse(slot->buf, mmsg->msg_len, &slot->addr, &pack);
+	if (!pack) {
+		l2tp_rx_buf_free(buf);
+		return;
+	}
+
+	slot->buf = buf;
+	slot->iov.iov_base = buf;
 
-		if (iprange_client_check(pack->addr.sin_addr.s_addr)) {
-			log_warn("l2tp: IP is out of client-ip-range, droping connection...\n");
-			goto skip;
+	if (iprange_client_check(pack->addr.sin_addr.s_addr)) {
+		log_warn("l2tp: IP is out of client-ip-range, droping connection...\n");
+		goto skip;
+	}
+
+	if (pack->hdr.tid) {
+		if (conf_shared_socket) {
+			l2tp_dispatch(pack);
+			return;
 		}
+		goto skip;
+	}
 
-		if (pack->hdr.tid)
-			goto skip;
+	if (list_empty(&pack->attrs)) {
+		if (conf_verbose)
+			log_warn("l2tp: to Message-Type attribute present\n");
+		goto skip;
+	}
 
-		if (list_empty(&pack->attrs)) {
-			if (conf_verbose)
-				log_warn("l2tp: to Message-Type attribute present\n");
-			goto skip;
+	msg_type = list_entry(pack->attrs.next, typeof(*msg_type), entry);
+	if (msg_type->attr->id != Message_Type) {
+		if (conf_verbose)
+			log_warn("l2tp: first attribute is not Message-Type\n");
+		goto skip;
+	}
+
+	if (msg_type->val.uint16 == Message_Type_Start_Ctrl_Conn_Request)
+		l2tp_recv_SCCRQ(serv, pack, &pkt_info);
+	else {
+		if (conf_verbose) {
+			log_warn("recv (unexpected) ");
+			l2tp_packet_print(pack, log_ppp_warn);
 		}
+	}
+skip:
+	l2tp_packet_free(pack);
+}
 
-		msg_type = list_entry(pack->attrs.next, typeof(*msg_type), entry);
-		if (msg_type->attr->id != Message_Type) {
-			if (conf_verbose)
-				log_warn("l2tp: first attribute is not Message-Type\n");
-			goto skip;
+static int l2tp_udp_read(struct triton_md_handler_t *h)
+{
+	struct l2tp_serv_t *serv = container_of(h, typeof(*serv), hnd);
+	int i, n;
+
+	while (1) {
+		for (i = 0; i < L2TP_RX_BATCH; i++) {
+			serv->rx_msg[i].msg_hdr.msg_namelen = sizeof(serv->rx_slot[i].addr);
+			serv->rx_msg[i].msg_hdr.msg_controllen = sizeof(serv->rx_slot[i].msg_control);
+			serv->rx_msg[i].msg_hdr.msg_flags = 0;
 		}
 
-		if (msg_type->val.uint16 == Message_Type_Start_Ctrl_Conn_Request)
-			l2tp_recv_SCCRQ(serv, pack, &pkt_info);
-		else {
-			if (conf_verbose) {
-				log_warn("recv (unexpected) ");
-				l2tp_packet_print(pack, log_ppp_warn);
-			}
+		n = recvmmsg(h->fd, serv->rx_msg, L2TP_RX_BATCH, 0, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				log_error("l2tp: recvmmsg: %s\n", strerror(errno));
+			break;
 		}
-skip:
-		l2tp_packet_free(pack);
+
+		for (i = 0; i < n; i++)
+			l2tp_udp_recv(serv, &serv->rx_msg[i], &serv->rx_slot[i]);
+
+		if (n < L2TP_RX_BATCH)
+			break;
 	}
 
 	return 0;
@@ -1110,17 +1749,35 @@ skip:
 static void l2tp_udp_close(struct triton_context_t *ctx)
 {
 	struct l2tp_serv_t *serv = container_of(ctx, typeof(*serv), ctx);
-	triton_md_unregister_handler(&serv->hnd);
-	close(serv->hnd.fd);
+	if (serv->hnd.tpd) {
+		triton_md_unregister_handler(&serv->hnd);
+		close(serv->hnd.fd);
+	}
 	triton_context_unregister(&serv->ctx);
 }
 
-static struct l2tp_serv_t udp_serv =
+/* runs in the listener's context, tunnels have sockets of their own */
+static void l2tp_udp_release(struct l2tp_serv_t *serv)
 {
-	.hnd.read = l2tp_udp_read,
-	.ctx.close = l2tp_udp_close,
-	.ctx.before_switch = log_switch,
-};
+	if (serv->hnd.tpd) {
+		triton_md_unregister_handler(&serv->hnd);
+		close(serv->hnd.fd);
+	}
+
+	upgrade_release();
+}
+
+static void ev_upgrade(void)
+{
+	int i;
+
+	for (i = 0; i < udp_serv_cnt; i++) {
+		if (udp_serv[i].ctx.tpd) {
+			upgrade_hold();
+			triton_context_call(&udp_serv[i].ctx, (triton_event_func)l2tp_udp_release, &udp_serv[i]);
+		}
+	}
+}
 
 /*static struct l2tp_serv_t ip_serv =
 {
@@ -1128,57 +1785,116 @@ static struct l2tp_serv_t udp_serv =
 	.ctx.close=l2tp_ip_close,
 };*/
 
-static void start_udp_server(void)
+static int start_udp_listener(struct l2tp_serv_t *serv, struct sockaddr_in *addr)
 {
-	struct sockaddr_in addr;
-	char *opt;
 	int flag = 1;
+	int i;
 
-	udp_serv.hnd.fd = socket(PF_INET, SOCK_DGRAM, 0);
-	if (udp_serv.hnd.fd < 0) {
+	serv->hnd.fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (serv->hnd.fd < 0) {
 		log_emerg("l2tp: socket: %s\n", strerror(errno));
-		return;
+		return -1;
 	}
-	
-	fcntl(udp_serv.hnd.fd, F_SETFD, fcntl(udp_serv.hnd.fd, F_GETFD) | FD_CLOEXEC);
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(L2TP_PORT);
+	fcntl(serv->hnd.fd, F_SETFD, fcntl(serv->hnd.fd, F_GETFD) | FD_CLOEXEC);
 
-	opt = conf_get_opt("l2tp", "bind");
-	if (opt)
-		addr.sin_addr.s_addr = inet_addr(opt);
-	else
-		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	setsockopt(serv->hnd.fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	setsockopt(serv->hnd.fd, SOL_SOCKET, SO_NO_CHECK, &flag, sizeof(flag));
 
-	setsockopt(udp_serv.hnd.fd, SOL_SOCKET, SO_REUSEADDR, &udp_serv.hnd.fd, sizeof(udp_serv.hnd.fd));
-	setsockopt(udp_serv.hnd.fd, SOL_SOCKET, SO_NO_CHECK, &udp_serv.hnd.fd, sizeof(udp_serv.hnd.fd));
+	if (udp_serv_cnt > 1 && setsockopt(serv->hnd.fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag))) {
+		log_emerg("l2tp: setsockopt(SO_REUSEPORT): %s\n", strerror(errno));
+		goto out_err;
+	}
 
-	if (bind (udp_serv.hnd.fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+	if (bind (serv->hnd.fd, (struct sockaddr *) addr, sizeof (*addr)) < 0) {
 		log_emerg("l2tp: bind: %s\n", strerror(errno));
-		close(udp_serv.hnd.fd);
-		return;
+		goto out_err;
 	}
 
-	if (fcntl(udp_serv.hnd.fd, F_SETFL, O_NONBLOCK)) {
+	if (fcntl(serv->hnd.fd, F_SETFL, O_NONBLOCK)) {
 		log_emerg("l2tp: failed to set nonblocking mode: %s\n", strerror(errno));
-		close(udp_serv.hnd.fd);
-		return;
+		goto out_err;
 	}
 
-	if (setsockopt(udp_serv.hnd.fd, IPPROTO_IP, IP_PKTINFO, &flag, sizeof(flag))) {
+	if (setsockopt(serv->hnd.fd, IPPROTO_IP, IP_PKTINFO, &flag, sizeof(flag))) {
 		log_emerg("l2tp: setsockopt(IP_PKTINFO): %s\n", strerror(errno));
-		close(udp_serv.hnd.fd);
-		return;
+		goto out_err;
 	}
 
-	memcpy(&udp_serv.addr, &addr, sizeof(addr));
+	serv->rx_slot = _malloc(L2TP_RX_BATCH * sizeof(*serv->rx_slot));
+	if (!serv->rx_slot) {
+		log_emerg("l2tp: out of memory\n");
+		goto out_err;
+	}
+
+	memset(serv->rx_msg, 0, sizeof(serv->rx_msg));
+	for (i = 0; i < L2TP_RX_BATCH; i++) {
+		serv->rx_slot[i].buf = l2tp_rx_buf_alloc();
+		if (!serv->rx_slot[i].buf) {
+			log_emerg("l2tp: out of memory\n");
+			goto out_err;
+		}
+		serv->rx_slot[i].iov.iov_base = serv->rx_slot[i].buf;
+		serv->rx_slot[i].iov.iov_len = L2TP_RX_BUF_SIZE;
+		serv->rx_msg[i].msg_hdr.msg_name = &serv->rx_slot[i].addr;
+		serv->rx_msg[i].msg_hdr.msg_iov = &serv->rx_slot[i].iov;
+		serv->rx_msg[i].msg_hdr.msg_iovlen = 1;
+		serv->rx_msg[i].msg_hdr.msg_control = serv->rx_slot[i].msg_control;
+	}
+
+	memcpy(&serv->addr, addr, sizeof(*addr));
+
+	serv->hnd.read = l2tp_udp_read;
+	serv->ctx.close = l2tp_udp_close;
+	serv->ctx.before_switch = log_switch;
+
+	triton_context_register(&serv->ctx, NULL);
+	triton_md_register_handler(&serv->ctx, &serv->hnd);
+	triton_md_enable_handler(&serv->hnd, MD_MODE_READ);
+	triton_context_wakeup(&serv->ctx);
+
+	return 0;
+
+out_err:
+	close(serv->hnd.fd);
+	return -1;
+}
+
+/*
+ * With shared-socket=N control messages of all tunnels are received on N
+ * listeners sharing the port by SO_REUSEPORT and dispatched by tid,
+ * otherwise each tunnel opens its own connected socket on SCCRQ.
+ */
+static void start_udp_server(void)
+{
+	struct sockaddr_in addr;
+	char *opt;
+	int i;
+
+	opt = conf_get_opt("l2tp", "shared-socket");
+	if (opt && atoi(opt) > 0)
+		conf_shared_socket = atoi(opt);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(L2TP_PORT);
+
+	opt = conf_get_opt("l2tp", "bind");
+	if (opt)
+		addr.sin_addr.s_addr = inet_addr(opt);
+	else
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	triton_context_register(&udp_serv.ctx, NULL);
-	triton_md_register_handler(&udp_serv.ctx, &udp_serv.hnd);
-	triton_md_enable_handler(&udp_serv.hnd, MD_MODE_READ);
-	triton_context_wakeup(&udp_serv.ctx);
+	udp_serv_cnt = conf_shared_socket ? conf_shared_socket : 1;
+	udp_serv = _malloc(udp_serv_cnt * sizeof(*udp_serv));
+	memset(udp_serv, 0, udp_serv_cnt * sizeof(*udp_serv));
+
+	for (i = 0; i < udp_serv_cnt; i++) {
+		if (start_udp_listener(&udp_serv[i], &addr))
+			break;
+	}
+
+	udp_serv_cnt = i;
 }
 
 static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
@@ -1186,6 +1902,7 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_send(client, "l2tp:\r\n");
 	cli_sendv(client, "  starting: %u\r\n", stat_starting);
 	cli_sendv(client, "  active: %u\r\n", stat_active);
+	cli_sendv(client, "  tunnels: %u\r\n", stat_tunnels);
 
 	return CLI_CMD_OK;
 }
@@ -1224,6 +1941,14 @@ static void load_config(void)
 	if (opt && atoi(opt) > 0)
 		conf_retransmit = atoi(opt);
 
+	opt = conf_get_opt("l2tp", "recv-window");
+	if (opt && atoi(opt) > 0 && atoi(opt) <= 32768)
+		conf_recv_window = atoi(opt);
+
+	opt = conf_get_opt("l2tp", "ack-delay");
+	if (opt && atoi(opt) > 0)
+		conf_ack_delay = atoi(opt);
+
 	opt = conf_get_opt("l2tp", "host-name");
 	if (opt)
 		conf_host_name = opt;
@@ -1273,6 +1998,7 @@ static void l2tp_init(void)
 	memset(l2tp_conn, 0, L2TP_MAX_TID * sizeof(void *));
 
 	l2tp_conn_pool = mempool_create(sizeof(struct l2tp_conn_t));
+	l2tp_sess_pool = mempool_create(sizeof(struct l2tp_sess_t));
 
 	load_config();
 
@@ -1281,6 +2007,7 @@ static void l2tp_init(void)
 	cli_register_simple_cmd2(&show_stat_exec, NULL, 2, "show", "stat");
 	
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
+	triton_event_register_handler(EV_UPGRADE, (triton_event_func)ev_upgrade);
 }
 
 DEFINE_INIT(22, l2tp_init);
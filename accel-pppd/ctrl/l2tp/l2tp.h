@@ -14,6 +14,7 @@
 #define ATTR_TYPE_STRING  5
 
 #define L2TP_MAX_PACKET_SIZE 65536
+#define L2TP_RX_BUF_SIZE L2TP_MAX_PACKET_SIZE
 #define L2TP_MAX_TID 65534
 
 #define L2TP_V2_PROTOCOL_VERSION ( 1 << 8 | 0 )
@@ -63,20 +64,29 @@ struct l2tp_packet_t
 	struct sockaddr_in addr;
 	struct l2tp_hdr_t hdr;
 	struct list_head attrs;
+	uint8_t *buf;
+	int arena_len;
+	int compact:1;
 };
 
 extern int conf_verbose;
 extern int conf_avp_permissive;
+extern const char *conf_secret;
 
 struct l2tp_dict_attr_t *l2tp_dict_find_attr_by_name(const char *name);
 struct l2tp_dict_attr_t *l2tp_dict_find_attr_by_id(int id);
 struct l2tp_dict_value_t *l2tp_dict_find_value(struct l2tp_dict_attr_t *attr, l2tp_value_t val);
 
 int l2tp_recv(int fd, struct l2tp_packet_t **, struct in_pktinfo *);
+uint8_t *l2tp_rx_buf_alloc(void);
+void l2tp_rx_buf_free(uint8_t *buf);
+void l2tp_packet_parse(uint8_t *buf, int n, struct sockaddr_in *addr, struct l2tp_packet_t **);
+struct l2tp_packet_t *l2tp_packet_compact(struct l2tp_packet_t *);
 void l2tp_packet_free(struct l2tp_packet_t *);
 void l2tp_packet_print(struct l2tp_packet_t *, void (*print)(const char *fmt, ...));
 struct l2tp_packet_t *l2tp_packet_alloc(int ver, int msg_type, struct sockaddr_in *addr);
 int l2tp_packet_send(int sock, struct l2tp_packet_t *);
+int l2tp_packet_sendto(int sock, struct l2tp_packet_t *, struct in_addr *src);
 int l2tp_packet_add_int16(struct l2tp_packet_t *pack, int id, int16_t val, int M);
 int l2tp_packet_add_int32(struct l2tp_packet_t *pack, int id, int32_t val, int M);
 int l2tp_packet_add_string(struct l2tp_packet_t *pack, int id, const char *val, int M);
@@ -10,6 +10,7 @@
 #include "triton.h"
 #include "log.h"
 #include "mempool.h"
+#include "crypto.h"
 #include "memdebug.h"
 
 #include "l2tp.h"
@@ -18,6 +19,7 @@
 static mempool_t attr_pool;
 static mempool_t pack_pool;
 static mempool_t buf_pool;
+static mempool_t arena_pool;
 
 void l2tp_packet_print(struct l2tp_packet_t *pack, void (*print)(const char *fmt, ...))
 {
@@ -84,6 +86,16 @@ void l2tp_packet_free(struct l2tp_packet_t *pack)
 {
 	struct l2tp_attr_t *attr;
 
+	if (pack->compact) {
+		_free(pack);
+		return;
+	}
+
+	if (pack->buf) {
+		l2tp_rx_buf_free(pack->buf);
+		return;
+	}
+
 	while (!list_empty(&pack->attrs)) {
 		attr = list_entry(pack->attrs.next, typeof(*attr), entry);
 		if (attr->attr->type == ATTR_TYPE_OCTETS || attr->attr->type == ATTR_TYPE_STRING)
@@ -97,14 +109,8 @@ void l2tp_packet_free(struct l2tp_packet_t *pack)
 
 int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info)
 {
-	int n, length;
+	int n;
 	uint8_t *buf;
-	struct l2tp_hdr_t *hdr;
-	struct l2tp_avp_t *avp;
-	struct l2tp_dict_attr_t *da;
-	struct l2tp_attr_t *attr, *RV = NULL;
-	uint8_t *ptr;
-	struct l2tp_packet_t *pack;
 	struct sockaddr_in addr;
 	socklen_t len = sizeof(addr);
 	struct msghdr msg;
@@ -135,18 +141,16 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info)
 		}
 	}
 
-	buf = mempool_alloc(buf_pool);
+	buf = l2tp_rx_buf_alloc();
 	if (!buf) {
 		log_emerg("l2tp: out of memory\n");
 		return 0;
 	}
-	hdr = (struct l2tp_hdr_t *)buf;
-	ptr = (uint8_t *)(hdr + 1);
 
-	n = recvfrom(fd, buf, L2TP_MAX_PACKET_SIZE, 0, &addr, &len);
+	n = recvfrom(fd, buf, L2TP_RX_BUF_SIZE, MSG_TRUNC, &addr, &len);
 
 	if (n < 0) {
-		mempool_free(buf);
+		l2tp_rx_buf_free(buf);
 		if (errno == EAGAIN) {
 			return -1;
 		} else if (errno == ECONNREFUSED) {
@@ -156,69 +160,191 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info)
 		return 0;
 	}
 
+	if (n > L2TP_RX_BUF_SIZE) {
+		if (conf_verbose)
+			log_warn("l2tp: too long message received (%i)\n", n);
+	} else
+		l2tp_packet_parse(buf, n, &addr, p);
+
+	if (!*p)
+		l2tp_rx_buf_free(buf);
+
+	return 0;
+}
+
+/*
+ * Received packets live in a single arena block: the packet header, the
+ * datagram (attribute values point into it) and the attribute records
+ * allocated from the tail. Freeing the packet returns the whole block.
+ * The tail also takes terminated copies of string values, so it is sized
+ * for a datagram of the largest length.
+ */
+#define ARENA_HDR_SIZE ((sizeof(struct l2tp_packet_t) + 7) & ~7)
+#define ARENA_ATTR_SIZE (L2TP_RX_BUF_SIZE + 8192)
+#define ARENA_SIZE (ARENA_HDR_SIZE + L2TP_RX_BUF_SIZE + ARENA_ATTR_SIZE)
+
+uint8_t *l2tp_rx_buf_alloc(void)
+{
+	uint8_t *arena = mempool_alloc(arena_pool);
+
+	if (!arena)
+		return NULL;
+
+	return arena + ARENA_HDR_SIZE;
+}
+
+void l2tp_rx_buf_free(uint8_t *buf)
+{
+	mempool_free(buf - ARENA_HDR_SIZE);
+}
+
+static void *arena_alloc(uint8_t **ptr, uint8_t *end, int size)
+{
+	void *r = *ptr;
+
+	size = (size + 7) & ~7;
+	if (*ptr + size > end)
+		return NULL;
+
+	*ptr += size;
+
+	return r;
+}
+
+/* Decrypts hidden AVP value in place (RFC 2661, 4.3) */
+static int avp_decrypt(struct l2tp_avp_t *avp, int len, struct l2tp_attr_t *RV, int *orig_len)
+{
+	MD5_CTX md5_ctx;
+	uint8_t md5[MD5_DIGEST_LENGTH];
+	uint8_t c[MD5_DIGEST_LENGTH];
+	uint8_t *val = avp->val;
+	int i, j, n;
+
+	if (!conf_secret) {
+		if (conf_verbose)
+			log_warn("l2tp: hidden avp received (type=%i), but no secret configured\n", ntohs(avp->type));
+		return -1;
+	}
+
+	if (len < 2)
+		return -1;
+
+	MD5_Init(&md5_ctx);
+	MD5_Update(&md5_ctx, &avp->type, 2);
+	MD5_Update(&md5_ctx, conf_secret, strlen(conf_secret));
+	MD5_Update(&md5_ctx, RV->val.octets, RV->length);
+	MD5_Final(md5, &md5_ctx);
+
+	for (i = 0; i < len; i += MD5_DIGEST_LENGTH) {
+		n = len - i < MD5_DIGEST_LENGTH ? len - i : MD5_DIGEST_LENGTH;
+		memcpy(c, val + i, n);
+		for (j = 0; j < n; j++)
+			val[i + j] ^= md5[j];
+
+		if (n == MD5_DIGEST_LENGTH) {
+			MD5_Init(&md5_ctx);
+			MD5_Update(&md5_ctx, conf_secret, strlen(conf_secret));
+			MD5_Update(&md5_ctx, c, MD5_DIGEST_LENGTH);
+			MD5_Final(md5, &md5_ctx);
+		}
+	}
+
+	*orig_len = (val[0] << 8) | val[1];
+	if (*orig_len > len - 2) {
+		if (conf_verbose)
+			log_warn("l2tp: incorrect hidden avp received (type=%i)\n", ntohs(avp->type));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a datagram of n bytes received from addr into buf, which must
+ * come from l2tp_rx_buf_alloc(). On success the buffer is owned by the
+ * returned packet, otherwise *p is left NULL and the buffer stays with
+ * the caller. The buffer is modified in place.
+ */
+void l2tp_packet_parse(uint8_t *buf, int n, struct sockaddr_in *addr, struct l2tp_packet_t **p)
+{
+	int length, vlen;
+	struct l2tp_hdr_t *hdr = (struct l2tp_hdr_t *)buf;
+	struct l2tp_avp_t *avp;
+	struct l2tp_dict_attr_t *da;
+	struct l2tp_attr_t *attr, *RV = NULL;
+	uint8_t *ptr = (uint8_t *)(hdr + 1);
+	uint8_t *val;
+	struct l2tp_packet_t *pack;
+	uint8_t *arena = buf + L2TP_RX_BUF_SIZE;
+	uint8_t *arena_end = arena + ARENA_ATTR_SIZE;
+
+	*p = NULL;
+
 	if (n < sizeof(*hdr)) {
 		if (conf_verbose)
 			log_warn("l2tp: short packet received (%i/%zu)\n", n, sizeof(*hdr));
-		goto out_err_hdr;
+		return;
 	}
 
-	if (n < ntohs(hdr->length)) {
+	if (n < ntohs(hdr->length) || ntohs(hdr->length) < sizeof(*hdr)) {
 		if (conf_verbose)
 			log_warn("l2tp: short packet received (%i/%i)\n", n, ntohs(hdr->length));
-		goto out_err_hdr;
+		return;
 	}
 
 	if (hdr->T == 0)
-		goto out_err_hdr;
+		return;
 
 	if (hdr->ver == 2) {
 		if (hdr->L == 0) {
 			if (conf_verbose)
 				log_warn("l2tp: incorrect message received (L=0)\n");
 			if (!conf_avp_permissive)
-			    goto out_err_hdr;
+			    return;
 		}
 
 		if (hdr->S == 0) {
 			if (conf_verbose)
 				log_warn("l2tp: incorrect message received (S=0)\n");
 			if (!conf_avp_permissive)
-			    goto out_err_hdr;
+			    return;
 		}
 
 		if (hdr->O == 1) {
 			if (conf_verbose)
 				log_warn("l2tp: incorrect message received (O=1)\n");
 			if (!conf_avp_permissive)
-			    goto out_err_hdr;
+			    return;
 		}
 	} else if (hdr->ver != 3) {
 		if (conf_verbose)
 			log_warn("l2tp: protocol version %i is not supported\n", hdr->ver);
-		goto out_err_hdr;
+		return;
 	}
 
-	pack = mempool_alloc(pack_pool);
-	if (!pack) {
-		log_emerg("l2tp: out of memory\n");
-		goto out_err_hdr;
-	}
+	pack = (struct l2tp_packet_t *)(buf - ARENA_HDR_SIZE);
 
 	memset(pack, 0, sizeof(*pack));
 	INIT_LIST_HEAD(&pack->attrs);
 
-	memcpy(&pack->addr, &addr, sizeof(addr));
+	memcpy(&pack->addr, addr, sizeof(*addr));
 	memcpy(&pack->hdr, hdr, sizeof(*hdr));
 	length = ntohs(hdr->length) - sizeof(*hdr);
 
 	while (length) {
+		if (length < sizeof(*avp)) {
+			if (conf_verbose)
+				log_warn("l2tp: incorrect avp received (exceeds message length)\n");
+			return;
+		}
+
 		*(uint16_t *)ptr = ntohs(*(uint16_t *)ptr);
 		avp = (struct l2tp_avp_t *)ptr;
 
-		if (avp->length > length) {
+		if (avp->length > length || avp->length < sizeof(*avp)) {
 			if (conf_verbose)
 				log_warn("l2tp: incorrect avp received (exceeds message length)\n");
-			goto out_err;
+			return;
 		}
 
 		if (avp->vendor)
@@ -229,73 +355,83 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info)
 			if (conf_verbose)
 				log_warn("l2tp: unknown avp received (type=%i, M=%u)\n", ntohs(avp->type), avp->M);
 			if (avp->M && !conf_avp_permissive)
-				goto out_err;
+				return;
 		} else {
 			if (da->M != -1 && da->M != avp->M) {
 				if (conf_verbose)
 					log_warn("l2tp: incorrect avp received (type=%i, M=%i, must be %i)\n", ntohs(avp->type), avp->M, da->M);
 				if (!conf_avp_permissive)
-				    goto out_err;
+				    return;
 			}
 
 			if (da->H != -1 && da->H != avp->H) {
 				if (conf_verbose)
 					log_warn("l2tp: incorrect avp received (type=%i, H=%i, must be %i)\n", ntohs(avp->type), avp->H, da->H);
 				if (!conf_avp_permissive)
-				    goto out_err;
+				    return;
 			}
 
+			val = avp->val;
+			vlen = avp->length - sizeof(*avp);
+
 			if (avp->H) {
 				if (!RV) {
 					if (conf_verbose)
 						log_warn("l2tp: incorrect avp received (type=%i, H=1, but Random-Vector is not received)\n", ntohs(avp->type));
-					goto out_err;
-				} else {
-					if (conf_verbose)
-						log_warn("l2tp: hidden avp received (type=%i)\n", ntohs(avp->type));
+					return;
 				}
+				if (avp_decrypt(avp, vlen, RV, &vlen))
+					return;
+				val += 2;
+			}
+
+			attr = arena_alloc(&arena, arena_end, sizeof(*attr));
+			if (!attr) {
+				if (conf_verbose)
+					log_warn("l2tp: too many avps received\n");
+				return;
 			}
 
-			attr = mempool_alloc(attr_pool);
 			memset(attr, 0, sizeof(*attr));
 			list_add_tail(&attr->entry, &pack->attrs);
 
 			attr->attr = da;
 			attr->M = avp->M;
 			attr->H = avp->H;
-			attr->length = avp->length - sizeof(*avp);
-			
+			attr->length = vlen;
+
 			if (attr->attr->id == Random_Vector)
 				RV = attr;
 
 			switch (da->type) {
 				case ATTR_TYPE_INT16:
-					if (avp->length != sizeof(*avp) + 2)
+					if (vlen != 2)
 						goto out_err_len;
-					attr->val.uint16 = ntohs(*(uint16_t *)avp->val);
+					attr->val.uint16 = ntohs(*(uint16_t *)val);
 					break;
 				case ATTR_TYPE_INT32:
-					if (avp->length != sizeof(*avp) + 4)
+					if (vlen != 4)
 						goto out_err_len;
-					attr->val.uint32 = ntohl(*(uint32_t *)avp->val);
+					attr->val.uint32 = ntohl(*(uint32_t *)val);
 					break;
 				case ATTR_TYPE_INT64:
-					if (avp->length != sizeof(*avp) + 8)
+					if (vlen != 8)
 						goto out_err_len;
-					attr->val.uint64 = *(uint64_t *)avp->val;
+					attr->val.uint64 = *(uint64_t *)val;
 					break;
 				case ATTR_TYPE_OCTETS:
-					attr->val.octets = _malloc(attr->length);
-					if (!attr->val.octets)
-						goto out_err_mem;
-					memcpy(attr->val.octets, avp->val, attr->length);
+					attr->val.octets = val;
 					break;
 				case ATTR_TYPE_STRING:
-					attr->val.string = _malloc(attr->length + 1);
-					if (!attr->val.string)
-						goto out_err_mem;
-					memcpy(attr->val.string, avp->val, attr->length);
-					attr->val.string[attr->length] = 0;
+					/* the next AVP header follows, so the terminated copy goes to the arena */
+					attr->val.string = arena_alloc(&arena, arena_end, vlen + 1);
+					if (!attr->val.string) {
+						if (conf_verbose)
+							log_warn("l2tp: too many avps received\n");
+						return;
+					}
+					memcpy(attr->val.string, val, vlen);
+					attr->val.string[vlen] = 0;
 					break;
 			}
 		}
@@ -304,27 +440,79 @@ skip:
 		length -= avp->length;
 	}
 
+	pack->buf = buf;
+	pack->arena_len = arena - (buf + L2TP_RX_BUF_SIZE);
 	*p = pack;
 
-	mempool_free(buf);
-
-	return 0;
+	return;
 
-out_err:
-	l2tp_packet_free(pack);
-out_err_hdr:
-	mempool_free(buf);
-	return 0;
 out_err_len:
 	if (conf_verbose)
 		log_warn("l2tp: incorrect avp received (type=%i, incorrect length %i)\n", ntohs(avp->type), avp->length);
-	goto out_err;
-out_err_mem:
-	log_emerg("l2tp: out of memory\n");
-	goto out_err;
+}
+
+/*
+ * Moves a received packet out of its arena into a block of the size it
+ * actually uses, for packets which are kept for a while (out of order
+ * messages waiting in the receive queue). The header and the datagram
+ * keep their relative layout, the used part of the attribute tail
+ * follows the datagram. If there is no memory the packet is returned
+ * as is.
+ */
+struct l2tp_packet_t *l2tp_packet_compact(struct l2tp_packet_t *pack)
+{
+	struct l2tp_packet_t *p;
+	struct l2tp_attr_t *attr, *a;
+	uint8_t *blk, *arena;
+	int len = ntohs(pack->hdr.length);
+	int size = (len + 7) & ~7;
+	long d_buf, d_arena;
+
+	if (pack->compact || !pack->buf)
+		return pack;
+
+	blk = _malloc(ARENA_HDR_SIZE + size + pack->arena_len);
+	if (!blk)
+		return pack;
+
+	arena = blk + ARENA_HDR_SIZE + size;
+
+	memcpy(blk, (uint8_t *)pack, ARENA_HDR_SIZE + len);
+	memcpy(arena, pack->buf + L2TP_RX_BUF_SIZE, pack->arena_len);
+
+	d_buf = blk - (uint8_t *)pack;
+	d_arena = arena - (pack->buf + L2TP_RX_BUF_SIZE);
+
+	p = (struct l2tp_packet_t *)blk;
+	p->buf = blk + ARENA_HDR_SIZE;
+	p->compact = 1;
+	INIT_LIST_HEAD(&p->attrs);
+
+	list_for_each_entry(attr, &pack->attrs, entry) {
+		a = (struct l2tp_attr_t *)((uint8_t *)attr + d_arena);
+		list_add_tail(&a->entry, &p->attrs);
+
+		if (a->attr->type == ATTR_TYPE_OCTETS)
+			a->val.octets += d_buf;
+		else if (a->attr->type == ATTR_TYPE_STRING)
+			a->val.string += d_arena;
+	}
+
+	l2tp_rx_buf_free(pack->buf);
+
+	return p;
 }
 
 int l2tp_packet_send(int sock, struct l2tp_packet_t *pack)
+{
+	return l2tp_packet_sendto(sock, pack, NULL);
+}
+
+/*
+ * Sends the message to pack->addr, on an unconnected socket src selects
+ * the local address the datagram is sent from.
+ */
+int l2tp_packet_sendto(int sock, struct l2tp_packet_t *pack, struct in_addr *src)
 {
 	uint8_t *buf = mempool_alloc(buf_pool);
 	struct l2tp_avp_t *avp;
@@ -374,8 +562,36 @@ int l2tp_packet_send(int sock, struct l2tp_packet_t *pack)
 	pack->hdr.length = htons(len);
 	memcpy(buf, &pack->hdr, sizeof(pack->hdr));
 
-	n = write(sock, buf, ntohs(pack->hdr.length));
-	
+	if (src) {
+		struct msghdr msg;
+		struct iovec iov;
+		struct in_pktinfo *pkt_info;
+		struct cmsghdr *cmsg;
+		char msg_control[CMSG_SPACE(sizeof(*pkt_info))];
+
+		iov.iov_base = buf;
+		iov.iov_len = ntohs(pack->hdr.length);
+
+		memset(&msg, 0, sizeof(msg));
+		memset(msg_control, 0, sizeof(msg_control));
+		msg.msg_name = &pack->addr;
+		msg.msg_namelen = sizeof(pack->addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = msg_control;
+		msg.msg_controllen = sizeof(msg_control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt_info));
+		pkt_info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+		pkt_info->ipi_spec_dst = *src;
+
+		n = sendmsg(sock, &msg, 0);
+	} else
+		n = write(sock, buf, ntohs(pack->hdr.length));
+
 	mempool_free(buf);
 
 	if (n < 0) {
@@ -498,6 +714,7 @@ static void init(void)
 	attr_pool = mempool_create(sizeof(struct l2tp_attr_t));
 	pack_pool = mempool_create(sizeof(struct l2tp_packet_t));
 	buf_pool = mempool_create(L2TP_MAX_PACKET_SIZE);
+	arena_pool = mempool_create(ARENA_SIZE);
 }
 
 DEFINE_INIT(21, init);
@@ -112,11 +112,20 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_send(client, "pppoe:\r\n");
 	cli_sendv(client, "  active: %u\r\n", stat_active);
 	cli_sendv(client, "  delayed PADO: %u\r\n", stat_delayed_pado);
+	cli_sendv(client, "  PADO delay: %i (load %u.%u%%)\r\n", pado_delay, dpado_load / 10, dpado_load % 10);
 	cli_sendv(client, "  recv PADI: %lu\r\n", stat_PADI_recv);
 	cli_sendv(client, "  drop PADI: %lu\r\n", stat_PADI_drop);
+	cli_sendv(client, "    admission: %lu\r\n", stat_PADI_drop_admission);
+	cli_sendv(client, "    mac rate: %lu\r\n", stat_PADI_drop_mac);
+	cli_sendv(client, "    interface limit: %lu\r\n", stat_PADI_drop_iface);
+	cli_sendv(client, "    global limit: %lu\r\n", stat_PADI_drop_global);
+	cli_sendv(client, "    connlimit: %lu\r\n", stat_PADI_drop_connlimit);
+	cli_sendv(client, "    no memory: %lu\r\n", stat_PADI_drop_nomem);
 	cli_sendv(client, "  sent PADO: %lu\r\n", stat_PADO_sent);
 	cli_sendv(client, "  recv PADR(dup): %lu(%lu)\r\n", stat_PADR_recv, stat_PADR_dup_recv);
 	cli_sendv(client, "  sent PADS: %lu\r\n", stat_PADS_sent);
+	cli_sendv(client, "  tx batch: 1:%lu 2-3:%lu 4-7:%lu 8-15:%lu 16-31:%lu 32:%lu\r\n",
+		stat_tx_batch[0], stat_tx_batch[1], stat_tx_batch[2], stat_tx_batch[3], stat_tx_batch[4], stat_tx_batch[5]);
 
 	return CLI_CMD_OK;
 }
@@ -0,0 +1,654 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+
+#include "triton.h"
+#include "log.h"
+#include "ppp.h"
+#include "cli.h"
+#include "random.h"
+#include "crypto.h"
+#include "memdebug.h"
+
+#include "pppoe.h"
+
+/*
+ * Coordination of PADO between several servers of one segment.
+ *
+ * Every node periodically sends HELLO with its load and session count
+ * to the configured peers (unicast addresses or a multicast group).
+ * For a PADI each node ranks the nodes heard within cluster-timeout by
+ * a hash of client's MAC and node id, weighted by load, so all nodes
+ * agree which one is designated. The designated node replies at once
+ * and sends CLAIM with the MAC, others delay PADO by cluster-delay and
+ * drop it if the claim arrives in the meantime. Without live peers, or
+ * if the designated node keeps silent, servers behave independently.
+ *
+ * With cluster-secret every datagram ends with a sequence number and
+ * HMAC-SHA1 of the whole datagram, peers drop datagrams with a wrong
+ * MAC or an already seen sequence number.
+ */
+
+#define CLUSTER_MAGIC 0x50504f43 /* PPOC */
+#define CLUSTER_VERSION 1
+
+#define CLUSTER_HELLO 1
+#define CLUSTER_CLAIM 2
+
+#define MAX_PEERS 16
+#define MAX_TARGETS 16
+#define CLAIM_HASH_SIZE 4096
+#define HMAC_BLOCK_SIZE 64
+
+struct cluster_hdr
+{
+	uint32_t magic;
+	uint8_t ver;
+	uint8_t type;
+	uint16_t cnt;
+	uint32_t node_id;
+} __attribute__((packed));
+
+struct cluster_hello
+{
+	struct cluster_hdr hdr;
+	uint32_t load;
+	uint32_t sessions;
+} __attribute__((packed));
+
+struct cluster_claim
+{
+	struct cluster_hdr hdr;
+	uint8_t addr[ETH_ALEN];
+} __attribute__((packed));
+
+struct cluster_auth
+{
+	uint64_t seq;
+	uint8_t mac[SHA_DIGEST_LENGTH];
+} __attribute__((packed));
+
+struct cluster_peer_t
+{
+	uint32_t node_id;
+	uint64_t seq;
+	struct in_addr addr;
+	int64_t last_seen;
+	unsigned int load;
+	unsigned int sessions;
+};
+
+struct claim_t
+{
+	uint8_t addr[ETH_ALEN];
+	int64_t ts;
+};
+
+int conf_cluster_delay = 200;
+static int conf_cluster_interval = 1000;
+static int conf_cluster_timeout = 3000;
+
+static int cluster_enabled;
+static uint32_t node_id;
+
+static int cluster_auth;
+static uint8_t auth_ipad[HMAC_BLOCK_SIZE];
+static uint8_t auth_opad[HMAC_BLOCK_SIZE];
+static uint64_t auth_seq;
+
+static struct sockaddr_in targets[MAX_TARGETS];
+static int target_cnt;
+
+static struct cluster_peer_t peers[MAX_PEERS];
+static int peer_cnt;
+/* values announced in the last HELLO, used for own rank */
+static unsigned int self_load;
+static unsigned int self_sessions;
+static spinlock_t peer_lock;
+
+static struct claim_t claims[CLAIM_HASH_SIZE];
+static spinlock_t claim_lock;
+
+static struct triton_context_t cluster_ctx;
+static struct triton_md_handler_t cluster_hnd;
+static struct triton_timer_t hello_timer;
+
+static unsigned long stat_claim_sent;
+static unsigned long stat_claim_recv;
+static unsigned long stat_pado_suppressed;
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned int claim_hash(const uint8_t *addr)
+{
+	return (addr[3] ^ (addr[4] << 4) ^ (addr[5] << 8) ^ addr[2]) & (CLAIM_HASH_SIZE - 1);
+}
+
+static uint64_t rank_hash(const uint8_t *addr, uint32_t id)
+{
+	uint64_t x = ((uint64_t)addr[0] << 40) | ((uint64_t)addr[1] << 32) | ((uint64_t)addr[2] << 24) |
+		((uint64_t)addr[3] << 16) | ((uint64_t)addr[4] << 8) | addr[5];
+
+	x ^= (uint64_t)id * 0x9e3779b97f4a7c15ull;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+
+	return x;
+}
+
+/* nodes carrying a larger share of sessions or load are ranked down */
+static uint64_t rank(const uint8_t *addr, uint32_t id, unsigned int load, unsigned int sessions, unsigned int total)
+{
+	unsigned int share = total ? sessions * 1000ull / total : 0;
+
+	if (share > load)
+		load = share;
+	if (load > 1000)
+		load = 1000;
+
+	return (rank_hash(addr, id) >> 32) * (1001 - load);
+}
+
+static void auth_init(const char *secret)
+{
+	SHA_CTX ctx;
+	uint8_t key[HMAC_BLOCK_SIZE];
+	int i, len = strlen(secret);
+
+	memset(key, 0, sizeof(key));
+	if (len > HMAC_BLOCK_SIZE) {
+		SHA1_Init(&ctx);
+		SHA1_Update(&ctx, secret, len);
+		SHA1_Final(key, &ctx);
+	} else
+		memcpy(key, secret, len);
+
+	for (i = 0; i < HMAC_BLOCK_SIZE; i++) {
+		auth_ipad[i] = key[i] ^ 0x36;
+		auth_opad[i] = key[i] ^ 0x5c;
+	}
+
+	/* sequence numbers of a restarted node must exceed the ones peers have seen */
+	auth_seq = (uint64_t)time(NULL) << 20;
+
+	cluster_auth = 1;
+}
+
+static void auth_mac(const void *buf, int len, uint8_t *mac)
+{
+	SHA_CTX ctx;
+	uint8_t md[SHA_DIGEST_LENGTH];
+
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, auth_ipad, HMAC_BLOCK_SIZE);
+	SHA1_Update(&ctx, buf, len);
+	SHA1_Final(md, &ctx);
+
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, auth_opad, HMAC_BLOCK_SIZE);
+	SHA1_Update(&ctx, md, SHA_DIGEST_LENGTH);
+	SHA1_Final(mac, &ctx);
+}
+
+/* strips and checks the trailer, returns length of the message or -1 */
+static int auth_check(const uint8_t *buf, int n, uint64_t *seq)
+{
+	const struct cluster_auth *auth;
+	uint8_t mac[SHA_DIGEST_LENGTH];
+	uint8_t d = 0;
+	int i;
+
+	if (n < sizeof(struct cluster_hdr) + sizeof(*auth))
+		return -1;
+
+	n -= sizeof(*auth);
+	auth = (const struct cluster_auth *)(buf + n);
+
+	auth_mac(buf, n + sizeof(auth->seq), mac);
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		d |= mac[i] ^ auth->mac[i];
+	if (d)
+		return -1;
+
+	*seq = be64toh(auth->seq);
+
+	return n;
+}
+
+/* a sequence number at or below the last one of the node is a replay */
+static int check_seq(uint32_t id, uint64_t seq)
+{
+	int i, r = 0;
+
+	spin_lock(&peer_lock);
+	for (i = 0; i < peer_cnt; i++) {
+		if (peers[i].node_id != id)
+			continue;
+		if (seq <= peers[i].seq)
+			r = -1;
+		else
+			peers[i].seq = seq;
+		break;
+	}
+	spin_unlock(&peer_lock);
+
+	return r;
+}
+
+static void send_to_targets(const void *buf, int len)
+{
+	uint8_t pkt[sizeof(struct cluster_hello) + sizeof(struct cluster_auth)];
+	struct cluster_auth *auth;
+	int i;
+
+	if (cluster_auth) {
+		memcpy(pkt, buf, len);
+		auth = (struct cluster_auth *)(pkt + len);
+		auth->seq = htobe64(__sync_add_and_fetch(&auth_seq, 1));
+		auth_mac(pkt, len + sizeof(auth->seq), auth->mac);
+		buf = pkt;
+		len += sizeof(*auth);
+	}
+
+	for (i = 0; i < target_cnt; i++) {
+		if (sendto(cluster_hnd.fd, buf, len, 0, (struct sockaddr *)&targets[i], sizeof(targets[i])) < 0 && conf_verbose)
+			log_warn("pppoe: cluster: sendto: %s\n", strerror(errno));
+	}
+}
+
+/*
+ * Returns -1 if there are no live peers, 0 if this node is designated
+ * for the client (the claim is sent), 1 otherwise.
+ */
+int cluster_padi(const uint8_t *addr)
+{
+	struct cluster_claim claim;
+	int64_t now;
+	uint64_t best, r;
+	unsigned int total;
+	int i, live = 0, designated = 1;
+
+	if (!cluster_enabled)
+		return -1;
+
+	now = now_ms();
+
+	spin_lock(&peer_lock);
+	total = self_sessions;
+	for (i = 0; i < peer_cnt; i++) {
+		if (now - peers[i].last_seen <= conf_cluster_timeout)
+			total += peers[i].sessions;
+	}
+
+	best = rank(addr, node_id, self_load, self_sessions, total);
+	for (i = 0; i < peer_cnt; i++) {
+		if (now - peers[i].last_seen > conf_cluster_timeout)
+			continue;
+		live = 1;
+		r = rank(addr, peers[i].node_id, peers[i].load, peers[i].sessions, total);
+		if (r > best || (r == best && peers[i].node_id > node_id)) {
+			designated = 0;
+			break;
+		}
+	}
+	spin_unlock(&peer_lock);
+
+	if (!live)
+		return -1;
+
+	if (!designated)
+		return 1;
+
+	claim.hdr.magic = htonl(CLUSTER_MAGIC);
+	claim.hdr.ver = CLUSTER_VERSION;
+	claim.hdr.type = CLUSTER_CLAIM;
+	claim.hdr.cnt = htons(1);
+	claim.hdr.node_id = htonl(node_id);
+	memcpy(claim.addr, addr, ETH_ALEN);
+
+	send_to_targets(&claim, sizeof(claim));
+	__sync_add_and_fetch(&stat_claim_sent, 1);
+
+	return 0;
+}
+
+/* another node has answered the client recently */
+int cluster_claimed(const uint8_t *addr)
+{
+	struct claim_t *c = &claims[claim_hash(addr)];
+	int r;
+
+	spin_lock(&claim_lock);
+	r = !memcmp(c->addr, addr, ETH_ALEN) && now_ms() - c->ts <= conf_cluster_delay * 2;
+	spin_unlock(&claim_lock);
+
+	if (r)
+		__sync_add_and_fetch(&stat_pado_suppressed, 1);
+
+	return r;
+}
+
+static void recv_hello(struct cluster_hello *msg, struct sockaddr_in *addr, uint64_t seq)
+{
+	uint32_t id = ntohl(msg->hdr.node_id);
+	int i;
+
+	spin_lock(&peer_lock);
+	for (i = 0; i < peer_cnt; i++) {
+		if (peers[i].node_id == id)
+			break;
+	}
+
+	if (i == peer_cnt) {
+		if (peer_cnt == MAX_PEERS) {
+			spin_unlock(&peer_lock);
+			log_warn("pppoe: cluster: too many peers, ignoring node %u\n", id);
+			return;
+		}
+		peer_cnt++;
+		peers[i].seq = seq;
+		log_info1("pppoe: cluster: node %u (%s) joined\n", id, inet_ntoa(addr->sin_addr));
+	}
+
+	peers[i].node_id = id;
+	peers[i].addr = addr->sin_addr;
+	peers[i].last_seen = now_ms();
+	peers[i].load = ntohl(msg->load);
+	peers[i].sessions = ntohl(msg->sessions);
+	spin_unlock(&peer_lock);
+}
+
+static void recv_claim(struct cluster_claim *msg, int len)
+{
+	int64_t now = now_ms();
+	uint8_t *addr = msg->addr;
+	struct claim_t *c;
+	int i, cnt = ntohs(msg->hdr.cnt);
+
+	if (sizeof(msg->hdr) + cnt * ETH_ALEN > len)
+		return;
+
+	spin_lock(&claim_lock);
+	for (i = 0; i < cnt; i++, addr += ETH_ALEN) {
+		c = &claims[claim_hash(addr)];
+		memcpy(c->addr, addr, ETH_ALEN);
+		c->ts = now;
+	}
+	spin_unlock(&claim_lock);
+
+	__sync_add_and_fetch(&stat_claim_recv, cnt);
+}
+
+static int cluster_read(struct triton_md_handler_t *h)
+{
+	uint8_t buf[1500];
+	struct cluster_hdr *hdr = (struct cluster_hdr *)buf;
+	struct sockaddr_in addr;
+	socklen_t len;
+	uint64_t seq = 0;
+	int n;
+
+	while (1) {
+		len = sizeof(addr);
+		n = recvfrom(h->fd, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &len);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+			log_error("pppoe: cluster: recv: %s\n", strerror(errno));
+			break;
+		}
+
+		if (n < sizeof(*hdr) || ntohl(hdr->magic) != CLUSTER_MAGIC || hdr->ver != CLUSTER_VERSION)
+			continue;
+
+		if (cluster_auth) {
+			n = auth_check(buf, n, &seq);
+			if (n < 0) {
+				if (conf_verbose)
+					log_warn("pppoe: cluster: bad authenticator from %s\n", inet_ntoa(addr.sin_addr));
+				continue;
+			}
+		}
+
+		if (ntohl(hdr->node_id) == node_id)
+			continue;
+
+		if (cluster_auth && check_seq(ntohl(hdr->node_id), seq))
+			continue;
+
+		if (hdr->type == CLUSTER_HELLO && n >= sizeof(struct cluster_hello))
+			recv_hello((struct cluster_hello *)buf, &addr, seq);
+		else if (hdr->type == CLUSTER_CLAIM)
+			recv_claim((struct cluster_claim *)buf, n);
+	}
+
+	return 0;
+}
+
+static void send_hello(struct triton_timer_t *t)
+{
+	struct cluster_hello msg;
+	unsigned int load = dpado_load;
+	unsigned int sessions = stat_active + stat_starting;
+
+	spin_lock(&peer_lock);
+	self_load = load;
+	self_sessions = sessions;
+	spin_unlock(&peer_lock);
+
+	msg.hdr.magic = htonl(CLUSTER_MAGIC);
+	msg.hdr.ver = CLUSTER_VERSION;
+	msg.hdr.type = CLUSTER_HELLO;
+	msg.hdr.cnt = 0;
+	msg.hdr.node_id = htonl(node_id);
+	msg.load = htonl(load);
+	msg.sessions = htonl(sessions);
+
+	send_to_targets(&msg, sizeof(msg));
+}
+
+static void cluster_close(struct triton_context_t *ctx)
+{
+	cluster_enabled = 0;
+	triton_timer_del(&hello_timer);
+	triton_md_unregister_handler(&cluster_hnd);
+	close(cluster_hnd.fd);
+	triton_context_unregister(ctx);
+}
+
+static int parse_addr(const char *str, struct sockaddr_in *addr)
+{
+	char *buf = _strdup(str);
+	char *ptr = strchr(buf, ':');
+	int r = -1;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+
+	if (ptr) {
+		*ptr = 0;
+		if (inet_pton(AF_INET, buf, &addr->sin_addr) == 1 && atoi(ptr + 1) > 0 && atoi(ptr + 1) < 65536) {
+			addr->sin_port = htons(atoi(ptr + 1));
+			r = 0;
+		}
+	}
+
+	_free(buf);
+
+	return r;
+}
+
+static int cluster_show_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
+{
+	int64_t now = now_ms();
+	int i;
+
+	if (!cluster_enabled) {
+		cli_send(client, "cluster is disabled\r\n");
+		return CLI_CMD_OK;
+	}
+
+	cli_sendv(client, "node %u: load %u.%u%% sessions %u\r\n", node_id, self_load / 10, self_load % 10, self_sessions);
+
+	spin_lock(&peer_lock);
+	for (i = 0; i < peer_cnt; i++) {
+		cli_sendv(client, "node %u (%s): load %u.%u%% sessions %u last seen %lli ms ago%s\r\n",
+			peers[i].node_id, inet_ntoa(peers[i].addr), peers[i].load / 10, peers[i].load % 10,
+			peers[i].sessions, (long long)(now - peers[i].last_seen),
+			now - peers[i].last_seen > conf_cluster_timeout ? " (timed out)" : "");
+	}
+	spin_unlock(&peer_lock);
+
+	cli_sendv(client, "claims sent: %lu\r\n", stat_claim_sent);
+	cli_sendv(client, "claims received: %lu\r\n", stat_claim_recv);
+	cli_sendv(client, "PADO suppressed: %lu\r\n", stat_pado_suppressed);
+
+	return CLI_CMD_OK;
+}
+
+static void cluster_show_help(char * const *fields, int fields_cnt, void *client)
+{
+	cli_send(client, "pppoe cluster show - show cluster peers\r\n");
+}
+
+static void cluster_init(void)
+{
+	struct conf_sect_t *s = conf_get_section("pppoe");
+	struct conf_option_t *opt;
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	char *val;
+	int sock, f = 1;
+
+	if (!s)
+		return;
+
+	val = conf_get_opt("pppoe", "cluster-bind");
+	if (!val)
+		return;
+
+	if (parse_addr(val, &addr)) {
+		log_emerg("pppoe: cluster: invalid cluster-bind value '%s'\n", val);
+		return;
+	}
+
+	val = conf_get_opt("pppoe", "cluster-id");
+	if (val)
+		node_id = strtoul(val, NULL, 10);
+	while (!node_id)
+		u_randbuf(&node_id, sizeof(node_id));
+
+	val = conf_get_opt("pppoe", "cluster-interval");
+	if (val && atoi(val) > 0)
+		conf_cluster_interval = atoi(val);
+
+	val = conf_get_opt("pppoe", "cluster-timeout");
+	if (val && atoi(val) > 0)
+		conf_cluster_timeout = atoi(val);
+
+	val = conf_get_opt("pppoe", "cluster-delay");
+	if (val && atoi(val) >= 0)
+		conf_cluster_delay = atoi(val);
+
+	val = conf_get_opt("pppoe", "cluster-secret");
+	if (val && *val)
+		auth_init(val);
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		log_emerg("pppoe: cluster: socket: %s\n", strerror(errno));
+		return;
+	}
+
+	fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &f, sizeof(f));
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		log_emerg("pppoe: cluster: bind: %s\n", strerror(errno));
+		close(sock);
+		return;
+	}
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK)) {
+		log_emerg("pppoe: cluster: failed to set nonblocking mode: %s\n", strerror(errno));
+		close(sock);
+		return;
+	}
+
+	/* multicast loop stays on so that nodes of one host see each other, own datagrams are dropped by node id */
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &f, sizeof(f));
+
+	list_for_each_entry(opt, &s->items, entry) {
+		if (strcmp(opt->name, "cluster-peer") || !opt->val)
+			continue;
+
+		if (target_cnt == MAX_TARGETS) {
+			log_error("pppoe: cluster: too many peers\n");
+			break;
+		}
+
+		if (parse_addr(opt->val, &targets[target_cnt])) {
+			log_error("pppoe: cluster: invalid cluster-peer value '%s'\n", opt->val);
+			continue;
+		}
+
+		if (IN_MULTICAST(ntohl(targets[target_cnt].sin_addr.s_addr))) {
+			mreq.imr_multiaddr = targets[target_cnt].sin_addr;
+			mreq.imr_interface = addr.sin_addr;
+			if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+				log_error("pppoe: cluster: failed to join %s: %s\n", opt->val, strerror(errno));
+		}
+
+		target_cnt++;
+	}
+
+	if (!target_cnt) {
+		log_emerg("pppoe: cluster: no cluster-peer specified\n");
+		close(sock);
+		return;
+	}
+
+	spinlock_init(&peer_lock);
+	spinlock_init(&claim_lock);
+
+	cluster_ctx.close = cluster_close;
+	cluster_hnd.fd = sock;
+	cluster_hnd.read = cluster_read;
+
+	triton_context_register(&cluster_ctx, NULL);
+	triton_md_register_handler(&cluster_ctx, &cluster_hnd);
+	triton_md_enable_handler(&cluster_hnd, MD_MODE_READ);
+
+	hello_timer.expire = send_hello;
+	hello_timer.period = conf_cluster_interval;
+	triton_timer_add(&cluster_ctx, &hello_timer, 0);
+
+	triton_context_wakeup(&cluster_ctx);
+
+	cluster_enabled = 1;
+
+	cli_register_simple_cmd2(cluster_show_exec, cluster_show_help, 3, "pppoe", "cluster", "show");
+
+	log_info1("pppoe: cluster: node %u, %i peer address(es)\n", node_id, target_cnt);
+}
+
+DEFINE_INIT(22, cluster_init);
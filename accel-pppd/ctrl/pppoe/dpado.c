@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include <errno.h>
 #include <limits.h>
 #include <netinet/in.h>
@@ -10,10 +11,29 @@
 #include "cli.h"
 #include "triton.h"
 #include "log.h"
+#include "ppp.h"
+#ifdef RADIUS
+#include "radius.h"
+#endif
 #include "memdebug.h"
 
 #include "pppoe.h"
 
+/*
+ * In load mode the delay follows how busy this box is: every second the
+ * most saturated of triton scheduling delay, CPU usage, RADIUS requests in
+ * flight, RADIUS auth response time and sessions being started gives a
+ * load sample in 0..1000, which is smoothed by EWMA and scaled to the
+ * maximum delay. Of several BRASes in a segment the least loaded one
+ * answers first.
+ */
+#define DPADO_INTERVAL 1000
+#define DPADO_DEFAULT_MAX 500
+#define DPADO_QDELAY_FULL 50       /* ms */
+#define DPADO_RTT_FULL 1000        /* ms */
+#define DPADO_INFLIGHT_FULL 256
+#define DPADO_STARTING_FULL 1000
+
 struct dpado_range_t
 {
 	struct list_head entry;
@@ -27,6 +47,130 @@ static struct dpado_range_t *dpado_range_next;
 static struct dpado_range_t *dpado_range_prev;
 int pado_delay;
 
+static int dpado_load_max; /* 0 - load mode is off */
+static int dpado_cpu_collect;
+unsigned int dpado_load;
+
+static struct triton_context_t dpado_ctx;
+static struct triton_context_t dpado_probe_ctx;
+static struct triton_timer_t dpado_timer;
+static struct timespec probe_ts;
+static int probe_pending;
+static unsigned int probe_delay;
+
+static unsigned int elapsed_ms(const struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+/* runs when a worker picks up the probe context, measures scheduling delay */
+static void dpado_probe(void *arg)
+{
+	probe_delay = elapsed_ms(&probe_ts);
+	probe_pending = 0;
+}
+
+static unsigned int scale(unsigned int val, unsigned int full)
+{
+	return val >= full ? 1000 : val * 1000 / full;
+}
+
+static unsigned int load_sample(void)
+{
+	unsigned int load, v, threads;
+#ifdef RADIUS
+	struct rad_server_stat_t *st;
+	LIST_HEAD(stats);
+	unsigned int inflight = 0, rtt = 0;
+#endif
+
+	/* a probe which is still waiting has been delayed at least that long */
+	load = scale(probe_pending ? elapsed_ms(&probe_ts) : probe_delay, DPADO_QDELAY_FULL);
+
+	threads = triton_stat.thread_count ? triton_stat.thread_count : 1;
+	v = scale(triton_stat.cpu, 100 * threads);
+	if (v > load)
+		load = v;
+
+	v = scale(ppp_stat.starting, DPADO_STARTING_FULL);
+	if (v > load)
+		load = v;
+
+#ifdef RADIUS
+	if (triton_module_loaded("radius") && !rad_server_stats(&stats)) {
+		while (!list_empty(&stats)) {
+			st = list_entry(stats.next, typeof(*st), entry);
+			list_del(&st->entry);
+			inflight += st->req_cnt + st->queue_cnt;
+			if (st->stat_auth_query_1m > rtt)
+				rtt = st->stat_auth_query_1m;
+			_free(st);
+		}
+
+		v = scale(inflight, DPADO_INFLIGHT_FULL);
+		if (v > load)
+			load = v;
+
+		v = scale(rtt, DPADO_RTT_FULL);
+		if (v > load)
+			load = v;
+	}
+#endif
+
+	return load;
+}
+
+static void dpado_timer_func(struct triton_timer_t *t)
+{
+	int max = dpado_load_max;
+
+	if (!max)
+		return;
+
+	dpado_load = (dpado_load * 3 + load_sample()) / 4;
+	pado_delay = dpado_load * max / 1000;
+
+	if (!probe_pending) {
+		probe_pending = 1;
+		clock_gettime(CLOCK_MONOTONIC, &probe_ts);
+		triton_context_call(&dpado_probe_ctx, dpado_probe, NULL);
+	}
+}
+
+static void dpado_load_start(void)
+{
+	if (!dpado_cpu_collect) {
+		triton_collect_cpu_usage();
+		dpado_cpu_collect = 1;
+	}
+
+	if (dpado_ctx.tpd)
+		return;
+
+	triton_context_register(&dpado_probe_ctx, NULL);
+	triton_context_wakeup(&dpado_probe_ctx);
+
+	triton_context_register(&dpado_ctx, NULL);
+	dpado_timer.expire = dpado_timer_func;
+	dpado_timer.period = DPADO_INTERVAL;
+	triton_timer_add(&dpado_ctx, &dpado_timer, 0);
+	triton_context_wakeup(&dpado_ctx);
+}
+
+static void dpado_load_stop(void)
+{
+	dpado_load_max = 0;
+
+	if (dpado_cpu_collect) {
+		triton_stop_collect_cpu_usage();
+		dpado_cpu_collect = 0;
+	}
+}
+
 void dpado_check_next(int conn_cnt)
 {
 	pthread_mutex_lock(&dpado_range_lock);
@@ -73,6 +217,45 @@ static void strip(char *str)
 	}
 }
 
+/* load[:max] */
+static int dpado_parse_load(const char *str)
+{
+	char *endptr;
+	int max = DPADO_DEFAULT_MAX;
+	struct dpado_range_t *r;
+
+	if (str[4] == ':') {
+		max = strtol(str + 5, &endptr, 10);
+		if (*endptr || max <= 0)
+			return -1;
+	} else if (str[4])
+		return -1;
+
+	pthread_mutex_lock(&dpado_range_lock);
+	while (!list_empty(&dpado_range_list)) {
+		r = list_entry(dpado_range_list.next, typeof(*r), entry);
+		list_del(&r->entry);
+		_free(r);
+	}
+
+	dpado_range_next = NULL;
+	dpado_range_prev = NULL;
+
+	if (!dpado_load_max)
+		dpado_load = 0;
+	dpado_load_max = max;
+	pado_delay = dpado_load * max / 1000;
+
+	dpado_load_start();
+
+	if (conf_pado_delay)
+		_free(conf_pado_delay);
+	conf_pado_delay = _strdup(str);
+	pthread_mutex_unlock(&dpado_range_lock);
+
+	return 0;
+}
+
 int dpado_parse(const char *str)
 {
 	char *str1 = _strdup(str);
@@ -82,6 +265,13 @@ int dpado_parse(const char *str)
 
 	strip(str1);
 
+	if (!strncmp(str1, "load", 4)) {
+		if (dpado_parse_load(str1))
+			goto out_err;
+		_free(str1);
+		return 0;
+	}
+
 	ptr1 = str1;
 
 	while (1) {
@@ -128,6 +318,8 @@ int dpado_parse(const char *str)
 	dpado_range_next = NULL;
 	dpado_range_prev = NULL;
 
+	dpado_load_stop();
+
 	while (!list_empty(&range_list)) {
 		r = list_entry(range_list.next, typeof(*r), entry);
 		list_del(&r->entry);
@@ -1,11 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <net/ethernet.h>
 
-#include "list.h"
 #include "cli.h"
 #include "triton.h"
 #include "log.h"
@@ -14,46 +15,255 @@
 
 #include "pppoe.h"
 
-struct mac_t
+/*
+ * Addresses are kept in an open addressing hash set (linear probing).
+ * Lookups take no lock: slots are updated with single 64-bit stores, a
+ * deleted slot becomes a tombstone, never empty. Reload and growth
+ * build a new set which replaces the current one, the old set is freed
+ * when every reader slot has been seen idle.
+ */
+
+#define MAC_KEY_FLAG (1ull << 48)
+#define MAC_TOMBSTONE 1
+#define MAC_SET_MIN 256
+#define MAC_READER_SLOTS 64
+
+struct mac_set_t
 {
-	struct list_head entry;
-	uint8_t addr[ETH_ALEN];
+	unsigned int mask;
+	unsigned int cnt;
+	unsigned int used;
+	uint64_t slot[0];
 };
 
-static LIST_HEAD(mac_list);
+struct mac_reader_t
+{
+	unsigned long cnt;
+} __attribute__((aligned(64)));
+
+static struct mac_set_t *mac_set;
+static struct mac_reader_t readers[MAC_READER_SLOTS];
+static int reader_next;
+static __thread int reader_idx = -1;
+
 static int type; // -1 - disabled, 1 - allow, 0 - denied
-static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static const char *conf_mac_filter;
 
+static inline uint64_t mac_key(const uint8_t *addr)
+{
+	return MAC_KEY_FLAG | ((uint64_t)addr[0] << 40) | ((uint64_t)addr[1] << 32) | ((uint64_t)addr[2] << 24) |
+		((uint64_t)addr[3] << 16) | ((uint64_t)addr[4] << 8) | addr[5];
+}
+
+static inline unsigned int mac_hash(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static struct mac_set_t *mac_set_alloc(unsigned int size)
+{
+	struct mac_set_t *set;
+
+	set = _malloc(sizeof(*set) + size * sizeof(uint64_t));
+	if (!set)
+		return NULL;
+
+	memset(set, 0, sizeof(*set) + size * sizeof(uint64_t));
+	set->mask = size - 1;
+
+	return set;
+}
+
+static int mac_set_lookup(const struct mac_set_t *set, uint64_t key)
+{
+	unsigned int i = mac_hash(key) & set->mask;
+	uint64_t v;
+
+	while (1) {
+		v = *(volatile uint64_t *)&set->slot[i];
+		if (v == key)
+			return 1;
+		if (!v)
+			return 0;
+		i = (i + 1) & set->mask;
+	}
+}
+
+/* returns 0 if added, 1 if already present, -1 if set is full */
+static int mac_set_insert(struct mac_set_t *set, uint64_t key)
+{
+	unsigned int i = mac_hash(key) & set->mask;
+	int pos = -1;
+
+	while (set->slot[i]) {
+		if (set->slot[i] == key)
+			return 1;
+		if (set->slot[i] == MAC_TOMBSTONE && pos == -1)
+			pos = i;
+		i = (i + 1) & set->mask;
+	}
+
+	if (pos == -1) {
+		if ((set->used + 1) * 4 > (set->mask + 1) * 3)
+			return -1;
+		pos = i;
+		set->used++;
+	}
+
+	*(volatile uint64_t *)&set->slot[pos] = key;
+	set->cnt++;
+
+	return 0;
+}
+
+static int mac_set_remove(struct mac_set_t *set, uint64_t key)
+{
+	unsigned int i = mac_hash(key) & set->mask;
+
+	while (set->slot[i]) {
+		if (set->slot[i] == key) {
+			*(volatile uint64_t *)&set->slot[i] = MAC_TOMBSTONE;
+			set->cnt--;
+			return 0;
+		}
+		i = (i + 1) & set->mask;
+	}
+
+	return -1;
+}
+
+/* rehash into a set with room for twice the current entries, drops tombstones */
+static struct mac_set_t *mac_set_grow(const struct mac_set_t *set)
+{
+	struct mac_set_t *n;
+	unsigned int size = MAC_SET_MIN;
+	unsigned int i;
+
+	while (size < (set->cnt + 1) * 4)
+		size <<= 1;
+
+	n = mac_set_alloc(size);
+	if (!n)
+		return NULL;
+
+	for (i = 0; i <= set->mask; i++) {
+		if (set->slot[i] & MAC_KEY_FLAG)
+			mac_set_insert(n, set->slot[i]);
+	}
+
+	return n;
+}
+
+/* waits until lookups which could have seen the previous set are finished */
+static void mac_set_sync(void)
+{
+	int i;
+
+	__sync_synchronize();
+
+	for (i = 0; i < MAC_READER_SLOTS; i++) {
+		while (*(volatile unsigned long *)&readers[i].cnt)
+			sched_yield();
+	}
+}
+
+/* called with lock held */
+static void mac_set_replace(struct mac_set_t *set)
+{
+	struct mac_set_t *old = mac_set;
+
+	__sync_synchronize();
+	mac_set = set;
+
+	if (old) {
+		mac_set_sync();
+		_free(old);
+	}
+}
+
+static int parse_mac(const char *str, uint8_t *addr)
+{
+	unsigned int n[ETH_ALEN];
+	int i;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x",
+		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6)
+		return -1;
+
+	for (i = 0; i < ETH_ALEN; i++) {
+		if (n[i] > 255)
+			return -1;
+		addr[i] = n[i];
+	}
+
+	return 0;
+}
+
 int mac_filter_check(const uint8_t *addr)
 {
-	struct mac_t *mac;
+	struct mac_reader_t *r;
+	struct mac_set_t *set;
 	int res = type;
 
 	if (type == -1)
 		return 0;
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(mac->addr, addr, ETH_ALEN))
-			continue;
+	if (reader_idx == -1)
+		reader_idx = __sync_fetch_and_add(&reader_next, 1) % MAC_READER_SLOTS;
+
+	r = &readers[reader_idx];
+
+	__sync_add_and_fetch(&r->cnt, 1);
+	set = *(struct mac_set_t * volatile *)&mac_set;
+	if (set && mac_set_lookup(set, mac_key(addr)))
 		res = !type;
-		break;
-	}
-	pthread_rwlock_unlock(&lock);
+	__sync_sub_and_fetch(&r->cnt, 1);
 
 	return res;
 }
 
+int mac_filter_get(uint8_t *addrs, int max, int *allow)
+{
+	unsigned int i;
+	uint64_t v;
+	int n = 0;
+
+	if (type == -1)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	*allow = type;
+	if (mac_set && mac_set->cnt > max)
+		n = -1;
+	else if (mac_set) {
+		for (i = 0; i <= mac_set->mask; i++) {
+			v = mac_set->slot[i];
+			if (!(v & MAC_KEY_FLAG))
+				continue;
+			addrs[n * ETH_ALEN] = v >> 40;
+			addrs[n * ETH_ALEN + 1] = v >> 32;
+			addrs[n * ETH_ALEN + 2] = v >> 24;
+			addrs[n * ETH_ALEN + 3] = v >> 16;
+			addrs[n * ETH_ALEN + 4] = v >> 8;
+			addrs[n * ETH_ALEN + 5] = v;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
 static int mac_filter_load(const char *opt)
 {
-	struct mac_t *mac;
+	struct mac_set_t *set, *n;
+	uint8_t addr[ETH_ALEN];
 	FILE *f;
 	char *c;
 	char *name = _strdup(opt);
 	char *buf = _malloc(1024);
-	int n[ETH_ALEN];
-	int i, line = 0;
+	int line = 0;
 
 	c = strstr(name, ",");
 	if (!c)
@@ -76,42 +286,45 @@ static int mac_filter_load(const char *opt)
 	
 	conf_mac_filter = opt;
 
-	pthread_rwlock_wrlock(&lock);
-	while (!list_empty(&mac_list)) {
-		mac = list_entry(mac_list.next, typeof(*mac), entry);
-		list_del(&mac->entry);
-		_free(mac);
-	}
+	set = mac_set_alloc(MAC_SET_MIN);
+	if (!set)
+		goto err_nomem;
 
 	while (fgets(buf, 1024, f)) {
 		line++;
 		if (buf[0] == '#' || buf[0] == ';' || buf[0] == '\n')
 			continue;
-		if (sscanf(buf, "%x:%x:%x:%x:%x:%x",
-			n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+		if (parse_mac(buf, addr)) {
 			log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
 			continue;
 		}
-		mac = _malloc(sizeof(*mac));
-		for (i = 0; i < ETH_ALEN; i++) {
-			if (n[i] > 255) {
-				log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
-				_free(mac);
-				continue;
-			}
-			mac->addr[i] = n[i];
+		if (mac_set_insert(set, mac_key(addr)) == -1) {
+			n = mac_set_grow(set);
+			_free(set);
+			if (!n)
+				goto err_nomem;
+			set = n;
+			mac_set_insert(set, mac_key(addr));
 		}
-		list_add_tail(&mac->entry, &mac_list);
 	}
-	pthread_rwlock_unlock(&lock);
 
 	fclose(f);
 
+	pthread_mutex_lock(&lock);
+	mac_set_replace(set);
+	pthread_mutex_unlock(&lock);
+
+	pppoe_update_filters();
+
 	_free(name);
 	_free(buf);
 
 	return 0;
 
+err_nomem:
+	fclose(f);
+	log_emerg("pppoe: mac-filter: out of memory\n");
+	goto err;
 err_inval:
 	log_emerg("pppoe: mac-filter format is invalid\n");
 err:
@@ -122,72 +335,63 @@ err:
 
 static void mac_filter_add(const char *addr, void *client)
 {
-	int n[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
+	uint8_t a[ETH_ALEN];
+	struct mac_set_t *n;
+	int r;
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(addr, a)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	mac = _malloc(sizeof(*mac));
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			_free(mac);
-			cli_send(client, "invalid format\r\n");
-			return;
+	pthread_mutex_lock(&lock);
+	if (!mac_set) {
+		n = mac_set_alloc(MAC_SET_MIN);
+		if (n)
+			mac_set_replace(n);
+	}
+	r = mac_set ? mac_set_insert(mac_set, mac_key(a)) : -1;
+	if (r == -1 && mac_set) {
+		n = mac_set_grow(mac_set);
+		if (n) {
+			r = mac_set_insert(n, mac_key(a));
+			mac_set_replace(n);
 		}
-		mac->addr[i] = n[i];
 	}
+	pthread_mutex_unlock(&lock);
 
-	pthread_rwlock_wrlock(&lock);
-	list_add_tail(&mac->entry, &mac_list);
-	pthread_rwlock_unlock(&lock);
+	if (r == -1)
+		cli_send(client, "out of memory\r\n");
+	else if (r == 0)
+		pppoe_update_filters();
 }
 
 static void mac_filter_del(const char *addr, void *client)
 {
-	int n[ETH_ALEN];
 	uint8_t a[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
-	int found = 0;
+	int r = -1;
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(addr, a)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			cli_send(client, "invalid format\r\n");
-			return;
-		}
-		a[i] = n[i];
-	}
-
-	pthread_rwlock_wrlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(a, mac->addr, ETH_ALEN))
-			continue;
-		list_del(&mac->entry);
-		_free(mac);
-		found = 1;
-		break;
-	}
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_lock(&lock);
+	if (mac_set)
+		r = mac_set_remove(mac_set, mac_key(a));
+	pthread_mutex_unlock(&lock);
 
-	if (!found)
+	if (r)
 		cli_send(client, "not found\r\n");
+	else
+		pppoe_update_filters();
 }
 
 static void mac_filter_show(void *client)
 {
-	struct mac_t *mac;
 	const char *filter_type;
+	unsigned int i;
+	uint64_t v;
 
 	if (type == 0)
 		filter_type = "deny";
@@ -198,13 +402,16 @@ static void mac_filter_show(void *client)
 
 	cli_sendv(client, "filter type: %s\r\n", filter_type);
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
+	pthread_mutex_lock(&lock);
+	for (i = 0; mac_set && i <= mac_set->mask; i++) {
+		v = mac_set->slot[i];
+		if (!(v & MAC_KEY_FLAG))
+			continue;
 		cli_sendv(client, "%02x:%02x:%02x:%02x:%02x:%02x\r\n",
-			mac->addr[0], mac->addr[1], mac->addr[2],
-			mac->addr[3],	mac->addr[4], mac->addr[5]);
+			(uint8_t)(v >> 40), (uint8_t)(v >> 32), (uint8_t)(v >> 24),
+			(uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v);
 	}
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
 }
 
 static void cmd_help(char * const *fields, int fields_cnt, void *client);
@@ -4,12 +4,15 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <net/ethernet.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <arpa/inet.h>
 #include <printf.h>
 #include <ctype.h>
@@ -29,6 +32,8 @@
 
 #include "iputils.h"
 #include "connlimit.h"
+#include "upgrade.h"
+#include "random.h"
 
 #include "pppoe.h"
 
@@ -39,6 +44,7 @@ struct pppoe_conn_t
 	struct list_head entry;
 	struct triton_context_t ctx;
 	struct pppoe_serv_t *serv;
+	struct pppoe_conn_t *cookie_next;
 	int disc_sock;
 	uint16_t sid;
 	uint8_t addr[ETH_ALEN];
@@ -49,6 +55,7 @@ struct pppoe_conn_t
 	struct pppoe_tag *service_name;
 	struct pppoe_tag *tr101;
 	uint8_t cookie[COOKIE_LENGTH];
+	struct upgrade_rec_t *upgrade_rec;
 	
 	struct ppp_ctrl_t ctrl;
 	struct ppp_t ppp;
@@ -60,21 +67,33 @@ struct pppoe_conn_t
 struct delayed_pado_t
 {
 	struct list_head entry;
-	struct triton_timer_t timer;
+	struct delayed_pado_t *next;
+	int64_t due;
+	struct pppoe_shard_t *shard;
 	struct pppoe_serv_t *serv;
 	uint8_t addr[ETH_ALEN];
+	int cluster:1;
 	struct pppoe_tag *host_uniq;
 	struct pppoe_tag *relay_sid;
 	struct pppoe_tag *service_name;
 };
 
+/* MAC which was answered within last second, hashed and queued on a ring slot by second */
 struct padi_t
 {
 	struct list_head entry;
-	struct timespec ts;
+	struct padi_t *next;
+	int64_t ts;
 	uint8_t addr[ETH_ALEN];
 };
 
+#define PADI_DROP_ADMISSION 1
+#define PADI_DROP_MAC 2
+#define PADI_DROP_IFACE 3
+#define PADI_DROP_GLOBAL 4
+#define PADI_DROP_CONNLIMIT 5
+#define PADI_DROP_NOMEM 6
+
 struct iplink_arg
 {
 	pcre *re;
@@ -88,6 +107,11 @@ int conf_ifname_in_sid;
 char *conf_pado_delay;
 int conf_tr101 = 1;
 int conf_padi_limit = 0;
+int conf_rx_ring = 0;
+int conf_fanout = 1;
+int conf_shared_socket = 0;
+int conf_cookie = COOKIE_DES;
+int conf_cookie_timeout = 60;
 int conf_mppe = MPPE_UNSET;
 static char *conf_ip_pool;
 int conf_reply_exact_service = 0;
@@ -102,19 +126,51 @@ unsigned int stat_active;
 unsigned int stat_delayed_pado;
 unsigned long stat_PADI_recv;
 unsigned long stat_PADI_drop;
+unsigned long stat_PADI_drop_admission;
+unsigned long stat_PADI_drop_mac;
+unsigned long stat_PADI_drop_iface;
+unsigned long stat_PADI_drop_global;
+unsigned long stat_PADI_drop_connlimit;
+unsigned long stat_PADI_drop_nomem;
+unsigned long stat_tx_batch[TX_HIST_SIZE];
 unsigned long stat_PADO_sent;
 unsigned long stat_PADR_recv;
 unsigned long stat_PADR_dup_recv;
 unsigned long stat_PADS_sent;
-unsigned int total_padi_cnt;
+
+static struct padi_bucket_t padi_bucket;
+static spinlock_t padi_bucket_lock;
 
 pthread_rwlock_t serv_lock = PTHREAD_RWLOCK_INITIALIZER;
 LIST_HEAD(serv_list);
 
+/* servers indexed by ifindex, protected by serv_lock */
+static struct pppoe_serv_t **serv_tab;
+static int serv_tab_size;
+
+/* shared discovery socket, created with the first interface using it */
+static struct pppoe_shard_t *shared_shard;
+static int shared_shard_cnt;
+static struct pppoe_sid_tab_t *shared_tab;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* siphash cookie keys, slot is selected by parity of ts / cookie-timeout + 1, epoch 0 is unused */
+struct cookie_key_t
+{
+	uint32_t epoch;
+	uint64_t k0;
+	uint64_t k1;
+};
+
+static struct cookie_key_t cookie_keys[2];
+static spinlock_t cookie_key_lock;
+
 static uint8_t bc_addr[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 static void pppoe_send_PADT(struct pppoe_conn_t *conn);
-static void _server_stop(struct pppoe_serv_t *serv);
+static void cookie_hash_del(struct pppoe_conn_t *conn);
+static void _server_stop(struct pppoe_shard_t *sh);
+static void serv_shard_left(struct pppoe_serv_t *serv, int idx, int terminate);
 void pppoe_server_free(struct pppoe_serv_t *serv);
 static int init_secret(struct pppoe_serv_t *serv);
 static void __pppoe_server_start(const char *ifname, const char *opt, void *cli);
@@ -136,15 +192,16 @@ static void disconnect(struct pppoe_conn_t *conn)
 
 	log_ppp_info1("disconnected\n");
 
-	pthread_mutex_lock(&conn->serv->lock);
-	conn->serv->conn[conn->sid] = NULL;
+	pthread_mutex_lock(&conn->serv->tab->lock);
+	conn->serv->tab->conn[conn->sid] = NULL;
 	list_del(&conn->entry);
+	cookie_hash_del(conn);
 	conn->serv->conn_cnt--;
-	if (conn->serv->stopping && conn->serv->conn_cnt == 0) {
-		pthread_mutex_unlock(&conn->serv->lock);
+	if (conn->serv->stopping && conn->serv->conn_cnt == 0 && conn->serv->shard_active == 0) {
+		pthread_mutex_unlock(&conn->serv->tab->lock);
 		pppoe_server_free(conn->serv);
 	} else
-		pthread_mutex_unlock(&conn->serv->lock);
+		pthread_mutex_unlock(&conn->serv->tab->lock);
 
 	_free(conn->ctrl.calling_station_id);
 	_free(conn->ctrl.called_station_id);
@@ -211,7 +268,38 @@ static int pppoe_rad_send_accounting_request(struct rad_plugin_t *rad, struct ra
 }
 #endif
 
-static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name, const struct pppoe_tag *tr101, const uint8_t *cookie)
+static int pppoe_upgrade(struct ppp_t *ppp);
+
+/*
+ * connections indexed by AC-Cookie for PADR lookup, cookies are cipher
+ * output so their leading bytes make a good hash; under tab->lock
+ */
+static inline unsigned int cookie_hash(const uint8_t *cookie)
+{
+	return (cookie[0] | (cookie[1] << 8) | (cookie[2] << 16)) & (COOKIE_HASH_SIZE - 1);
+}
+
+static void cookie_hash_add(struct pppoe_conn_t *conn)
+{
+	struct pppoe_conn_t **head = &conn->serv->tab->cookie_hash[cookie_hash(conn->cookie)];
+
+	conn->cookie_next = *head;
+	*head = conn;
+}
+
+static void cookie_hash_del(struct pppoe_conn_t *conn)
+{
+	struct pppoe_conn_t **p = &conn->serv->tab->cookie_hash[cookie_hash(conn->cookie)];
+
+	for (; *p; p = &(*p)->cookie_next) {
+		if (*p == conn) {
+			*p = conn->cookie_next;
+			break;
+		}
+	}
+}
+
+static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name, const struct pppoe_tag *tr101, const uint8_t *cookie, uint16_t fixed_sid)
 {
 	struct pppoe_conn_t *conn;
 	int sid;
@@ -224,20 +312,32 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 
 	memset(conn, 0, sizeof(*conn));
 
-	pthread_mutex_lock(&serv->lock);
-	for (sid = serv->sid + 1; sid != serv->sid; sid++) {
+	conn->serv = serv;
+	memcpy(conn->cookie, cookie, COOKIE_LENGTH);
+
+	pthread_mutex_lock(&serv->tab->lock);
+	if (fixed_sid) {
+		if (fixed_sid < MAX_SID && !serv->tab->conn[fixed_sid]) {
+			conn->sid = fixed_sid;
+			serv->tab->conn[fixed_sid] = conn;
+			list_add_tail(&conn->entry, &serv->conn_list);
+			cookie_hash_add(conn);
+			serv->conn_cnt++;
+		}
+	} else for (sid = serv->sid + 1; sid != serv->sid; sid++) {
 		if (sid == MAX_SID)
 			sid = 1;
-		if (!serv->conn[sid]) {
+		if (!serv->tab->conn[sid]) {
 			conn->sid = sid;
 			serv->sid = sid;
-			serv->conn[sid] = conn;
+			serv->tab->conn[sid] = conn;
 			list_add_tail(&conn->entry, &serv->conn_list);
+			cookie_hash_add(conn);
 			serv->conn_cnt++;
 			break;
 		}
 	}
-	pthread_mutex_unlock(&serv->lock);
+	pthread_mutex_unlock(&serv->tab->lock);
 
 	if (!conn->sid) {
 		log_warn("pppoe: no free sid available\n");
@@ -245,7 +345,6 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 		return NULL;
 	}
 	
-	conn->serv = serv;
 	memcpy(conn->addr, addr, ETH_ALEN);
 
 	if (host_uniq) {
@@ -266,13 +365,12 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 	conn->service_name = _malloc(sizeof(*service_name) + ntohs(service_name->tag_len));
 	memcpy(conn->service_name, service_name, sizeof(*service_name) + ntohs(service_name->tag_len));
 
-	memcpy(conn->cookie, cookie, COOKIE_LENGTH);
-
 	conn->ctx.before_switch = log_switch;
 	conn->ctx.close = pppoe_conn_close;
 	conn->ctrl.ctx = &conn->ctx;
 	conn->ctrl.started = ppp_started;
 	conn->ctrl.finished = ppp_finished;
+	conn->ctrl.upgrade = pppoe_upgrade;
 	conn->ctrl.max_mtu = MAX_PPPOE_MTU;
 	conn->ctrl.type = CTRL_TYPE_PPPOE;
 	conn->ctrl.name = "pppoe";
@@ -307,7 +405,7 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 	triton_event_fire(EV_CTRL_STARTING, &conn->ppp);
 	triton_event_fire(EV_CTRL_STARTED, &conn->ppp);
 
-	conn->disc_sock = dup(serv->hnd.fd);
+	conn->disc_sock = dup(serv->shard[0].hnd.fd);
 
 	return conn;
 }
@@ -363,12 +461,153 @@ out_err:
 	disconnect(conn);
 }
 
+static void put_tag(struct upgrade_rec_t *rec, int type, const struct pppoe_tag *tag)
+{
+	if (tag)
+		upgrade_put(rec, type, tag, sizeof(*tag) + ntohs(tag->tag_len));
+}
+
+static const struct pppoe_tag *get_tag(struct upgrade_rec_t *rec, int type)
+{
+	const struct pppoe_tag *tag;
+	int len;
+
+	tag = upgrade_get(rec, type, &len);
+	if (!tag || len < sizeof(*tag) || len != sizeof(*tag) + ntohs(tag->tag_len))
+		return NULL;
+
+	return tag;
+}
+
+static int pppoe_upgrade(struct ppp_t *ppp)
+{
+	struct pppoe_conn_t *conn = container_of(ppp, typeof(*conn), ppp);
+	struct upgrade_rec_t *rec;
+	int r = -1;
+
+	rec = upgrade_rec_alloc("pppoe");
+	if (!rec)
+		return -1;
+
+	upgrade_put_str(rec, UPG_PPPOE_IFNAME, conn->serv->ifname);
+	upgrade_put(rec, UPG_PPPOE_SID, &conn->sid, sizeof(conn->sid));
+	upgrade_put(rec, UPG_PPPOE_ADDR, conn->addr, ETH_ALEN);
+	upgrade_put(rec, UPG_PPPOE_COOKIE, conn->cookie, COOKIE_LENGTH);
+	put_tag(rec, UPG_PPPOE_SERVICE_NAME, conn->service_name);
+	put_tag(rec, UPG_PPPOE_HOST_UNIQ, conn->host_uniq);
+	put_tag(rec, UPG_PPPOE_RELAY_SID, conn->relay_sid);
+	put_tag(rec, UPG_PPPOE_TR101, conn->tr101);
+
+	if (!ppp_upgrade_save(ppp, rec) && !upgrade_send(rec))
+		r = 0;
+
+	upgrade_rec_free(rec);
+
+	if (r)
+		return -1;
+
+	/* the new process owns the session now, don't answer PADT for it */
+	pthread_mutex_lock(&conn->serv->tab->lock);
+	conn->serv->tab->conn[conn->sid] = NULL;
+	pthread_mutex_unlock(&conn->serv->tab->lock);
+
+	dpado_check_prev(__sync_fetch_and_sub(&stat_active, 1));
+	conn->ppp_started = 0;
+
+	ppp_upgrade_detach(ppp);
+
+	return 0;
+}
+
+static void pppoe_upgrade_resume(struct pppoe_conn_t *conn)
+{
+	struct upgrade_rec_t *rec = conn->upgrade_rec;
+
+	conn->upgrade_rec = NULL;
+
+	if (ppp_upgrade_restore(&conn->ppp, rec)) {
+		upgrade_rec_close(rec);
+		upgrade_rec_free(rec);
+		disconnect(conn);
+		return;
+	}
+
+	upgrade_rec_free(rec);
+
+#ifdef RADIUS
+	if (conn->tr101 && triton_module_loaded("radius")) {
+		conn->radius.send_access_request = pppoe_rad_send_access_request;
+		conn->radius.send_accounting_request = pppoe_rad_send_accounting_request;
+		rad_register_plugin(&conn->ppp, &conn->radius);
+	}
+#endif
+
+	conn->ppp_started = 1;
+
+	dpado_check_next(__sync_add_and_fetch(&stat_active, 1));
+}
+
+static void pppoe_upgrade_restore(struct upgrade_rec_t *rec)
+{
+	struct pppoe_serv_t *serv;
+	struct pppoe_conn_t *conn = NULL;
+	const struct pppoe_tag *service_name;
+	uint8_t addr[ETH_ALEN];
+	uint8_t cookie[COOKIE_LENGTH];
+	uint16_t sid;
+	char *ifname;
+
+	ifname = upgrade_get_str(rec, UPG_PPPOE_IFNAME);
+	service_name = get_tag(rec, UPG_PPPOE_SERVICE_NAME);
+
+	if (!ifname || !service_name ||
+			upgrade_get_val(rec, UPG_PPPOE_SID, &sid, sizeof(sid)) ||
+			upgrade_get_val(rec, UPG_PPPOE_ADDR, addr, ETH_ALEN) ||
+			upgrade_get_val(rec, UPG_PPPOE_COOKIE, cookie, COOKIE_LENGTH)) {
+		log_error("pppoe: upgrade: malformed session record\n");
+		goto out_err;
+	}
+
+	pthread_rwlock_rdlock(&serv_lock);
+	list_for_each_entry(serv, &serv_list, entry) {
+		if (strcmp(serv->ifname, ifname) || serv->stopping)
+			continue;
+		conn = allocate_channel(serv, addr, get_tag(rec, UPG_PPPOE_HOST_UNIQ), get_tag(rec, UPG_PPPOE_RELAY_SID),
+			service_name, get_tag(rec, UPG_PPPOE_TR101), cookie, sid);
+		break;
+	}
+	pthread_rwlock_unlock(&serv_lock);
+
+	if (!conn) {
+		log_error("pppoe: upgrade: failed to restore session %i on %s\n", sid, ifname);
+		goto out_err;
+	}
+
+	_free(ifname);
+
+	conn->upgrade_rec = rec;
+	triton_context_call(&conn->ctx, (triton_event_func)pppoe_upgrade_resume, conn);
+
+	return;
+
+out_err:
+	if (ifname)
+		_free(ifname);
+	upgrade_rec_close(rec);
+	upgrade_rec_free(rec);
+}
+
+static struct upgrade_handler_t upgrade_hnd = {
+	.name = "pppoe",
+	.restore = pppoe_upgrade_restore,
+};
+
 static struct pppoe_conn_t *find_channel(struct pppoe_serv_t *serv, const uint8_t *cookie)
 {
 	struct pppoe_conn_t *conn;
 
-	list_for_each_entry(conn, &serv->conn_list, entry)
-		if (!memcmp(conn->cookie, cookie, COOKIE_LENGTH))
+	for (conn = serv->tab->cookie_hash[cookie_hash(cookie)]; conn; conn = conn->cookie_next)
+		if (conn->serv == serv && !memcmp(conn->cookie, cookie, COOKIE_LENGTH))
 			return conn;
 
 	return NULL;
@@ -478,7 +717,19 @@ static void print_packet(uint8_t *pack)
 	log_info2("]\n");
 }
 
-static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
+/* check_cookie_des accepts only keys with odd parity which are not weak */
+static int des_random_key(DES_cblock *key)
+{
+	do {
+		if (u_randbuf(key, sizeof(*key)))
+			return -1;
+		DES_set_odd_parity(key);
+	} while (DES_is_weak_key((const_DES_cblock *)key));
+
+	return 0;
+}
+
+static void generate_cookie_des(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
 {
 	MD5_CTX ctx;
 	DES_cblock key;
@@ -489,7 +740,7 @@ static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8
 		uint8_t raw[24];
 	} u1, u2;
 
-	DES_random_key(&key);
+	des_random_key(&key);
 	DES_set_key(&key, &ks);
 
 	MD5_Init(&ctx);
@@ -509,7 +760,7 @@ static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8
 	memcpy(cookie, u1.raw, 24);
 }
 
-static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+static int check_cookie_des(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
 {
 	MD5_CTX ctx;
 	DES_key_schedule ks;	
@@ -540,6 +791,156 @@ static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uin
 	return memcmp(u1.raw, u2.raw, 16);
 }
 
+/*
+ * SipHash-2-4 cookie: 12 bytes nonce, 4 bytes timestamp (monotonic
+ * seconds), 8 bytes tag over nonce, timestamp, AC and client addresses.
+ * The key is replaced every cookie-timeout seconds and the previous one
+ * is kept, so a cookie is accepted for cookie-timeout seconds.
+ */
+#define SIP_ROUND \
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);
+
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t siphash(uint64_t k0, uint64_t k1, const uint8_t *data, int len)
+{
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t m, b = (uint64_t)len << 56;
+	int i;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		m = get_le64(data);
+		v3 ^= m;
+		SIP_ROUND;
+		SIP_ROUND;
+		v0 ^= m;
+	}
+
+	for (i = 0; i < len; i++)
+		b |= (uint64_t)data[i] << (i * 8);
+
+	v3 ^= b;
+	SIP_ROUND;
+	SIP_ROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	for (i = 0; i < 4; i++) {
+		SIP_ROUND;
+	}
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t cookie_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int get_cookie_key(uint32_t epoch, int create, uint64_t *k)
+{
+	struct cookie_key_t *key = &cookie_keys[epoch & 1];
+	uint64_t buf[2];
+	int r = 0;
+
+	spin_lock(&cookie_key_lock);
+	if (key->epoch != epoch) {
+		if (!create || u_randbuf(buf, sizeof(buf)))
+			r = -1;
+		else {
+			key->epoch = epoch;
+			key->k0 = buf[0];
+			key->k1 = buf[1];
+		}
+	}
+	if (!r) {
+		k[0] = key->k0;
+		k[1] = key->k1;
+	}
+	spin_unlock(&cookie_key_lock);
+
+	return r;
+}
+
+static uint64_t cookie_tag(const uint64_t *k, struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+{
+	uint8_t buf[16 + 2 * ETH_ALEN];
+
+	memcpy(buf, cookie, 16);
+	memcpy(buf + 16, serv->hwaddr, ETH_ALEN);
+	memcpy(buf + 16 + ETH_ALEN, src, ETH_ALEN);
+
+	return siphash(k[0], k[1], buf, sizeof(buf));
+}
+
+static void generate_cookie_siphash(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
+{
+	uint32_t t = cookie_time();
+	uint64_t k[2], tag;
+	int timeout = conf_cookie_timeout;
+
+	if (get_cookie_key(t / timeout + 1, 1, k)) {
+		memset(cookie, 0, COOKIE_LENGTH);
+		return;
+	}
+
+	u_randbuf(cookie, 12);
+	*(uint32_t *)(cookie + 12) = htonl(t);
+
+	tag = cookie_tag(k, serv, src, cookie);
+	memcpy(cookie + 16, &tag, 8);
+}
+
+static int check_cookie_siphash(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+{
+	uint32_t t = cookie_time();
+	uint32_t ts = ntohl(*(uint32_t *)(cookie + 12));
+	uint64_t k[2], tag;
+	int timeout = conf_cookie_timeout;
+
+	if (ts > t || t - ts > (uint32_t)timeout)
+		return -1;
+
+	if (get_cookie_key(ts / timeout + 1, 0, k))
+		return -1;
+
+	tag = cookie_tag(k, serv, src, cookie);
+
+	return memcmp(cookie + 16, &tag, 8);
+}
+
+static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
+{
+	if (conf_cookie == COOKIE_SIPHASH)
+		generate_cookie_siphash(serv, src, cookie);
+	else
+		generate_cookie_des(serv, src, cookie);
+}
+
+static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+{
+	if (conf_cookie == COOKIE_SIPHASH)
+		return check_cookie_siphash(serv, src, cookie);
+
+	return check_cookie_des(serv, src, cookie);
+}
+
 static void setup_header(uint8_t *pack, const uint8_t *src, const uint8_t *dst, int code, uint16_t sid)
 {
 	struct ethhdr *ethhdr = (struct ethhdr *)pack;
@@ -578,13 +979,20 @@ static void add_tag2(uint8_t *pack, const struct pppoe_tag *t)
 	hdr->length = htons(ntohs(hdr->length) + sizeof(*tag) + ntohs(t->tag_len));
 }
 
-static void pppoe_send(int fd, const uint8_t *pack)
+static void pppoe_send(int fd, int ifindex, const uint8_t *pack)
 {
 	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+	struct sockaddr_ll sa;
 	int n, s;
 
+	/* the shared socket is not bound, so the interface is always given */
+	memset(&sa, 0, sizeof(sa));
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_PPP_DISC);
+	sa.sll_ifindex = ifindex;
+
 	s = ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length);
-	n = write(fd, pack, s);
+	n = sendto(fd, pack, s, 0, (struct sockaddr *)&sa, sizeof(sa));
 	if (n < 0 )
 		log_error("pppoe: write: %s\n", strerror(errno));
 	else if (n != s) {
@@ -592,7 +1000,70 @@ static void pppoe_send(int fd, const uint8_t *pack)
 	}
 }
 
-static void pppoe_send_PADO(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name)
+/* frames from the shard context are queued and sent by pppoe_flush */
+static void pppoe_flush(struct pppoe_shard_t *sh)
+{
+	struct pppoe_txq_t *q = sh->txq;
+	int i, n, h;
+
+	if (!q || !q->cnt)
+		return;
+
+	for (h = 0, n = q->cnt; n > 1 && h < TX_HIST_SIZE - 1; n >>= 1)
+		h++;
+	__sync_add_and_fetch(&stat_tx_batch[h], 1);
+
+	for (i = 0; i < q->cnt; i += n) {
+		n = sendmmsg(sh->hnd.fd, q->msg + i, q->cnt - i, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			log_error("pppoe: sendmmsg: %s\n", strerror(errno));
+			/* skip the frame which failed */
+			n = 1;
+		}
+	}
+
+	q->cnt = 0;
+}
+
+static void pppoe_queue(struct pppoe_shard_t *sh, int ifindex, const uint8_t *pack)
+{
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+	struct pppoe_txq_t *q = sh->txq;
+	int s;
+
+	if (!q) {
+		q = sh->txq = _malloc(sizeof(*q));
+		if (!q) {
+			pppoe_send(sh->hnd.fd, ifindex, pack);
+			return;
+		}
+		memset(q, 0, sizeof(*q));
+	}
+
+	s = ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length);
+	memcpy(q->buf[q->cnt], pack, s);
+
+	q->iov[q->cnt].iov_base = q->buf[q->cnt];
+	q->iov[q->cnt].iov_len = s;
+
+	q->addr[q->cnt].sll_family = AF_PACKET;
+	q->addr[q->cnt].sll_protocol = htons(ETH_P_PPP_DISC);
+	q->addr[q->cnt].sll_ifindex = ifindex;
+
+	q->msg[q->cnt].msg_hdr.msg_name = &q->addr[q->cnt];
+	q->msg[q->cnt].msg_hdr.msg_namelen = sizeof(q->addr[q->cnt]);
+	q->msg[q->cnt].msg_hdr.msg_iov = &q->iov[q->cnt];
+	q->msg[q->cnt].msg_hdr.msg_iovlen = 1;
+
+	if (++q->cnt == TX_BATCH)
+		pppoe_flush(sh);
+}
+
+static void pppoe_send_PADO(struct pppoe_shard_t *sh, struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name)
 {
 	uint8_t pack[ETHER_MAX_LEN];
 	uint8_t cookie[COOKIE_LENGTH];
@@ -630,10 +1101,10 @@ static void pppoe_send_PADO(struct pppoe_serv_t *serv, const uint8_t *addr, cons
 	}
 
 	__sync_add_and_fetch(&stat_PADO_sent, 1);
-	pppoe_send(serv->hnd.fd, pack);
+	pppoe_queue(sh, serv->ifindex, pack);
 }
 
-static void pppoe_send_err(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, int code, int tag_type)
+static void pppoe_send_err(struct pppoe_shard_t *sh, struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, int code, int tag_type)
 {
 	uint8_t pack[ETHER_MAX_LEN];
 
@@ -653,10 +1124,10 @@ static void pppoe_send_err(struct pppoe_serv_t *serv, const uint8_t *addr, const
 		print_packet(pack);
 	}
 
-	pppoe_send(serv->hnd.fd, pack);
+	pppoe_queue(sh, serv->ifindex, pack);
 }
 
-static void pppoe_send_PADS(struct pppoe_conn_t *conn)
+static void pppoe_send_PADS(struct pppoe_shard_t *sh, struct pppoe_conn_t *conn)
 {
 	uint8_t pack[ETHER_MAX_LEN];
 
@@ -678,7 +1149,7 @@ static void pppoe_send_PADS(struct pppoe_conn_t *conn)
 	}
 
 	__sync_add_and_fetch(&stat_PADS_sent, 1);
-	pppoe_send(conn->disc_sock, pack);
+	pppoe_queue(sh, conn->serv->ifindex, pack);
 }
 
 static void pppoe_send_PADT(struct pppoe_conn_t *conn)
@@ -702,12 +1173,33 @@ static void pppoe_send_PADT(struct pppoe_conn_t *conn)
 		print_packet(pack);
 	}
 
-	pppoe_send(conn->disc_sock, pack);
+	pppoe_send(conn->disc_sock, conn->serv->ifindex, pack);
+}
+
+static inline unsigned int hwaddr_hash(const uint8_t *addr)
+{
+	return (addr[3] ^ (addr[4] << 3) ^ (addr[5] << 6) ^ addr[5]) & (PADI_HASH_SIZE - 1);
+}
+
+static int64_t mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 static void free_delayed_pado(struct delayed_pado_t *pado)
 {
-	triton_timer_del(&pado->timer);
+	struct delayed_pado_t **p = &pado->shard->pado_hash[hwaddr_hash(pado->addr)];
+
+	for (; *p; p = &(*p)->next) {
+		if (*p == pado) {
+			*p = pado->next;
+			break;
+		}
+	}
 
 	__sync_sub_and_fetch(&stat_delayed_pado, 1);
 	list_del(&pado->entry);
@@ -722,67 +1214,244 @@ static void free_delayed_pado(struct delayed_pado_t *pado)
 	mempool_free(pado);
 }
 
-static void pado_timer(struct triton_timer_t *t)
+static void pado_timer_arm(struct pppoe_shard_t *sh, int64_t now)
 {
-	struct delayed_pado_t *pado = container_of(t, typeof(*pado), timer);
+	struct delayed_pado_t *pado = list_entry(sh->pado_list.next, typeof(*pado), entry);
+	int64_t t = pado->due - now;
 
-	if (!ppp_shutdown)
-		pppoe_send_PADO(pado->serv, pado->addr, pado->host_uniq, pado->relay_sid, pado->service_name);
+	/* zero expire_tv would disarm the timer */
+	if (t <= 0) {
+		sh->pado_timer.expire_tv.tv_sec = 0;
+		sh->pado_timer.expire_tv.tv_usec = 1;
+	} else {
+		sh->pado_timer.expire_tv.tv_sec = t / 1000;
+		sh->pado_timer.expire_tv.tv_usec = (t % 1000) * 1000;
+	}
+	sh->pado_timer.period = 0;
 
-	free_delayed_pado(pado);
+	if (sh->pado_timer.tpd)
+		triton_timer_mod(&sh->pado_timer, 0);
+	else
+		triton_timer_add(&sh->ctx, &sh->pado_timer, 0);
 }
 
-static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
+static void pado_timer(struct triton_timer_t *t)
 {
-	struct padi_t *padi;
-	struct timespec ts;
+	struct pppoe_shard_t *sh = container_of(t, typeof(*sh), pado_timer);
+	struct delayed_pado_t *pado;
+	int64_t now = mono_ms();
 
-	if (serv->padi_limit == 0)
-		goto connlimit_check;
+	while (!list_empty(&sh->pado_list)) {
+		pado = list_entry(sh->pado_list.next, typeof(*pado), entry);
+		if (pado->due > now)
+			break;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (!ppp_shutdown && !ppp_admission_check() && !(pado->cluster && cluster_claimed(pado->addr)))
+			pppoe_send_PADO(sh, pado->serv, pado->addr, pado->host_uniq, pado->relay_sid, pado->service_name);
 
-	while (!list_empty(&serv->padi_list)) {
-		padi = list_entry(serv->padi_list.next, typeof(*padi), entry);
-		if ((ts.tv_sec - padi->ts.tv_sec) * 1000 + (ts.tv_nsec - padi->ts.tv_nsec) / 1000000 > 1000) {
-			list_del(&padi->entry);
-			mempool_free(padi);
-			serv->padi_cnt--;
-			__sync_sub_and_fetch(&total_padi_cnt, 1);
-		} else
-			break;
-	}
-	
-	if (serv->padi_cnt == serv->padi_limit)
-		return -1;
-	
-	if (conf_padi_limit && total_padi_cnt >= conf_padi_limit)
-		return -1;
-	
-	list_for_each_entry(padi, &serv->padi_list, entry) {
-		if (memcmp(padi->addr, addr, ETH_ALEN) == 0)
-			return -1;
+		free_delayed_pado(pado);
 	}
 
-	padi = mempool_alloc(padi_pool);
-	if (!padi)
-		return -1;
-	
-	padi->ts = ts;
-	memcpy(padi->addr, addr, ETH_ALEN);
-	list_add_tail(&padi->entry, &serv->padi_list);
-	serv->padi_cnt++;
+	pppoe_flush(sh);
 
-	__sync_add_and_fetch(&total_padi_cnt, 1);
+	if (!list_empty(&sh->pado_list))
+		pado_timer_arm(sh, now);
+}
 
-connlimit_check:
-	if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_mac(addr)))
-		return -1;
+static int tag_equal(const struct pppoe_tag *t1, const struct pppoe_tag *t2)
+{
+	if (!t1 || !t2)
+		return t1 == t2;
+
+	return t1->tag_len == t2->tag_len && !memcmp(t1->tag_data, t2->tag_data, ntohs(t1->tag_len));
+}
+
+/* a PADO is already pending for this client (MAC and Host-Uniq) */
+static struct delayed_pado_t *find_delayed_pado(struct pppoe_shard_t *sh, const uint8_t *addr, const struct pppoe_tag *host_uniq)
+{
+	struct delayed_pado_t *pado;
+
+	if (!sh->pado_hash)
+		return NULL;
+
+	for (pado = sh->pado_hash[hwaddr_hash(addr)]; pado; pado = pado->next) {
+		if (!memcmp(pado->addr, addr, ETH_ALEN) && tag_equal(pado->host_uniq, host_uniq))
+			return pado;
+	}
+
+	return NULL;
+}
+
+static void queue_delayed_pado(struct pppoe_shard_t *sh, struct delayed_pado_t *pado, int delay)
+{
+	struct delayed_pado_t *p;
+	struct list_head *pos;
+	int64_t now = mono_ms();
+
+	pado->due = now + delay;
+
+	/* delay changes rarely, so the place is almost always the tail */
+	for (pos = sh->pado_list.prev; pos != &sh->pado_list; pos = pos->prev) {
+		p = list_entry(pos, typeof(*p), entry);
+		if (p->due <= pado->due)
+			break;
+	}
+	list_add(&pado->entry, pos);
+
+	pado->next = sh->pado_hash[hwaddr_hash(pado->addr)];
+	sh->pado_hash[hwaddr_hash(pado->addr)] = pado;
+
+	__sync_add_and_fetch(&stat_delayed_pado, 1);
+
+	if (sh->pado_list.next == &pado->entry)
+		pado_timer_arm(sh, now);
+}
+
+static void padi_unhash(struct pppoe_serv_t *serv, struct padi_t *padi)
+{
+	struct padi_t **p = &serv->padi_hash[hwaddr_hash(padi->addr)];
+
+	for (; *p; p = &(*p)->next) {
+		if (*p == padi) {
+			*p = padi->next;
+			break;
+		}
+	}
+}
+
+/* entries added in second s are older than 1 second once sec >= s + 2 */
+static void padi_expire(struct pppoe_serv_t *serv, time_t sec)
+{
+	struct list_head *slot;
+	struct padi_t *padi;
+	int i;
+
+	for (i = 0; i < PADI_RING_SIZE && serv->padi_ring_sec + 2 <= sec; i++) {
+		slot = &serv->padi_ring[serv->padi_ring_sec & (PADI_RING_SIZE - 1)];
+		while (!list_empty(slot)) {
+			padi = list_entry(slot->next, typeof(*padi), entry);
+			list_del(&padi->entry);
+			padi_unhash(serv, padi);
+			mempool_free(padi);
+		}
+		serv->padi_ring_sec++;
+	}
+
+	if (serv->padi_ring_sec + 2 <= sec)
+		serv->padi_ring_sec = sec - 1;
+}
+
+static int padi_bucket_refill(struct padi_bucket_t *b, int rate, int64_t now)
+{
+	int64_t max = (int64_t)rate * 1000;
+
+	b->tokens += (now - b->ts) * rate;
+	b->ts = now;
+	if (b->tokens > max)
+		b->tokens = max;
+
+	return b->tokens >= 1000;
+}
+
+static int check_global_limit(int64_t now)
+{
+	int r = 0;
+
+	if (!conf_padi_limit)
+		return 0;
+
+	spin_lock(&padi_bucket_lock);
+	if (padi_bucket_refill(&padi_bucket, conf_padi_limit, now))
+		padi_bucket.tokens -= 1000;
+	else
+		r = -1;
+	spin_unlock(&padi_bucket_lock);
+
+	return r;
+}
+
+/*
+ * Each MAC is answered at most once per second, an interface and all
+ * interfaces together are limited by token buckets of padi-limit
+ * packets per second. Returns zero or PADI_DROP_* reason.
+ */
+static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
+{
+	struct padi_t *padi;
+	struct timespec ts;
+	int64_t now;
+	int r;
+
+	if (ppp_admission_check())
+		return PADI_DROP_ADMISSION;
+
+	if (serv->padi_limit == 0)
+		goto connlimit_check;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	spin_lock(&serv->padi_lock);
+	if (!serv->padi_hash) {
+		serv->padi_hash = _malloc(PADI_HASH_SIZE * sizeof(*serv->padi_hash));
+		if (!serv->padi_hash) {
+			r = PADI_DROP_NOMEM;
+			goto out_drop;
+		}
+		memset(serv->padi_hash, 0, PADI_HASH_SIZE * sizeof(*serv->padi_hash));
+	}
+
+	padi_expire(serv, ts.tv_sec);
+
+	for (padi = serv->padi_hash[hwaddr_hash(addr)]; padi; padi = padi->next) {
+		if (memcmp(padi->addr, addr, ETH_ALEN) == 0)
+			break;
+	}
+
+	if (padi && now - padi->ts < 1000) {
+		r = PADI_DROP_MAC;
+		goto out_drop;
+	}
+
+	if (!padi_bucket_refill(&serv->padi_bucket, serv->padi_limit, now)) {
+		r = PADI_DROP_IFACE;
+		goto out_drop;
+	}
+
+	if (check_global_limit(now)) {
+		r = PADI_DROP_GLOBAL;
+		goto out_drop;
+	}
+
+	if (!padi) {
+		padi = mempool_alloc(padi_pool);
+		if (!padi) {
+			r = PADI_DROP_NOMEM;
+			goto out_drop;
+		}
+		memcpy(padi->addr, addr, ETH_ALEN);
+		padi->next = serv->padi_hash[hwaddr_hash(addr)];
+		serv->padi_hash[hwaddr_hash(addr)] = padi;
+	} else
+		list_del(&padi->entry);
+
+	padi->ts = now;
+	list_add_tail(&padi->entry, &serv->padi_ring[ts.tv_sec & (PADI_RING_SIZE - 1)]);
+	serv->padi_bucket.tokens -= 1000;
+	spin_unlock(&serv->padi_lock);
+
+connlimit_check:
+	if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_mac(addr)))
+		return PADI_DROP_CONNLIMIT;
 
 	return 0;
+
+out_drop:
+	spin_unlock(&serv->padi_lock);
+	return r;
 }
 
-static void pppoe_recv_PADI(struct pppoe_serv_t *serv, uint8_t *pack, int size)
+static void pppoe_recv_PADI(struct pppoe_shard_t *sh, struct pppoe_serv_t *serv, uint8_t *pack, int size)
 {
 	struct ethhdr *ethhdr = (struct ethhdr *)pack;
 	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
@@ -790,19 +1459,40 @@ static void pppoe_recv_PADI(struct pppoe_serv_t *serv, uint8_t *pack, int size)
 	struct pppoe_tag *host_uniq_tag = NULL;
 	struct pppoe_tag *relay_sid_tag = NULL;
 	struct pppoe_tag *service_name_tag = NULL;
-	int n, i, service_match = 0;
+	int n, i, r, service_match = 0;
 	struct delayed_pado_t *pado;
 	char **service_names = NULL;
 	struct timespec ts;
-	int len;
+	int len, delay, cluster;
 
 	__sync_add_and_fetch(&stat_PADI_recv, 1);
 
 	if (ppp_shutdown || pado_delay == -1)
 		return;
 
-	if (check_padi_limit(serv, ethhdr->h_source)) {
+	r = check_padi_limit(serv, ethhdr->h_source);
+	if (r) {
 		__sync_add_and_fetch(&stat_PADI_drop, 1);
+		switch (r) {
+			case PADI_DROP_ADMISSION:
+				__sync_add_and_fetch(&stat_PADI_drop_admission, 1);
+				break;
+			case PADI_DROP_MAC:
+				__sync_add_and_fetch(&stat_PADI_drop_mac, 1);
+				break;
+			case PADI_DROP_IFACE:
+				__sync_add_and_fetch(&stat_PADI_drop_iface, 1);
+				break;
+			case PADI_DROP_GLOBAL:
+				__sync_add_and_fetch(&stat_PADI_drop_global, 1);
+				break;
+			case PADI_DROP_CONNLIMIT:
+				__sync_add_and_fetch(&stat_PADI_drop_connlimit, 1);
+				break;
+			case PADI_DROP_NOMEM:
+				__sync_add_and_fetch(&stat_PADI_drop_nomem, 1);
+				break;
+		}
 		if (conf_verbose) {
 			clock_gettime(CLOCK_MONOTONIC, &ts);
 			if (ts.tv_sec - 60 >= serv->last_padi_limit_warn) {
@@ -872,18 +1562,34 @@ static void pppoe_recv_PADI(struct pppoe_serv_t *serv, uint8_t *pack, int size)
 		return;
 	}
 
-	if (pado_delay) {
-		list_for_each_entry(pado, &serv->pado_list, entry) {
-			if (memcmp(pado->addr, ethhdr->h_source, ETH_ALEN))
-				continue;
+	/* not designated by the cluster, give way to the node which is */
+	delay = pado_delay;
+	cluster = cluster_padi(ethhdr->h_source);
+	if (cluster > 0)
+		delay += conf_cluster_delay;
+
+	if (delay) {
+		if (find_delayed_pado(sh, ethhdr->h_source, host_uniq_tag)) {
 			if (conf_verbose)
 				log_warn("pppoe: discarding PADI packet (already queued)\n");
 			return;
 		}
+
+		if (!sh->pado_hash) {
+			sh->pado_hash = _malloc(PADI_HASH_SIZE * sizeof(*sh->pado_hash));
+			if (!sh->pado_hash)
+				return;
+			memset(sh->pado_hash, 0, PADI_HASH_SIZE * sizeof(*sh->pado_hash));
+		}
+
 		pado = mempool_alloc(pado_pool);
+		if (!pado)
+			return;
 		memset(pado, 0, sizeof(*pado));
+		pado->shard = sh;
 		pado->serv = serv;
 		memcpy(pado->addr, ethhdr->h_source, ETH_ALEN);
+		pado->cluster = cluster > 0;
 
 		if (host_uniq_tag) {
 			pado->host_uniq = _malloc(sizeof(*host_uniq_tag) + ntohs(host_uniq_tag->tag_len));
@@ -900,18 +1606,12 @@ static void pppoe_recv_PADI(struct pppoe_serv_t *serv, uint8_t *pack, int size)
 			memcpy(pado->service_name, service_name_tag, sizeof(*service_name_tag) + ntohs(service_name_tag->tag_len));
 		}
 
-		pado->timer.expire = pado_timer;
-		pado->timer.period = pado_delay;
-
-		triton_timer_add(&serv->ctx, &pado->timer, 0);
-
-		list_add_tail(&pado->entry, &serv->pado_list);
-		__sync_add_and_fetch(&stat_delayed_pado, 1);
+		queue_delayed_pado(sh, pado, delay);
 	} else
-		pppoe_send_PADO(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag);
+		pppoe_send_PADO(sh, serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag);
 }
 
-static void pppoe_recv_PADR(struct pppoe_serv_t *serv, uint8_t *pack, int size)
+static void pppoe_recv_PADR(struct pppoe_shard_t *sh, struct pppoe_serv_t *serv, uint8_t *pack, int size)
 {
 	struct ethhdr *ethhdr = (struct ethhdr *)pack;
 	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
@@ -1027,26 +1727,32 @@ static void pppoe_recv_PADR(struct pppoe_serv_t *serv, uint8_t *pack, int size)
 	if (!service_match) {
 		if (conf_verbose)
 			log_warn("pppoe: Service-Name mismatch\n");
-		pppoe_send_err(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_SERVICE_NAME_ERROR);
+		pppoe_send_err(sh, serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_SERVICE_NAME_ERROR);
 		return;
 	}
 
-	pthread_mutex_lock(&serv->lock);
+	pthread_mutex_lock(&serv->tab->lock);
 	conn = find_channel(serv, (uint8_t *)ac_cookie_tag->tag_data);
 	if (conn && !conn->ppp.username) {
 		__sync_add_and_fetch(&stat_PADR_dup_recv, 1);
-		pppoe_send_PADS(conn);
+		pppoe_send_PADS(sh, conn);
 	}
-	pthread_mutex_unlock(&serv->lock);
+	pthread_mutex_unlock(&serv->tab->lock);
 
 	if (conn)
 		return;
 
-	conn = allocate_channel(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag, tr101_tag, (uint8_t *)ac_cookie_tag->tag_data);
+	if (ppp_admission_acquire()) {
+		if (conf_verbose)
+			log_warn("pppoe: discard PADR packet (admission limit reached)\n");
+		return;
+	}
+
+	conn = allocate_channel(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag, tr101_tag, (uint8_t *)ac_cookie_tag->tag_data, 0);
 	if (!conn)
-		pppoe_send_err(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_AC_SYSTEM_ERROR);
+		pppoe_send_err(sh, serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_AC_SYSTEM_ERROR);
 	else {
-		pppoe_send_PADS(conn);
+		pppoe_send_PADS(sh, conn);
 		triton_context_call(&conn->ctx, (triton_event_func)connect_channel, conn);
 	}
 }
@@ -1068,101 +1774,467 @@ static void pppoe_recv_PADT(struct pppoe_serv_t *serv, uint8_t *pack)
 		print_packet(pack);
 	}
 
-	pthread_mutex_lock(&serv->lock);
-	conn = serv->conn[ntohs(hdr->sid)];
-	if (conn && !memcmp(conn->addr, ethhdr->h_source, ETH_ALEN))
+	pthread_mutex_lock(&serv->tab->lock);
+	conn = serv->tab->conn[ntohs(hdr->sid)];
+	if (conn && conn->serv == serv && !memcmp(conn->addr, ethhdr->h_source, ETH_ALEN))
 		triton_context_call(&conn->ctx, (void (*)(void *))disconnect, conn);
-	pthread_mutex_unlock(&serv->lock);
+	pthread_mutex_unlock(&serv->tab->lock);
 }
 
-static int pppoe_serv_read(struct triton_md_handler_t *h)
+/*
+ * rx ring geometry, the kernel hands a block over when it is full or
+ * RING_BLOCK_TMO ms after the first frame landed in it
+ */
+#define RING_BLOCK_SIZE (1 << 16)
+#define RING_BLOCK_NR 8
+#define RING_FRAME_SIZE 2048
+#define RING_BLOCK_TMO 4
+
+static void pppoe_serv_process(struct pppoe_shard_t *sh, struct pppoe_serv_t *serv, uint8_t *pack, int n)
 {
-	struct pppoe_serv_t *serv = container_of(h, typeof(*serv), hnd);
-	uint8_t pack[ETHER_MAX_LEN];
 	struct ethhdr *ethhdr = (struct ethhdr *)pack;
 	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+
+	if (n < ETH_HLEN + sizeof(*hdr)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received (%i)\n", n);
+		return;
+	}
+
+	if (mac_filter_check(ethhdr->h_source))
+		return;
+
+	if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
+		return;
+
+	if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is broadcast)\n");
+		return;
+	}
+
+	if ((ethhdr->h_source[0] & 1) != 0) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is not unicast)\n");
+		return;
+	}
+
+	if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received\n");
+		return;
+	}
+
+	if (hdr->ver != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
+		return;
+	}
+	
+	if (hdr->type != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
+	}
+
+	switch (hdr->code) {
+		case CODE_PADI:
+			pppoe_recv_PADI(sh, serv, pack, n);
+			break;
+		case CODE_PADR:
+			pppoe_recv_PADR(sh, serv, pack, n);
+			break;
+		case CODE_PADT:
+			pppoe_recv_PADT(serv, pack);
+			break;
+	}
+}
+
+/* frames of the shared socket are matched to the interface by ifindex */
+static void pppoe_shard_process(struct pppoe_shard_t *sh, int ifindex, uint8_t *pack, int n)
+{
+	struct pppoe_serv_t *serv;
+
+	if (sh->serv) {
+		pppoe_serv_process(sh, sh->serv, pack, n);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&serv_lock);
+	if (ifindex > 0 && ifindex < serv_tab_size) {
+		serv = serv_tab[ifindex];
+		if (serv && serv->shared && !serv->stopping)
+			pppoe_serv_process(sh, serv, pack, n);
+	}
+	pthread_rwlock_unlock(&serv_lock);
+}
+
+static int pppoe_serv_read(struct triton_md_handler_t *h)
+{
+	struct pppoe_shard_t *sh = container_of(h, typeof(*sh), hnd);
+	uint8_t pack[ETHER_MAX_LEN];
+	struct sockaddr_ll sa;
+	socklen_t len;
 	int n;
 
 	while (1) {
-		n = read(h->fd, pack, sizeof(pack));
+		len = sizeof(sa);
+		n = recvfrom(h->fd, pack, sizeof(pack), 0, (struct sockaddr *)&sa, &len);
 		if (n < 0) {
 			if (errno == EAGAIN)
 				break;
 			log_error("pppoe: read: %s\n", strerror(errno));
-			return 0;
+			break;
 		}
 
-		if (n < ETH_HLEN + sizeof(*hdr)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received (%i)\n", n);
-			continue;
-		}
+		pppoe_shard_process(sh, sa.sll_ifindex, pack, n);
+	}
 
-		if (mac_filter_check(ethhdr->h_source))
-			continue;
+	pppoe_flush(sh);
 
-		if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
-			continue;
+	return 0;
+}
 
-		if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is broadcast)\n");
-			continue;
-		}
+static int pppoe_serv_read_ring(struct triton_md_handler_t *h)
+{
+	struct pppoe_shard_t *sh = container_of(h, typeof(*sh), hnd);
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *th;
+	struct sockaddr_ll *sa;
+	int i;
 
-		if ((ethhdr->h_source[0] & 1) != 0) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is not unicast)\n");
-			continue;
-		}
+	while (1) {
+		bd = (struct tpacket_block_desc *)(sh->ring + sh->ring_idx * RING_BLOCK_SIZE);
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+			break;
 
-		if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received\n");
-			continue;
+		__sync_synchronize();
+
+		th = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			sa = (struct sockaddr_ll *)((uint8_t *)th + TPACKET_ALIGN(sizeof(*th)));
+			pppoe_shard_process(sh, sa->sll_ifindex, (uint8_t *)th + th->tp_mac, th->tp_snaplen);
+			th = (struct tpacket3_hdr *)((uint8_t *)th + th->tp_next_offset);
 		}
 
-		if (hdr->ver != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
+		__sync_synchronize();
+
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		sh->ring_idx = (sh->ring_idx + 1) % RING_BLOCK_NR;
+	}
+
+	pppoe_flush(sh);
+
+	return 0;
+}
+
+static int setup_rx_ring(struct pppoe_shard_t *sh, const char *name)
+{
+	struct tpacket_req3 req;
+	int sock = sh->hnd.fd;
+	int ver = TPACKET_V3;
+
+	if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver))) {
+		log_error("pppoe: %s: failed to set TPACKET_V3: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_block_nr = RING_BLOCK_NR;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCK_NR;
+	req.tp_retire_blk_tov = RING_BLOCK_TMO;
+
+	if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		log_error("pppoe: %s: failed to setup rx ring: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	sh->ring = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_NR, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+	if (sh->ring == MAP_FAILED) {
+		log_error("pppoe: %s: failed to map rx ring: %s\n", name, strerror(errno));
+		sh->ring = NULL;
+		return -1;
+	}
+
+	sh->ring_idx = 0;
+
+	return 0;
+}
+
+/* ifindex 0 gives an unbound socket receiving on all interfaces */
+static int open_disc_socket(const char *name, int ifindex)
+{
+	struct sockaddr_ll sa;
+	int sock;
+	int f = 1;
+
+	sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_PPP_DISC));
+	if (sock < 0) {
+		log_error("pppoe: %s: socket: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
+
+	if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &f, sizeof(f))) {
+		log_error("pppoe: %s: setsockopt(SO_BROADCAST): %s\n", name, strerror(errno));
+		goto out_err;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_PPP_DISC);
+	sa.sll_ifindex = ifindex;
+
+	if (ifindex && bind(sock, (struct sockaddr *)&sa, sizeof(sa))) {
+		log_error("pppoe: %s: bind: %s\n", name, strerror(errno));
+		goto out_err;
+	}
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK)) {
+		log_error("pppoe: %s: failed to set nonblocking mode: %s\n", name, strerror(errno));
+		goto out_err;
+	}
+
+	return sock;
+
+out_err:
+	close(sock);
+	return -1;
+}
+
+/*
+ * Joins all shard sockets into one fanout group. Discovery frames carry no
+ * flow the kernel could hash, so the group is steered by a classic BPF
+ * program on the source address (the program sees the frame from the
+ * network header, hence SKF_LL_OFF); every frame of a client then lands on
+ * the same shard, which keeps delayed PADO and PADR handling per client
+ * in one context. Kernels without PACKET_FANOUT_CBPF fall back to
+ * PACKET_FANOUT_HASH.
+ */
+static int setup_fanout(struct pppoe_shard_t *shard, int cnt, int id, const char *name)
+{
+	struct sock_filter f[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + ETH_ALEN + 2),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, cnt),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(f) / sizeof(f[0]),
+		.filter = f,
+	};
+	int mode = PACKET_FANOUT_CBPF;
+	int i, arg;
+
+	for (i = 0; i < cnt; i++) {
+		arg = (id & 0xffff) | (mode << 16);
+		if (!setsockopt(shard[i].hnd.fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)))
+			continue;
+		if (i == 0 && mode == PACKET_FANOUT_CBPF) {
+			mode = PACKET_FANOUT_HASH;
+			i--;
 			continue;
 		}
-		
-		if (hdr->type != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
-		}
+		log_error("pppoe: %s: failed to join fanout group: %s\n", name, strerror(errno));
+		return -1;
+	}
 
-		switch (hdr->code) {
-			case CODE_PADI:
-				pppoe_recv_PADI(serv, pack, n);
-				break;
-			case CODE_PADR:
-				pppoe_recv_PADR(serv, pack, n);
-				break;
-			case CODE_PADT:
-				pppoe_recv_PADT(serv, pack);
-				break;
-		}
+	if (mode == PACKET_FANOUT_CBPF &&
+			setsockopt(shard[0].hnd.fd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog))) {
+		log_error("pppoe: %s: failed to set fanout program: %s\n", name, strerror(errno));
+		return -1;
 	}
+
 	return 0;
 }
 
-static void pppoe_serv_close(struct triton_context_t *ctx)
+/*
+ * Classic BPF prefilter for the discovery socket, it rejects in the kernel
+ * what pppoe_serv_process would drop anyway: short or truncated frames,
+ * foreign destination, multicast source, wrong version or unknown code.
+ * Small mac-filter lists are encoded too, larger ones are left to
+ * mac_filter_check.
+ */
+#define BPF_MAC_MAX 32
+#define BPF_HDR_INSNS 22
+#define BPF_MAX_INSNS (BPF_HDR_INSNS + BPF_MAC_MAX * 4 + 2)
+
+#define BPF_MAC_HI(a) ((uint32_t)(a)[0] << 24 | (uint32_t)(a)[1] << 16 | (uint32_t)(a)[2] << 8 | (a)[3])
+#define BPF_MAC_LO(a) ((uint32_t)(a)[4] << 8 | (a)[5])
+
+/* hw is NULL for the shared socket, the destination is checked in userspace then */
+static int build_filter(const uint8_t *hw, struct sock_filter *f)
 {
-	struct pppoe_serv_t *serv = container_of(ctx, typeof(*serv), ctx);
+	static const uint8_t any[ETH_ALEN];
+	uint8_t macs[BPF_MAC_MAX * ETH_ALEN];
+	int allow, cnt, len, drop, accept, i, n = 0;
 
-	triton_md_disable_handler(&serv->hnd, MD_MODE_READ | MD_MODE_WRITE);
+	cnt = mac_filter_get(macs, BPF_MAC_MAX, &allow);
+	if (cnt < 0) {
+		cnt = 0;
+		allow = 0;
+	}
 
-	serv->stopping = 1;
+	len = BPF_HDR_INSNS + cnt * 4 + 2;
 
-	pthread_mutex_lock(&serv->lock);
-	if (!serv->conn_cnt) {
-		pthread_mutex_unlock(&serv->lock);
-		pppoe_server_free(serv);
-		return;
+	/* the last two instructions: no match in the mac list, match */
+	if (allow == 1) {
+		drop = len - 2;
+		accept = len - 1;
+	} else {
+		accept = len - 2;
+		drop = len - 1;
+	}
+
+#define JDROP(i) (drop - (i) - 1)
+
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, ETH_HLEN + sizeof(struct pppoe_hdr), 0, JDROP(n)); n++;
+	f[n] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0); n++;
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + offsetof(struct pppoe_hdr, length)); n++;
+	f[n] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, ETH_HLEN + sizeof(struct pppoe_hdr)); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_X, 0, JDROP(n), 0); n++;
+
+	/* destination is either broadcast or our address */
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffffffff, 0, 2); n++;
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffff, 3, JDROP(n)); n++;
+	if (hw)
+		f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BPF_MAC_HI(hw), 0, JDROP(n));
+	else {
+		f[n] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, 2);
+		hw = any;
+	}
+	n++;
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BPF_MAC_LO(hw), 0, JDROP(n)); n++;
+
+	/* source is unicast */
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_ALEN); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, JDROP(n), 0); n++;
+
+	/* version 1, any type (it is only warned about), known code */
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN); n++;
+	f[n] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x10, 0, JDROP(n)); n++;
+	f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + offsetof(struct pppoe_hdr, code)); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, CODE_PADI, 2, 0); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, CODE_PADR, 1, 0); n++;
+	f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, CODE_PADT, 0, JDROP(n)); n++;
+
+	for (i = 0; i < cnt; i++) {
+		uint8_t *mac = macs + i * ETH_ALEN;
+
+		f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ETH_ALEN); n++;
+		f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BPF_MAC_HI(mac), 0, 2); n++;
+		f[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, ETH_ALEN + 4); n++;
+		f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BPF_MAC_LO(mac), len - n - 2, 0); n++;
+	}
+
+#undef JDROP
+
+	f[accept] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffff);
+	f[drop] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	return len;
+}
+
+static void attach_filter(struct pppoe_shard_t *shard, int cnt, const uint8_t *hw, const char *name)
+{
+	struct sock_filter f[BPF_MAX_INSNS];
+	struct sock_fprog prog;
+	int i;
+
+	prog.len = build_filter(hw, f);
+	prog.filter = f;
+
+	for (i = 0; i < cnt; i++) {
+		if (setsockopt(shard[i].hnd.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+			log_warn("pppoe: %s: failed to attach socket filter: %s\n", name, strerror(errno));
 	}
-	pthread_mutex_unlock(&serv->lock);
+}
+
+void pppoe_update_filters(void)
+{
+	struct pppoe_serv_t *serv;
+
+	pthread_rwlock_rdlock(&serv_lock);
+	list_for_each_entry(serv, &serv_list, entry) {
+		if (!serv->shared)
+			attach_filter(serv->shard, serv->shard_cnt, serv->hwaddr, serv->ifname);
+	}
+	pthread_rwlock_unlock(&serv_lock);
+
+	pthread_mutex_lock(&shared_lock);
+	if (shared_shard_cnt)
+		attach_filter(shared_shard, shared_shard_cnt, NULL, "shared socket");
+	pthread_mutex_unlock(&shared_lock);
+}
+
+static void shard_stop(struct pppoe_shard_t *sh)
+{
+	struct delayed_pado_t *pado;
+
+	sh->stopping = 1;
+	triton_md_disable_handler(&sh->hnd, MD_MODE_READ | MD_MODE_WRITE);
+
+	while (!list_empty(&sh->pado_list)) {
+		pado = list_entry(sh->pado_list.next, typeof(*pado), entry);
+		free_delayed_pado(pado);
+	}
+
+	if (sh->pado_timer.tpd)
+		triton_timer_del(&sh->pado_timer);
+}
+
+/* the shared socket goes away with the daemon only */
+static void shared_shard_close(struct pppoe_shard_t *sh)
+{
+	struct pppoe_serv_t *serv, **servs;
+	int i, n = 0;
+
+	pthread_rwlock_rdlock(&serv_lock);
+	list_for_each_entry(serv, &serv_list, entry)
+		n++;
+	servs = _malloc(sizeof(*servs) * (n + 1));
+	n = 0;
+	list_for_each_entry(serv, &serv_list, entry) {
+		if (serv->shared && !(serv->shard_left & (1ULL << sh->idx)))
+			servs[n++] = serv;
+	}
+	pthread_rwlock_unlock(&serv_lock);
+
+	for (i = 0; i < n; i++)
+		serv_shard_left(servs[i], sh->idx, 0);
+
+	_free(servs);
+
+	triton_md_unregister_handler(&sh->hnd);
+	if (sh->ring)
+		munmap(sh->ring, RING_BLOCK_SIZE * RING_BLOCK_NR);
+	if (sh->txq)
+		_free(sh->txq);
+	if (sh->pado_hash)
+		_free(sh->pado_hash);
+	close(sh->hnd.fd);
+	triton_context_unregister(&sh->ctx);
+}
+
+static void pppoe_serv_close(struct triton_context_t *ctx)
+{
+	struct pppoe_shard_t *sh = container_of(ctx, typeof(*sh), ctx);
+
+	if (sh->stopping)
+		return;
+
+	shard_stop(sh);
+
+	if (sh->serv)
+		serv_shard_left(sh->serv, sh->idx, 0);
+	else
+		shared_shard_close(sh);
 }
 
 int pppoe_add_service_name(char **list, const char *item)
@@ -1204,6 +2276,14 @@ static int parse_interface_set_option(struct pppoe_serv_t *serv, char *property,
 			sprintf(errbuf, "Invalid padi-limit value %d", serv->padi_limit);
 			return 0;
 		}
+	} else if (!strcmp(property, "rx-ring")) {
+		serv->rx_ring = !!atoi(value);
+	} else if (!strcmp(property, "fanout")) {
+		serv->fanout = atoi(value);
+		if (serv->fanout < 1 || serv->fanout > MAX_FANOUT) {
+			sprintf(errbuf, "Invalid fanout value %d", serv->fanout);
+			return 0;
+		}
 	} else if (!strcmp(property, "require-service-name") || !strcmp(property, "require-sn")) {
 		serv->require_service_name = !!atoi(value);
 	} else if (!strcmp(property, "service-name")) {
@@ -1379,52 +2459,167 @@ void pppoe_server_start(const char *opt, void *cli)
 		__pppoe_server_start(opt, opt, cli);
 }
 
+static void start_shards(struct pppoe_serv_t *serv, int sock)
+{
+	struct pppoe_shard_t *sh;
+	int i;
+
+	serv->shard_cnt = serv->fanout > 1 ? serv->fanout : 1;
+	serv->shard = _malloc(sizeof(*serv->shard) * serv->shard_cnt);
+	memset(serv->shard, 0, sizeof(*serv->shard) * serv->shard_cnt);
+	serv->shard[0].hnd.fd = sock;
+
+	for (i = 1; i < serv->shard_cnt; i++) {
+		serv->shard[i].hnd.fd = open_disc_socket(serv->ifname, serv->ifindex);
+		if (serv->shard[i].hnd.fd < 0)
+			break;
+	}
+	serv->shard_cnt = i;
+
+	if (serv->shard_cnt > 1 && setup_fanout(serv->shard, serv->shard_cnt, serv->ifindex, serv->ifname)) {
+		for (i = 1; i < serv->shard_cnt; i++)
+			close(serv->shard[i].hnd.fd);
+		serv->shard_cnt = 1;
+	}
+
+	if (serv->shard_cnt < serv->fanout)
+		log_warn("pppoe: %s: running %i of %i fanout shards\n", serv->ifname, serv->shard_cnt, serv->fanout);
+
+	attach_filter(serv->shard, serv->shard_cnt, serv->hwaddr, serv->ifname);
+
+	serv->shard_active = serv->shard_cnt;
+
+	for (i = 0; i < serv->shard_cnt; i++) {
+		sh = &serv->shard[i];
+		sh->serv = serv;
+		sh->idx = i;
+		sh->ctx.close = pppoe_serv_close;
+		sh->ctx.before_switch = log_switch;
+		INIT_LIST_HEAD(&sh->pado_list);
+		sh->pado_timer.expire = pado_timer;
+
+		if (serv->rx_ring && !setup_rx_ring(sh, serv->ifname))
+			sh->hnd.read = pppoe_serv_read_ring;
+		else
+			sh->hnd.read = pppoe_serv_read;
+
+		triton_context_register(&sh->ctx, NULL);
+		triton_md_register_handler(&sh->ctx, &sh->hnd);
+		triton_md_enable_handler(&sh->hnd, MD_MODE_READ);
+		triton_context_wakeup(&sh->ctx);
+	}
+}
+
+/*
+ * Unbound sockets receiving discovery for every interface in shared mode,
+ * frames are dispatched by ifindex. Created once, [pppoe] fanout applies.
+ */
+static int shared_socket_start(void)
+{
+	struct pppoe_shard_t *sh;
+	int i, cnt, r = 0;
+
+	pthread_mutex_lock(&shared_lock);
+	if (shared_shard)
+		goto out;
+
+	cnt = conf_fanout;
+	shared_shard = _malloc(sizeof(*shared_shard) * cnt);
+	memset(shared_shard, 0, sizeof(*shared_shard) * cnt);
+
+	for (i = 0; i < cnt; i++) {
+		shared_shard[i].hnd.fd = open_disc_socket("shared socket", 0);
+		if (shared_shard[i].hnd.fd < 0)
+			break;
+	}
+
+	if (i == 0) {
+		_free(shared_shard);
+		shared_shard = NULL;
+		r = -1;
+		goto out;
+	}
+	cnt = i;
+
+	/* fanout group ids of bound sockets are their ifindexes */
+	if (cnt > 1 && setup_fanout(shared_shard, cnt, 0, "shared socket")) {
+		for (i = 1; i < cnt; i++)
+			close(shared_shard[i].hnd.fd);
+		cnt = 1;
+	}
+
+	attach_filter(shared_shard, cnt, NULL, "shared socket");
+
+	shared_tab = _malloc(sizeof(*shared_tab));
+	memset(shared_tab, 0, sizeof(*shared_tab));
+	pthread_mutex_init(&shared_tab->lock, NULL);
+
+	for (i = 0; i < cnt; i++) {
+		sh = &shared_shard[i];
+		sh->idx = i;
+		sh->ctx.close = pppoe_serv_close;
+		sh->ctx.before_switch = log_switch;
+		INIT_LIST_HEAD(&sh->pado_list);
+		sh->pado_timer.expire = pado_timer;
+
+		if (conf_rx_ring && !setup_rx_ring(sh, "shared socket"))
+			sh->hnd.read = pppoe_serv_read_ring;
+		else
+			sh->hnd.read = pppoe_serv_read;
+
+		triton_context_register(&sh->ctx, NULL);
+		triton_md_register_handler(&sh->ctx, &sh->hnd);
+		triton_md_enable_handler(&sh->hnd, MD_MODE_READ);
+		triton_context_wakeup(&sh->ctx);
+	}
+
+	shared_shard_cnt = cnt;
+
+out:
+	pthread_mutex_unlock(&shared_lock);
+	return r;
+}
+
 static void __pppoe_server_start(const char *ifname, const char *opt, void *cli)
 {
 	struct pppoe_serv_t *serv;
-	int sock;
+	int sock, ifindex, i;
 	int f = 1;
 	struct ifreq ifr;
 	struct sockaddr_ll sa;
 	char *ifopt, *errmsg;
 
-	pthread_rwlock_rdlock(&serv_lock);
-	list_for_each_entry(serv, &serv_list, entry) {
-		if (!strcmp(serv->ifname, ifname)) {
-			if (cli)
-				cli_send(cli, "error: already exists\r\n");
-			pthread_rwlock_unlock(&serv_lock);
-			return;
-		}
-	}
-	pthread_rwlock_unlock(&serv_lock);
-
 	serv = _malloc(sizeof(*serv));
 	memset(serv, 0, sizeof(*serv));
 
-	if (init_secret(serv)) {
-		if (cli)
-			cli_sendv(cli, "init secret failed\r\n");
-		_free(serv);
-		return;
-	}
+	if (conf_shared_socket) {
+		if (shared_socket_start()) {
+			if (cli)
+				cli_send(cli, "failed to create shared socket\r\n");
+			_free(serv);
+			return;
+		}
+		/* used for ioctls only */
+		sock = shared_shard[0].hnd.fd;
+		serv->shared = 1;
+	} else {
+		sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_PPP_DISC));
+		if (sock < 0) {
+			if (cli)
+				cli_sendv(cli, "socket: %s\r\n", strerror(errno));
+			log_emerg("pppoe: socket: %s\n", strerror(errno));
+			_free(serv);
+			return;
+		}
 
-	sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_PPP_DISC));
-	if (sock < 0) {
-		if (cli)
-			cli_sendv(cli, "socket: %s\r\n", strerror(errno));
-		log_emerg("pppoe: socket: %s\n", strerror(errno));
-		_free(serv);
-		return;
-	}
-	
-	fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
+		fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
 
-	if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &f, sizeof(f))) {
-		if (cli)
-			cli_sendv(cli, "setsockopt(SO_BROADCAST): %s\r\n", strerror(errno));
-		log_emerg("pppoe: setsockopt(SO_BROADCAST): %s\n", strerror(errno));
-		goto out_err;
+		if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &f, sizeof(f))) {
+			if (cli)
+				cli_sendv(cli, "setsockopt(SO_BROADCAST): %s\r\n", strerror(errno));
+			log_emerg("pppoe: setsockopt(SO_BROADCAST): %s\n", strerror(errno));
+			goto out_err;
+		}
 	}
 
 	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
@@ -1471,10 +2666,32 @@ static void __pppoe_server_start(const char *ifname, const char *opt, void *cli)
 		goto out_err;
 	}
 
+	ifindex = ifr.ifr_ifindex;
+
+	pthread_rwlock_rdlock(&serv_lock);
+	if (ifindex < serv_tab_size && serv_tab[ifindex]) {
+		pthread_rwlock_unlock(&serv_lock);
+		if (cli)
+			cli_send(cli, "error: already exists\r\n");
+		goto out_err;
+	}
+	pthread_rwlock_unlock(&serv_lock);
+
+	if (init_secret(serv)) {
+		if (cli)
+			cli_sendv(cli, "init secret failed\r\n");
+		goto out_err;
+	}
+
+	serv->ifindex = ifindex;
+
+	if (serv->shared)
+		goto skip_bind;
+
 	memset(&sa, 0, sizeof(sa));
 	sa.sll_family = AF_PACKET;
 	sa.sll_protocol = htons(ETH_P_PPP_DISC);
-	sa.sll_ifindex = ifr.ifr_ifindex;
+	sa.sll_ifindex = ifindex;
 
 	if (bind(sock, (struct sockaddr *)&sa, sizeof(sa))) {
 		if (cli)
@@ -1490,7 +2707,10 @@ static void __pppoe_server_start(const char *ifname, const char *opt, void *cli)
 		goto out_err;
 	}
 
+skip_bind:
 	serv->padi_limit = conf_padi_limit;
+	serv->rx_ring = conf_rx_ring;
+	serv->fanout = conf_fanout;
 
 	ifopt = strchr(opt, ',');
 	if (ifopt)
@@ -1504,30 +2724,45 @@ static void __pppoe_server_start(const char *ifname, const char *opt, void *cli)
 		goto out_err;
 	}
 
-	serv->ctx.close = pppoe_serv_close;
-	serv->ctx.before_switch = log_switch;
-	serv->hnd.fd = sock;
-	serv->hnd.read = pppoe_serv_read;
+	if (serv->shared && (serv->rx_ring != conf_rx_ring || serv->fanout != conf_fanout))
+		log_warn("pppoe: %s: rx-ring and fanout are ignored in shared socket mode\n", ifname);
+
 	serv->ifname = _strdup(ifname);
-	pthread_mutex_init(&serv->lock, NULL);
 
-	INIT_LIST_HEAD(&serv->conn_list);
-	INIT_LIST_HEAD(&serv->pado_list);
-	INIT_LIST_HEAD(&serv->padi_list);
+	spinlock_init(&serv->padi_lock);
 
-	triton_context_register(&serv->ctx, NULL);
-	triton_md_register_handler(&serv->ctx, &serv->hnd);
-	triton_md_enable_handler(&serv->hnd, MD_MODE_READ);
-	triton_context_wakeup(&serv->ctx);
+	INIT_LIST_HEAD(&serv->conn_list);
+	for (i = 0; i < PADI_RING_SIZE; i++)
+		INIT_LIST_HEAD(&serv->padi_ring[i]);
+
+	if (serv->shared) {
+		serv->tab = shared_tab;
+		serv->shard = shared_shard;
+		serv->shard_cnt = shared_shard_cnt;
+		serv->shard_active = serv->shard_cnt;
+	} else {
+		serv->tab = _malloc(sizeof(*serv->tab));
+		memset(serv->tab, 0, sizeof(*serv->tab));
+		pthread_mutex_init(&serv->tab->lock, NULL);
+		start_shards(serv, sock);
+	}
 
 	pthread_rwlock_wrlock(&serv_lock);
+	if (ifindex >= serv_tab_size) {
+		i = serv_tab_size;
+		serv_tab_size = (ifindex + 1) * 2;
+		serv_tab = _realloc(serv_tab, sizeof(*serv_tab) * serv_tab_size);
+		memset(serv_tab + i, 0, sizeof(*serv_tab) * (serv_tab_size - i));
+	}
+	serv_tab[ifindex] = serv;
 	list_add_tail(&serv->entry, &serv_list);
 	pthread_rwlock_unlock(&serv_lock);
 
 	return;
 
 out_err:
-	close(sock);
+	if (!serv->shared)
+		close(sock);
 	_free(serv);
 }
 
@@ -1536,44 +2771,100 @@ static void _conn_stop(struct pppoe_conn_t *conn)
 	ppp_terminate(&conn->ppp, TERM_ADMIN_RESET, 0);
 }
 
-static void _server_stop(struct pppoe_serv_t *serv)
+/*
+ * Called in the context of a shard that no longer serves the interface.
+ * The last shard to leave frees the interface, or terminates its
+ * connections and leaves freeing to the last of them.
+ */
+static void serv_shard_left(struct pppoe_serv_t *serv, int idx, int terminate)
 {
 	struct pppoe_conn_t *conn;
 
-	if (serv->stopping)
+	pthread_mutex_lock(&serv->tab->lock);
+	if (serv->shard_left & (1ULL << idx)) {
+		pthread_mutex_unlock(&serv->tab->lock);
 		return;
-	
+	}
+	serv->shard_left |= 1ULL << idx;
 	serv->stopping = 1;
-	triton_md_disable_handler(&serv->hnd, MD_MODE_READ | MD_MODE_WRITE);
-
-	pthread_mutex_lock(&serv->lock);
+	if (--serv->shard_active) {
+		pthread_mutex_unlock(&serv->tab->lock);
+		return;
+	}
 	if (!serv->conn_cnt) {
-		pthread_mutex_unlock(&serv->lock);
+		pthread_mutex_unlock(&serv->tab->lock);
 		pppoe_server_free(serv);
 		return;
 	}
-	list_for_each_entry(conn, &serv->conn_list, entry)
-		triton_context_call(&conn->ctx, (triton_event_func)_conn_stop, conn);
-	pthread_mutex_unlock(&serv->lock);
+	if (terminate) {
+		list_for_each_entry(conn, &serv->conn_list, entry)
+			triton_context_call(&conn->ctx, (triton_event_func)_conn_stop, conn);
+	}
+	pthread_mutex_unlock(&serv->tab->lock);
 }
 
-void pppoe_server_free(struct pppoe_serv_t *serv)
+static void _server_stop(struct pppoe_shard_t *sh)
 {
+	if (sh->stopping)
+		return;
+
+	shard_stop(sh);
+	serv_shard_left(sh->serv, sh->idx, 1);
+}
+
+static void _shared_server_stop(struct pppoe_serv_t *serv)
+{
+	struct pppoe_shard_t *sh = container_of(triton_context_self(), typeof(*sh), ctx);
 	struct delayed_pado_t *pado;
+	struct list_head *pos, *n;
+
+	list_for_each_safe(pos, n, &sh->pado_list) {
+		pado = list_entry(pos, typeof(*pado), entry);
+		if (pado->serv == serv)
+			free_delayed_pado(pado);
+	}
+
+	serv_shard_left(serv, sh->idx, 1);
+}
+
+void pppoe_server_free(struct pppoe_serv_t *serv)
+{
+	struct pppoe_shard_t *sh;
+	struct padi_t *padi;
 	int i;
 
 	pthread_rwlock_wrlock(&serv_lock);
 	list_del(&serv->entry);
+	if (serv->ifindex < serv_tab_size && serv_tab[serv->ifindex] == serv)
+		serv_tab[serv->ifindex] = NULL;
 	pthread_rwlock_unlock(&serv_lock);
 
-	while (!list_empty(&serv->pado_list)) {
-		pado = list_entry(serv->pado_list.next, typeof(*pado), entry);
-		free_delayed_pado(pado);
+	if (!serv->shared) {
+		for (i = 0; i < serv->shard_cnt; i++) {
+			sh = &serv->shard[i];
+			triton_md_unregister_handler(&sh->hnd);
+			if (sh->ring)
+				munmap(sh->ring, RING_BLOCK_SIZE * RING_BLOCK_NR);
+			if (sh->txq)
+				_free(sh->txq);
+			if (sh->pado_hash)
+				_free(sh->pado_hash);
+			close(sh->hnd.fd);
+			triton_context_unregister(&sh->ctx);
+		}
+		_free(serv->shard);
+		_free(serv->tab);
 	}
 
-	triton_md_unregister_handler(&serv->hnd);
-	close(serv->hnd.fd);
-	triton_context_unregister(&serv->ctx);
+	for (i = 0; i < PADI_RING_SIZE; i++) {
+		while (!list_empty(&serv->padi_ring[i])) {
+			padi = list_entry(serv->padi_ring[i].next, typeof(*padi), entry);
+			list_del(&padi->entry);
+			mempool_free(padi);
+		}
+	}
+	if (serv->padi_hash)
+		_free(serv->padi_hash);
 	for (i = 0; i < MAX_SERVICE_NAMES; i++) {
 		if (serv->service_names[i]) {
 			_free(serv->service_names[i]);
@@ -1587,12 +2878,24 @@ void pppoe_server_free(struct pppoe_serv_t *serv)
 void pppoe_server_stop(const char *ifname)
 {
 	struct pppoe_serv_t *serv;
+	int i, stopping;
 
 	pthread_rwlock_rdlock(&serv_lock);
 	list_for_each_entry(serv, &serv_list, entry) {
 		if (strcmp(serv->ifname, ifname))
 			continue;
-		triton_context_call(&serv->ctx, (triton_event_func)_server_stop, serv);
+		pthread_mutex_lock(&serv->tab->lock);
+		stopping = serv->stopping;
+		serv->stopping = 1;
+		pthread_mutex_unlock(&serv->tab->lock);
+		if (stopping)
+			break;
+		for (i = 0; i < serv->shard_cnt; i++) {
+			if (serv->shared)
+				triton_context_call(&serv->shard[i].ctx, (triton_event_func)_shared_server_stop, serv);
+			else
+				triton_context_call(&serv->shard[i].ctx, (triton_event_func)_server_stop, &serv->shard[i]);
+		}
 		break;
 	}
 	pthread_rwlock_unlock(&serv_lock);
@@ -1608,13 +2911,12 @@ static int init_secret(struct pppoe_serv_t *serv)
 {
 	DES_cblock key;
 
-	if (read(urandom_fd, serv->secret, SECRET_LENGTH) < 0) {
-		log_emerg("pppoe: failed to read /dev/urandom: %s\n", strerror(errno));
+	if (u_randbuf(serv->secret, SECRET_LENGTH))
+		return -1;
+
+	if (des_random_key(&key))
 		return -1;
-	}
 
-	memset(key, 0, sizeof(key));
-	DES_random_key(&key);
 	DES_set_key(&key, &serv->des_ks);
 
 	return 0;
@@ -1667,10 +2969,53 @@ static void load_config(void)
 	if (opt)
 		conf_tr101 = atoi(opt);
 	
+	opt = conf_get_opt("pppoe", "rx-ring");
+	if (opt)
+		conf_rx_ring = atoi(opt) > 0;
+	else
+		conf_rx_ring = 0;
+
+	opt = conf_get_opt("pppoe", "fanout");
+	if (opt) {
+		conf_fanout = atoi(opt);
+		if (conf_fanout < 1 || conf_fanout > MAX_FANOUT) {
+			log_error("pppoe: invalid fanout value %i\n", conf_fanout);
+			conf_fanout = 1;
+		}
+	} else
+		conf_fanout = 1;
+
+	opt = conf_get_opt("pppoe", "shared-socket");
+	if (opt)
+		conf_shared_socket = atoi(opt) > 0;
+	else
+		conf_shared_socket = 0;
+
 	opt = conf_get_opt("pppoe", "padi-limit");
 	if (opt)
 		conf_padi_limit = atoi(opt);
 
+	opt = conf_get_opt("pppoe", "cookie");
+	if (opt) {
+		if (!strcmp(opt, "des"))
+			conf_cookie = COOKIE_DES;
+		else if (!strcmp(opt, "siphash"))
+			conf_cookie = COOKIE_SIPHASH;
+		else
+			log_error("pppoe: unknown cookie algorithm '%s'\n", opt);
+	} else
+		conf_cookie = COOKIE_DES;
+
+	opt = conf_get_opt("pppoe", "cookie-timeout");
+	if (opt) {
+		conf_cookie_timeout = atoi(opt);
+		if (conf_cookie_timeout <= 0) {
+			log_error("pppoe: invalid cookie-timeout value %i\n", conf_cookie_timeout);
+			conf_cookie_timeout = 60;
+		}
+	} else
+		conf_cookie_timeout = 60;
+
 	conf_mppe = MPPE_UNSET;
 	opt = conf_get_opt("l2tp", "mppe");
 	if (opt) {
@@ -1708,11 +3053,17 @@ static void pppoe_init(void)
 	pado_pool = mempool_create(sizeof(struct delayed_pado_t));
 	padi_pool = mempool_create(sizeof(struct padi_t));
 
+	spinlock_init(&cookie_key_lock);
+	spinlock_init(&padi_bucket_lock);
+
 	if (!s) {
 		log_emerg("pppoe: no configuration, disabled...\n");
 		return;
 	}
 
+	/* interfaces take their defaults (rx-ring, fanout, shared-socket, padi-limit) from it */
+	load_config();
+
 	list_for_each_entry(opt, &s->items, entry) {
 		if (opt->val) {
 			if (!strcmp(opt->name, "interface")) {
@@ -1723,7 +3074,7 @@ static void pppoe_init(void)
 		}
 	}
 
-	load_config();
+	upgrade_register_handler(&upgrade_hnd);
 
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 }
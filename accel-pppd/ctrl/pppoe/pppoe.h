@@ -3,10 +3,14 @@
 
 #include <pthread.h>
 
+#include <sys/socket.h>
+#include <net/ethernet.h>
 #include <linux/if.h>
+#include <linux/if_packet.h>
 #include <linux/if_pppox.h>
 
 #include "crypto.h"
+#include "spinlock.h"
 
 /* PPPoE codes */
 #define CODE_PADI           0x09
@@ -46,8 +50,15 @@
 #define MAX_SID 65534
 #define SECRET_LENGTH 16
 #define COOKIE_LENGTH 24
+
+#define COOKIE_DES 0
+#define COOKIE_SIPHASH 1
+
 #define MAX_SERVICE_NAMES 8
 
+#define PADI_HASH_SIZE 256
+#define PADI_RING_SIZE 4
+
 struct pppoe_tag_t
 {
 	struct list_head entry;
@@ -64,33 +75,101 @@ struct pppoe_packet_t
 	struct list_head tags;
 };
 
-struct pppoe_serv_t
+#define MAX_FANOUT 64
+
+#define COOKIE_HASH_SIZE 4096
+
+/* token bucket, tokens are kept in 1/1000 units and refilled per ms */
+struct padi_bucket_t
+{
+	int64_t tokens;
+	int64_t ts;
+};
+
+/*
+ * session ids and AC-Cookie index, an interface has its own table or
+ * shares a global one
+ */
+struct pppoe_sid_tab_t
+{
+	pthread_mutex_t lock;
+	struct pppoe_conn_t *conn[MAX_SID];
+	struct pppoe_conn_t *cookie_hash[COOKIE_HASH_SIZE];
+};
+
+/*
+ * Discovery socket with its own context, an interface has one shard or,
+ * with fanout, several sharing the session table of pppoe_serv_t.
+ * Shards of the shared socket are not bound, serv is NULL for them.
+ */
+#define TX_BATCH 32
+#define TX_HIST_SIZE 6
+
+/* discovery frames produced by one read burst or timer, sent by one sendmmsg */
+struct pppoe_txq_t
+{
+	int cnt;
+	struct mmsghdr msg[TX_BATCH];
+	struct iovec iov[TX_BATCH];
+	struct sockaddr_ll addr[TX_BATCH];
+	uint8_t buf[TX_BATCH][ETHER_MAX_LEN];
+};
+
+struct pppoe_shard_t
 {
-	struct list_head entry;
 	struct triton_context_t ctx;
 	struct triton_md_handler_t hnd;
+	struct pppoe_serv_t *serv;
+
+	/* delayed PADOs ordered by due time, one timer releases them */
+	struct list_head pado_list;
+	struct delayed_pado_t **pado_hash;
+	struct triton_timer_t pado_timer;
+
+	uint8_t *ring;
+	int ring_idx;
+
+	struct pppoe_txq_t *txq;
+
+	int idx;
+	int stopping:1;
+};
+
+struct pppoe_serv_t
+{
+	struct list_head entry;
 	uint8_t hwaddr[ETH_ALEN];
 	char *ifname;
+	int ifindex;
 	int require_service_name:1;
 	char *service_names[MAX_SERVICE_NAMES];
 
 	uint8_t secret[SECRET_LENGTH];
 	DES_key_schedule des_ks;
 
-	pthread_mutex_t lock;
-	struct pppoe_conn_t *conn[MAX_SID];
+	struct pppoe_sid_tab_t *tab;
 	uint16_t sid;
 	int stopping:1;
+	int shared:1;
 
 	unsigned int conn_cnt;
 	struct list_head conn_list;
 
-	struct list_head pado_list;
-
-	struct list_head padi_list;
-	int padi_cnt;
+	spinlock_t padi_lock;
+	struct padi_t **padi_hash;
+	struct list_head padi_ring[PADI_RING_SIZE];
+	time_t padi_ring_sec;
+	struct padi_bucket_t padi_bucket;
 	int padi_limit;
 	time_t last_padi_limit_warn;
+
+	int rx_ring;
+	int fanout;
+
+	struct pppoe_shard_t *shard;
+	int shard_cnt;
+	int shard_active;
+	uint64_t shard_left;
 };
 
 extern int conf_verbose;
@@ -98,7 +177,13 @@ extern char *conf_service_names[MAX_SERVICE_NAMES];
 extern char *conf_ac_name;
 extern char *conf_pado_delay;
 extern int conf_reply_exact_service;
+extern int conf_rx_ring;
+extern int conf_fanout;
+extern int conf_shared_socket;
+extern int conf_cookie;
+extern int conf_cookie_timeout;
 
+extern unsigned int stat_starting;
 extern unsigned int stat_active;
 extern unsigned int stat_delayed_pado;
 extern unsigned long stat_PADI_recv;
@@ -107,11 +192,20 @@ extern unsigned long stat_PADR_recv;
 extern unsigned long stat_PADR_dup_recv;
 extern unsigned long stat_PADS_sent;
 extern unsigned long stat_PADI_drop;
+extern unsigned long stat_PADI_drop_admission;
+extern unsigned long stat_PADI_drop_mac;
+extern unsigned long stat_PADI_drop_iface;
+extern unsigned long stat_PADI_drop_global;
+extern unsigned long stat_PADI_drop_connlimit;
+extern unsigned long stat_PADI_drop_nomem;
+extern unsigned long stat_tx_batch[TX_HIST_SIZE];
 
 extern pthread_rwlock_t serv_lock;
 extern struct list_head serv_list;
 
 int mac_filter_check(const uint8_t *addr);
+int mac_filter_get(uint8_t *addrs, int max, int *allow);
+void pppoe_update_filters(void);
 void pppoe_server_start(const char *intf, void *client);
 void pppoe_server_stop(const char *intf);
 
@@ -119,10 +213,15 @@ int pppoe_add_service_name(char **list, const char *item);
 int pppoe_del_service_name(char **list, const char *item);
 
 extern int pado_delay;
+extern unsigned int dpado_load;
 void dpado_check_next(int conn_cnt);
 void dpado_check_prev(int conn_cnt);
 int dpado_parse(const char *str);
 
+extern int conf_cluster_delay;
+int cluster_padi(const uint8_t *addr);
+int cluster_claimed(const uint8_t *addr);
+
 struct rad_packet_t;
 int tr101_send_access_request(struct pppoe_tag *tr101, struct rad_packet_t *pack);
 int tr101_send_accounting_request(struct pppoe_tag *tr101, struct rad_packet_t *pack);
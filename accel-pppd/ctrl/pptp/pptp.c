@@ -9,6 +9,7 @@
 #include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
 #include "if_pppox.h"
@@ -23,6 +24,7 @@
 #include "iprange.h"
 #include "utils.h"
 #include "cli.h"
+#include "upgrade.h"
 
 #include "connlimit.h"
 
@@ -61,11 +63,17 @@ static int conf_echo_failure = 3;
 static int conf_verbose = 0;
 static int conf_mppe = MPPE_UNSET;
 static char *conf_ip_pool;
+static int conf_listeners = 1;
+static int conf_backlog = 100;
 
 static mempool_t conn_pool;
 
 static unsigned int stat_starting;
 static unsigned int stat_active;
+static unsigned int stat_accepted;
+static unsigned int stat_rejected;
+static unsigned long long stat_accept_wait;
+static unsigned int stat_accept_wait_max;
 
 static int pptp_read(struct triton_md_handler_t *h);
 static int pptp_write(struct triton_md_handler_t *h);
@@ -612,48 +620,103 @@ struct pptp_serv_t
 {
 	struct triton_context_t ctx;
 	struct triton_md_handler_t hnd;
+	struct triton_timer_t defer_timer;
+	struct timespec ready_ts;
 };
 
+static struct pptp_serv_t *serv;
+static int serv_cnt;
+
+static unsigned int ts_elapsed_ms(struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+/*
+ * Accept wait is counted from the moment the listener was found readable
+ * (or deferred by admission control) to the moment the connection is
+ * taken out of the backlog.
+ */
+static void pptp_account_accept(struct pptp_serv_t *s)
+{
+	unsigned int ms = ts_elapsed_ms(&s->ready_ts);
+	unsigned int max;
+
+	__sync_add_and_fetch(&stat_accepted, 1);
+	__sync_add_and_fetch(&stat_accept_wait, ms);
+
+	do {
+		max = stat_accept_wait_max;
+		if (ms <= max)
+			break;
+	} while (!__sync_bool_compare_and_swap(&stat_accept_wait_max, max, ms));
+}
+
+static void pptp_reject(int sock)
+{
+	close(sock);
+	__sync_add_and_fetch(&stat_rejected, 1);
+}
+
 static int pptp_connect(struct triton_md_handler_t *h)
 {
-  struct sockaddr_in addr;
+	struct sockaddr_in addr;
 	socklen_t size = sizeof(addr);
 	int sock;
 	struct pptp_conn_t *conn;
+	struct pptp_serv_t *s = container_of(h, typeof(*s), hnd);
+
+	if (!s->ready_ts.tv_sec)
+		clock_gettime(CLOCK_MONOTONIC, &s->ready_ts);
 
 	while(1) {
-		sock = accept(h->fd, (struct sockaddr *)&addr, &size);
+		if (!ppp_shutdown && ppp_admission_check()) {
+			/* leave connections in the listen backlog and retry later */
+			if (!s->defer_timer.tpd)
+				triton_timer_add(&s->ctx, &s->defer_timer, 0);
+			return 0;
+		}
+
+		size = sizeof(addr);
+		sock = accept4(h->fd, (struct sockaddr *)&addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
 		if (sock < 0) {
-			if (errno == EAGAIN)
+			if (errno == EAGAIN) {
+				s->ready_ts.tv_sec = 0;
 				return 0;
+			}
 			log_error("pptp: accept failed: %s\n", strerror(errno));
 			continue;
 		}
 
+		pptp_account_accept(s);
+
 		if (ppp_shutdown) {
 			close(sock);
 			continue;
 		}
 
 		if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_ipv4(addr.sin_addr.s_addr))) {
-			close(sock);
-			return 0;
+			pptp_reject(sock);
+			continue;
 		}
 
-		log_info2("pptp: new connection from %s\n", inet_ntoa(addr.sin_addr));
-
 		if (iprange_client_check(addr.sin_addr.s_addr)) {
 			log_warn("pptp: IP is out of client-ip-range, droping connection...\n");
-			close(sock);
+			pptp_reject(sock);
 			continue;
 		}
 
-		if (fcntl(sock, F_SETFL, O_NONBLOCK)) {
-			log_error("pptp: failed to set nonblocking mode: %s, closing connection...\n", strerror(errno));
-			close(sock);
+		if (ppp_admission_acquire()) {
+			pptp_reject(sock);
 			continue;
 		}
 
+		log_info2("pptp: new connection from %s\n", inet_ntoa(addr.sin_addr));
+
 		conn = mempool_alloc(conn_pool);
 		memset(conn, 0, sizeof(*conn));
 		conn->hnd.fd = sock;
@@ -696,26 +759,117 @@ static int pptp_connect(struct triton_md_handler_t *h)
 	}
 	return 0;
 }
+static void pptp_defer_timer(struct triton_timer_t *t)
+{
+	struct pptp_serv_t *s = container_of(t, typeof(*s), defer_timer);
+
+	triton_timer_del(t);
+
+	if (s->hnd.tpd)
+		pptp_connect(&s->hnd);
+}
+
 static void pptp_serv_close(struct triton_context_t *ctx)
 {
 	struct pptp_serv_t *s=container_of(ctx,typeof(*s),ctx);
-	triton_md_unregister_handler(&s->hnd);
-	close(s->hnd.fd);
+	if (s->defer_timer.tpd)
+		triton_timer_del(&s->defer_timer);
+	if (s->hnd.tpd) {
+		triton_md_unregister_handler(&s->hnd);
+		close(s->hnd.fd);
+	}
 	triton_context_unregister(ctx);
 }
 
-static struct pptp_serv_t serv=
+/* runs in the listener's context, established connections stay */
+static void pptp_serv_release(struct pptp_serv_t *s)
 {
-	.hnd.read = pptp_connect,
-	.ctx.close = pptp_serv_close,
-	.ctx.before_switch = log_switch,
-};
+	if (s->defer_timer.tpd)
+		triton_timer_del(&s->defer_timer);
+	if (s->hnd.tpd) {
+		triton_md_unregister_handler(&s->hnd);
+		close(s->hnd.fd);
+	}
+
+	upgrade_release();
+}
+
+static void ev_upgrade(void)
+{
+	int i;
+
+	for (i = 0; i < serv_cnt; i++) {
+		if (serv[i].ctx.tpd) {
+			upgrade_hold();
+			triton_context_call(&serv[i].ctx, (triton_event_func)pptp_serv_release, &serv[i]);
+		}
+	}
+}
+
+/* Kernel counters of connections dropped on full accept queues, they are
+ * system wide, the kernel does not keep them per socket */
+static int get_listen_drops(unsigned long long *overflows, unsigned long long *drops)
+{
+	char names[4096], values[4096];
+	char *n, *v, *n_save, *v_save;
+	FILE *f;
+	int r = -1;
+
+	f = fopen("/proc/net/netstat", "r");
+	if (!f)
+		return -1;
+
+	while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+		if (strncmp(names, "TcpExt:", 7))
+			continue;
+
+		n = strtok_r(names + 7, " \n", &n_save);
+		v = strtok_r(values + 7, " \n", &v_save);
+		while (n && v) {
+			if (!strcmp(n, "ListenOverflows"))
+				*overflows = strtoull(v, NULL, 10);
+			else if (!strcmp(n, "ListenDrops"))
+				*drops = strtoull(v, NULL, 10);
+			n = strtok_r(NULL, " \n", &n_save);
+			v = strtok_r(NULL, " \n", &v_save);
+		}
+		r = 0;
+		break;
+	}
+
+	fclose(f);
+
+	return r;
+}
 
 static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
 {
+	struct tcp_info info;
+	socklen_t len;
+	unsigned int backlog = 0, backlog_max = 0;
+	unsigned long long overflows = 0, drops = 0;
+	int i;
+
 	cli_send(client, "pptp:\r\n");
 	cli_sendv(client,"  starting: %u\r\n", stat_starting);
 	cli_sendv(client,"  active: %u\r\n", stat_active);
+	cli_sendv(client,"  accepted: %u\r\n", stat_accepted);
+	cli_sendv(client,"  rejected: %u\r\n", stat_rejected);
+	cli_sendv(client,"  accept-wait: %llu/%u ms (avg/max)\r\n",
+		stat_accepted ? stat_accept_wait / stat_accepted : 0, stat_accept_wait_max);
+
+	for (i = 0; i < serv_cnt; i++) {
+		len = sizeof(info);
+		if (serv[i].hnd.tpd && !getsockopt(serv[i].hnd.fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+			/* for a listening socket these are accept queue length and limit */
+			backlog += info.tcpi_unacked;
+			backlog_max += info.tcpi_sacked;
+		}
+	}
+	cli_sendv(client,"  backlog: %u/%u\r\n", backlog, backlog_max);
+
+	if (!get_listen_drops(&overflows, &drops))
+		cli_sendv(client,"  listen-drops: %llu (overflows %llu, system wide)\r\n", drops, overflows);
 
 	return CLI_CMD_OK;
 }
@@ -767,11 +921,61 @@ static void load_config(void)
 		conf_ip_pool = NULL;
 }
 
+static int start_listener(struct pptp_serv_t *s, struct sockaddr_in *addr)
+{
+	int flag = 1;
+
+	s->hnd.fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s->hnd.fd < 0) {
+		log_emerg("pptp: failed to create server socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	setsockopt(s->hnd.fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+	if (serv_cnt > 1 && setsockopt(s->hnd.fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag))) {
+		log_emerg("pptp: setsockopt(SO_REUSEPORT): %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	if (bind(s->hnd.fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+		log_emerg("pptp: failed to bind socket: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	if (listen(s->hnd.fd, conf_backlog) < 0) {
+		log_emerg("pptp: failed to listen socket: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	s->hnd.read = pptp_connect;
+	s->defer_timer.expire = pptp_defer_timer;
+	s->defer_timer.expire_tv.tv_usec = 100000;
+	s->ctx.close = pptp_serv_close;
+	s->ctx.before_switch = log_switch;
+
+	triton_context_register(&s->ctx, NULL);
+	triton_md_register_handler(&s->ctx, &s->hnd);
+	triton_md_enable_handler(&s->hnd, MD_MODE_READ);
+	triton_context_wakeup(&s->ctx);
+
+	return 0;
+
+out_err:
+	close(s->hnd.fd);
+	return -1;
+}
+
+/*
+ * With listeners=N the port is shared by N SO_REUSEPORT sockets, the
+ * kernel spreads incoming connections among them and each is accepted
+ * in its own context.
+ */
 static void pptp_init(void)
 {
 	struct sockaddr_in addr;
 	char *opt;
-	int fd;
+	int fd, i;
 
 	fd = socket(AF_PPPOX, SOCK_DGRAM, PX_PROTO_PPTP);
 	if (fd >= 0)
@@ -779,54 +983,45 @@ static void pptp_init(void)
 	else if (system("modprobe -q pptp"))
 		log_warn("failed to load pptp kernel module\n");
 
-	serv.hnd.fd = socket(PF_INET, SOCK_STREAM, 0);
-	if (serv.hnd.fd < 0) {
-		log_emerg("pptp: failed to create server socket: %s\n", strerror(errno));
-		return;
-	}
-
-	fcntl(serv.hnd.fd, F_SETFD, fcntl(serv.hnd.fd, F_GETFD) | FD_CLOEXEC);
-  
+	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-  addr.sin_port = htons(PPTP_PORT);
+	addr.sin_port = htons(PPTP_PORT);
 
 	opt = conf_get_opt("pptp", "bind");
 	if (opt)
 		addr.sin_addr.s_addr = inet_addr(opt);
 	else
 		addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  
-  setsockopt(serv.hnd.fd, SOL_SOCKET, SO_REUSEADDR, &serv.hnd.fd, 4);  
-  if (bind (serv.hnd.fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
-    log_emerg("pptp: failed to bind socket: %s\n", strerror(errno));
-		close(serv.hnd.fd);
-    return;
-  }
-
-  if (listen (serv.hnd.fd, 100) < 0) {
-    log_emerg("pptp: failed to listen socket: %s\n", strerror(errno));
-		close(serv.hnd.fd);
-    return;
-  }
-
-	if (fcntl(serv.hnd.fd, F_SETFL, O_NONBLOCK)) {
-    log_emerg("pptp: failed to set nonblocking mode: %s\n", strerror(errno));
-		close(serv.hnd.fd);
-    return;
-	}
-	
+
+	opt = conf_get_opt("pptp", "listeners");
+	if (opt && atoi(opt) > 0)
+		conf_listeners = atoi(opt);
+
+	opt = conf_get_opt("pptp", "backlog");
+	if (opt && atoi(opt) > 0)
+		conf_backlog = atoi(opt);
+
 	conn_pool = mempool_create(sizeof(struct pptp_conn_t));
 
 	load_config();
 
-	triton_context_register(&serv.ctx, NULL);
-	triton_md_register_handler(&serv.ctx, &serv.hnd);
-	triton_md_enable_handler(&serv.hnd, MD_MODE_READ);
-	triton_context_wakeup(&serv.ctx);
+	serv_cnt = conf_listeners;
+	serv = _malloc(serv_cnt * sizeof(*serv));
+	memset(serv, 0, serv_cnt * sizeof(*serv));
+
+	for (i = 0; i < serv_cnt; i++) {
+		if (start_listener(&serv[i], &addr))
+			break;
+	}
+
+	serv_cnt = i;
+	if (!serv_cnt)
+		return;
 
 	cli_register_simple_cmd2(show_stat_exec, NULL, 2, "show", "stat");
 	
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
+	triton_event_register_handler(EV_UPGRADE, (triton_event_func)ev_upgrade);
 }
 
 DEFINE_INIT(20, pptp_init);
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include <byteswap.h>
+#include <sys/inotify.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -29,6 +32,40 @@ static in_addr_t conf_gw_ip_address = 0;
 static void *pd_key;
 static struct ipdb_t ipdb;
 
+struct cs_entry_t
+{
+	struct list_head entry;
+	char *username;
+	char *passwd;
+	in_addr_t peer_addr;
+	char *rate;
+};
+
+struct cs_table_t
+{
+	unsigned int mask;
+	int count;
+	struct list_head hash[0];
+};
+
+static struct cs_table_t *cs_table;
+static pthread_rwlock_t cs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void cs_ctx_close(struct triton_context_t *ctx);
+static int cs_inotify_read(struct triton_md_handler_t *h);
+
+static struct triton_context_t cs_ctx = {
+	.close = cs_ctx_close,
+	.before_switch = log_switch,
+};
+
+static struct triton_md_handler_t cs_hnd = {
+	.read = cs_inotify_read,
+};
+
+static int cs_wd = -1;
+static char *cs_watch_name;
+
 struct hash_chain
 {
 	struct list_head entry;
@@ -113,19 +150,156 @@ static int split(char *buf, char **ptr)
 }
 
 
-static struct cs_pd_t *create_pd(struct ppp_t *ppp, const char *username)
+static unsigned int hash_str(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *str; str++)
+		h = (h ^ (uint8_t)*str) * 16777619;
+
+	return h;
+}
+
+static struct cs_entry_t *alloc_entry(const char *username, const char *passwd, const char *ip, const char *rate)
+{
+	struct cs_entry_t *e;
+	int ulen = strlen(username) + 1;
+	int plen = strlen(passwd) + 1;
+	int rlen = rate ? strlen(rate) + 1 : 0;
+
+	e = _malloc(sizeof(*e) + ulen + plen + rlen);
+	if (!e)
+		return NULL;
+
+	e->username = (char *)(e + 1);
+	e->passwd = e->username + ulen;
+	memcpy(e->username, username, ulen);
+	memcpy(e->passwd, passwd, plen);
+
+	if (rate) {
+		e->rate = e->passwd + plen;
+		memcpy(e->rate, rate, rlen);
+	} else
+		e->rate = NULL;
+
+	if (ip && ip[0] != '*')
+		e->peer_addr = inet_addr(ip);
+	else
+		e->peer_addr = 0;
+
+	return e;
+}
+
+static void free_table(struct cs_table_t *t)
+{
+	struct cs_entry_t *e;
+	unsigned int i;
+
+	for (i = 0; i <= t->mask; i++) {
+		while (!list_empty(&t->hash[i])) {
+			e = list_entry(t->hash[i].next, typeof(*e), entry);
+			list_del(&e->entry);
+			_free(e);
+		}
+	}
+
+	_free(t);
+}
+
+static void load_secrets(void)
 {
 	FILE *f;
 	char *buf;
 	char *ptr[5];
-	int n, i;
-	struct cs_pd_t *pd;
+	int n, count = 0;
+	unsigned int size;
+	struct cs_entry_t *e;
+	struct cs_table_t *t, *old;
+	LIST_HEAD(entries);
+
+	f = fopen(conf_chap_secrets, "r");
+	if (!f) {
+		log_error("chap-secrets: open '%s': %s\n", conf_chap_secrets, strerror(errno));
+		t = NULL;
+		goto out_swap;
+	}
+
+	buf = _malloc(4096);
+	if (!buf) {
+		log_emerg("chap-secrets: out of memory\n");
+		fclose(f);
+		return;
+	}
+
+	while (fgets(buf, 4096, f)) {
+		if (buf[0] == '#')
+			continue;
+		n = split(buf, ptr);
+		if (n < 3)
+			continue;
+#ifdef CRYPTO_OPENSSL
+		if (conf_encrypted && strlen(ptr[1]) != 32)
+			continue;
+#endif
+		e = alloc_entry(*buf == '\'' || *buf == '"' ? buf + 1 : buf, ptr[1], ptr[2], n >= 4 ? ptr[3] : NULL);
+		if (!e) {
+			log_emerg("chap-secrets: out of memory\n");
+			break;
+		}
+		list_add_tail(&e->entry, &entries);
+		count++;
+	}
+
+	fclose(f);
+	_free(buf);
+
+	for (size = 16; size < count; size <<= 1);
+
+	t = _malloc(sizeof(*t) + size * sizeof(struct list_head));
+	if (!t) {
+		log_emerg("chap-secrets: out of memory\n");
+		while (!list_empty(&entries)) {
+			e = list_entry(entries.next, typeof(*e), entry);
+			list_del(&e->entry);
+			_free(e);
+		}
+		return;
+	}
+
+	t->mask = size - 1;
+	t->count = count;
+	for (n = 0; n < size; n++)
+		INIT_LIST_HEAD(&t->hash[n]);
+
+	/* keep file order, so the first matching line wins as before */
+	while (!list_empty(&entries)) {
+		e = list_entry(entries.next, typeof(*e), entry);
+		list_move_tail(&e->entry, &t->hash[hash_str(e->username) & t->mask]);
+	}
+
+	log_info2("chap-secrets: loaded %i entries from '%s'\n", count, conf_chap_secrets);
+
+out_swap:
+	pthread_rwlock_wrlock(&cs_lock);
+	old = cs_table;
+	cs_table = t;
+	pthread_rwlock_unlock(&cs_lock);
+
+	if (old)
+		free_table(old);
+}
+
+static struct cs_pd_t *create_pd(struct ppp_t *ppp, const char *username)
+{
+	struct cs_entry_t *e;
+	struct cs_pd_t *pd = NULL;
 #ifdef CRYPTO_OPENSSL
 	char username_hash[EVP_MAX_MD_SIZE * 2 + 1];
 	uint8_t hash[EVP_MAX_MD_SIZE];
 	struct hash_chain *hc;
 	EVP_MD_CTX md_ctx;
-	char c;
+	char hex[3];
+	int i, n;
 #endif
 
 	if (!conf_chap_secrets)
@@ -148,46 +322,20 @@ static struct cs_pd_t *create_pd(struct ppp_t *ppp, const char *username)
 		username = username_hash;
 	}
 #endif
-	
-	f = fopen(conf_chap_secrets, "r");
-	if (!f) {
-		log_error("chap-secrets: open '%s': %s\n", conf_chap_secrets, strerror(errno));
-		return NULL;
-	}
 
-	buf = _malloc(4096);
-	if (!buf) {
-		log_emerg("chap-secrets: out of memory\n");
-		fclose(f);
-		return NULL;
-	}
-	
-	while (fgets(buf, 4096, f)) {
-		if (buf[0] == '#')
-			continue;
-		n = split(buf, ptr);
-		if (n < 3)
-			continue;
-		if (*buf == '\'' || *buf == '"') {
-			if (!strcmp(buf + 1, username))
-				goto found;
-		} else {
-			if (!strcmp(buf, username))
-				goto found;
-		}
+	pthread_rwlock_rdlock(&cs_lock);
+
+	if (!cs_table)
+		goto out;
+
+	list_for_each_entry(e, &cs_table->hash[hash_str(username) & cs_table->mask], entry) {
+		if (!strcmp(e->username, username))
+			goto found;
 	}
 
-out:
-	fclose(f);
-	_free(buf);
-	return NULL;
+	goto out;
 
 found:
-#ifdef CRYPTO_OPENSSL
-	if (conf_encrypted && strlen(ptr[1]) != 32)
-		goto out;
-#endif
-
 	pd = _malloc(sizeof(*pd));
 	if (!pd) {
 		log_emerg("chap-secrets: out of memory\n");
@@ -199,43 +347,42 @@ found:
 #ifdef CRYPTO_OPENSSL
 	if (conf_encrypted) {
 		pd->passwd = _malloc(16);
-		if (!pd->passwd) {
-			log_emerg("chap-secrets: out of memory\n");
-			_free(pd);
-			goto out;
-		}
+		if (!pd->passwd)
+			goto out_nomem;
 		
+		hex[2] = 0;
 		for (i = 0; i < 16; i++) {
-			c = ptr[1][i*2 + 2];
-			ptr[1][i*2 + 2] = 0;
-			pd->passwd[i] = strtol(ptr[1] + i*2, NULL, 16);
-			ptr[1][i*2 + 2] = c;
+			hex[0] = e->passwd[i*2];
+			hex[1] = e->passwd[i*2 + 1];
+			pd->passwd[i] = strtol(hex, NULL, 16);
 		}
 	} else 
 #endif
 	{
-		pd->passwd = _strdup(ptr[1]);
-		if (!pd->passwd) {
-			log_emerg("chap-secrets: out of memory\n");
-			_free(pd);
-			goto out;
-		}
+		pd->passwd = _strdup(e->passwd);
+		if (!pd->passwd)
+			goto out_nomem;
 	}
 
 	pd->ip.addr = conf_gw_ip_address;
-	if (n >= 3 && ptr[2][0] != '*')
-		pd->ip.peer_addr = inet_addr(ptr[2]);
+	pd->ip.peer_addr = e->peer_addr;
 	pd->ip.owner = &ipdb;
 
-	if (n >= 4)
-		pd->rate = _strdup(ptr[3]);
+	if (e->rate)
+		pd->rate = _strdup(e->rate);
 
 	list_add_tail(&pd->pd.entry, &ppp->pd_list);
 
-	fclose(f);
-	_free(buf);
+out:
+	pthread_rwlock_unlock(&cs_lock);
 
 	return pd;
+
+out_nomem:
+	pthread_rwlock_unlock(&cs_lock);
+	log_emerg("chap-secrets: out of memory\n");
+	_free(pd);
+	return NULL;
 }
 
 static struct cs_pd_t *find_pd(struct ppp_t *ppp)
@@ -697,6 +844,85 @@ static void parse_hash_chain(const char *opt)
 }
 #endif
 
+static void setup_watch(void)
+{
+	char *dir, *ptr;
+
+	if (cs_wd != -1) {
+		inotify_rm_watch(cs_hnd.fd, cs_wd);
+		cs_wd = -1;
+	}
+
+	if (cs_watch_name)
+		_free(cs_watch_name);
+
+	/* watch the directory, editors usually replace the file by rename */
+	dir = _strdup(conf_chap_secrets);
+	ptr = strrchr(dir, '/');
+	if (ptr) {
+		cs_watch_name = _strdup(ptr + 1);
+		if (ptr == dir)
+			ptr[1] = 0;
+		else
+			*ptr = 0;
+	} else {
+		cs_watch_name = dir;
+		dir = _strdup(".");
+	}
+
+	cs_wd = inotify_add_watch(cs_hnd.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+	if (cs_wd < 0)
+		log_error("chap-secrets: inotify_add_watch '%s': %s\n", dir, strerror(errno));
+
+	_free(dir);
+}
+
+static int cs_inotify_read(struct triton_md_handler_t *h)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	char *ptr;
+	int n, reload = 0;
+
+	while (1) {
+		n = read(h->fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno != EAGAIN)
+				log_error("chap-secrets: inotify read: %s\n", strerror(errno));
+			break;
+		}
+
+		for (ptr = buf; ptr < buf + n; ptr += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)ptr;
+			if (ev->wd == cs_wd && ev->len && !strcmp(ev->name, cs_watch_name))
+				reload = 1;
+		}
+	}
+
+	if (reload)
+		load_secrets();
+
+	return 0;
+}
+
+static void reload_secrets(void)
+{
+	if (cs_hnd.tpd)
+		setup_watch();
+
+	load_secrets();
+}
+
+static void cs_ctx_close(struct triton_context_t *ctx)
+{
+	if (cs_hnd.tpd) {
+		triton_md_unregister_handler(&cs_hnd);
+		close(cs_hnd.fd);
+	}
+
+	triton_context_unregister(ctx);
+}
+
 static void load_config(void)
 {
 	const char *opt;
@@ -727,16 +953,42 @@ static void load_config(void)
 #endif
 }
 
+/* the file name is used by cs_ctx, so it is replaced there */
+static void reload_config(void)
+{
+	load_config();
+	reload_secrets();
+}
+
+static void ev_config_reload(void)
+{
+	triton_context_call(&cs_ctx, (triton_event_func)reload_config, NULL);
+}
+
 static void init(void)
 {
 	load_config();
 
+	triton_context_register(&cs_ctx, NULL);
+
+	cs_hnd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cs_hnd.fd < 0)
+		log_error("chap-secrets: inotify_init: %s, automatic reload disabled\n", strerror(errno));
+	else {
+		triton_md_register_handler(&cs_ctx, &cs_hnd);
+		triton_md_enable_handler(&cs_hnd, MD_MODE_READ);
+	}
+
+	reload_secrets();
+
+	triton_context_wakeup(&cs_ctx);
+
 	pwdb_register(&pwdb);
 	ipdb_register(&ipdb);
 	
 	triton_event_register_handler(EV_PPP_FINISHED, (triton_event_func)ev_ppp_finished);
 	triton_event_register_handler(EV_PPP_PRE_UP, (triton_event_func)ev_ppp_pre_up);
-	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
+	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)ev_config_reload);
 }
 
 DEFINE_INIT(51, init);
@@ -3,104 +3,213 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "ppp.h"
 #include "events.h"
 #include "triton.h"
 #include "log.h"
+#include "cli.h"
+#include "mempool.h"
 
 #include "memdebug.h"
 
+/*
+ * Entries are hashed by key into CL_SHARDS independently locked shards.
+ * Every shard keeps its entries on a wheel of one second slots by the
+ * time they were last refreshed, a timer frees entries of the slot which
+ * has just become older than the burst timeout.
+ */
+#define CL_SHARDS 16
+#define CL_HASH_SIZE 1024
+#define CL_WHEEL_SIZE 256
+
 struct item
 {
 	struct list_head entry;
+	struct item *next;
 	uint64_t key;
-	struct timespec ts;
+	int64_t ts;
 	int count;
 };
 
+struct cl_shard
+{
+	pthread_mutex_t lock;
+	struct item *hash[CL_HASH_SIZE];
+	struct list_head wheel[CL_WHEEL_SIZE];
+	unsigned int count;
+};
+
 static int conf_burst = 3;
 static int conf_burst_timeout = 60 * 1000;
 static int conf_limit_timeout = 5000;
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(items);
+static struct cl_shard shards[CL_SHARDS];
+static mempool_t item_pool;
+static struct triton_timer_t expire_timer;
+static time_t expire_sec;
+
+static unsigned long stat_accept;
+static unsigned long stat_drop;
+static unsigned long stat_new;
+static unsigned long stat_expired;
+
+static inline uint64_t key_hash(uint64_t key)
+{
+	return key * 0x9e3779b97f4a7c15ull;
+}
+
+static void item_touch(struct cl_shard *sh, struct item *it, struct timespec *ts, int64_t now)
+{
+	it->ts = now;
+	list_move_tail(&it->entry, &sh->wheel[ts->tv_sec % CL_WHEEL_SIZE]);
+}
 
 int __export connlimit_check(uint64_t key)
 {
+	uint64_t h = key_hash(key);
+	struct cl_shard *sh = &shards[(h >> 48) % CL_SHARDS];
+	struct item **head = &sh->hash[(h >> 32) % CL_HASH_SIZE];
 	struct item *it;
 	struct timespec ts;
-	unsigned int d;
-	struct list_head *pos, *n;
-	LIST_HEAD(tmp_list);
-	int r = 1;
+	int64_t now, d;
+	int r = 0;
 
-	
 	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 
-	pthread_mutex_lock(&lock);
+	pthread_mutex_lock(&sh->lock);
 	log_debug("connlimit: check entry %" PRIu64 "\n", key);
-	list_for_each_safe(pos, n, &items) {
-		it = list_entry(pos, typeof(*it), entry);
-
-		d = (ts.tv_sec - it->ts.tv_sec) * 1000 + (ts.tv_nsec - it->ts.tv_nsec) / 1000000;
-
-		if (it->key == key) {
-			if (d >= conf_burst_timeout) {
-				it->ts = ts;
-				list_move(&it->entry, &items);
-				it->count = 0;
-				r = 0;
-				break;
-			}
-			it->count++;
-			if (it->count >= conf_burst) {
-				if (d >= conf_limit_timeout) {
-					it->ts = ts;
-					list_move(&it->entry, &items);
-					r = 0;
-				} else
-					r = -1;
-			} else
-				r = 0;
+
+	for (it = *head; it; it = it->next) {
+		if (it->key == key)
 			break;
-		}
+	}
 
-		if (d > conf_burst_timeout) {
-			log_debug("connlimit: remove %" PRIu64 "\n", it->key);
-			list_move(&it->entry, &tmp_list);
+	if (it) {
+		d = now - it->ts;
+
+		if (d >= conf_burst_timeout) {
+			item_touch(sh, it, &ts, now);
+			it->count = 0;
+		} else if (++it->count >= conf_burst) {
+			if (d >= conf_limit_timeout)
+				item_touch(sh, it, &ts, now);
+			else
+				r = -1;
+		}
+	} else {
+		it = mempool_alloc(item_pool);
+		if (it) {
+			memset(it, 0, sizeof(*it));
+			it->key = key;
+			it->next = *head;
+			*head = it;
+			INIT_LIST_HEAD(&it->entry);
+			item_touch(sh, it, &ts, now);
+			sh->count++;
+			__sync_add_and_fetch(&stat_new, 1);
+			log_debug("connlimit: add entry %" PRIu64 "\n", key);
 		}
 	}
-	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&sh->lock);
 
-	if (r == 1) {
-		it = _malloc(sizeof(*it));
-		memset(it, 0, sizeof(*it));
-		it->ts = ts;
-		it->key = key;
+	if (r == 0) {
+		__sync_add_and_fetch(&stat_accept, 1);
+		log_debug("connlimit: accept %" PRIu64 "\n", key);
+	} else {
+		__sync_add_and_fetch(&stat_drop, 1);
+		log_debug("connlimit: drop %" PRIu64 "\n", key);
+	}
 
-		log_debug("connlimit: add entry %" PRIu64 "\n", key);
+	return r;
+}
 
-		pthread_mutex_lock(&lock);
-		list_add(&it->entry, &items);
-		pthread_mutex_unlock(&lock);
+static void item_unhash(struct cl_shard *sh, struct item *it)
+{
+	uint64_t h = key_hash(it->key);
+	struct item **p = &sh->hash[(h >> 32) % CL_HASH_SIZE];
 
-		r = 0;
+	for (; *p; p = &(*p)->next) {
+		if (*p == it) {
+			*p = it->next;
+			break;
+		}
 	}
-	
-	if (r == 0)
-		log_debug("connlimit: accept %" PRIu64 "\n", key);
-	else
-		log_debug("connlimit: drop %" PRIu64 "\n", key);
+}
 
-	
-	while (!list_empty(&tmp_list)) {
-		it = list_entry(tmp_list.next, typeof(*it), entry);
-		list_del(&it->entry);
-		_free(it);
+/* frees entries of the given second, entries which are still fresh belong to a later turn of the wheel */
+static void expire_slot(time_t sec, int64_t now)
+{
+	struct cl_shard *sh;
+	struct list_head *pos, *n, *slot;
+	struct item *it;
+	int i, cnt = 0;
+
+	for (i = 0; i < CL_SHARDS; i++) {
+		sh = &shards[i];
+		slot = &sh->wheel[sec % CL_WHEEL_SIZE];
+
+		pthread_mutex_lock(&sh->lock);
+		list_for_each_safe(pos, n, slot) {
+			it = list_entry(pos, typeof(*it), entry);
+			if (now - it->ts <= conf_burst_timeout)
+				continue;
+			log_debug("connlimit: remove %" PRIu64 "\n", it->key);
+			list_del(&it->entry);
+			item_unhash(sh, it);
+			mempool_free(it);
+			sh->count--;
+			cnt++;
+		}
+		pthread_mutex_unlock(&sh->lock);
 	}
 
-	return r;
+	if (cnt)
+		__sync_add_and_fetch(&stat_expired, cnt);
+}
+
+static void expire_timer_func(struct triton_timer_t *t)
+{
+	struct timespec ts;
+	int64_t now;
+	time_t sec;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	/* last second all of whose entries are older than burst timeout */
+	sec = (now - conf_burst_timeout) / 1000 - 1;
+	if (sec < 0)
+		return;
+
+	if (sec - expire_sec > CL_WHEEL_SIZE)
+		expire_sec = sec - CL_WHEEL_SIZE;
+	if (expire_sec < -1)
+		expire_sec = -1;
+
+	for (i = 0; expire_sec < sec && i < CL_WHEEL_SIZE; i++)
+		expire_slot(++expire_sec, now);
+}
+
+static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
+{
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < CL_SHARDS; i++)
+		count += shards[i].count;
+
+	cli_send(client, "connlimit:\r\n");
+	cli_sendv(client, "  entries: %u\r\n", count);
+	cli_sendv(client, "  new: %lu\r\n", stat_new);
+	cli_sendv(client, "  accept: %lu\r\n", stat_accept);
+	cli_sendv(client, "  drop: %lu\r\n", stat_drop);
+	cli_sendv(client, "  expired: %lu\r\n", stat_expired);
+
+	return CLI_CMD_OK;
 }
 
 static int parse_limit(const char *opt, int *limit, int *time)
@@ -164,8 +273,28 @@ static void load_config()
 
 static void init()
 {
+	struct timespec ts;
+	int i, j;
+
+	for (i = 0; i < CL_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		for (j = 0; j < CL_WHEEL_SIZE; j++)
+			INIT_LIST_HEAD(&shards[i].wheel[j]);
+	}
+
+	item_pool = mempool_create(sizeof(struct item));
+
 	load_config();
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	expire_sec = ts.tv_sec - conf_burst_timeout / 1000 - 1;
+
+	expire_timer.expire = expire_timer_func;
+	expire_timer.period = 1000;
+	triton_timer_add(NULL, &expire_timer, 0);
+
+	cli_register_simple_cmd2(show_stat_exec, NULL, 2, "show", "stat");
+
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 }
 
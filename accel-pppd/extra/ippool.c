@@ -304,9 +304,51 @@ static void put_ip(struct ppp_t *ppp, struct ipv4db_item_t *it)
 	}
 }
 
+static struct ippool_item_t *claim_item(struct ippool_t *p, in_addr_t addr, in_addr_t peer_addr)
+{
+	struct ippool_item_t *it;
+
+	spin_lock(&p->lock);
+	list_for_each_entry(it, &p->items, entry) {
+		if (it->it.addr == addr && it->it.peer_addr == peer_addr) {
+			list_del(&it->entry);
+			spin_unlock(&p->lock);
+			return it;
+		}
+	}
+	spin_unlock(&p->lock);
+
+	return NULL;
+}
+
+static struct ipv4db_item_t *restore_ip(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr)
+{
+	struct ippool_item_t *it;
+	struct ippool_t *p;
+
+	spin_lock(&persist_pool->lock);
+	it = find_persist_item2(peer_addr);
+	spin_unlock(&persist_pool->lock);
+	if (it)
+		return &it->it;
+
+	it = claim_item(def_pool, addr, peer_addr);
+	if (it)
+		return &it->it;
+
+	list_for_each_entry(p, &pool_list, entry) {
+		it = claim_item(p, addr, peer_addr);
+		if (it)
+			return &it->it;
+	}
+
+	return NULL;
+}
+
 static struct ipdb_t ipdb = {
 	.get_ipv4 = get_ip,
 	.put_ipv4 = put_ip,
+	.restore_ipv4 = restore_ip,
 };
 
 #ifdef RADIUS
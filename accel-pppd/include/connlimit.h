@@ -13,6 +13,7 @@ static inline uint64_t cl_key_from_mac(uint8_t hw[6])
 		uint64_t key;
 	} key;
 
+	key.key = 0;
 	memcpy(key.hw, hw, sizeof(key.hw));
 
 	return key.key;
@@ -17,6 +17,9 @@
 #define EV_CONFIG_RELOAD		11
 #define EV_PPP_AUTH_FAILED  12
 #define EV_PPP_PRE_FINISHED 13
+#define EV_UPGRADE          14
+#define EV_PPP_UPGRADE_SAVE    15
+#define EV_PPP_UPGRADE_RESTORE 16
 #define EV_IP_CHANGED       100
 #define EV_SHAPER           101
 #define EV_MPPE_KEYS        102
@@ -27,6 +30,7 @@
 
 struct ppp_t;
 struct rad_packet_t;
+struct upgrade_rec_t;
 struct ev_radius_t
 {
 	struct ppp_t *ppp;
@@ -63,4 +67,11 @@ struct ev_wins_t
 	in_addr_t wins1;
 	in_addr_t wins2;
 };
+
+struct ev_upgrade_t
+{
+	struct ppp_t *ppp;
+	struct upgrade_rec_t *rec;
+};
+
 #endif
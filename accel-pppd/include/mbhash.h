@@ -0,0 +1 @@
+../../crypto/mbhash.h
\ No newline at end of file
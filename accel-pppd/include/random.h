@@ -0,0 +1 @@
+../random.h
\ No newline at end of file
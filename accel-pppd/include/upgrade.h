@@ -0,0 +1 @@
+../upgrade.h
\ No newline at end of file
@@ -1,10 +1,22 @@
+#include <stdlib.h>
+
 #include "triton.h"
 #include "ipdb.h"
+#include "log.h"
 
 #include "memdebug.h"
 
 static LIST_HEAD(ipdb_handlers);
 
+static void restore_put_ipv4(struct ppp_t *ppp, struct ipv4db_item_t *it)
+{
+	_free(it);
+}
+
+static struct ipdb_t restore_ipdb = {
+	.put_ipv4 = restore_put_ipv4,
+};
+
 struct ipv4db_item_t __export *ipdb_get_ipv4(struct ppp_t *ppp)
 {
 	struct ipdb_t *ipdb;
@@ -27,6 +39,33 @@ void __export ipdb_put_ipv4(struct ppp_t *ppp, struct ipv4db_item_t *it)
 		it->owner->put_ipv4(ppp, it);
 }
 
+struct ipv4db_item_t __export *ipdb_restore_ipv4(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr)
+{
+	struct ipdb_t *ipdb;
+	struct ipv4db_item_t *it;
+
+	list_for_each_entry(ipdb, &ipdb_handlers, entry) {
+		if (!ipdb->restore_ipv4)
+			continue;
+		it = ipdb->restore_ipv4(ppp, addr, peer_addr);
+		if (it)
+			return it;
+	}
+
+	/* address came from a source which doesn't track it, keep it as is */
+	it = _malloc(sizeof(*it));
+	if (!it) {
+		log_emerg("ipdb: out of memory\n");
+		return NULL;
+	}
+
+	it->owner = &restore_ipdb;
+	it->addr = addr;
+	it->peer_addr = peer_addr;
+
+	return it;
+}
+
 struct ipv6db_item_t __export *ipdb_get_ipv6(struct ppp_t *ppp)
 {
 	struct ipdb_t *ipdb;
@@ -42,6 +42,7 @@ struct ipdb_t
 	
 	struct ipv4db_item_t *(*get_ipv4)(struct ppp_t *ppp);
 	void (*put_ipv4)(struct ppp_t *ppp, struct ipv4db_item_t *);
+	struct ipv4db_item_t *(*restore_ipv4)(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr);
 
 	struct ipv6db_item_t *(*get_ipv6)(struct ppp_t *ppp);
 	void (*put_ipv6)(struct ppp_t *ppp, struct ipv6db_item_t *);
@@ -52,6 +53,7 @@ struct ipdb_t
 
 struct ipv4db_item_t *ipdb_get_ipv4(struct ppp_t *ppp);
 void ipdb_put_ipv4(struct ppp_t *ppp, struct ipv4db_item_t *);
+struct ipv4db_item_t *ipdb_restore_ipv4(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr);
 
 struct ipv6db_item_t *ipdb_get_ipv6(struct ppp_t *ppp);
 void ipdb_put_ipv6(struct ppp_t *ppp, struct ipv6db_item_t *);
@@ -14,9 +14,11 @@
 #include "memdebug.h"
 #include "log.h"
 #include "events.h"
+#include "upgrade.h"
 
 static char *pid_file;
 static char *conf_file;
+static int upgrade_fd = -1;
 
 #ifdef CRYPTO_OPENSSL
 #include <openssl/ssl.h>
@@ -112,6 +114,10 @@ int main(int argc, char **argv)
 			if (i == argc - 1)
 				goto usage;
 			conf_file = argv[++i];
+		} else if (!strcmp(argv[i], "-u")) {
+			if (i == argc - 1)
+				goto usage;
+			upgrade_fd = atoi(argv[++i]);
 		}
 	}
 
@@ -121,6 +127,8 @@ int main(int argc, char **argv)
 	if (triton_init(conf_file))
 		_exit(EXIT_FAILURE);
 
+	upgrade_setup(argc, argv);
+
 	if (goto_daemon) {
 		/*pid_t pid = fork();
 		if (pid > 0)
@@ -193,9 +201,16 @@ int main(int argc, char **argv)
 	sigaddset(&set, SIGILL);
 	sigaddset(&set, SIGFPE);
 	sigaddset(&set, SIGBUS);
+
+	if (upgrade_fd >= 0)
+		upgrade_restore(upgrade_fd);
 	
 	sigwait(&set, &sig);
 	log_info1("terminate, sig = %i\n", sig);
+
+	/* sessions belong to the new process now, don't tear them down */
+	if (upgrade_handover)
+		_exit(EXIT_SUCCESS);
 	
 	triton_terminate();
 
@@ -206,7 +221,8 @@ usage:
 	where:\n\
 		-d - daemon mode\n\
 		-p - write pid to <file>\n\
-		-c - config file\n");
+		-c - config file\n\
+		-u - take over sessions from old process through <fd> (used by 'upgrade' command)\n");
 	_exit(EXIT_FAILURE);
 }
 
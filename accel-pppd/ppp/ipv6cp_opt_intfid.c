@@ -15,6 +15,7 @@
 #include "ppp_ccp.h"
 #include "ppp_ipv6cp.h"
 #include "ipdb.h"
+#include "random.h"
 
 #include "memdebug.h"
 
@@ -122,7 +123,7 @@ static uint64_t generate_intf_id(struct ppp_t *ppp)
 			break;
 		//case INTF_ID_RANDOM:
 		default:
-			read(urandom_fd, &id, 8);
+			u_randbuf(&id, 8);
 			break;
 	}
 
@@ -143,7 +144,7 @@ static uint64_t generate_peer_intf_id(struct ppp_t *ppp)
 			return conf_peer_intf_id_val;
 			break;
 		case INTF_ID_RANDOM:
-			read(urandom_fd, &u, sizeof(u));
+			u_randbuf(&u, sizeof(u));
 			break;
 		case INTF_ID_CSID:
 			break;
@@ -8,6 +8,7 @@
 #include <arpa/inet.h>
 #include <features.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include "linux_ppp.h"
@@ -23,6 +24,7 @@
 #include "log.h"
 #include "spinlock.h"
 #include "mempool.h"
+#include "upgrade.h"
 
 #include "memdebug.h"
 
@@ -30,6 +32,9 @@ int __export conf_ppp_verbose;
 int conf_sid_ucase;
 int conf_single_session = -1;
 int conf_unit_cache = 0;
+static int conf_max_starting;
+static int conf_admission_rate;
+static int conf_admission_burst;
 
 pthread_rwlock_t __export ppp_lock = PTHREAD_RWLOCK_INITIALIZER;
 __export LIST_HEAD(ppp_list);
@@ -51,6 +56,10 @@ static spinlock_t seq_lock;
 
 __export struct ppp_stat_t ppp_stat;
 
+static spinlock_t admission_lock = SPINLOCK_INITIALIZER;
+static long long admission_tokens; // in 1/1000 of token
+static struct timespec admission_ts;
+
 struct layer_node_t
 {
 	struct list_head entry;
@@ -729,6 +738,63 @@ struct ppp_layer_data_t *ppp_find_layer_data(struct ppp_t *ppp, struct ppp_layer
 	return NULL;
 }
 
+static int admission(int take)
+{
+	struct timespec ts;
+	long long d;
+	int r = 0;
+
+	if (conf_max_starting && ppp_stat.starting >= conf_max_starting)
+		goto out_drop;
+
+	if (!conf_admission_rate)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	spin_lock(&admission_lock);
+	d = (ts.tv_sec - admission_ts.tv_sec) * 1000ll + (ts.tv_nsec - admission_ts.tv_nsec) / 1000000;
+	if (d > 0) {
+		admission_tokens += d * conf_admission_rate;
+		if (admission_tokens > conf_admission_burst * 1000ll)
+			admission_tokens = conf_admission_burst * 1000ll;
+		admission_ts = ts;
+	}
+	if (admission_tokens < 1000)
+		r = -1;
+	else if (take)
+		admission_tokens -= 1000;
+	spin_unlock(&admission_lock);
+
+	if (r == 0)
+		return 0;
+
+out_drop:
+	if (take)
+		__sync_add_and_fetch(&ppp_stat.admission_drop, 1);
+
+	return -1;
+}
+
+/*
+ * Checks whether a new session would be admitted now without consuming
+ * a token, used on early discovery stages (PADI) which do not
+ * necessarily lead to a session.
+ */
+int __export ppp_admission_check(void)
+{
+	return admission(0);
+}
+
+/*
+ * Consumes a token for a new session, returns -1 if the session must be
+ * shed (too many sessions in starting state or rate exceeded).
+ */
+int __export ppp_admission_acquire(void)
+{
+	return admission(1);
+}
+
 void ppp_shutdown_soft(void)
 {
 	ppp_shutdown = 1;
@@ -737,6 +803,7 @@ void ppp_shutdown_soft(void)
 		kill(getpid(), SIGTERM);
 }
 
+
 static void save_seq(void)
 {
 	FILE *f;
@@ -751,6 +818,225 @@ static void save_seq(void)
 	}
 }
 
+int __export ppp_upgrade_save(struct ppp_t *ppp, struct upgrade_rec_t *rec)
+{
+	struct layer_node_t *n;
+	struct ppp_layer_data_t *d;
+	struct ev_upgrade_t ev = {
+		.ppp = ppp,
+		.rec = rec,
+	};
+	uint32_t acct[8];
+
+	ppp_read_stats(ppp, NULL);
+
+	upgrade_put_fd(rec, ppp->fd);
+	upgrade_put_fd(rec, ppp->chan_fd);
+	upgrade_put_fd(rec, ppp->unit_fd);
+
+	upgrade_put(rec, UPG_PPP_SESSIONID, ppp->sessionid, PPP_SESSIONID_LEN);
+	upgrade_put_str(rec, UPG_PPP_IFNAME, ppp->ifname);
+	upgrade_put(rec, UPG_PPP_CHAN_IDX, &ppp->chan_idx, sizeof(ppp->chan_idx));
+	upgrade_put(rec, UPG_PPP_UNIT_IDX, &ppp->unit_idx, sizeof(ppp->unit_idx));
+	upgrade_put(rec, UPG_PPP_START_TIME, &ppp->start_time, sizeof(ppp->start_time));
+	upgrade_put_str(rec, UPG_PPP_USERNAME, ppp->username);
+	upgrade_put_str(rec, UPG_PPP_CHARGEABLE_IDENTITY, ppp->chargeable_identity);
+	upgrade_put_str(rec, UPG_PPP_IPV4_POOL, ppp->ipv4_pool_name);
+	upgrade_put_str(rec, UPG_PPP_IPV6_POOL, ppp->ipv6_pool_name);
+
+	if (ppp->ipv4) {
+		upgrade_put(rec, UPG_PPP_IPV4_ADDR, &ppp->ipv4->addr, sizeof(in_addr_t));
+		upgrade_put(rec, UPG_PPP_IPV4_PEER_ADDR, &ppp->ipv4->peer_addr, sizeof(in_addr_t));
+	}
+
+	acct[0] = ppp->acct_rx_bytes;
+	acct[1] = ppp->acct_tx_bytes;
+	acct[2] = ppp->acct_input_gigawords;
+	acct[3] = ppp->acct_output_gigawords;
+	acct[4] = ppp->acct_rx_packets_i;
+	acct[5] = ppp->acct_tx_packets_i;
+	acct[6] = ppp->acct_rx_bytes_i;
+	acct[7] = ppp->acct_tx_bytes_i;
+	upgrade_put(rec, UPG_PPP_ACCT, acct, sizeof(acct));
+
+	list_for_each_entry(n, &ppp->layers, entry) {
+		list_for_each_entry(d, &n->items, entry) {
+			if (d->started && d->layer->save)
+				d->layer->save(d, rec);
+		}
+	}
+
+	triton_event_fire(EV_PPP_UPGRADE_SAVE, &ev);
+
+	return rec->err ? -1 : 0;
+}
+
+/* old process: forget the session after it was handed over, without touching the link */
+void __export ppp_upgrade_detach(struct ppp_t *ppp)
+{
+	pthread_rwlock_wrlock(&ppp_lock);
+	list_del(&ppp->entry);
+	pthread_rwlock_unlock(&ppp_lock);
+
+	__sync_sub_and_fetch(&ppp_stat.active, 1);
+
+	triton_md_unregister_handler(&ppp->chan_hnd);
+	triton_md_unregister_handler(&ppp->unit_hnd);
+
+	close(ppp->unit_fd);
+	close(ppp->chan_fd);
+	close(ppp->fd);
+
+	ppp->unit_fd = -1;
+	ppp->chan_fd = -1;
+	ppp->fd = -1;
+
+	_free_layers(ppp);
+
+	ppp->terminated = 1;
+
+	log_ppp_info1("upgrade: session handed over\n");
+}
+
+/*
+ * new process: take over the session passed by the old one. If it fails
+ * once the session is set up, the session is destroyed (ctrl->finished
+ * is called) and -1 is returned, the caller releases only its channel.
+ */
+int __export ppp_upgrade_restore(struct ppp_t *ppp, struct upgrade_rec_t *rec)
+{
+	struct layer_node_t *n;
+	struct ppp_layer_data_t *d;
+	struct ifreq ifr;
+	struct ev_upgrade_t ev = {
+		.ppp = ppp,
+		.rec = rec,
+	};
+	in_addr_t addr, peer_addr;
+	uint32_t acct[8];
+	char *ifname;
+	int r;
+
+	if (rec->fd_cnt < 3) {
+		log_ppp_error("ppp: upgrade: missing descriptors\n");
+		return -1;
+	}
+
+	ifname = upgrade_get_str(rec, UPG_PPP_IFNAME);
+	if (!ifname || strlen(ifname) >= PPP_IFNAME_LEN ||
+			upgrade_get_val(rec, UPG_PPP_SESSIONID, ppp->sessionid, PPP_SESSIONID_LEN) ||
+			upgrade_get_val(rec, UPG_PPP_CHAN_IDX, &ppp->chan_idx, sizeof(ppp->chan_idx)) ||
+			upgrade_get_val(rec, UPG_PPP_UNIT_IDX, &ppp->unit_idx, sizeof(ppp->unit_idx)) ||
+			upgrade_get_val(rec, UPG_PPP_START_TIME, &ppp->start_time, sizeof(ppp->start_time)) ||
+			upgrade_get_val(rec, UPG_PPP_ACCT, acct, sizeof(acct))) {
+		log_ppp_error("ppp: upgrade: malformed session record\n");
+		if (ifname)
+			_free(ifname);
+		return -1;
+	}
+
+	strcpy(ppp->ifname, ifname);
+	_free(ifname);
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, ppp->ifname);
+
+	if (ioctl(sock_fd, SIOCGIFINDEX, &ifr)) {
+		log_ppp_error("ppp: ioctl(SIOCGIFINDEX): %s\n", strerror(errno));
+		return -1;
+	}
+	ppp->ifindex = ifr.ifr_ifindex;
+
+	ppp->fd = rec->fds[0];
+	ppp->chan_fd = rec->fds[1];
+	ppp->unit_fd = rec->fds[2];
+	/* the descriptors belong to the session now */
+	rec->fd_cnt = 0;
+
+	ppp->username = upgrade_get_str(rec, UPG_PPP_USERNAME);
+	ppp->chargeable_identity = upgrade_get_str(rec, UPG_PPP_CHARGEABLE_IDENTITY);
+	ppp->ipv4_pool_name = upgrade_get_str(rec, UPG_PPP_IPV4_POOL);
+	ppp->ipv6_pool_name = upgrade_get_str(rec, UPG_PPP_IPV6_POOL);
+
+	ppp->acct_rx_bytes = acct[0];
+	ppp->acct_tx_bytes = acct[1];
+	ppp->acct_input_gigawords = acct[2];
+	ppp->acct_output_gigawords = acct[3];
+	ppp->acct_rx_packets_i = acct[4];
+	ppp->acct_tx_packets_i = acct[5];
+	ppp->acct_rx_bytes_i = acct[6];
+	ppp->acct_tx_bytes_i = acct[7];
+
+	log_ppp_info1("upgrade: %s <--> %s(%s)\n", ppp->ifname, ppp->ctrl->name, ppp->chan_name);
+
+	init_layers(ppp);
+
+	ppp->buf = mempool_alloc(buf_pool);
+
+	ppp->chan_hnd.fd = ppp->chan_fd;
+	ppp->chan_hnd.read = ppp_chan_read;
+	ppp->unit_hnd.fd = ppp->unit_fd;
+	ppp->unit_hnd.read = ppp_unit_read;
+	triton_md_register_handler(ppp->ctrl->ctx, &ppp->chan_hnd);
+	triton_md_register_handler(ppp->ctrl->ctx, &ppp->unit_hnd);
+
+	triton_md_enable_handler(&ppp->chan_hnd, MD_MODE_READ);
+	triton_md_enable_handler(&ppp->unit_hnd, MD_MODE_READ);
+
+	ppp->state = PPP_STATE_ACTIVE;
+	__sync_add_and_fetch(&ppp_stat.active, 1);
+
+	pthread_rwlock_wrlock(&ppp_lock);
+	list_add_tail(&ppp->entry, &ppp_list);
+	pthread_rwlock_unlock(&ppp_lock);
+
+	triton_event_fire(EV_PPP_STARTING, ppp);
+
+	if (!upgrade_get_val(rec, UPG_PPP_IPV4_ADDR, &addr, sizeof(addr)) &&
+			!upgrade_get_val(rec, UPG_PPP_IPV4_PEER_ADDR, &peer_addr, sizeof(peer_addr))) {
+		ppp->ipv4 = ipdb_restore_ipv4(ppp, addr, peer_addr);
+		if (!ppp->ipv4) {
+			ppp_terminate(ppp, TERM_NAS_ERROR, 1);
+			return -1;
+		}
+	}
+
+	triton_event_fire(EV_PPP_UPGRADE_RESTORE, &ev);
+
+	/* a module failed to restore its state and terminated the session */
+	if (ppp->terminating) {
+		ppp_terminate(ppp, TERM_NAS_ERROR, 1);
+		return -1;
+	}
+
+	/* layers which can't resume their state stay idle until the session ends */
+	list_for_each_entry(n, &ppp->layers, entry) {
+		list_for_each_entry(d, &n->items, entry) {
+			if (!d->layer->restore)
+				continue;
+			r = d->layer->restore(d, rec);
+			if (r < 0) {
+				ppp_terminate(ppp, TERM_NAS_ERROR, 1);
+				return -1;
+			}
+			if (r)
+				continue;
+			d->starting = 1;
+			d->started = 1;
+		}
+	}
+
+	return 0;
+}
+
+static void ppp_upgrade_prepare(void)
+{
+	ppp_shutdown = 1;
+
+	/* the new process picks up sequence from the seq-file */
+	save_seq();
+}
+
 int __export ppp_read_stats(struct ppp_t *ppp,  struct rtnl_link_stats *stats)
 {
 	struct rtnl_link_stats lstats;
@@ -809,6 +1095,29 @@ static void load_config(void)
 		conf_unit_cache = atoi(opt);
 	else
 		conf_unit_cache = 0;
+
+	opt = conf_get_opt("ppp", "max-starting");
+	if (opt && atoi(opt) > 0)
+		conf_max_starting = atoi(opt);
+	else
+		conf_max_starting = 0;
+
+	opt = conf_get_opt("ppp", "admission-rate");
+	if (opt && atoi(opt) > 0)
+		conf_admission_rate = atoi(opt);
+	else
+		conf_admission_rate = 0;
+
+	opt = conf_get_opt("ppp", "admission-burst");
+	if (opt && atoi(opt) > 0)
+		conf_admission_burst = atoi(opt);
+	else
+		conf_admission_burst = conf_admission_rate;
+
+	spin_lock(&admission_lock);
+	if (admission_tokens > conf_admission_burst * 1000ll)
+		admission_tokens = conf_admission_burst * 1000ll;
+	spin_unlock(&admission_lock);
 }
 
 static void init(void)
@@ -854,6 +1163,7 @@ static void init(void)
 
 	load_config();
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
+	triton_event_register_handler(EV_UPGRADE, (triton_event_func)ppp_upgrade_prepare);
 
 	atexit(save_seq);
 }
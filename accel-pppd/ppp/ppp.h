@@ -68,6 +68,7 @@
 #define MPPE_REQUIRE 2
 
 struct ppp_t;
+struct upgrade_rec_t;
 
 struct ipv4db_item_t;
 struct ipv6db_item_t;
@@ -84,6 +85,7 @@ struct ppp_ctrl_t
 	char *called_station_id;
 	void (*started)(struct ppp_t*);
 	void (*finished)(struct ppp_t*);
+	int (*upgrade)(struct ppp_t*);
 };
 
 struct ppp_pd_t
@@ -168,6 +170,9 @@ struct ppp_layer_t
 	int (*start)(struct ppp_layer_data_t*);
 	void (*finish)(struct ppp_layer_data_t*);
 	void (*free)(struct ppp_layer_data_t *);
+	void (*save)(struct ppp_layer_data_t *, struct upgrade_rec_t *);
+	/* returns 0 if state was restored, 1 if nothing was saved, -1 on error */
+	int (*restore)(struct ppp_layer_data_t *, struct upgrade_rec_t *);
 };
 
 struct ppp_handler_t
@@ -183,6 +188,7 @@ struct ppp_stat_t
 	unsigned int active;
 	unsigned int starting;
 	unsigned int finishing;
+	unsigned int admission_drop;
 };
 
 struct ppp_t *alloc_ppp(void);
@@ -216,6 +222,13 @@ int ppp_read_stats(struct ppp_t *ppp,  struct rtnl_link_stats *stats);
 extern int ppp_shutdown;
 void ppp_shutdown_soft(void);
 
+int ppp_admission_check(void);
+int ppp_admission_acquire(void);
+
+int ppp_upgrade_save(struct ppp_t *ppp, struct upgrade_rec_t *rec);
+void ppp_upgrade_detach(struct ppp_t *ppp);
+int ppp_upgrade_restore(struct ppp_t *ppp, struct upgrade_rec_t *rec);
+
 int ppp_ipv6_nd_start(struct ppp_t *ppp, uint64_t intf_id);
 
 extern int conf_ppp_verbose;
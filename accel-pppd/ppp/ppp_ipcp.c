@@ -12,6 +12,7 @@
 #include "ppp.h"
 #include "ppp_ipcp.h"
 #include "ipdb.h"
+#include "upgrade.h"
 
 #include "memdebug.h"
 
@@ -176,6 +177,33 @@ void ipcp_layer_free(struct ppp_layer_data_t *ld)
 	_free(ipcp);
 }
 
+static void ipcp_layer_save(struct ppp_layer_data_t *ld, struct upgrade_rec_t *rec)
+{
+	struct ppp_ipcp_t *ipcp = container_of(ld, typeof(*ipcp), ld);
+
+	if (ipcp->fsm.fsm_state == FSM_Opened)
+		upgrade_put(rec, UPG_IPCP_ID, &ipcp->fsm.id, sizeof(ipcp->fsm.id));
+}
+
+static int ipcp_layer_restore(struct ppp_layer_data_t *ld, struct upgrade_rec_t *rec)
+{
+	struct ppp_ipcp_t *ipcp = container_of(ld, typeof(*ipcp), ld);
+
+	log_ppp_debug("ipcp_layer_restore\n");
+
+	if (upgrade_get_val(rec, UPG_IPCP_ID, &ipcp->fsm.id, sizeof(ipcp->fsm.id)))
+		return 1;
+
+	if (!ipcp->ppp->ipv4)
+		return -1;
+
+	ipcp->fsm.fsm_state = FSM_Opened;
+	ipcp->starting = 1;
+	ipcp->started = 1;
+
+	return 0;
+}
+
 static void __ipcp_layer_up(struct ppp_ipcp_t *ipcp)
 {
 	log_ppp_debug("ipcp_layer_started\n");
@@ -805,6 +833,8 @@ static struct ppp_layer_t ipcp_layer =
 	.start  = ipcp_layer_start,
 	.finish = ipcp_layer_finish,
 	.free   = ipcp_layer_free,
+	.save   = ipcp_layer_save,
+	.restore = ipcp_layer_restore,
 };
 
 static void load_config(void)
@@ -12,6 +12,7 @@
 #include "ppp.h"
 #include "ppp_lcp.h"
 #include "events.h"
+#include "upgrade.h"
 
 #include "memdebug.h"
 
@@ -156,6 +157,33 @@ void lcp_layer_free(struct ppp_layer_data_t *ld)
 	_free(lcp);
 }
 
+static void lcp_layer_save(struct ppp_layer_data_t *ld, struct upgrade_rec_t *rec)
+{
+	struct ppp_lcp_t *lcp = container_of(ld, typeof(*lcp), ld);
+
+	upgrade_put(rec, UPG_LCP_MAGIC, &lcp->magic, sizeof(lcp->magic));
+	upgrade_put(rec, UPG_LCP_ID, &lcp->fsm.id, sizeof(lcp->fsm.id));
+}
+
+static int lcp_layer_restore(struct ppp_layer_data_t *ld, struct upgrade_rec_t *rec)
+{
+	struct ppp_lcp_t *lcp = container_of(ld, typeof(*lcp), ld);
+
+	log_ppp_debug("lcp_layer_restore\n");
+
+	lcp_options_init(lcp);
+
+	if (upgrade_get_val(rec, UPG_LCP_MAGIC, &lcp->magic, sizeof(lcp->magic)))
+		return -1;
+	upgrade_get_val(rec, UPG_LCP_ID, &lcp->fsm.id, sizeof(lcp->fsm.id));
+
+	lcp->fsm.fsm_state = FSM_Opened;
+	lcp->started = 1;
+	start_echo(lcp);
+
+	return 0;
+}
+
 static void lcp_layer_up(struct ppp_fsm_t *fsm)
 {
 	struct ppp_lcp_t *lcp = container_of(fsm, typeof(*lcp), fsm);
@@ -901,6 +929,8 @@ static struct ppp_layer_t lcp_layer=
 	.start  = lcp_layer_start,
 	.finish = lcp_layer_finish,
 	.free   = lcp_layer_free,
+	.save   = lcp_layer_save,
+	.restore = lcp_layer_restore,
 };
 
 static void load_config(void)
@@ -31,6 +31,86 @@ int __export pwdb_check(struct ppp_t *ppp, const char *username, int type, ...)
 
 	return res;
 }
+
+struct pwdb_async_t
+{
+	pwdb_callback cb;
+	void *cb_arg;
+	int res;
+};
+
+static void pwdb_check_done(void *arg, int res)
+{
+	struct pwdb_async_t *a = arg;
+	pwdb_callback cb = a->cb;
+	void *cb_arg = a->cb_arg;
+
+	/* a denial falls through to the handlers after the waiting one */
+	if (res != PWDB_SUCCESS && a->res != PWDB_NO_IMPL)
+		res = a->res;
+
+	_free(a);
+
+	cb(cb_arg, res);
+}
+
+/*
+ * Same as pwdb_check but handlers providing check_async may answer
+ * PWDB_WAIT, the result is reported through cb later. The handlers
+ * after the waiting one are checked right away, while the arguments
+ * are valid, and their result is used if the waiting one denies, so
+ * the outcome is the same as of pwdb_check. Input arguments are used
+ * during the call only, output arguments must stay valid until cb is
+ * called.
+ */
+int __export pwdb_check_async(struct ppp_t *ppp, pwdb_callback cb, void *cb_arg, const char *username, int type, ...)
+{
+	struct pwdb_t *pwdb;
+	struct pwdb_async_t *a = NULL;
+	int r, res = PWDB_NO_IMPL;
+	va_list args;
+
+	va_start(args, type);
+
+	list_for_each_entry(pwdb, &pwdb_handlers, entry) {
+		if (pwdb->check_async && !a) {
+			a = _malloc(sizeof(*a));
+			if (!a) {
+				res = PWDB_DENIED;
+				break;
+			}
+			a->cb = cb;
+			a->cb_arg = cb_arg;
+			a->res = PWDB_NO_IMPL;
+			r = pwdb->check_async(pwdb, ppp, pwdb_check_done, a, username, type, args);
+			if (r == PWDB_WAIT) {
+				res = PWDB_WAIT;
+				continue;
+			}
+			_free(a);
+			a = NULL;
+		} else if (pwdb->check)
+			r = pwdb->check(pwdb, ppp, username, type, args);
+		else
+			continue;
+		if (r == PWDB_NO_IMPL)
+			continue;
+		if (res == PWDB_WAIT) {
+			a->res = r;
+			if (r == PWDB_SUCCESS)
+				break;
+			continue;
+		}
+		res = r;
+		if (r == PWDB_SUCCESS)
+			break;
+	}
+
+	va_end(args);
+
+	return res;
+}
+
 __export char *pwdb_get_passwd(struct ppp_t *ppp, const char *username)
 {
 	struct pwdb_t *pwdb;
@@ -13,15 +13,22 @@ struct ppp_t;
 #define PWDB_SUCCESS 0
 #define PWDB_DENIED  1
 #define PWDB_NO_IMPL 2
+#define PWDB_WAIT    3
+
+/* reports the result of a check that returned PWDB_WAIT,
+ * it is called in the session context */
+typedef void (*pwdb_callback)(void *arg, int res);
 
 struct pwdb_t
 {
 	struct list_head entry;
 	int (*check)(struct pwdb_t *, struct ppp_t *, const char *username, int type, va_list args);
+	int (*check_async)(struct pwdb_t *, struct ppp_t *, pwdb_callback cb, void *cb_arg, const char *username, int type, va_list args);
 	char* (*get_passwd)(struct pwdb_t *, struct ppp_t *, const char *username);
 };
 
 int pwdb_check(struct ppp_t *, const char *username, int type, ...);
+int pwdb_check_async(struct ppp_t *, pwdb_callback cb, void *cb_arg, const char *username, int type, ...);
 char *pwdb_get_passwd(struct ppp_t *, const char *username);
 
 void pwdb_register(struct pwdb_t *);
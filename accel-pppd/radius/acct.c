@@ -53,39 +53,17 @@ static void req_set_stat(struct rad_req_t *req, struct ppp_t *ppp)
 	rad_packet_change_int(req->pack, NULL, "Acct-Session-Time", stop_time - ppp->start_time);
 }
 
-static int rad_acct_read(struct triton_md_handler_t *h)
+static void rad_acct_recv(struct rad_req_t *req)
 {
-	struct rad_req_t *req = container_of(h, typeof(*req), hnd);
-	struct rad_packet_t *pack;
-	int r;
 	unsigned int dt;
 
-	if (req->reply) {
-		rad_packet_free(req->reply);
-		req->reply = NULL;
-	}
-
-	while (1) {
-		r = rad_packet_recv(h->fd, &pack, NULL);
-
-		if (pack) {
-			rad_server_reply(req->serv);
-			if (req->reply)
-				rad_packet_free(req->reply);
-			req->reply = pack;
-			if (conf_interim_verbose) {
-				log_ppp_info2("recv ");
-				rad_packet_print(req->reply, req->serv, log_ppp_info2);
-			}
-		}
+	rad_server_reply(req->serv);
 
-		if (r)
-			break;
+	if (conf_interim_verbose) {
+		log_ppp_info2("recv ");
+		rad_packet_print(req->reply, req->serv, log_ppp_info2);
 	}
 
-	if (!req->reply)
-		return 0;
-
 	dt = (req->reply->tv.tv_sec - req->pack->tv.tv_sec) * 1000 + 
 		(req->reply->tv.tv_nsec - req->pack->tv.tv_nsec) / 1000000;
 
@@ -99,8 +77,6 @@ static int rad_acct_read(struct triton_md_handler_t *h)
 		if (req->timeout.tpd)
 			triton_timer_del(&req->timeout);
 	}
-
-	return 0;
 }
 
 static void __rad_req_send(struct rad_req_t *req)
@@ -118,10 +94,6 @@ static void __rad_req_send(struct rad_req_t *req)
 		}
 
 		rad_req_send(req, conf_interim_verbose);
-		if (!req->hnd.tpd) {
-			triton_md_register_handler(req->rpd->ppp->ctrl->ctx, &req->hnd);
-			triton_md_enable_handler(&req->hnd, MD_MODE_READ);
-		}
 
 		rad_server_req_exit(req);
 
@@ -215,12 +187,52 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	triton_timer_add(rpd->ppp->ctrl->ctx, &rpd->acct_req->timeout, 0);
 }
 
-int rad_acct_start(struct radius_pd_t *rpd)
+/* re-signs the packet before every try, also with a new server's secret */
+static int rad_acct_prepare(struct rad_req_t *req)
 {
-	int i;
 	time_t ts;
-	unsigned int dt;
-	
+
+	if (conf_acct_delay_time) {
+		time(&ts);
+		rad_packet_change_int(req->pack, NULL, "Acct-Delay-Time", ts - req->ts);
+		req->pack->id++;
+	}
+
+	return req_set_RA(req, req->serv->secret);
+}
+
+static void rad_acct_start_done(struct rad_req_t *req, int res)
+{
+	struct radius_pd_t *rpd = req->rpd;
+
+	req->prepare = NULL;
+
+	if (res) {
+		log_ppp_warn("radius:acct_start: no servers available\n");
+		goto out_err;
+	}
+
+	req->recv = rad_acct_recv;
+
+	req->timeout.expire = rad_acct_timeout;
+	req->timeout.period = conf_timeout * 1000;
+
+	rpd->acct_interim_timer.expire = rad_acct_interim_update;
+	rpd->acct_interim_timer.period = rpd->acct_interim_interval ? rpd->acct_interim_interval * 1000 : STAT_UPDATE_INTERVAL;
+	if (rpd->acct_interim_interval && triton_timer_add(rpd->ppp->ctrl->ctx, &rpd->acct_interim_timer, 0))
+		goto out_err;
+
+	return;
+
+out_err:
+	rad_req_free(req);
+	rpd->acct_req = NULL;
+	ppp_terminate(rpd->ppp, TERM_NAS_ERROR, 0);
+}
+
+/* Start is sent in the background, the session is terminated if no server answers it */
+int rad_acct_start(struct radius_pd_t *rpd)
+{
 	if (!conf_accounting)
 		return 0;
 
@@ -238,101 +250,50 @@ int rad_acct_start(struct radius_pd_t *rpd)
 	//if (rad_req_add_str(rpd->acct_req, "Acct-Session-Id", rpd->ppp->sessionid, PPP_SESSIONID_LEN, 1))
 	//	goto out_err;
 
-	if (rpd->acct_req->reply) {
-		rad_packet_free(rpd->acct_req->reply);
-		rpd->acct_req->reply = NULL;
-	}
-
 	time(&rpd->acct_timestamp);
+	rpd->acct_req->ts = rpd->acct_timestamp;
 	
 	if (req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret))
 		goto out_err;
 
-	while (1) {
-
-		if (rad_server_req_enter(rpd->acct_req)) {
-			if (rad_server_realloc(rpd->acct_req)) {
-				log_ppp_warn("radius:acct_start: no servers available\n");
-				goto out_err;
-			}
-			if (req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret))
-				goto out_err;
-			continue;
-		}
-
-		for (i = 0; i < conf_max_try; i++) {
-			if (conf_acct_delay_time) {
-				time(&ts);
-				rad_packet_change_int(rpd->acct_req->pack, NULL, "Acct-Delay-Time", ts - rpd->acct_timestamp);
-				if (req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret)) {
-					rad_server_req_exit(rpd->acct_req);
-					goto out_err;
-				}
-			}
-
-			if (rad_req_send(rpd->acct_req, conf_verbose))
-				goto out;
-
-			__sync_add_and_fetch(&rpd->acct_req->serv->stat_acct_sent, 1);
+	rpd->acct_req->prepare = rad_acct_prepare;
+	rad_req_start(rpd->acct_req, rad_acct_start_done);
 
-			rad_req_wait(rpd->acct_req, conf_timeout);
-
-			if (!rpd->acct_req->reply) {
-				if (conf_acct_delay_time)
-					rpd->acct_req->pack->id++;
-				__sync_add_and_fetch(&rpd->acct_req->serv->stat_acct_lost, 1);
-				stat_accm_add(rpd->acct_req->serv->stat_acct_lost_1m, 1);
-				stat_accm_add(rpd->acct_req->serv->stat_acct_lost_5m, 1);
-				continue;
-			}
+	return 0;
 
-			dt = (rpd->acct_req->reply->tv.tv_sec - rpd->acct_req->pack->tv.tv_sec) * 1000 + 
-				(rpd->acct_req->reply->tv.tv_nsec - rpd->acct_req->pack->tv.tv_nsec) / 1000000;
-			stat_accm_add(rpd->acct_req->serv->stat_acct_query_1m, dt);
-			stat_accm_add(rpd->acct_req->serv->stat_acct_query_5m, dt);
-
-			if (rpd->acct_req->reply->id != rpd->acct_req->pack->id || rpd->acct_req->reply->code != CODE_ACCOUNTING_RESPONSE) {
-				rad_packet_free(rpd->acct_req->reply);
-				rpd->acct_req->reply = NULL;
-				rpd->acct_req->pack->id++;
-				__sync_add_and_fetch(&rpd->acct_req->serv->stat_acct_lost, 1);
-				stat_accm_add(rpd->acct_req->serv->stat_acct_lost_1m, 1);
-				stat_accm_add(rpd->acct_req->serv->stat_acct_lost_5m, 1);
-			} else
-				break;
-		}
+out_err:
+	rad_req_free(rpd->acct_req);
+	rpd->acct_req = NULL;
+	return -1;
+}
 
-out:
-		rad_server_req_exit(rpd->acct_req);
+/* resume accounting of a session taken over from the old process, Start was already sent by it */
+int rad_acct_restore(struct radius_pd_t *rpd)
+{
+	if (!conf_accounting)
+		return 0;
 
-		if (rpd->acct_req->reply)
-			break;
+	rpd->acct_req = rad_req_alloc(rpd, CODE_ACCOUNTING_REQUEST, rpd->ppp->username);
+	if (!rpd->acct_req)
+		return -1;
 
-		rad_server_fail(rpd->acct_req->serv);
-		if (rad_server_realloc(rpd->acct_req)) {
-			log_ppp_warn("radius:acct_start: no servers available\n");
-			goto out_err;
-		}
-		if (req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret))
-			goto out_err;
+	if (rad_req_acct_fill(rpd->acct_req)) {
+		log_ppp_error("radius:acct: failed to fill accounting attributes\n");
+		goto out_err;
 	}
 
-	rpd->acct_req->hnd.read = rad_acct_read;
+	time(&rpd->acct_timestamp);
+
+	rpd->acct_req->recv = rad_acct_recv;
 
-	triton_md_register_handler(rpd->ppp->ctrl->ctx, &rpd->acct_req->hnd);
-	if (triton_md_enable_handler(&rpd->acct_req->hnd, MD_MODE_READ))
-		goto out_err;
-	
 	rpd->acct_req->timeout.expire = rad_acct_timeout;
 	rpd->acct_req->timeout.period = conf_timeout * 1000;
-	
+
 	rpd->acct_interim_timer.expire = rad_acct_interim_update;
 	rpd->acct_interim_timer.period = rpd->acct_interim_interval ? rpd->acct_interim_interval * 1000 : STAT_UPDATE_INTERVAL;
-	if (rpd->acct_interim_interval && triton_timer_add(rpd->ppp->ctrl->ctx, &rpd->acct_interim_timer, 0)) {
-		triton_md_unregister_handler(&rpd->acct_req->hnd);
-		triton_timer_del(&rpd->acct_req->timeout);
+	if (rpd->acct_interim_interval && triton_timer_add(rpd->ppp->ctrl->ctx, &rpd->acct_interim_timer, 0))
 		goto out_err;
-	}
+
 	return 0;
 
 out_err:
@@ -341,123 +302,181 @@ out_err:
 	return -1;
 }
 
+/*
+ * Stop requests are handed over to the accounting context, sessions do
+ * not wait for them. Every session and every Stop in flight holds the
+ * context, on shutdown it is kept until the last of them is gone.
+ */
+static struct triton_context_t acct_ctx;
+static pthread_mutex_t acct_lock = PTHREAD_MUTEX_INITIALIZER;
+static int acct_refs;
+static int acct_closing;
+
+void rad_acct_hold(void)
+{
+	pthread_mutex_lock(&acct_lock);
+	acct_refs++;
+	pthread_mutex_unlock(&acct_lock);
+}
+
+static void rad_acct_unregister(void *arg)
+{
+	triton_context_unregister(&acct_ctx);
+}
+
+void rad_acct_release(void)
+{
+	pthread_mutex_lock(&acct_lock);
+	if (--acct_refs == 0 && acct_closing)
+		triton_context_call(&acct_ctx, rad_acct_unregister, NULL);
+	pthread_mutex_unlock(&acct_lock);
+}
+
+static void rad_acct_close(struct triton_context_t *ctx)
+{
+	pthread_mutex_lock(&acct_lock);
+	acct_closing = 1;
+	if (!acct_refs)
+		triton_context_unregister(ctx);
+	pthread_mutex_unlock(&acct_lock);
+}
+
+static void rad_acct_stop_done(struct rad_req_t *req, int res)
+{
+	rad_req_free(req);
+	rad_acct_release();
+}
+
+/* Start of a session that is already gone, its Stop follows it */
+static void rad_acct_late_start_done(struct rad_req_t *req, int res)
+{
+	struct rad_req_t *stop = req->next;
+
+	rad_req_free(req);
+
+	if (res) {
+		log_warn("radius:acct_start: no servers available, Stop is not sent\n");
+		rad_req_free(stop);
+		rad_acct_release();
+		return;
+	}
+
+	rad_req_start(stop, rad_acct_stop_done);
+}
+
+static void req_set_stop(struct rad_req_t *req, struct ppp_t *ppp)
+{
+	switch (ppp->terminate_cause) {
+		case TERM_USER_REQUEST:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "User-Request");
+			break;
+		case TERM_SESSION_TIMEOUT:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "Session-Timeout");
+			break;
+		case TERM_ADMIN_RESET:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "Admin-Reset");
+			break;
+		case TERM_USER_ERROR:
+		case TERM_AUTH_ERROR:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "User-Error");
+			break;
+		case TERM_NAS_ERROR:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "NAS-Error");
+			break;
+		case TERM_NAS_REQUEST:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "NAS-Request");
+			break;
+		case TERM_NAS_REBOOT:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "NAS-Reboot");
+			break;
+		case TERM_LOST_CARRIER:
+			rad_packet_add_val(req->pack, NULL, "Acct-Terminate-Cause", "Lost-Carrier");
+			break;
+	}
+	rad_packet_change_val(req->pack, NULL, "Acct-Status-Type", "Stop");
+	req_set_stat(req, ppp);
+	/// !!! rad_req_add_val(rpd->acct_req, "Acct-Terminate-Cause", "");
+
+	time(&req->ts);
+}
+
+/*
+ * If the session ends while its Start is still queued, nothing is sent.
+ * A Start that has already been sent is moved to the accounting context
+ * together with a separate Stop, which is sent once the Start is answered.
+ */
 void rad_acct_stop(struct radius_pd_t *rpd)
 {
-	int i;
-	time_t ts;
-	unsigned int dt;
+	struct rad_req_t *req = rpd->acct_req;
+	struct rad_req_t *start = NULL;
 
-	if (!rpd->acct_req || !rpd->acct_req->serv)
+	if (!req || !req->serv)
 		return;
 
 	if (rpd->acct_interim_timer.tpd)
 		triton_timer_del(&rpd->acct_interim_timer);
 
-	if (rpd->acct_req) {
-		triton_md_unregister_handler(&rpd->acct_req->hnd);
-		if (rpd->acct_req->timeout.tpd)
-			triton_timer_del(&rpd->acct_req->timeout);
+	rpd->acct_req = NULL;
 
-		switch (rpd->ppp->terminate_cause) {
-			case TERM_USER_REQUEST:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "User-Request");
-				break;
-			case TERM_SESSION_TIMEOUT:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "Session-Timeout");
-				break;
-			case TERM_ADMIN_RESET:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "Admin-Reset");
-				break;
-			case TERM_USER_ERROR:
-			case TERM_AUTH_ERROR:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "User-Error");
-				break;
-			case TERM_NAS_ERROR:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "NAS-Error");
-				break;
-			case TERM_NAS_REQUEST:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "NAS-Request");
-				break;
-			case TERM_NAS_REBOOT:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "NAS-Reboot");
-				break;
-			case TERM_LOST_CARRIER:
-				rad_packet_add_val(rpd->acct_req->pack, NULL, "Acct-Terminate-Cause", "Lost-Carrier");
-				break;
-		}
-		rad_packet_change_val(rpd->acct_req->pack, NULL, "Acct-Status-Type", "Stop");
-		req_set_stat(rpd->acct_req, rpd->ppp);
-		req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret);
-		/// !!! rad_req_add_val(rpd->acct_req, "Acct-Terminate-Cause", "");
-		
-		if (rpd->acct_req->reply) {
-			rad_packet_free(rpd->acct_req->reply);
-			rpd->acct_req->reply = NULL;
+	if (req->done) {
+		if (!req->sent) {
+			rad_req_free(req);
+			return;
 		}
-	
-		time(&rpd->acct_timestamp);
 
-		while (1) {
+		start = req;
 
-			if (rad_server_req_enter(rpd->acct_req)) {
-				if (rad_server_realloc(rpd->acct_req)) {
-					log_ppp_warn("radius:acct_stop: no servers available\n");
-					break;
-				}
-				req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret);
-				continue;
-			}
+		req = rad_req_alloc(rpd, CODE_ACCOUNTING_REQUEST, rpd->ppp->username);
+		if (!req) {
+			rad_req_free(start);
+			return;
+		}
 
-			for(i = 0; i < conf_max_try; i++) {
-				if (conf_acct_delay_time) {
-					time(&ts);
-					rad_packet_change_int(rpd->acct_req->pack, NULL, "Acct-Delay-Time", ts - rpd->acct_timestamp);
-					rpd->acct_req->pack->id++;
-					if (req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret))
-						break;
-				}
-				if (rad_req_send(rpd->acct_req, conf_verbose))
-					goto out;
-				__sync_add_and_fetch(&rpd->acct_req->serv->stat_acct_sent, 1);
-				rad_req_wait(rpd->acct_req, conf_timeout);
-				if (!rpd->acct_req->reply) {
-					__sync_add_and_fetch(&rpd->acct_req->serv->stat_acct_lost, 1);
-					stat_accm_add(rpd->acct_req->serv->stat_acct_lost_1m, 1);
-					stat_accm_add(rpd->acct_req->serv->stat_acct_lost_5m, 1);
-					continue;
-				}
+		if (rad_req_acct_fill(req)) {
+			log_ppp_error("radius:acct: failed to fill accounting attributes\n");
+			rad_req_free(req);
+			rad_req_free(start);
+			return;
+		}
+	}
 
-				dt = (rpd->acct_req->reply->tv.tv_sec - rpd->acct_req->pack->tv.tv_sec) * 1000 + 
-					(rpd->acct_req->reply->tv.tv_nsec - rpd->acct_req->pack->tv.tv_nsec) / 1000000;
-				stat_accm_add(rpd->acct_req->serv->stat_acct_query_1m, dt);
-				stat_accm_add(rpd->acct_req->serv->stat_acct_query_5m, dt);
-
-				if (rpd->acct_req->reply->id != rpd->acct_req->pack->id || rpd->acct_req->reply->code != CODE_ACCOUNTING_RESPONSE) {
-					rad_packet_free(rpd->acct_req->reply);
-					rpd->acct_req->reply = NULL;
-					__sync_add_and_fetch(&rpd->acct_req->serv->stat_acct_lost, 1);
-					stat_accm_add(rpd->acct_req->serv->stat_acct_lost_1m, 1);
-					stat_accm_add(rpd->acct_req->serv->stat_acct_lost_5m, 1);
-				} else
-					break;
-			}
+	req_set_stop(req, rpd->ppp);
 
-out:
-			rad_server_req_exit(rpd->acct_req);
+	req = rad_req_move(req, &acct_ctx);
+	if (!req) {
+		if (start)
+			rad_req_free(start);
+		return;
+	}
 
-			if (rpd->acct_req->reply)
-				break;
+	req->prepare = rad_acct_prepare;
 
-			rad_server_fail(rpd->acct_req->serv);
-			if (rad_server_realloc(rpd->acct_req)) {
-				log_ppp_warn("radius:acct_stop: no servers available\n");
-				break;
-			}
-			req_set_RA(rpd->acct_req, rpd->acct_req->serv->secret);
-		}
+	rad_acct_hold();
 
-		rad_req_free(rpd->acct_req);
-		rpd->acct_req = NULL;
+	if (!start) {
+		rad_req_start(req, rad_acct_stop_done);
+		return;
 	}
+
+	start = rad_req_move(start, &acct_ctx);
+	if (!start) {
+		rad_req_free(req);
+		rad_acct_release();
+		return;
+	}
+
+	start->prepare = rad_acct_prepare;
+	start->next = req;
+	rad_req_start(start, rad_acct_late_start_done);
+}
+
+static void acct_init(void)
+{
+	acct_ctx.close = rad_acct_close;
+	acct_ctx.before_switch = log_switch;
+
+	triton_context_register(&acct_ctx, NULL);
+	triton_context_wakeup(&acct_ctx);
 }
 
+DEFINE_INIT(51, acct_init);
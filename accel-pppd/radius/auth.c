@@ -142,6 +142,17 @@ static uint8_t* encrypt_password(const char *passwd, const char *secret, const u
 	return epasswd;
 }
 
+static int rad_auth_reply(struct rad_req_t *req)
+{
+	if (req->reply->code != CODE_ACCESS_ACCEPT)
+		return PWDB_DENIED;
+
+	if (rad_proc_attrs(req))
+		return PWDB_DENIED;
+
+	return PWDB_SUCCESS;
+}
+
 static int rad_auth_send(struct rad_req_t *req)
 {
 	int i;
@@ -202,14 +213,8 @@ out:
 				log_ppp_warn("radius: no available servers\n");
 				break;
 			}
-		} else {
-			if (req->reply->code == CODE_ACCESS_ACCEPT) {
-				if (rad_proc_attrs(req))
-					return PWDB_DENIED;
-				return PWDB_SUCCESS;
-			} else
-				break;
-		}
+		} else
+			return rad_auth_reply(req);
 	}
 
 	return PWDB_DENIED;
@@ -234,18 +239,44 @@ int rad_auth_set_common(struct rad_packet_t *pack, struct radius_pd_t *rpd)
 	return 0;
 }
 
+static int rad_auth_pap_result(struct radius_pd_t *rpd, int r)
+{
+	if (r == PWDB_SUCCESS) {
+		struct ev_radius_t ev = {
+			.ppp = rpd->ppp,
+			.request = rpd->auth_req->pack,
+			.reply = rpd->auth_req->reply,
+		};
+		triton_event_fire(EV_RADIUS_ACCESS_ACCEPT, &ev);
+	}
+
+	rad_req_free(rpd->auth_req);
+	rpd->auth_req = NULL;
+
+	return r;
+}
+
+/*
+ * rad_auth_* build rpd->auth_req and set rpd->auth_result, which turns
+ * the outcome of the request into the result of the check. They return
+ * 0 when the request is ready to be sent.
+ */
 int rad_auth_pap(struct radius_pd_t *rpd, const char *username, va_list args)
 {
 	struct rad_req_t *req;
-	int r = PWDB_DENIED;
 	//int id = va_arg(args, int);
 	const char *passwd = va_arg(args, const char *);
 	uint8_t *epasswd;
 	int epasswd_len;
 
+	if (rpd->auth_req) {
+		rad_req_free(rpd->auth_req);
+		rpd->auth_req = NULL;
+	}
+
 	req = rad_req_alloc(rpd, CODE_ACCESS_REQUEST, username);
 	if (!req)
-		return PWDB_DENIED;
+		return -1;
 	
 	epasswd = encrypt_password(passwd, req->serv->secret, req->RA, &epasswd_len);
 	if (!epasswd)
@@ -263,25 +294,34 @@ int rad_auth_pap(struct radius_pd_t *rpd, const char *username, va_list args)
 	if (rad_auth_set_common(req->pack, rpd))
 		goto out;
 
-	r = rad_auth_send(req);
+	rpd->auth_req = req;
+	rpd->auth_result = rad_auth_pap_result;
+
+	return 0;
+
+out:
+	rad_req_free(req);
+
+	return -1;
+}
+
+static int rad_auth_chap_md5_result(struct radius_pd_t *rpd, int r)
+{
 	if (r == PWDB_SUCCESS) {
 		struct ev_radius_t ev = {
 			.ppp = rpd->ppp,
-			.request = req->pack,
-			.reply = req->reply,
+			.request = rpd->auth_req->pack,
+			.reply = rpd->auth_req->reply,
 		};
 		triton_event_fire(EV_RADIUS_ACCESS_ACCEPT, &ev);
+		rpd->auth_req->pack->id++;
 	}
 
-out:
-	rad_req_free(req);
-
 	return r;
 }
 
 int rad_auth_chap_md5(struct radius_pd_t *rpd, const char *username, va_list args)
 {
-	int r = PWDB_DENIED;
 	uint8_t chap_password[17];
 	
 	int id = va_arg(args, int);
@@ -295,7 +335,7 @@ int rad_auth_chap_md5(struct radius_pd_t *rpd, const char *username, va_list arg
 	if (!rpd->auth_req) {
 		rpd->auth_req = rad_req_alloc(rpd, CODE_ACCESS_REQUEST, username);
 		if (!rpd->auth_req)
-			return PWDB_DENIED;
+			return -1;
 	
 		if (challenge_len == 16)
 			memcpy(rpd->auth_req->RA, challenge, 16);
@@ -324,29 +364,20 @@ int rad_auth_chap_md5(struct radius_pd_t *rpd, const char *username, va_list arg
 		}
 		
 		if (rad_packet_build(rpd->auth_req->pack, rpd->auth_req->RA))
-			return -1;
+			goto out;
 	}
 
 	if (rad_auth_set_common(rpd->auth_req->pack, rpd))
 		goto out;
 
-	r = rad_auth_send(rpd->auth_req);
-	if (r == PWDB_SUCCESS) {
-		struct ev_radius_t ev = {
-			.ppp = rpd->ppp,
-			.request = rpd->auth_req->pack,
-			.reply = rpd->auth_req->reply,
-		};
-		triton_event_fire(EV_RADIUS_ACCESS_ACCEPT, &ev);
-		rpd->auth_req->pack->id++;
-	}
+	rpd->auth_result = rad_auth_chap_md5_result;
 
-	return r;
+	return 0;
 out:
 	rad_req_free(rpd->auth_req);
 	rpd->auth_req = NULL;
 
-	return r;
+	return -1;
 }
 
 static void setup_mppe(struct rad_req_t *req, const uint8_t *challenge)
@@ -391,11 +422,31 @@ static void setup_mppe(struct rad_req_t *req, const uint8_t *challenge)
 		triton_event_fire(EV_MPPE_KEYS, &ev_mppe);
 }
 
+static int rad_auth_mschap_v1_result(struct radius_pd_t *rpd, int r)
+{
+	struct rad_attr_t *ra;
+
+	if (r == PWDB_SUCCESS) {
+		struct ev_radius_t ev = {
+			.ppp = rpd->ppp,
+			.request = rpd->auth_req->pack,
+			.reply = rpd->auth_req->reply,
+		};
+		triton_event_fire(EV_RADIUS_ACCESS_ACCEPT, &ev);
+		setup_mppe(rpd->auth_req, rpd->auth_challenge);
+		rpd->auth_req->pack->id++;
+	} else if (rpd->auth_req->reply) {
+		ra = rad_packet_find_attr(rpd->auth_req->reply, "Microsoft", "MS-CHAP-Error");
+		if (ra)
+			*rpd->auth_mschap_error = ra->val.string;
+	}
+
+	return r;
+}
+
 int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list args)
 {
-	int r = PWDB_DENIED;
 	uint8_t response[50];
-	struct rad_attr_t *ra;
 
 	int id = va_arg(args, int);
 	const uint8_t *challenge = va_arg(args, const uint8_t *);
@@ -413,7 +464,7 @@ int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list ar
 	if (!rpd->auth_req) {
 		rpd->auth_req = rad_req_alloc(rpd, CODE_ACCESS_REQUEST, username);
 		if (!rpd->auth_req)
-			return PWDB_DENIED;
+			return -1;
 		
 		if (rad_packet_add_octets(rpd->auth_req->pack, "Microsoft", "MS-CHAP-Challenge", challenge, challenge_len))
 			goto out;
@@ -438,13 +489,36 @@ int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list ar
 		}
 		
 		if (rad_packet_build(rpd->auth_req->pack, rpd->auth_req->RA))
-			return -1;
+			goto out;
 	}
 
 	if (rad_auth_set_common(rpd->auth_req->pack, rpd))
 			goto out;
 
-	r = rad_auth_send(rpd->auth_req);
+	rpd->auth_challenge = challenge;
+	rpd->auth_mschap_error = mschap_error;
+	rpd->auth_result = rad_auth_mschap_v1_result;
+
+	return 0;
+out:
+	rad_req_free(rpd->auth_req);
+	rpd->auth_req = NULL;
+
+	return -1;
+}
+
+static int rad_auth_mschap_v2_result(struct radius_pd_t *rpd, int r)
+{
+	struct rad_attr_t *ra;
+
+	if (r == PWDB_SUCCESS) {
+		ra = rad_packet_find_attr(rpd->auth_req->reply, "Microsoft", "MS-CHAP2-Success");
+		if (!ra) {
+			log_error("radius:auth:mschap-v2: 'MS-CHAP-Success' not found in radius response\n");
+			r = PWDB_DENIED;
+		} else
+			memcpy(rpd->auth_authenticator, ra->val.octets + 3, 40);
+	}
 	if (r == PWDB_SUCCESS) {
 		struct ev_radius_t ev = {
 			.ppp = rpd->ppp,
@@ -452,26 +526,22 @@ int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list ar
 			.reply = rpd->auth_req->reply,
 		};
 		triton_event_fire(EV_RADIUS_ACCESS_ACCEPT, &ev);
-		setup_mppe(rpd->auth_req, challenge);
+		setup_mppe(rpd->auth_req, NULL);
 		rpd->auth_req->pack->id++;
 	} else if (rpd->auth_req->reply) {
 		ra = rad_packet_find_attr(rpd->auth_req->reply, "Microsoft", "MS-CHAP-Error");
 		if (ra)
-			*mschap_error = ra->val.string;
+			*rpd->auth_mschap_error = ra->val.string;
+		ra = rad_packet_find_attr(rpd->auth_req->reply, NULL, "Reply-Message");
+		if (ra)
+			*rpd->auth_reply_msg = ra->val.string;
 	}
 
-	return r;
-out:
-	rad_req_free(rpd->auth_req);
-	rpd->auth_req = NULL;
-
 	return r;
 }
 
 int rad_auth_mschap_v2(struct radius_pd_t *rpd, const char *username, va_list args)
 {
-	int r = PWDB_DENIED;
-	struct rad_attr_t *ra;
 	uint8_t mschap_response[50];
 
 	int id = va_arg(args, int);
@@ -493,7 +563,7 @@ int rad_auth_mschap_v2(struct radius_pd_t *rpd, const char *username, va_list ar
 	if (!rpd->auth_req) {		
 		rpd->auth_req = rad_req_alloc(rpd, CODE_ACCESS_REQUEST, username);
 		if (!rpd->auth_req)
-			return PWDB_DENIED;
+			return -1;
 
 		if (rad_packet_add_octets(rpd->auth_req->pack, "Microsoft", "MS-CHAP-Challenge", challenge, 16))
 			goto out;
@@ -524,41 +594,60 @@ int rad_auth_mschap_v2(struct radius_pd_t *rpd, const char *username, va_list ar
 	if (rad_auth_set_common(rpd->auth_req->pack, rpd))
 			goto out;
 
-	r = rad_auth_send(rpd->auth_req);
-	if (r == PWDB_SUCCESS) {
-		ra = rad_packet_find_attr(rpd->auth_req->reply, "Microsoft", "MS-CHAP2-Success");
-		if (!ra) {
-			log_error("radius:auth:mschap-v2: 'MS-CHAP-Success' not found in radius response\n");
-			r = PWDB_DENIED;
-		} else
-			memcpy(authenticator, ra->val.octets + 3, 40);
-	}
-	if (r == PWDB_SUCCESS) {
-		struct ev_radius_t ev = {
-			.ppp = rpd->ppp,
-			.request = rpd->auth_req->pack,
-			.reply = rpd->auth_req->reply,
-		};
-		triton_event_fire(EV_RADIUS_ACCESS_ACCEPT, &ev);
-		setup_mppe(rpd->auth_req, NULL);
-		rpd->auth_req->pack->id++;
-	} else if (rpd->auth_req->reply) {
-		ra = rad_packet_find_attr(rpd->auth_req->reply, "Microsoft", "MS-CHAP-Error");
-		if (ra)
-			*mschap_error = ra->val.string;
-		ra = rad_packet_find_attr(rpd->auth_req->reply, NULL, "Reply-Message");
-		if (ra)
-			*reply_msg = ra->val.string;
-	}
-
+	rpd->auth_authenticator = authenticator;
+	rpd->auth_mschap_error = mschap_error;
+	rpd->auth_reply_msg = reply_msg;
+	rpd->auth_result = rad_auth_mschap_v2_result;
 
-
-	return r;
+	return 0;
 out:
 	rad_req_free(rpd->auth_req);
 	rpd->auth_req = NULL;
 
-	return r;
+	return -1;
+}
+
+int rad_auth_check(struct radius_pd_t *rpd)
+{
+	return rpd->auth_result(rpd, rad_auth_send(rpd->auth_req));
+}
+
+static void rad_auth_done(struct rad_req_t *req, int res)
+{
+	struct radius_pd_t *rpd = req->rpd;
+	pwdb_callback cb = rpd->auth_cb;
+	int r = PWDB_DENIED;
+
+	if (!res)
+		r = rad_auth_reply(req);
+
+	r = rpd->auth_result(rpd, r);
+	if (r == PWDB_SUCCESS)
+		rpd->authenticated = 1;
+
+	rpd->auth_cb = NULL;
+	cb(rpd->auth_cb_arg, r);
+}
+
+/* sends rpd->auth_req without blocking, the result is passed to cb */
+int rad_auth_check_async(struct radius_pd_t *rpd, pwdb_callback cb, void *cb_arg)
+{
+	rpd->auth_cb = cb;
+	rpd->auth_cb_arg = cb_arg;
+
+	rad_req_start(rpd->auth_req, rad_auth_done);
+
+	return PWDB_WAIT;
 }
 
+/* the session is gone, lets the waiting authentication module clean up */
+void rad_auth_cancel(struct radius_pd_t *rpd)
+{
+	pwdb_callback cb = rpd->auth_cb;
 
+	if (!cb)
+		return;
+
+	rpd->auth_cb = NULL;
+	cb(rpd->auth_cb_arg, PWDB_DENIED);
+}
@@ -15,6 +15,7 @@
 #include "triton.h"
 #include "events.h"
 #include "log.h"
+#include "upgrade.h"
 
 #include "radius_p.h"
 
@@ -301,8 +302,10 @@ static int dm_coa_read(struct triton_md_handler_t *h)
 static void dm_coa_close(struct triton_context_t *ctx)
 {
 	struct dm_coa_serv_t *serv = container_of(ctx, typeof(*serv), ctx);
-	triton_md_unregister_handler(&serv->hnd);
-	close(serv->hnd.fd);
+	if (serv->hnd.tpd) {
+		triton_md_unregister_handler(&serv->hnd);
+		close(serv->hnd.fd);
+	}
 	triton_context_unregister(ctx);
 }
 
@@ -312,6 +315,25 @@ static struct dm_coa_serv_t serv = {
 	.hnd.read = dm_coa_read,
 };
 
+/* runs in the server's context */
+static void dm_coa_release(void *arg)
+{
+	if (serv.hnd.tpd) {
+		triton_md_unregister_handler(&serv.hnd);
+		close(serv.hnd.fd);
+	}
+
+	upgrade_release();
+}
+
+static void ev_upgrade(void)
+{
+	if (serv.ctx.tpd) {
+		upgrade_hold();
+		triton_context_call(&serv.ctx, dm_coa_release, NULL);
+	}
+}
+
 static void init(void)
 {
 	struct sockaddr_in addr;
@@ -351,6 +373,8 @@ static void init(void)
 	triton_md_register_handler(&serv.ctx, &serv.hnd);
 	triton_md_enable_handler(&serv.hnd, MD_MODE_READ);
 	triton_context_wakeup(&serv.ctx);
+
+	triton_event_register_handler(EV_UPGRADE, (triton_event_func)ev_upgrade);
 }
 
 DEFINE_INIT(52, init);
@@ -12,6 +12,7 @@
 #include "pwdb.h"
 #include "ipdb.h"
 #include "ppp_auth.h"
+#include "upgrade.h"
 
 #include "radius_p.h"
 #include "attr_defs.h"
@@ -41,6 +42,7 @@ int conf_request_cui;
 int conf_accounting;
 int conf_fail_time;
 int conf_req_limit;
+int conf_sockets = 4;
 
 static const char *conf_default_realm;
 static int conf_default_realm_len;
@@ -155,12 +157,12 @@ int rad_proc_attrs(struct rad_req_t *req)
 	return res;
 }
 
-static int rad_pwdb_check(struct pwdb_t *pwdb, struct ppp_t *ppp, const char *username, int type, va_list _args)
+/* builds rpd->auth_req, returns PWDB_SUCCESS when it is ready to be sent */
+static int rad_auth_prepare(struct radius_pd_t *rpd, const char *username, int type, va_list _args)
 {
 	int r = PWDB_NO_IMPL;
 	va_list args;
 	int chap_type;
-	struct radius_pd_t *rpd = find_pd(ppp);
 	char username1[256];
 
 	if (conf_default_realm && !strchr(username, '@')) {
@@ -201,12 +203,46 @@ static int rad_pwdb_check(struct pwdb_t *pwdb, struct ppp_t *ppp, const char *us
 
 	va_end(args);
 
+	if (r == PWDB_NO_IMPL)
+		return r;
+
+	return r ? PWDB_DENIED : PWDB_SUCCESS;
+}
+
+static int rad_pwdb_check(struct pwdb_t *pwdb, struct ppp_t *ppp, const char *username, int type, va_list args)
+{
+	struct radius_pd_t *rpd = find_pd(ppp);
+	int r;
+
+	r = rad_auth_prepare(rpd, username, type, args);
+	if (r != PWDB_SUCCESS)
+		return r;
+
+	r = rad_auth_check(rpd);
+
 	if (r == PWDB_SUCCESS)
 		rpd->authenticated = 1;
 
 	return r;
 }
 
+static int rad_pwdb_check_async(struct pwdb_t *pwdb, struct ppp_t *ppp, pwdb_callback cb, void *cb_arg, const char *username, int type, va_list args)
+{
+	struct radius_pd_t *rpd = find_pd(ppp);
+	int r;
+
+	if (rpd->auth_cb) {
+		log_ppp_warn("radius: authentication is already in progress\n");
+		return PWDB_DENIED;
+	}
+
+	r = rad_auth_prepare(rpd, username, type, args);
+	if (r != PWDB_SUCCESS)
+		return r;
+
+	return rad_auth_check_async(rpd, cb, cb_arg);
+}
+
 static struct ipv4db_item_t *get_ipv4(struct ppp_t *ppp)
 {
 	struct radius_pd_t *rpd = find_pd(ppp);
@@ -275,6 +311,8 @@ static void ppp_starting(struct ppp_t *ppp)
 	pthread_rwlock_wrlock(&sessions_lock);
 	list_add_tail(&rpd->entry, &sessions);
 	pthread_rwlock_unlock(&sessions_lock);
+
+	rad_acct_hold();
 }
 
 static void ppp_acct_start(struct ppp_t *ppp)
@@ -317,6 +355,8 @@ static void ppp_finished(struct ppp_t *ppp)
 	if (rpd->auth_req)
 		rad_req_free(rpd->auth_req);
 
+	rad_auth_cancel(rpd);
+
 	if (rpd->acct_req)
 		rad_req_free(rpd->acct_req);
 
@@ -347,6 +387,73 @@ static void ppp_finished(struct ppp_t *ppp)
 	list_del(&rpd->pd.entry);
 	
 	mempool_free(rpd);
+
+	rad_acct_release();
+}
+
+static void ppp_upgrade_save_rpd(struct ev_upgrade_t *ev)
+{
+	struct radius_pd_t *rpd = find_pd(ev->ppp);
+	int authenticated = rpd->authenticated;
+
+	upgrade_put(ev->rec, UPG_RADIUS_AUTHENTICATED, &authenticated, sizeof(authenticated));
+	if (!authenticated)
+		return;
+
+	upgrade_put(ev->rec, UPG_RADIUS_INTERIM_INTERVAL, &rpd->acct_interim_interval, sizeof(rpd->acct_interim_interval));
+	upgrade_put(ev->rec, UPG_RADIUS_SESSION_TIMEOUT, &rpd->session_timeout.expire_tv.tv_sec, sizeof(rpd->session_timeout.expire_tv.tv_sec));
+	upgrade_put(ev->rec, UPG_RADIUS_TERMINATION, &rpd->termination_action, sizeof(rpd->termination_action));
+
+	if (rpd->attr_class)
+		upgrade_put(ev->rec, UPG_RADIUS_CLASS, rpd->attr_class, rpd->attr_class_len);
+
+	if (rpd->attr_state)
+		upgrade_put(ev->rec, UPG_RADIUS_STATE, rpd->attr_state, rpd->attr_state_len);
+}
+
+static void ppp_upgrade_restore_rpd(struct ev_upgrade_t *ev)
+{
+	struct radius_pd_t *rpd = find_pd(ev->ppp);
+	const uint8_t *ptr;
+	int authenticated = 0;
+	int len;
+	time_t ts;
+
+	upgrade_get_val(ev->rec, UPG_RADIUS_AUTHENTICATED, &authenticated, sizeof(authenticated));
+	if (!authenticated)
+		return;
+
+	rpd->authenticated = 1;
+
+	upgrade_get_val(ev->rec, UPG_RADIUS_INTERIM_INTERVAL, &rpd->acct_interim_interval, sizeof(rpd->acct_interim_interval));
+	upgrade_get_val(ev->rec, UPG_RADIUS_SESSION_TIMEOUT, &rpd->session_timeout.expire_tv.tv_sec, sizeof(rpd->session_timeout.expire_tv.tv_sec));
+	upgrade_get_val(ev->rec, UPG_RADIUS_TERMINATION, &rpd->termination_action, sizeof(rpd->termination_action));
+
+	ptr = upgrade_get(ev->rec, UPG_RADIUS_CLASS, &len);
+	if (ptr) {
+		rpd->attr_class = _malloc(len);
+		memcpy(rpd->attr_class, ptr, len);
+		rpd->attr_class_len = len;
+	}
+
+	ptr = upgrade_get(ev->rec, UPG_RADIUS_STATE, &len);
+	if (ptr) {
+		rpd->attr_state = _malloc(len);
+		memcpy(rpd->attr_state, ptr, len);
+		rpd->attr_state_len = len;
+	}
+
+	if (rad_acct_restore(rpd)) {
+		ppp_terminate(ev->ppp, TERM_NAS_ERROR, 0);
+		return;
+	}
+
+	if (rpd->session_timeout.expire_tv.tv_sec) {
+		ts = rpd->session_timeout.expire_tv.tv_sec - (time(NULL) - ev->ppp->start_time);
+		rpd->session_timeout.expire_tv.tv_sec = ts > 0 ? ts : 1;
+		rpd->session_timeout.expire = session_timeout;
+		triton_timer_add(ev->ppp->ctrl->ctx, &rpd->session_timeout, 0);
+	}
 }
 
 struct radius_pd_t *find_pd(struct ppp_t *ppp)
@@ -485,6 +592,7 @@ static struct ipdb_t ipdb = {
 
 static struct pwdb_t pwdb = {
 	.check = rad_pwdb_check,
+	.check_async = rad_pwdb_check_async,
 };
 
 static int parse_server(const char *opt, in_addr_t *addr, int *port, char **secret)
@@ -600,6 +708,10 @@ static int load_config(void)
 	opt = conf_get_opt("radius", "req-limit");
 	if (opt)
 		conf_req_limit = atoi(opt);
+
+	opt = conf_get_opt("radius", "sockets");
+	if (opt && atoi(opt) > 0)
+		conf_sockets = atoi(opt);
 	
 	conf_default_realm = conf_get_opt("radius", "default-realm");
 	if (conf_default_realm)
@@ -632,6 +744,8 @@ static void radius_init(void)
 	triton_event_register_handler(EV_PPP_ACCT_START, (triton_event_func)ppp_acct_start);
 	triton_event_register_handler(EV_PPP_FINISHING, (triton_event_func)ppp_finishing);
 	triton_event_register_handler(EV_PPP_FINISHED, (triton_event_func)ppp_finished);
+	triton_event_register_handler(EV_PPP_UPGRADE_SAVE, (triton_event_func)ppp_upgrade_save_rpd);
+	triton_event_register_handler(EV_PPP_UPGRADE_RESTORE, (triton_event_func)ppp_upgrade_restore_rpd);
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 }
 
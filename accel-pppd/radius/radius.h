@@ -118,6 +118,7 @@ struct rad_server_stat_t
 	in_addr_t addr;
 	int auth_port;
 	int acct_port;
+	unsigned int req_cnt;
 	unsigned int queue_cnt;
 
 	unsigned long stat_auth_sent;
@@ -9,8 +9,10 @@
 #include "radius.h"
 #include "ppp.h"
 #include "ipdb.h"
+#include "pwdb.h"
 
 struct rad_server_t;
+struct rad_sock_t;
 
 struct radius_pd_t
 {
@@ -22,6 +24,16 @@ struct radius_pd_t
 
 	struct rad_req_t *auth_req;
 	struct rad_req_t *acct_req;
+
+	/* authentication in progress (rad_auth_check_async) */
+	pwdb_callback auth_cb;
+	void *auth_cb_arg;
+	int (*auth_result)(struct radius_pd_t *, int);
+	const uint8_t *auth_challenge;
+	uint8_t *auth_authenticator;
+	char **auth_mschap_error;
+	char **auth_reply_msg;
+
 	struct triton_timer_t acct_interim_timer;
 	struct triton_timer_t session_timeout;
 
@@ -45,8 +57,6 @@ struct radius_pd_t
 struct rad_req_t
 {
 	struct list_head entry;
-	struct triton_context_t ctx;
-	struct triton_md_handler_t hnd;
 	struct triton_timer_t timeout;
 	uint8_t RA[16];
 	struct rad_packet_t *pack;
@@ -54,10 +64,53 @@ struct rad_req_t
 
 	struct radius_pd_t *rpd;
 	struct rad_server_t *serv;
-	
-	in_addr_t server_addr;
-	int server_port;
 	int type;
+
+	/* context the request belongs to, replies and timers run in it */
+	struct triton_context_t *ctx;
+
+	/* transport state, protected by the transport lock (req.c) */
+	struct rad_sock_t *sock;
+	int id;
+	uint8_t auth[16];
+	struct triton_timer_t wait_timer;
+	struct rad_packet_t *pending_reply;
+	int pending;
+	int expect:1;
+	int wait:1;
+	int dead:1;
+
+	/* if set, replies are passed to it in the owner context */
+	void (*recv)(struct rad_req_t *);
+
+	/* non-blocking request state (rad_req_start) */
+	void (*done)(struct rad_req_t *, int res);
+	int (*prepare)(struct rad_req_t *);
+	int try;
+	int entered;
+	int queued;
+	int woken;
+	int sent;
+	time_t ts;
+
+	/* accounting Stop to be started once this Start is done */
+	struct rad_req_t *next;
+};
+
+#define RAD_SOCK_IDS 256
+
+/* a connected socket shared by requests to one server port, requests
+ * are told apart by the packet identifier */
+struct rad_sock_t
+{
+	struct list_head entry;
+	struct triton_context_t ctx;
+	struct triton_md_handler_t hnd;
+	struct rad_server_t *serv;
+	int type;
+	int req_cnt;
+	int next_id;
+	struct rad_req_t *req[RAD_SOCK_IDS];
 };
 
 struct rad_server_t
@@ -78,6 +131,9 @@ struct rad_server_t
 	int timeout_cnt;
 	pthread_mutex_t lock;
 
+	struct list_head sock_list[2];
+	int sock_cnt[2];
+
 	unsigned long stat_auth_sent;
 	unsigned long stat_auth_lost;
 	unsigned long stat_acct_sent;
@@ -127,6 +183,7 @@ extern int conf_acct_interim_interval;
 extern int conf_accounting;
 extern int conf_fail_time;
 extern int conf_req_limit;
+extern int conf_sockets;
 extern int conf_request_cui;
 
 int rad_check_nas_pack(struct rad_packet_t *pack);
@@ -141,6 +198,11 @@ int rad_req_acct_fill(struct rad_req_t *);
 void rad_req_free(struct rad_req_t *);
 int rad_req_send(struct rad_req_t *, int verbose);
 int rad_req_wait(struct rad_req_t *, int);
+void rad_req_detach(struct rad_req_t *);
+void rad_req_start(struct rad_req_t *, void (*done)(struct rad_req_t *, int res));
+void rad_req_wakeup(struct rad_req_t *);
+struct rad_req_t *rad_req_move(struct rad_req_t *, struct triton_context_t *);
+void rad_server_sock_free(struct rad_server_t *);
 
 struct radius_pd_t *find_pd(struct ppp_t *ppp);
 int rad_proc_attrs(struct rad_req_t *req);
@@ -149,9 +211,15 @@ int rad_auth_pap(struct radius_pd_t *rpd, const char *username, va_list args);
 int rad_auth_chap_md5(struct radius_pd_t *rpd, const char *username, va_list args);
 int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list args);
 int rad_auth_mschap_v2(struct radius_pd_t *rpd, const char *username, va_list args);
+int rad_auth_check(struct radius_pd_t *rpd);
+int rad_auth_check_async(struct radius_pd_t *rpd, pwdb_callback cb, void *cb_arg);
+void rad_auth_cancel(struct radius_pd_t *rpd);
 
 int rad_acct_start(struct radius_pd_t *rpd);
+int rad_acct_restore(struct radius_pd_t *rpd);
 void rad_acct_stop(struct radius_pd_t *rpd);
+void rad_acct_hold(void);
+void rad_acct_release(void);
 
 struct rad_packet_t *rad_packet_alloc(int code);
 int rad_packet_build(struct rad_packet_t *pack, uint8_t *RA);
@@ -166,6 +234,8 @@ struct rad_server_t *rad_server_get(int);
 void rad_server_put(struct rad_server_t *, int);
 int rad_server_req_enter(struct rad_req_t *);
 void rad_server_req_exit(struct rad_req_t *);
+int rad_server_req_resume(struct rad_req_t *);
+void rad_server_req_cancel(struct rad_req_t *);
 int rad_server_realloc(struct rad_req_t *);
 void rad_server_fail(struct rad_server_t *);
 void rad_server_timeout(struct rad_server_t *);
@@ -9,13 +9,28 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "crypto.h"
+#include "mbhash.h"
+
 #include "log.h"
 #include "radius_p.h"
+#include "random.h"
 
 #include "memdebug.h"
 
-static int rad_req_read(struct triton_md_handler_t *h);
-static void rad_req_timeout(struct triton_timer_t *t);
+/*
+ * Requests are sent through a small pool of long-lived sockets per server
+ * port. Each request borrows an identifier of one of them for as long as
+ * it waits for a reply, the socket's context matches replies by identifier
+ * and response authenticator and passes them to the owner. Slot tables
+ * and the transport fields of requests are protected by req_lock.
+ */
+#define RAD_SOCK_BATCH 16
+
+static pthread_mutex_t req_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void rad_req_deliver(struct rad_req_t *req);
+static void __rad_req_detach(struct rad_req_t *req);
 
 struct rad_req_t *rad_req_alloc(struct radius_pd_t *rpd, int code, const char *username)
 {
@@ -29,27 +44,16 @@ struct rad_req_t *rad_req_alloc(struct radius_pd_t *rpd, int code, const char *u
 
 	memset(req, 0, sizeof(*req));
 	req->rpd = rpd;
-	req->hnd.fd = -1;
-	req->ctx.before_switch = log_switch;
+	req->ctx = rpd->ppp->ctrl->ctx;
 
 	req->type = code == CODE_ACCESS_REQUEST ? RAD_SERV_AUTH : RAD_SERV_ACCT;
 
 	req->serv = rad_server_get(req->type);
 	if (!req->serv)
 		goto out_err;
-	
-	req->server_addr = req->serv->addr;
-	req->server_port = req->serv->auth_port;
-
-	while (1) {
-		if (read(urandom_fd, req->RA, 16) != 16) {
-			if (errno == EINTR)
-				continue;
-			log_ppp_error("radius:req:read urandom: %s\n", strerror(errno));
-			goto out_err;
-		}
-		break;
-	}
+
+	if (u_randbuf(req->RA, 16))
+		goto out_err;
 
 	req->pack = rad_packet_alloc(code);
 	if (!req->pack)
@@ -114,8 +118,6 @@ int rad_req_acct_fill(struct rad_req_t *req)
 {
 	struct ipv6db_addr_t *a;
 
-	req->server_port = req->serv->acct_port;
-
 	memset(req->RA, 0, sizeof(req->RA));
 
 	if (rad_packet_add_val(req->pack, NULL, "Acct-Status-Type", "Start"))
@@ -158,12 +160,10 @@ int rad_req_acct_fill(struct rad_req_t *req)
 	return 0;
 }
 
-void rad_req_free(struct rad_req_t *req)
+static void __rad_req_free(struct rad_req_t *req)
 {
 	if (req->serv)
 		rad_server_put(req->serv, req->type);
-	if (req->hnd.fd >= 0 )
-		close(req->hnd.fd);
 	if (req->pack)
 		rad_packet_free(req->pack);
 	if (req->reply)
@@ -171,128 +171,528 @@ void rad_req_free(struct rad_req_t *req)
 	_free(req);
 }
 
-static int make_socket(struct rad_req_t *req)
+/* stops whatever the request is doing, done is not called */
+static void req_cancel(struct rad_req_t *req)
+{
+	if (req->serv)
+		rad_server_req_cancel(req);
+
+	if (req->entered) {
+		rad_server_req_exit(req);
+		req->entered = 0;
+	}
+
+	pthread_mutex_lock(&req_lock);
+	req->recv = NULL;
+	__rad_req_detach(req);
+	pthread_mutex_unlock(&req_lock);
+
+	if (req->timeout.tpd)
+		triton_timer_del(&req->timeout);
+
+	req->done = NULL;
+}
+
+void rad_req_free(struct rad_req_t *req)
+{
+	req_cancel(req);
+
+	/* calls are queued to the owner context, the last one frees the request */
+	pthread_mutex_lock(&req_lock);
+	if (req->pending) {
+		req->dead = 1;
+		pthread_mutex_unlock(&req_lock);
+		return;
+	}
+	pthread_mutex_unlock(&req_lock);
+
+	__rad_req_free(req);
+}
+
+/*
+ * Hands the packet and the server of a request over to a new one owned
+ * by ctx, so that it may outlive the session. The old request is freed.
+ */
+struct rad_req_t *rad_req_move(struct rad_req_t *req, struct triton_context_t *ctx)
+{
+	struct rad_req_t *r = _malloc(sizeof(*r));
+
+	if (!r) {
+		log_emerg("radius: out of memory\n");
+		rad_req_free(req);
+		return NULL;
+	}
+
+	req_cancel(req);
+
+	memset(r, 0, sizeof(*r));
+	r->ctx = ctx;
+	r->type = req->type;
+	r->serv = req->serv;
+	r->pack = req->pack;
+	r->ts = req->ts;
+	memcpy(r->RA, req->RA, sizeof(r->RA));
+
+	req->serv = NULL;
+	req->pack = NULL;
+	rad_req_free(req);
+
+	return r;
+}
+
+/* queues func to the owner context, the request is kept until it runs */
+static void req_call(struct rad_req_t *req, void (*func)(struct rad_req_t *))
+{
+	pthread_mutex_lock(&req_lock);
+	req->pending++;
+	triton_context_call(req->ctx, (triton_event_func)func, req);
+	pthread_mutex_unlock(&req_lock);
+}
+
+/* called first by queued calls, returns 1 if the request was released */
+static int req_put(struct rad_req_t *req)
+{
+	int dead, release;
+
+	pthread_mutex_lock(&req_lock);
+	req->pending--;
+	dead = req->dead;
+	release = dead && !req->pending;
+	pthread_mutex_unlock(&req_lock);
+
+	if (release)
+		__rad_req_free(req);
+
+	return dead;
+}
+
+static int rad_sock_read(struct triton_md_handler_t *h);
+
+static void rad_sock_close(struct triton_context_t *ctx)
+{
+	struct rad_sock_t *sock = container_of(ctx, typeof(*sock), ctx);
+
+	if (sock->hnd.tpd) {
+		triton_md_unregister_handler(&sock->hnd);
+		close(sock->hnd.fd);
+	}
+	triton_context_unregister(ctx);
+}
+
+static void rad_sock_free(struct rad_sock_t *sock)
+{
+	rad_sock_close(&sock->ctx);
+	_free(sock);
+}
+
+static struct rad_sock_t *rad_sock_create(struct rad_server_t *s, int type)
 {
-  struct sockaddr_in addr;
+	struct rad_sock_t *sock;
+	struct sockaddr_in addr;
+	uint8_t id;
+
+	sock = _malloc(sizeof(*sock));
+	if (!sock) {
+		log_emerg("radius: out of memory\n");
+		return NULL;
+	}
 
-	req->hnd.fd = socket(PF_INET, SOCK_DGRAM, 0);
-	if (req->hnd.fd < 0) {
+	memset(sock, 0, sizeof(*sock));
+
+	sock->hnd.fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (sock->hnd.fd < 0) {
 		log_ppp_error("radius:socket: %s\n", strerror(errno));
-		return -1;
+		_free(sock);
+		return NULL;
 	}
 	
-	fcntl(req->hnd.fd, F_SETFD, fcntl(req->hnd.fd, F_GETFD) | FD_CLOEXEC);
+	fcntl(sock->hnd.fd, F_SETFD, fcntl(sock->hnd.fd, F_GETFD) | FD_CLOEXEC);
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 
 	if (conf_bind) {
 		addr.sin_addr.s_addr = conf_bind;
-		if (bind(req->hnd.fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		if (bind(sock->hnd.fd, (struct sockaddr *) &addr, sizeof(addr))) {
 			log_ppp_error("radius:bind: %s\n", strerror(errno));
 			goto out_err;
 		}
 	}
 
-	addr.sin_addr.s_addr = req->server_addr;
-	addr.sin_port = htons(req->server_port);
+	addr.sin_addr.s_addr = s->addr;
+	addr.sin_port = htons(type == RAD_SERV_ACCT ? s->acct_port : s->auth_port);
 
-	if (connect(req->hnd.fd, (struct sockaddr *) &addr, sizeof(addr))) {
+	if (connect(sock->hnd.fd, (struct sockaddr *) &addr, sizeof(addr))) {
 		log_ppp_error("radius:connect: %s\n", strerror(errno));
 		goto out_err;
 	}
 
-	if (fcntl(req->hnd.fd, F_SETFL, O_NONBLOCK)) {
+	if (fcntl(sock->hnd.fd, F_SETFL, O_NONBLOCK)) {
 		log_ppp_error("radius: failed to set nonblocking mode: %s\n", strerror(errno));
 		goto out_err;
 	}
-	
-	return 0;
+
+	sock->serv = s;
+	sock->type = type;
+	sock->next_id = u_randbuf(&id, 1) ? 0 : id;
+	sock->hnd.read = rad_sock_read;
+	sock->ctx.close = rad_sock_close;
+	sock->ctx.before_switch = log_switch;
+
+	triton_context_register(&sock->ctx, NULL);
+	triton_context_set_priority(&sock->ctx, 1);
+	triton_md_register_handler(&sock->ctx, &sock->hnd);
+	triton_md_enable_handler(&sock->hnd, MD_MODE_READ);
+	triton_context_wakeup(&sock->ctx);
+
+	list_add_tail(&sock->entry, &s->sock_list[type]);
+	s->sock_cnt[type]++;
+
+	return sock;
 
 out_err:
-	close(req->hnd.fd);
-	req->hnd.fd = -1;
-	return -1;
+	close(sock->hnd.fd);
+	_free(sock);
+	return NULL;
 }
 
-int rad_req_send(struct rad_req_t *req, int verbose)
+/* called when the server is freed, no requests are attached by then */
+void rad_server_sock_free(struct rad_server_t *s)
+{
+	struct rad_sock_t *sock;
+	int type;
+
+	pthread_mutex_lock(&req_lock);
+	for (type = 0; type < 2; type++) {
+		while (!list_empty(&s->sock_list[type])) {
+			sock = list_entry(s->sock_list[type].next, typeof(*sock), entry);
+			list_del(&sock->entry);
+			/* replies already read are dropped by rad_sock_reply */
+			sock->serv = NULL;
+			if (sock->ctx.tpd)
+				triton_context_call(&sock->ctx, (triton_event_func)rad_sock_free, sock);
+			else
+				_free(sock);
+		}
+		s->sock_cnt[type] = 0;
+	}
+	pthread_mutex_unlock(&req_lock);
+}
+
+/* Picks the least loaded socket of the server, opens another one while
+ * the pool is not full, and takes a free identifier on it */
+static int __rad_req_attach(struct rad_req_t *req)
 {
-	if (req->hnd.fd == -1 && make_socket(req))
+	struct rad_server_t *s = req->serv;
+	struct rad_sock_t *sock, *s0 = NULL;
+	int i;
+
+	list_for_each_entry(sock, &s->sock_list[req->type], entry) {
+		if (!s0 || sock->req_cnt < s0->req_cnt)
+			s0 = sock;
+	}
+
+	if (!s0 || (s0->req_cnt && s->sock_cnt[req->type] < conf_sockets)) {
+		sock = rad_sock_create(s, req->type);
+		if (sock)
+			s0 = sock;
+	}
+
+	if (!s0)
+		return -1;
+
+	if (s0->req_cnt == RAD_SOCK_IDS) {
+		log_ppp_error("radius: server(%i) has no free identifiers\n", s->id);
 		return -1;
+	}
+
+	for (i = s0->next_id; s0->req[i]; i = (i + 1) % RAD_SOCK_IDS);
+
+	s0->req[i] = req;
+	s0->req_cnt++;
+	s0->next_id = (i + 1) % RAD_SOCK_IDS;
+
+	req->sock = s0;
+	req->id = i;
+
+	return 0;
+}
+
+static void __rad_req_detach(struct rad_req_t *req)
+{
+	if (req->sock) {
+		req->sock->req[req->id] = NULL;
+		req->sock->req_cnt--;
+		req->sock = NULL;
+	}
+	req->expect = 0;
+}
+
+void rad_req_detach(struct rad_req_t *req)
+{
+	pthread_mutex_lock(&req_lock);
+	__rad_req_detach(req);
+	pthread_mutex_unlock(&req_lock);
+}
+
+/* Puts the transport's identifier into the built packet, accounting
+ * requests are signed over it so the authenticator is recalculated */
+static void req_set_id(struct rad_req_t *req)
+{
+	struct rad_packet_t *pack = req->pack;
+	MD5_CTX ctx;
+
+	pack->id = req->id;
+	((uint8_t *)pack->buf)[1] = req->id;
+
+	if (pack->code != CODE_ACCOUNTING_REQUEST)
+		return;
+
+	memset(pack->buf + 4, 0, 16);
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, pack->buf, pack->len);
+	MD5_Update(&ctx, req->serv->secret, strlen(req->serv->secret));
+	MD5_Final(pack->buf + 4, &ctx);
+}
+
+/*
+ * A packet whose identifier was changed by the caller gets a new
+ * identifier from the transport, otherwise it is a retransmission and
+ * keeps the one it has.
+ */
+int rad_req_send(struct rad_req_t *req, int verbose)
+{
+	int fd;
 
 	if (!req->pack->buf && rad_packet_build(req->pack, req->RA))
-		goto out_err;
+		return -1;
+
+	pthread_mutex_lock(&req_lock);
+
+	if (req->sock && req->pack->id != req->id)
+		__rad_req_detach(req);
+
+	if (!req->sock && __rad_req_attach(req)) {
+		pthread_mutex_unlock(&req_lock);
+		return -1;
+	}
+
+	if (req->pack->id != req->id || ((uint8_t *)req->pack->buf)[1] != req->id)
+		req_set_id(req);
+
+	memcpy(req->auth, req->pack->buf + 4, 16);
+	req->expect = 1;
+	fd = req->sock->hnd.fd;
+
+	pthread_mutex_unlock(&req_lock);
 	
 	if (verbose) {
 		log_ppp_info1("send ");
 		rad_packet_print(req->pack, req->serv, log_ppp_info1);
 	}
 
-	rad_packet_send(req->pack, req->hnd.fd, NULL);
+	rad_packet_send(req->pack, fd, NULL);
 
 	return 0;
+}
 
-out_err:
-	close(req->hnd.fd);
-	req->hnd.fd = -1;
-	return -1;
+static int rad_sock_check_auth(struct rad_sock_t *sock, struct rad_req_t *req, struct rad_packet_t *pack)
+{
+	MD5_CTX ctx;
+	uint8_t md[16];
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, pack->buf, 4);
+	MD5_Update(&ctx, req->auth, 16);
+	MD5_Update(&ctx, pack->buf + 20, pack->len - 20);
+	MD5_Update(&ctx, sock->serv->secret, strlen(sock->serv->secret));
+	MD5_Final(md, &ctx);
+
+	return memcmp(md, pack->buf + 4, 16);
 }
 
-static void req_wakeup(struct rad_req_t *req)
+/* called with req_lock held, consumes the packet */
+static void rad_sock_deliver(struct rad_req_t *req, struct rad_packet_t *pack)
 {
-	struct triton_context_t *ctx = req->rpd->ppp->ctrl->ctx;
-	if (req->timeout.tpd)
-		triton_timer_del(&req->timeout);
-	triton_md_unregister_handler(&req->hnd);
-	triton_context_unregister(&req->ctx);
-	triton_context_wakeup(ctx);
+	if (req->recv) {
+		if (req->pending_reply)
+			rad_packet_free(req->pending_reply);
+		else {
+			req->pending++;
+			triton_context_call(req->ctx, (triton_event_func)rad_req_deliver, req);
+		}
+		req->pending_reply = pack;
+	} else if (req->expect) {
+		if (req->reply)
+			rad_packet_free(req->reply);
+		req->reply = pack;
+		req->expect = 0;
+		if (req->wait) {
+			req->wait = 0;
+			triton_timer_del(&req->wait_timer);
+			triton_context_wakeup(req->ctx);
+		}
+	} else
+		rad_packet_free(pack);
 }
-static int rad_req_read(struct triton_md_handler_t *h)
+
+/*
+ * Response authenticators of the replies read in one go are computed
+ * together by MD5_batch. The hashed message is built in place: the
+ * Request Authenticator temporarily replaces the received one and the
+ * secret is put after the packet, packets without room for it are
+ * checked one by one.
+ */
+static void rad_sock_reply(struct rad_sock_t *sock, struct rad_packet_t **packs, int n)
 {
-	struct rad_req_t *req = container_of(h, typeof(*req), hnd);
 	struct rad_packet_t *pack;
-	int r;
-
-	while (1) {
-		r = rad_packet_recv(h->fd, &pack, NULL);
-		
-		if (pack) {
-			if (req->reply)
-				rad_packet_free(req->reply);
-			req->reply = pack;
+	struct rad_req_t *req[RAD_SOCK_BATCH];
+	struct mbhash_job_t jobs[RAD_SOCK_BATCH];
+	uint8_t ra[RAD_SOCK_BATCH][16];
+	uint8_t md[RAD_SOCK_BATCH][16];
+	int batched[RAD_SOCK_BATCH];
+	int i, cnt = 0, invalid, slen;
+
+	pthread_mutex_lock(&req_lock);
+
+	/* the server is gone */
+	if (!sock->serv) {
+		pthread_mutex_unlock(&req_lock);
+		for (i = 0; i < n; i++)
+			rad_packet_free(packs[i]);
+		return;
+	}
+
+	slen = strlen(sock->serv->secret);
+
+	for (i = 0; i < n; i++) {
+		pack = packs[i];
+		batched[i] = 0;
+
+		req[i] = sock->req[pack->id];
+		if (!req[i]) {
+			if (conf_verbose)
+				log_info2("radius: server(%i): unexpected reply id %i\n", sock->serv->id, pack->id);
+			continue;
 		}
 
-		if (r)
-			break;
+		if (pack->len < 20 || pack->len + slen > REQ_LENGTH_MAX)
+			continue;
+
+		memcpy(ra[i], pack->buf + 4, 16);
+		memcpy(pack->buf + 4, req[i]->auth, 16);
+		memcpy(pack->buf + pack->len, sock->serv->secret, slen);
+
+		jobs[cnt].data = pack->buf;
+		jobs[cnt].len = pack->len + slen;
+		jobs[cnt].md = md[i];
+		cnt++;
+		batched[i] = 1;
 	}
 
-	req_wakeup(req);
-	
-	return 1;
+	if (cnt)
+		MD5_batch(jobs, cnt);
+
+	for (i = 0; i < n; i++) {
+		pack = packs[i];
+
+		if (!req[i]) {
+			rad_packet_free(pack);
+			continue;
+		}
+
+		if (batched[i]) {
+			memcpy(pack->buf + 4, ra[i], 16);
+			invalid = memcmp(md[i], ra[i], 16);
+		} else
+			invalid = pack->len < 20 || rad_sock_check_auth(sock, req[i], pack);
+
+		if (invalid) {
+			log_warn("radius: server(%i): invalid response authenticator (id %i)\n", sock->serv->id, pack->id);
+			rad_packet_free(pack);
+			continue;
+		}
+
+		rad_sock_deliver(req[i], pack);
+	}
+
+	pthread_mutex_unlock(&req_lock);
 }
-static void rad_req_timeout(struct triton_timer_t *t)
+
+static int rad_sock_read(struct triton_md_handler_t *h)
 {
-	struct rad_req_t *req = container_of(t, typeof(*req), timeout);
-	
-	req_wakeup(req);
+	struct rad_sock_t *sock = container_of(h, typeof(*sock), hnd);
+	struct rad_packet_t *packs[RAD_SOCK_BATCH];
+	struct rad_packet_t *pack;
+	int n, r;
+
+	do {
+		n = 0;
+		do {
+			r = rad_packet_recv(h->fd, &pack, NULL);
+			if (pack)
+				packs[n++] = pack;
+		} while (!r && n < RAD_SOCK_BATCH);
+
+		if (n)
+			rad_sock_reply(sock, packs, n);
+	} while (!r);
+
+	return 0;
 }
 
-int rad_req_wait(struct rad_req_t *req, int timeout)
+/* runs in the owner context */
+static void rad_req_deliver(struct rad_req_t *req)
 {
-	req->hnd.read = rad_req_read;
-	req->timeout.expire = rad_req_timeout;
+	struct rad_packet_t *pack;
 
-	triton_context_register(&req->ctx, req->rpd->ppp);
-	triton_context_set_priority(&req->ctx, 1);
-	triton_md_register_handler(&req->ctx, &req->hnd);
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	pthread_mutex_lock(&req_lock);
+	pack = req->pending_reply;
+	req->pending_reply = NULL;
+	pthread_mutex_unlock(&req_lock);
 
-	req->timeout.period = timeout * 1000;
-	triton_timer_add(&req->ctx, &req->timeout, 0);
-	
-	triton_context_wakeup(&req->ctx);
+	if (req_put(req) || !req->recv) {
+		rad_packet_free(pack);
+		return;
+	}
+
+	if (req->reply)
+		rad_packet_free(req->reply);
+	req->reply = pack;
+
+	req->recv(req);
+}
+
+/* runs in the socket's context, like the replies */
+static void rad_req_timeout(struct triton_timer_t *t)
+{
+	struct rad_req_t *req = container_of(t, typeof(*req), wait_timer);
+
+	pthread_mutex_lock(&req_lock);
+	triton_timer_del(t);
+	req->wait = 0;
+	req->expect = 0;
+	triton_context_wakeup(req->ctx);
+	pthread_mutex_unlock(&req_lock);
+}
+
+int rad_req_wait(struct rad_req_t *req, int timeout)
+{
+	int wait = 0;
+
+	pthread_mutex_lock(&req_lock);
+	if (req->expect) {
+		req->wait = 1;
+		req->wait_timer.expire = rad_req_timeout;
+		req->wait_timer.period = timeout * 1000;
+		triton_timer_add(&req->sock->ctx, &req->wait_timer, 0);
+		wait = 1;
+	}
+	pthread_mutex_unlock(&req_lock);
 
-	triton_context_schedule();
+	if (wait)
+		triton_context_schedule();
 
 	if (conf_verbose && req->reply) {
 		log_ppp_info1("recv ");
@@ -301,6 +701,214 @@ int rad_req_wait(struct rad_req_t *req, int timeout)
 	return 0;
 }
 
+/*
+ * Non-blocking requests. rad_req_start runs the whole exchange in the
+ * owner context: it enters the server (the request is queued if the
+ * server's req-limit is reached), sends the request up to max-try times
+ * waiting timeout seconds for each reply, and moves on to the next server
+ * if this one does not answer. done gets 0 once a valid reply is stored
+ * in req->reply or -1 if no server answered.
+ */
+static void req_enter(struct rad_req_t *req);
+static void req_send(struct rad_req_t *req);
+
+static void req_finish(struct rad_req_t *req, int res)
+{
+	void (*done)(struct rad_req_t *, int) = req->done;
+
+	pthread_mutex_lock(&req_lock);
+	req->recv = NULL;
+	__rad_req_detach(req);
+	pthread_mutex_unlock(&req_lock);
+
+	if (req->timeout.tpd)
+		triton_timer_del(&req->timeout);
+
+	req->done = NULL;
+	done(req, res);
+}
+
+static void req_realloc(struct rad_req_t *req)
+{
+	if (rad_server_realloc(req)) {
+		log_ppp_warn("radius: no available servers\n");
+		req_finish(req, -1);
+		return;
+	}
+
+	req_enter(req);
+}
+
+static void req_entered(struct rad_req_t *req)
+{
+	req->entered = 1;
+	req->try = 0;
+	req_send(req);
+}
+
+static void req_enter(struct rad_req_t *req)
+{
+	int r = rad_server_req_enter(req);
+
+	if (r > 0)
+		return;
+
+	if (r < 0)
+		req_realloc(req);
+	else
+		req_entered(req);
+}
+
+/* the server did not answer any of the tries */
+static void req_fail(struct rad_req_t *req)
+{
+	rad_server_req_exit(req);
+	req->entered = 0;
+
+	rad_server_fail(req->serv);
+	req_realloc(req);
+}
+
+static void req_lost(struct rad_req_t *req)
+{
+	struct rad_server_t *s = req->serv;
+
+	if (req->type == RAD_SERV_AUTH) {
+		__sync_add_and_fetch(&s->stat_auth_lost, 1);
+		stat_accm_add(s->stat_auth_lost_1m, 1);
+		stat_accm_add(s->stat_auth_lost_5m, 1);
+	} else {
+		__sync_add_and_fetch(&s->stat_acct_lost, 1);
+		stat_accm_add(s->stat_acct_lost_1m, 1);
+		stat_accm_add(s->stat_acct_lost_5m, 1);
+	}
+
+	if (++req->try < conf_max_try)
+		req_send(req);
+	else
+		req_fail(req);
+}
+
+static void req_timeout(struct triton_timer_t *t)
+{
+	struct rad_req_t *req = container_of(t, typeof(*req), timeout);
+
+	triton_timer_del(t);
+
+	req_lost(req);
+}
+
+static void req_recv(struct rad_req_t *req)
+{
+	struct rad_server_t *s = req->serv;
+	unsigned int dt;
+
+	/* a late reply to an identifier the request no longer uses */
+	if (req->reply->id != req->pack->id) {
+		rad_packet_free(req->reply);
+		req->reply = NULL;
+		return;
+	}
+
+	if (conf_verbose) {
+		log_ppp_info1("recv ");
+		rad_packet_print(req->reply, s, log_ppp_info1);
+	}
+
+	if (req->timeout.tpd)
+		triton_timer_del(&req->timeout);
+
+	dt = (req->reply->tv.tv_sec - req->pack->tv.tv_sec) * 1000 +
+		(req->reply->tv.tv_nsec - req->pack->tv.tv_nsec) / 1000000;
+
+	if (req->type == RAD_SERV_AUTH) {
+		stat_accm_add(s->stat_auth_query_1m, dt);
+		stat_accm_add(s->stat_auth_query_5m, dt);
+	} else {
+		stat_accm_add(s->stat_acct_query_1m, dt);
+		stat_accm_add(s->stat_acct_query_5m, dt);
+
+		if (req->reply->code != CODE_ACCOUNTING_RESPONSE) {
+			rad_packet_free(req->reply);
+			req->reply = NULL;
+			req->pack->id++;
+			req_lost(req);
+			return;
+		}
+	}
+
+	rad_server_req_exit(req);
+	req->entered = 0;
+
+	req_finish(req, 0);
+}
+
+static void req_send(struct rad_req_t *req)
+{
+	if (req->prepare && req->prepare(req)) {
+		rad_server_req_exit(req);
+		req->entered = 0;
+		req_finish(req, -1);
+		return;
+	}
+
+	if (req->type == RAD_SERV_AUTH)
+		__sync_add_and_fetch(&req->serv->stat_auth_sent, 1);
+	else
+		__sync_add_and_fetch(&req->serv->stat_acct_sent, 1);
+
+	req->recv = req_recv;
+	req->sent = 1;
+
+	if (rad_req_send(req, conf_verbose)) {
+		req_fail(req);
+		return;
+	}
+
+	req->timeout.expire = req_timeout;
+	req->timeout.period = conf_timeout * 1000;
+	triton_timer_add(req->ctx, &req->timeout, 0);
+}
+
+static void req_begin(struct rad_req_t *req)
+{
+	if (req_put(req))
+		return;
+
+	req_enter(req);
+}
+
+/* the request was taken from the server's queue */
+static void req_resume(struct rad_req_t *req)
+{
+	if (req_put(req))
+		return;
+
+	if (rad_server_req_resume(req))
+		req_realloc(req);
+	else
+		req_entered(req);
+}
+
+/* called by the server with its lock held */
+void rad_req_wakeup(struct rad_req_t *req)
+{
+	req_call(req, req_resume);
+}
+
+void rad_req_start(struct rad_req_t *req, void (*done)(struct rad_req_t *, int res))
+{
+	if (req->reply) {
+		rad_packet_free(req->reply);
+		req->reply = NULL;
+	}
+
+	req->done = done;
+
+	/* done is never called before rad_req_start returns */
+	req_call(req, req_begin);
+}
+
 static void req_init(void)
 {
 }
@@ -24,6 +24,20 @@ static LIST_HEAD(serv_list);
 
 static void __free_server(struct rad_server_t *);
 
+/* takes a request off the queue, called with the server's lock held */
+static void req_wakeup(struct rad_server_t *s, struct rad_req_t *r)
+{
+	list_del(&r->entry);
+
+	if (r->queued) {
+		r->queued = 0;
+		r->woken = 1;
+		s->queue_cnt--;
+		rad_req_wakeup(r);
+	} else
+		triton_context_wakeup(r->rpd->ppp->ctrl->ctx);
+}
+
 static struct rad_server_t *__rad_server_get(int type, struct rad_server_t *exclude)
 {
 	struct rad_server_t *s, *s0 = NULL;
@@ -100,6 +114,13 @@ int rad_server_req_enter(struct rad_req_t *req)
 		list_add_tail(&req->entry, &req->serv->req_queue);
 		req->serv->queue_cnt++;
 
+		/* non-blocking requests continue in rad_server_req_resume */
+		if (req->done) {
+			req->queued = 1;
+			pthread_mutex_unlock(&req->serv->lock);
+			return 1;
+		}
+
 		pthread_mutex_unlock(&req->serv->lock);
 		triton_context_schedule();
 		pthread_mutex_lock(&req->serv->lock);
@@ -129,7 +150,7 @@ int rad_server_req_enter(struct rad_req_t *req)
 
 void rad_server_req_exit(struct rad_req_t *req)
 {
-	struct rad_req_t *r = NULL;
+	struct rad_req_t *r;
 	
 	if (!req->serv->req_limit)
 		return;
@@ -138,12 +159,47 @@ void rad_server_req_exit(struct rad_req_t *req)
 	req->serv->req_cnt--;
 	if (req->serv->req_cnt < req->serv->req_limit && !list_empty(&req->serv->req_queue)) {
 		r = list_entry(req->serv->req_queue.next, typeof(*r), entry);
-		list_del(&r->entry);
+		req_wakeup(req->serv, r);
 	}
 	pthread_mutex_unlock(&req->serv->lock);
+}
 
-	if (r)
-		triton_context_wakeup(r->rpd->ppp->ctrl->ctx);
+int rad_server_req_resume(struct rad_req_t *req)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	pthread_mutex_lock(&req->serv->lock);
+	req->woken = 0;
+	if (ts.tv_sec < req->serv->fail_time || req->serv->need_free) {
+		pthread_mutex_unlock(&req->serv->lock);
+		return -1;
+	}
+	req->serv->req_cnt++;
+	pthread_mutex_unlock(&req->serv->lock);
+
+	return 0;
+}
+
+void rad_server_req_cancel(struct rad_req_t *req)
+{
+	struct rad_req_t *r;
+
+	pthread_mutex_lock(&req->serv->lock);
+	if (req->queued) {
+		list_del(&req->entry);
+		req->queued = 0;
+		req->serv->queue_cnt--;
+	} else if (req->woken) {
+		/* the request won't take the slot it was woken for, pass it on */
+		req->woken = 0;
+		if (req->serv->req_cnt < req->serv->req_limit && !list_empty(&req->serv->req_queue)) {
+			r = list_entry(req->serv->req_queue.next, typeof(*r), entry);
+			req_wakeup(req->serv, r);
+		}
+	}
+	pthread_mutex_unlock(&req->serv->lock);
 }
 
 int rad_server_realloc(struct rad_req_t *req)
@@ -153,24 +209,14 @@ int rad_server_realloc(struct rad_req_t *req)
 	if (!s)
 		return -1;
 
+	/* the socket belongs to the old server, which may be freed by the put */
+	rad_req_detach(req);
+
 	if (req->serv)
 		rad_server_put(req->serv, req->type);
 
 	req->serv = s;
 
-	if (req->hnd.fd != -1) {
-		if (req->hnd.tpd)
-			triton_md_unregister_handler(&req->hnd);
-		close(req->hnd.fd);
-		req->hnd.fd = -1;
-	}
-
-	req->server_addr = req->serv->addr;
-	if (req->type == RAD_SERV_ACCT)
-		req->server_port = req->serv->acct_port;
-	else
-		req->server_port = req->serv->auth_port;
-
 	return 0;
 }
 
@@ -192,8 +238,7 @@ void rad_server_fail(struct rad_server_t *s)
 	if (s->conf_fail_time) {
 		while (!list_empty(&s->req_queue)) {
 			r = list_entry(s->req_queue.next, typeof(*r), entry);
-			list_del(&r->entry);
-			triton_context_wakeup(r->rpd->ppp->ctrl->ctx);
+			req_wakeup(s, r);
 		}
 	}
 
@@ -234,6 +279,7 @@ static void show_stat(struct rad_server_t *s, void *client)
 		
 	cli_sendv(client, "  request count: %i\r\n", s->req_cnt);
 	cli_sendv(client, "  queue length: %i\r\n", s->queue_cnt);
+	cli_sendv(client, "  sockets(auth/acct): %i/%i\r\n", s->sock_cnt[RAD_SERV_AUTH], s->sock_cnt[RAD_SERV_ACCT]);
 
 	if (s->auth_port) {
 		cli_sendv(client, "  auth sent: %lu\r\n", s->stat_auth_sent);
@@ -274,6 +320,7 @@ void fill_stat(struct rad_server_t *s, struct rad_server_stat_t *st)
 	st->addr = s->addr;
 	st->auth_port = s->auth_port;
 	st->acct_port = s->acct_port;
+	st->req_cnt = s->req_cnt;
 	st->queue_cnt = s->queue_cnt;
 
 	st->stat_auth_sent = s->stat_auth_sent;
@@ -330,6 +377,8 @@ static void __add_server(struct rad_server_t *s)
 
 	s->id = ++num;
 	INIT_LIST_HEAD(&s->req_queue);
+	INIT_LIST_HEAD(&s->sock_list[0]);
+	INIT_LIST_HEAD(&s->sock_list[1]);
 	pthread_mutex_init(&s->lock, NULL);
 	list_add_tail(&s->entry, &serv_list);
 
@@ -353,6 +402,8 @@ static void __free_server(struct rad_server_t *s)
 {
 	log_debug("radius: free(%i)\n", s->id);
 
+	rad_server_sock_free(s);
+
 	stat_accm_free(s->stat_auth_lost_1m);
 	stat_accm_free(s->stat_auth_lost_5m);
 	stat_accm_free(s->stat_auth_query_1m);
@@ -613,11 +664,12 @@ static void load_config(void)
 		if (s->need_free) {
 			list_del(&s->entry);
 
+			pthread_mutex_lock(&s->lock);
 			while (!list_empty(&s->req_queue)) {
 				r = list_entry(s->req_queue.next, typeof(*r), entry);
-				list_del(&r->entry);
-				triton_context_wakeup(r->rpd->ppp->ctrl->ctx);
+				req_wakeup(s, r);
 			}
+			pthread_mutex_unlock(&s->lock);
 
 			if (!s->client_cnt[0] && !s->client_cnt[1])
 				__free_server(s);
@@ -0,0 +1,171 @@
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "triton.h"
+#include "log.h"
+#include "ppp.h"
+#include "random.h"
+
+/*
+ * Per-thread ChaCha20 based generator. Every refill produces a buffer of
+ * keystream, the first 32 bytes of which replace the key (fast key
+ * erasure), consumed bytes are wiped. The key is re-seeded from the
+ * kernel after RESEED_BYTES of output and after fork.
+ */
+
+#define BUF_BLOCKS 16
+#define BUF_SIZE (BUF_BLOCKS * 64)
+#define RESEED_BYTES (1024 * 1024)
+
+struct rand_state_t
+{
+	uint32_t key[8];
+	uint8_t buf[BUF_SIZE];
+	int pos;
+	int out;
+	int fork_gen;
+	int seeded;
+};
+
+static __thread struct rand_state_t rs;
+static int fork_gen;
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QR(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+static void chacha20_block(const uint32_t *key, uint32_t counter, uint8_t *out)
+{
+	uint32_t s[16], x[16];
+	int i;
+
+	s[0] = 0x61707865;
+	s[1] = 0x3320646e;
+	s[2] = 0x79622d32;
+	s[3] = 0x6b206574;
+	memcpy(s + 4, key, 32);
+	s[12] = counter;
+	s[13] = 0;
+	s[14] = 0;
+	s[15] = 0;
+
+	memcpy(x, s, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+		QR(x[0], x[4], x[8], x[12]);
+		QR(x[1], x[5], x[9], x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8], x[13]);
+		QR(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; i++) {
+		x[i] += s[i];
+		out[i * 4] = x[i];
+		out[i * 4 + 1] = x[i] >> 8;
+		out[i * 4 + 2] = x[i] >> 16;
+		out[i * 4 + 3] = x[i] >> 24;
+	}
+}
+
+static int get_entropy(void *buf, int size)
+{
+	int r;
+
+	while (1) {
+#ifdef SYS_getrandom
+		r = syscall(SYS_getrandom, buf, size, 0);
+		if (r < 0 && errno == ENOSYS)
+			r = read(urandom_fd, buf, size);
+#else
+		r = read(urandom_fd, buf, size);
+#endif
+		if (r == size)
+			return 0;
+		if (r < 0 && errno == EINTR)
+			continue;
+		log_emerg("random: failed to get entropy: %s\n", r < 0 ? strerror(errno) : "short read");
+		return -1;
+	}
+}
+
+static int reseed(struct rand_state_t *s)
+{
+	if (get_entropy(s->key, sizeof(s->key)))
+		return -1;
+
+	s->pos = BUF_SIZE;
+	s->out = 0;
+	s->fork_gen = fork_gen;
+	s->seeded = 1;
+
+	return 0;
+}
+
+static void refill(struct rand_state_t *s)
+{
+	int i;
+
+	for (i = 0; i < BUF_BLOCKS; i++)
+		chacha20_block(s->key, i, s->buf + i * 64);
+
+	memcpy(s->key, s->buf, sizeof(s->key));
+	memset(s->buf, 0, sizeof(s->key));
+
+	s->pos = sizeof(s->key);
+}
+
+int __export u_randbuf(void *buf, int size)
+{
+	struct rand_state_t *s = &rs;
+	uint8_t *ptr = buf;
+	int n;
+
+	if (!s->seeded || s->out >= RESEED_BYTES || s->fork_gen != fork_gen) {
+		if (reseed(s))
+			return -1;
+	}
+
+	s->out += size;
+
+	while (size) {
+		if (s->pos == BUF_SIZE)
+			refill(s);
+
+		n = BUF_SIZE - s->pos;
+		if (n > size)
+			n = size;
+
+		memcpy(ptr, s->buf + s->pos, n);
+		memset(s->buf + s->pos, 0, n);
+
+		s->pos += n;
+		ptr += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+static void random_atfork_child(void)
+{
+	fork_gen++;
+}
+
+static void init(void)
+{
+	pthread_atfork(NULL, NULL, random_atfork_child);
+}
+
+DEFINE_INIT(1, init);
@@ -0,0 +1,6 @@
+#ifndef __RANDOM_H
+#define __RANDOM_H
+
+int u_randbuf(void *buf, int size);
+
+#endif
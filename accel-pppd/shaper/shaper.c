@@ -13,6 +13,7 @@
 #include "log.h"
 #include "ppp.h"
 #include "cli.h"
+#include "upgrade.h"
 
 #ifdef RADIUS
 #include "radius.h"
@@ -448,6 +449,72 @@ static void ev_ppp_finishing(struct ppp_t *ppp)
 	}
 }
 
+/* limiters stay installed on the interface, only the session state is handed over */
+static void ev_ppp_upgrade_save(struct ev_upgrade_t *ev)
+{
+	struct shaper_pd_t *pd = find_pd(ev->ppp, 0);
+	struct time_range_pd_t *tr_pd;
+	int rate[4];
+	int tr[32][5];
+	int n = 0;
+
+	if (!pd)
+		return;
+
+	rate[0] = pd->temp_down_speed;
+	rate[1] = pd->temp_up_speed;
+	rate[2] = pd->down_speed;
+	rate[3] = pd->up_speed;
+	upgrade_put(ev->rec, UPG_SHAPER_RATE, rate, sizeof(rate));
+
+	list_for_each_entry(tr_pd, &pd->tr_list, entry) {
+		if (n == 32)
+			break;
+		tr[n][0] = tr_pd->id;
+		tr[n][1] = tr_pd->down_speed;
+		tr[n][2] = tr_pd->down_burst;
+		tr[n][3] = tr_pd->up_speed;
+		tr[n][4] = tr_pd->up_burst;
+		n++;
+	}
+
+	if (n)
+		upgrade_put(ev->rec, UPG_SHAPER_TIME_RANGE, tr, n * sizeof(tr[0]));
+}
+
+static void ev_ppp_upgrade_restore(struct ev_upgrade_t *ev)
+{
+	struct shaper_pd_t *pd;
+	struct time_range_pd_t *tr_pd;
+	const int *tr;
+	int rate[4];
+	int i, len;
+
+	if (upgrade_get_val(ev->rec, UPG_SHAPER_RATE, rate, sizeof(rate)))
+		return;
+
+	pd = find_pd(ev->ppp, 1);
+	if (!pd)
+		return;
+
+	pd->temp_down_speed = rate[0];
+	pd->temp_up_speed = rate[1];
+	pd->down_speed = rate[2];
+	pd->up_speed = rate[3];
+
+	tr = upgrade_get(ev->rec, UPG_SHAPER_TIME_RANGE, &len);
+	if (!tr)
+		return;
+
+	for (i = 0; i < len / (5 * sizeof(int)); i++, tr += 5) {
+		tr_pd = get_tr_pd(pd, tr[0]);
+		tr_pd->down_speed = tr[1];
+		tr_pd->down_burst = tr[2];
+		tr_pd->up_speed = tr[3];
+		tr_pd->up_burst = tr[4];
+	}
+}
+
 static void shaper_change_help(char * const *f, int f_cnt, void *cli)
 {
 	cli_send(cli, "shaper change <interface> <value> [temp] - change shaper on specified interface, if temp is set then previous settings may be restored later by 'shaper restore'\r\n");
@@ -988,6 +1055,8 @@ static void init(void)
 	triton_event_register_handler(EV_PPP_FINISHING, (triton_event_func)ev_ppp_finishing);
 	//triton_event_register_handler(EV_CTRL_FINISHED, (triton_event_func)ev_ctrl_finished);
 	triton_event_register_handler(EV_SHAPER, (triton_event_func)ev_shaper);
+	triton_event_register_handler(EV_PPP_UPGRADE_SAVE, (triton_event_func)ev_ppp_upgrade_save);
+	triton_event_register_handler(EV_PPP_UPGRADE_RESTORE, (triton_event_func)ev_ppp_upgrade_restore);
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 
 	cli_register_simple_cmd2(shaper_change_exec, shaper_change_help, 2, "shaper", "change");
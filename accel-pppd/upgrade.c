@@ -0,0 +1,554 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "triton.h"
+#include "events.h"
+#include "ppp.h"
+#include "log.h"
+#include "cli.h"
+#include "upgrade.h"
+
+#include "memdebug.h"
+
+#define UPGRADE_TIMEOUT 60
+
+struct upgrade_hdr_t
+{
+	char name[UPGRADE_NAME_LEN];
+	int fd_cnt;
+	int len;
+};
+
+struct upgrade_tlv_t
+{
+	uint16_t type;
+	uint16_t len;
+	uint8_t val[0];
+} __attribute__((packed));
+
+int __export upgrade_handover;
+
+static LIST_HEAD(handlers);
+
+static int main_argc;
+static char **main_argv;
+
+static pid_t upgrade_pid;
+static int upgrade_pending;
+static int upgrade_cnt;
+
+/* the new process is started once the listeners are released */
+static int upgrade_holds;
+static char *upgrade_path;
+static char **upgrade_argv;
+static char upgrade_fd_str[16];
+static int upgrade_sv[2];
+
+static int upgrade_read(struct triton_md_handler_t *h);
+static void upgrade_timeout(struct triton_timer_t *t);
+
+static struct triton_context_t upgrade_ctx;
+static struct triton_md_handler_t upgrade_hnd = {
+	.fd = -1,
+	.read = upgrade_read,
+};
+static struct triton_timer_t upgrade_timer = {
+	.expire = upgrade_timeout,
+	.expire_tv.tv_sec = UPGRADE_TIMEOUT,
+};
+
+struct upgrade_rec_t __export *upgrade_rec_alloc(const char *name)
+{
+	struct upgrade_rec_t *rec = _malloc(sizeof(*rec));
+
+	if (!rec) {
+		log_emerg("upgrade: out of memory\n");
+		return NULL;
+	}
+
+	memset(rec, 0, offsetof(typeof(*rec), data));
+
+	if (name)
+		strncpy(rec->name, name, UPGRADE_NAME_LEN - 1);
+
+	return rec;
+}
+
+void __export upgrade_rec_free(struct upgrade_rec_t *rec)
+{
+	_free(rec);
+}
+
+void __export upgrade_rec_close(struct upgrade_rec_t *rec)
+{
+	int i;
+
+	for (i = 0; i < rec->fd_cnt; i++)
+		close(rec->fds[i]);
+
+	rec->fd_cnt = 0;
+}
+
+int __export upgrade_put(struct upgrade_rec_t *rec, int type, const void *val, int len)
+{
+	struct upgrade_tlv_t *tlv = (struct upgrade_tlv_t *)(rec->data + rec->len);
+
+	if (rec->len + sizeof(*tlv) + len > UPGRADE_DATA_SIZE) {
+		rec->err = 1;
+		return -1;
+	}
+
+	tlv->type = type;
+	tlv->len = len;
+	memcpy(tlv->val, val, len);
+
+	rec->len += sizeof(*tlv) + len;
+
+	return 0;
+}
+
+int __export upgrade_put_str(struct upgrade_rec_t *rec, int type, const char *str)
+{
+	if (!str)
+		return 0;
+
+	return upgrade_put(rec, type, str, strlen(str) + 1);
+}
+
+int __export upgrade_put_fd(struct upgrade_rec_t *rec, int fd)
+{
+	if (rec->fd_cnt == UPGRADE_MAX_FDS) {
+		rec->err = 1;
+		return -1;
+	}
+
+	rec->fds[rec->fd_cnt] = fd;
+
+	return rec->fd_cnt++;
+}
+
+const void __export *upgrade_get(const struct upgrade_rec_t *rec, int type, int *len)
+{
+	const struct upgrade_tlv_t *tlv;
+	int pos = 0;
+
+	while (pos + sizeof(*tlv) <= rec->len) {
+		tlv = (const struct upgrade_tlv_t *)(rec->data + pos);
+		if (pos + sizeof(*tlv) + tlv->len > rec->len)
+			break;
+		if (tlv->type == type) {
+			if (len)
+				*len = tlv->len;
+			return tlv->val;
+		}
+		pos += sizeof(*tlv) + tlv->len;
+	}
+
+	return NULL;
+}
+
+int __export upgrade_get_val(const struct upgrade_rec_t *rec, int type, void *val, int len)
+{
+	const void *ptr;
+	int n;
+
+	ptr = upgrade_get(rec, type, &n);
+	if (!ptr || n != len)
+		return -1;
+
+	memcpy(val, ptr, len);
+
+	return 0;
+}
+
+char __export *upgrade_get_str(const struct upgrade_rec_t *rec, int type)
+{
+	const char *ptr;
+	int n;
+
+	ptr = upgrade_get(rec, type, &n);
+	if (!ptr || n == 0 || ptr[n - 1])
+		return NULL;
+
+	return _strdup(ptr);
+}
+
+int __export upgrade_send(struct upgrade_rec_t *rec)
+{
+	struct upgrade_hdr_t hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+
+	if (rec->err) {
+		log_ppp_error("upgrade: record is too large\n");
+		return -1;
+	}
+
+	memcpy(hdr.name, rec->name, UPGRADE_NAME_LEN);
+	hdr.fd_cnt = rec->fd_cnt;
+	hdr.len = rec->len;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = rec->data;
+	iov[1].iov_len = rec->len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	if (rec->fd_cnt) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * rec->fd_cnt);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * rec->fd_cnt);
+		memcpy(CMSG_DATA(cmsg), rec->fds, sizeof(int) * rec->fd_cnt);
+	}
+
+	while (sendmsg(upgrade_hnd.fd, &msg, MSG_NOSIGNAL) < 0) {
+		if (errno == EINTR)
+			continue;
+		log_ppp_error("upgrade: sendmsg: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct upgrade_rec_t *upgrade_recv(int fd)
+{
+	struct upgrade_rec_t *rec;
+	struct upgrade_hdr_t hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+	int n, cnt;
+
+	rec = upgrade_rec_alloc(NULL);
+	if (!rec)
+		return NULL;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = rec->data;
+	iov[1].iov_len = UPGRADE_DATA_SIZE;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+		if (errno == EINTR)
+			continue;
+		log_error("upgrade: recvmsg: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	if (n == 0)
+		goto out_err;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (cnt > UPGRADE_MAX_FDS - rec->fd_cnt)
+			cnt = UPGRADE_MAX_FDS - rec->fd_cnt;
+		memcpy(rec->fds + rec->fd_cnt, CMSG_DATA(cmsg), sizeof(int) * cnt);
+		rec->fd_cnt += cnt;
+	}
+
+	if (n < sizeof(hdr) || hdr.len != n - sizeof(hdr) || hdr.fd_cnt != rec->fd_cnt || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		log_error("upgrade: malformed record received\n");
+		upgrade_rec_close(rec);
+		goto out_err;
+	}
+
+	memcpy(rec->name, hdr.name, UPGRADE_NAME_LEN);
+	rec->name[UPGRADE_NAME_LEN - 1] = 0;
+	rec->len = hdr.len;
+
+	return rec;
+
+out_err:
+	upgrade_rec_free(rec);
+	return NULL;
+}
+
+void __export upgrade_register_handler(struct upgrade_handler_t *h)
+{
+	list_add_tail(&h->entry, &handlers);
+}
+
+static void upgrade_put_ref(void)
+{
+	if (__sync_sub_and_fetch(&upgrade_pending, 1))
+		return;
+
+	log_info1("upgrade: %i sessions handed over\n", upgrade_cnt);
+
+	shutdown(upgrade_hnd.fd, SHUT_WR);
+
+	ppp_shutdown_soft();
+}
+
+static void upgrade_session(struct ppp_t *ppp)
+{
+	if (!ppp->terminating && ppp->state == PPP_STATE_ACTIVE && ppp->ctrl->upgrade && ppp->ctrl->upgrade(ppp) == 0)
+		__sync_add_and_fetch(&upgrade_cnt, 1);
+	else
+		ppp_terminate(ppp, TERM_NAS_REBOOT, 0);
+
+	upgrade_put_ref();
+}
+
+static void upgrade_abort(void)
+{
+	if (upgrade_timer.tpd)
+		triton_timer_del(&upgrade_timer);
+
+	if (upgrade_hnd.tpd)
+		triton_md_unregister_handler(&upgrade_hnd);
+
+	close(upgrade_hnd.fd);
+	upgrade_hnd.fd = -1;
+
+	kill(upgrade_pid, SIGTERM);
+	upgrade_pid = 0;
+
+	triton_context_unregister(&upgrade_ctx);
+
+	log_emerg("upgrade: aborted, staying in shutdown mode\n");
+}
+
+static int upgrade_read(struct triton_md_handler_t *h)
+{
+	struct ppp_t *ppp;
+	char c;
+	int n;
+
+	n = read(h->fd, &c, 1);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	if (n != 1) {
+		log_emerg("upgrade: new process exited before taking over sessions\n");
+		upgrade_abort();
+		return 1;
+	}
+
+	triton_timer_del(&upgrade_timer);
+	triton_md_unregister_handler(h);
+
+	fcntl(h->fd, F_SETFL, fcntl(h->fd, F_GETFL) & ~O_NONBLOCK);
+
+	log_info1("upgrade: new process is ready, handing over sessions\n");
+
+	upgrade_handover = 1;
+	upgrade_pending = 1;
+
+	pthread_rwlock_rdlock(&ppp_lock);
+	list_for_each_entry(ppp, &ppp_list, entry) {
+		__sync_add_and_fetch(&upgrade_pending, 1);
+		triton_context_call(ppp->ctrl->ctx, (triton_event_func)upgrade_session, ppp);
+	}
+	pthread_rwlock_unlock(&ppp_lock);
+
+	upgrade_put_ref();
+
+	return 1;
+}
+
+static void upgrade_timeout(struct triton_timer_t *t)
+{
+	log_emerg("upgrade: new process did not respond\n");
+	upgrade_abort();
+}
+
+static void upgrade_spawn(void *arg)
+{
+	sigset_t set;
+
+	upgrade_pid = fork();
+	if (upgrade_pid == 0) {
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+		execvp(upgrade_path, upgrade_argv);
+		_exit(EXIT_FAILURE);
+	}
+
+	_free(upgrade_path);
+	_free(upgrade_argv);
+	close(upgrade_sv[1]);
+
+	if (upgrade_pid < 0) {
+		log_emerg("upgrade: fork: %s, staying in shutdown mode\n", strerror(errno));
+		close(upgrade_sv[0]);
+		upgrade_pid = 0;
+		triton_context_unregister(&upgrade_ctx);
+		return;
+	}
+
+	fcntl(upgrade_sv[0], F_SETFL, O_NONBLOCK);
+	upgrade_hnd.fd = upgrade_sv[0];
+
+	triton_md_register_handler(&upgrade_ctx, &upgrade_hnd);
+	triton_md_enable_handler(&upgrade_hnd, MD_MODE_READ);
+	triton_timer_add(&upgrade_ctx, &upgrade_timer, 0);
+}
+
+/*
+ * EV_UPGRADE handlers which release listeners in other contexts hold
+ * the start of the new process until the sockets are closed, otherwise
+ * it could fail to bind them.
+ */
+void __export upgrade_hold(void)
+{
+	__sync_add_and_fetch(&upgrade_holds, 1);
+}
+
+void __export upgrade_release(void)
+{
+	if (__sync_sub_and_fetch(&upgrade_holds, 1) == 0)
+		triton_context_call(&upgrade_ctx, upgrade_spawn, NULL);
+}
+
+static int upgrade_start(const char *path)
+{
+	char **argv;
+	int i, n = 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, upgrade_sv)) {
+		log_error("upgrade: socketpair: %s\n", strerror(errno));
+		return -1;
+	}
+
+	fcntl(upgrade_sv[0], F_SETFD, fcntl(upgrade_sv[0], F_GETFD) | FD_CLOEXEC);
+
+	sprintf(upgrade_fd_str, "%i", upgrade_sv[1]);
+
+	/* path may be a cli argument, it is used after the command returns */
+	upgrade_path = _strdup(path);
+
+	argv = _malloc((main_argc + 3) * sizeof(char *));
+	argv[n++] = upgrade_path;
+	for (i = 1; i < main_argc; i++) {
+		if (!strcmp(main_argv[i], "-u")) {
+			i++;
+			continue;
+		}
+		argv[n++] = main_argv[i];
+	}
+	argv[n++] = "-u";
+	argv[n++] = upgrade_fd_str;
+	argv[n] = NULL;
+	upgrade_argv = argv;
+
+	log_info1("upgrade: starting %s\n", path);
+
+	/* upgrade_pid marks the upgrade as started until the process is spawned */
+	upgrade_pid = -1;
+	upgrade_holds = 1;
+
+	triton_context_register(&upgrade_ctx, NULL);
+	triton_context_wakeup(&upgrade_ctx);
+
+	/* stop accepting new sessions and release listening sockets for the new process */
+	triton_event_fire(EV_UPGRADE, NULL);
+
+	upgrade_release();
+
+	return 0;
+}
+
+void upgrade_restore(int fd)
+{
+	struct upgrade_rec_t *rec;
+	struct upgrade_handler_t *h;
+	struct timeval tv = {
+		.tv_sec = UPGRADE_TIMEOUT,
+	};
+	char c = 0;
+	int cnt = 0;
+
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (write(fd, &c, 1) != 1) {
+		log_emerg("upgrade: failed to notify old process: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	log_info1("upgrade: taking over sessions\n");
+
+	while ((rec = upgrade_recv(fd))) {
+		list_for_each_entry(h, &handlers, entry) {
+			if (!strcmp(h->name, rec->name))
+				break;
+		}
+
+		if (&h->entry == &handlers) {
+			log_error("upgrade: no handler for '%s' record\n", rec->name);
+			upgrade_rec_close(rec);
+			upgrade_rec_free(rec);
+			continue;
+		}
+
+		h->restore(rec);
+		cnt++;
+	}
+
+	close(fd);
+
+	log_info1("upgrade: %i sessions taken over\n", cnt);
+}
+
+void upgrade_setup(int argc, char **argv)
+{
+	main_argc = argc;
+	main_argv = argv;
+}
+
+static int upgrade_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
+{
+	if (f_cnt > 2)
+		return CLI_CMD_SYNTAX;
+
+	if (upgrade_pid) {
+		cli_send(cli, "upgrade is already in progress\r\n");
+		return CLI_CMD_OK;
+	}
+
+	if (upgrade_start(f_cnt == 2 ? f[1] : main_argv[0]))
+		cli_send(cli, "failed\r\n");
+
+	return CLI_CMD_OK;
+}
+
+static void upgrade_help(char * const *fields, int fields_cnt, void *client)
+{
+	cli_send(client, "upgrade [<binary>] - start new daemon and hand over active sessions to it\r\n");
+	cli_send(client, "\t\tbinary - path to new daemon executable (default is the one this daemon was started as)\r\n");
+}
+
+static void init(void)
+{
+	cli_register_simple_cmd2(upgrade_exec, upgrade_help, 1, "upgrade");
+}
+
+DEFINE_INIT(12, init);
@@ -0,0 +1,93 @@
+#ifndef __UPGRADE_H
+#define __UPGRADE_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+#define UPGRADE_NAME_LEN 16
+#define UPGRADE_DATA_SIZE 4096
+#define UPGRADE_MAX_FDS 8
+
+/*
+ * Record types used inside session records.
+ */
+#define UPG_PPP_SESSIONID            0x0001
+#define UPG_PPP_IFNAME               0x0002
+#define UPG_PPP_CHAN_IDX             0x0003
+#define UPG_PPP_UNIT_IDX             0x0004
+#define UPG_PPP_START_TIME           0x0005
+#define UPG_PPP_USERNAME             0x0006
+#define UPG_PPP_CHARGEABLE_IDENTITY  0x0007
+#define UPG_PPP_IPV4_POOL            0x0008
+#define UPG_PPP_IPV6_POOL            0x0009
+#define UPG_PPP_IPV4_ADDR            0x000a
+#define UPG_PPP_IPV4_PEER_ADDR       0x000b
+#define UPG_PPP_ACCT                 0x000c
+
+#define UPG_LCP_MAGIC                0x0101
+#define UPG_LCP_ID                   0x0102
+
+#define UPG_IPCP_ID                  0x0201
+
+#define UPG_RADIUS_AUTHENTICATED     0x0301
+#define UPG_RADIUS_INTERIM_INTERVAL  0x0302
+#define UPG_RADIUS_SESSION_TIMEOUT   0x0303
+#define UPG_RADIUS_CLASS             0x0304
+#define UPG_RADIUS_STATE             0x0305
+#define UPG_RADIUS_TERMINATION       0x0306
+
+#define UPG_PPPOE_IFNAME             0x0401
+#define UPG_PPPOE_SID                0x0402
+#define UPG_PPPOE_ADDR               0x0403
+#define UPG_PPPOE_COOKIE             0x0404
+#define UPG_PPPOE_HOST_UNIQ          0x0405
+#define UPG_PPPOE_RELAY_SID          0x0406
+#define UPG_PPPOE_SERVICE_NAME       0x0407
+#define UPG_PPPOE_TR101              0x0408
+
+#define UPG_SHAPER_RATE              0x0501
+#define UPG_SHAPER_TIME_RANGE        0x0502
+
+struct upgrade_rec_t
+{
+	char name[UPGRADE_NAME_LEN];
+	int fd_cnt;
+	int fds[UPGRADE_MAX_FDS];
+	int len;
+	int err;
+	uint8_t data[UPGRADE_DATA_SIZE];
+};
+
+struct upgrade_handler_t
+{
+	struct list_head entry;
+	const char *name;
+	/* called in the new process, takes ownership of rec and its descriptors */
+	void (*restore)(struct upgrade_rec_t *rec);
+};
+
+struct upgrade_rec_t *upgrade_rec_alloc(const char *name);
+void upgrade_rec_free(struct upgrade_rec_t *rec);
+void upgrade_rec_close(struct upgrade_rec_t *rec);
+
+int upgrade_put(struct upgrade_rec_t *rec, int type, const void *val, int len);
+int upgrade_put_str(struct upgrade_rec_t *rec, int type, const char *str);
+int upgrade_put_fd(struct upgrade_rec_t *rec, int fd);
+const void *upgrade_get(const struct upgrade_rec_t *rec, int type, int *len);
+int upgrade_get_val(const struct upgrade_rec_t *rec, int type, void *val, int len);
+char *upgrade_get_str(const struct upgrade_rec_t *rec, int type);
+
+int upgrade_send(struct upgrade_rec_t *rec);
+
+void upgrade_register_handler(struct upgrade_handler_t *h);
+
+void upgrade_hold(void);
+void upgrade_release(void);
+
+void upgrade_setup(int argc, char **argv);
+void upgrade_restore(int fd);
+
+extern int upgrade_handover;
+
+#endif
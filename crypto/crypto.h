@@ -41,6 +41,8 @@ typedef unsigned char const_DES_cblock[8];
 #define DES_DECRYPT 0
 #define DES_set_key(key, schedule) des_setup((const unsigned char *)key, 8, 0, schedule)
 
+void DES_set_odd_parity(DES_cblock *key);
+int DES_is_weak_key(const_DES_cblock *key);
 int DES_set_key_checked(const_DES_cblock *key, DES_key_schedule *schedule);
 int DES_random_key(DES_cblock *ret);
 void DES_ecb_encrypt(const_DES_cblock *input, DES_cblock *output, DES_key_schedule *ks, int enc);
@@ -0,0 +1,393 @@
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "crypto.h"
+#include "mbhash.h"
+
+#define __export __attribute__((visibility("default")))
+
+/*
+ * Kernels work on LANES messages at once. On x86 they are built twice,
+ * for AVX2 and for the baseline (SSE2) instruction set, and the proper
+ * variant is picked at load time.
+ */
+#define LANES 8
+
+#if (defined(__x86_64__) || defined(__i386__)) && __GNUC__ >= 6
+#define MB_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define MB_TARGETS
+#endif
+
+typedef uint32_t vec_t __attribute__((vector_size(LANES * 4)));
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+struct lane_t
+{
+	const uint8_t *data;
+	unsigned int len;
+	int blocks;
+};
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const int md4_g3[16] = {
+	0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15,
+};
+
+static int nblocks(unsigned int len)
+{
+	/* 0x80 terminator and 64-bit length */
+	return (len + 8) / 64 + 1;
+}
+
+static void get_block(const struct lane_t *l, int b, uint8_t *blk, int big_endian)
+{
+	unsigned int off = b * 64, n;
+	uint64_t bits;
+	int i;
+
+	memset(blk, 0, 64);
+
+	if (off < l->len) {
+		n = l->len - off;
+		if (n > 64)
+			n = 64;
+		memcpy(blk, l->data + off, n);
+		if (n < 64)
+			blk[n] = 0x80;
+	} else if (off == l->len)
+		blk[0] = 0x80;
+
+	if (b == l->blocks - 1) {
+		bits = (uint64_t)l->len * 8;
+		for (i = 0; i < 8; i++)
+			blk[big_endian ? 63 - i : 56 + i] = bits >> (8 * i);
+	}
+}
+
+static void load_block(vec_t *w, vec_t *mask, const struct lane_t *lanes, int b, int big_endian)
+{
+	uint32_t x[16][LANES], m[LANES], v;
+	uint8_t blk[64];
+	const uint8_t *p;
+	int i, j;
+
+	for (j = 0; j < LANES; j++) {
+		if (b >= lanes[j].blocks) {
+			for (i = 0; i < 16; i++)
+				x[i][j] = 0;
+			m[j] = 0;
+			continue;
+		}
+
+		if ((b + 1) * 64 <= lanes[j].len)
+			p = lanes[j].data + b * 64;
+		else {
+			get_block(&lanes[j], b, blk, big_endian);
+			p = blk;
+		}
+
+		for (i = 0; i < 16; i++, p += 4) {
+			memcpy(&v, p, 4);
+			x[i][j] = big_endian ? be32toh(v) : le32toh(v);
+		}
+		m[j] = 0xffffffff;
+	}
+
+	memcpy(w, x, sizeof(x));
+	memcpy(mask, m, sizeof(m));
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD4_STEP(f, a, b, c, d, x, k, r) a = ROTL(a + f(b, c, d) + (k) + (x), r)
+#define MD5_STEP(f, a, b, c, d, x, k, r) a = b + ROTL(a + f(b, c, d) + (k) + (x), r)
+
+static MB_TARGETS void md4_blocks(vec_t *s, const struct lane_t *lanes, int blocks)
+{
+	vec_t w[16], mask, a, b, c, d;
+	int n, i;
+
+	for (n = 0; n < blocks; n++) {
+		load_block(w, &mask, lanes, n, 0);
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+
+		for (i = 0; i < 16; i += 4) {
+			MD4_STEP(F, a, b, c, d, w[i], 0, 3);
+			MD4_STEP(F, d, a, b, c, w[i + 1], 0, 7);
+			MD4_STEP(F, c, d, a, b, w[i + 2], 0, 11);
+			MD4_STEP(F, b, c, d, a, w[i + 3], 0, 19);
+		}
+
+		for (i = 0; i < 4; i++) {
+			MD4_STEP(G, a, b, c, d, w[i], 0x5a827999, 3);
+			MD4_STEP(G, d, a, b, c, w[i + 4], 0x5a827999, 5);
+			MD4_STEP(G, c, d, a, b, w[i + 8], 0x5a827999, 9);
+			MD4_STEP(G, b, c, d, a, w[i + 12], 0x5a827999, 13);
+		}
+
+		for (i = 0; i < 16; i += 4) {
+			MD4_STEP(H, a, b, c, d, w[md4_g3[i]], 0x6ed9eba1, 3);
+			MD4_STEP(H, d, a, b, c, w[md4_g3[i + 1]], 0x6ed9eba1, 9);
+			MD4_STEP(H, c, d, a, b, w[md4_g3[i + 2]], 0x6ed9eba1, 11);
+			MD4_STEP(H, b, c, d, a, w[md4_g3[i + 3]], 0x6ed9eba1, 15);
+		}
+
+		s[0] += a & mask;
+		s[1] += b & mask;
+		s[2] += c & mask;
+		s[3] += d & mask;
+	}
+}
+
+static MB_TARGETS void md5_blocks(vec_t *s, const struct lane_t *lanes, int blocks)
+{
+	vec_t w[16], mask, a, b, c, d;
+	int n, i;
+
+	for (n = 0; n < blocks; n++) {
+		load_block(w, &mask, lanes, n, 0);
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+
+		for (i = 0; i < 16; i += 4) {
+			MD5_STEP(F, a, b, c, d, w[i], md5_k[i], 7);
+			MD5_STEP(F, d, a, b, c, w[i + 1], md5_k[i + 1], 12);
+			MD5_STEP(F, c, d, a, b, w[i + 2], md5_k[i + 2], 17);
+			MD5_STEP(F, b, c, d, a, w[i + 3], md5_k[i + 3], 22);
+		}
+
+		for (i = 16; i < 32; i += 4) {
+			MD5_STEP(MD5_G, a, b, c, d, w[(5 * i + 1) % 16], md5_k[i], 5);
+			MD5_STEP(MD5_G, d, a, b, c, w[(5 * i + 6) % 16], md5_k[i + 1], 9);
+			MD5_STEP(MD5_G, c, d, a, b, w[(5 * i + 11) % 16], md5_k[i + 2], 14);
+			MD5_STEP(MD5_G, b, c, d, a, w[(5 * i + 16) % 16], md5_k[i + 3], 20);
+		}
+
+		for (i = 32; i < 48; i += 4) {
+			MD5_STEP(H, a, b, c, d, w[(3 * i + 5) % 16], md5_k[i], 4);
+			MD5_STEP(H, d, a, b, c, w[(3 * i + 8) % 16], md5_k[i + 1], 11);
+			MD5_STEP(H, c, d, a, b, w[(3 * i + 11) % 16], md5_k[i + 2], 16);
+			MD5_STEP(H, b, c, d, a, w[(3 * i + 14) % 16], md5_k[i + 3], 23);
+		}
+
+		for (i = 48; i < 64; i += 4) {
+			MD5_STEP(MD5_I, a, b, c, d, w[(7 * i) % 16], md5_k[i], 6);
+			MD5_STEP(MD5_I, d, a, b, c, w[(7 * i + 7) % 16], md5_k[i + 1], 10);
+			MD5_STEP(MD5_I, c, d, a, b, w[(7 * i + 14) % 16], md5_k[i + 2], 15);
+			MD5_STEP(MD5_I, b, c, d, a, w[(7 * i + 21) % 16], md5_k[i + 3], 21);
+		}
+
+		s[0] += a & mask;
+		s[1] += b & mask;
+		s[2] += c & mask;
+		s[3] += d & mask;
+	}
+}
+
+#define SHA1_STEP(f, k) \
+	do { \
+		t = ROTL(a, 5) + f(b, c, d) + e + (k) + w[i]; \
+		e = d; \
+		d = c; \
+		c = ROTL(b, 30); \
+		b = a; \
+		a = t; \
+	} while (0)
+
+static MB_TARGETS void sha1_blocks(vec_t *s, const struct lane_t *lanes, int blocks)
+{
+	vec_t w[80], mask, a, b, c, d, e, t;
+	int n, i;
+
+	for (n = 0; n < blocks; n++) {
+		load_block(w, &mask, lanes, n, 1);
+
+		for (i = 16; i < 80; i++) {
+			t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+			w[i] = ROTL(t, 1);
+		}
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+
+		for (i = 0; i < 20; i++)
+			SHA1_STEP(F, 0x5a827999);
+		for (; i < 40; i++)
+			SHA1_STEP(H, 0x6ed9eba1);
+		for (; i < 60; i++)
+			SHA1_STEP(G, 0x8f1bbcdc);
+		for (; i < 80; i++)
+			SHA1_STEP(H, 0xca62c1d6);
+
+		s[0] += a & mask;
+		s[1] += b & mask;
+		s[2] += c & mask;
+		s[3] += d & mask;
+		s[4] += e & mask;
+	}
+}
+
+static void splat(vec_t *r, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < LANES; i++)
+		(*r)[i] = v;
+}
+
+static int setup_lanes(struct lane_t *lanes, struct mbhash_job_t *jobs, int n)
+{
+	int i, blocks = 0;
+
+	for (i = 0; i < LANES; i++) {
+		if (i < n) {
+			lanes[i].data = jobs[i].data;
+			lanes[i].len = jobs[i].len;
+			lanes[i].blocks = nblocks(jobs[i].len);
+			if (lanes[i].blocks > blocks)
+				blocks = lanes[i].blocks;
+		} else
+			lanes[i].blocks = 0;
+	}
+
+	return blocks;
+}
+
+static void store(struct mbhash_job_t *jobs, int n, vec_t *s, int words, int big_endian)
+{
+	unsigned char *p;
+	uint32_t v;
+	int i, j;
+
+	for (j = 0; j < n; j++) {
+		for (i = 0, p = jobs[j].md; i < words; i++, p += 4) {
+			v = s[i][j];
+			if (big_endian) {
+				p[0] = v >> 24;
+				p[1] = v >> 16;
+				p[2] = v >> 8;
+				p[3] = v;
+			} else {
+				p[0] = v;
+				p[1] = v >> 8;
+				p[2] = v >> 16;
+				p[3] = v >> 24;
+			}
+		}
+	}
+}
+
+void __export MD4_batch(struct mbhash_job_t *jobs, int n)
+{
+	struct lane_t lanes[LANES];
+	vec_t s[4];
+	MD4_CTX ctx;
+	int cnt, blocks;
+
+	for (; n > 0; jobs += cnt, n -= cnt) {
+		if (n == 1) {
+			MD4_Init(&ctx);
+			MD4_Update(&ctx, jobs->data, jobs->len);
+			MD4_Final(jobs->md, &ctx);
+			break;
+		}
+
+		cnt = n < LANES ? n : LANES;
+		blocks = setup_lanes(lanes, jobs, cnt);
+
+		splat(&s[0], 0x67452301);
+		splat(&s[1], 0xefcdab89);
+		splat(&s[2], 0x98badcfe);
+		splat(&s[3], 0x10325476);
+
+		md4_blocks(s, lanes, blocks);
+
+		store(jobs, cnt, s, 4, 0);
+	}
+}
+
+void __export MD5_batch(struct mbhash_job_t *jobs, int n)
+{
+	struct lane_t lanes[LANES];
+	vec_t s[4];
+	MD5_CTX ctx;
+	int cnt, blocks;
+
+	for (; n > 0; jobs += cnt, n -= cnt) {
+		if (n == 1) {
+			MD5_Init(&ctx);
+			MD5_Update(&ctx, jobs->data, jobs->len);
+			MD5_Final(jobs->md, &ctx);
+			break;
+		}
+
+		cnt = n < LANES ? n : LANES;
+		blocks = setup_lanes(lanes, jobs, cnt);
+
+		splat(&s[0], 0x67452301);
+		splat(&s[1], 0xefcdab89);
+		splat(&s[2], 0x98badcfe);
+		splat(&s[3], 0x10325476);
+
+		md5_blocks(s, lanes, blocks);
+
+		store(jobs, cnt, s, 4, 0);
+	}
+}
+
+void __export SHA1_batch(struct mbhash_job_t *jobs, int n)
+{
+	struct lane_t lanes[LANES];
+	vec_t s[5];
+	SHA_CTX ctx;
+	int cnt, blocks;
+
+	for (; n > 0; jobs += cnt, n -= cnt) {
+		if (n == 1) {
+			SHA1_Init(&ctx);
+			SHA1_Update(&ctx, jobs->data, jobs->len);
+			SHA1_Final(jobs->md, &ctx);
+			break;
+		}
+
+		cnt = n < LANES ? n : LANES;
+		blocks = setup_lanes(lanes, jobs, cnt);
+
+		splat(&s[0], 0x67452301);
+		splat(&s[1], 0xefcdab89);
+		splat(&s[2], 0x98badcfe);
+		splat(&s[3], 0x10325476);
+		splat(&s[4], 0xc3d2e1f0);
+
+		sha1_blocks(s, lanes, blocks);
+
+		store(jobs, cnt, s, 5, 1);
+	}
+}
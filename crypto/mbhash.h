@@ -0,0 +1,20 @@
+#ifndef __MBHASH_H
+#define __MBHASH_H
+
+/*
+ * Multi-buffer hashing: digests of independent messages are computed
+ * in parallel, one message per SIMD lane.
+ */
+
+struct mbhash_job_t
+{
+	const void *data;
+	unsigned int len;
+	unsigned char *md;
+};
+
+void MD4_batch(struct mbhash_job_t *jobs, int n);
+void MD5_batch(struct mbhash_job_t *jobs, int n);
+void SHA1_batch(struct mbhash_job_t *jobs, int n);
+
+#endif